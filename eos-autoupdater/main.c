@@ -22,6 +22,7 @@
 #include <eos-updater/dbus.h>
 #include <eos-updater/resources.h>
 #include <libeos-updater-util/config-util.h>
+#include <libeos-updater-util/rollout-private.h>
 #include <libeos-updater-util/types.h>
 #include <libeos-updater-util/util.h>
 
@@ -64,11 +65,21 @@ typedef enum {
 #define SEC_PER_DAY (3600ul * 24)
 #define USEC_PER_DAY (SEC_PER_DAY * G_USEC_PER_SEC)
 
+#define SERVER_OVERLOADED_ERROR_NAME "com.endlessm.Updater.Error.ServerOverloaded"
+#define OUTSIDE_FETCH_WINDOW_ERROR_NAME "com.endlessm.Updater.Error.OutsideFetchWindow"
+
+/* Longest time to wait before checking again for an update whose fetch was
+ * deferred, rather than the full update interval. */
+#define FETCH_DEFERRED_RECHECK_SECS ((guint64) 4 * 3600)
+
 static const char *STATE_DIR = LOCALSTATEDIR "/lib/eos-updater";
 
 /* This file is touched whenever the updater starts */
 static const char *UPDATE_STAMP_NAME = "eos-updater-stamp";
 static const char *POLL_RESULTS_NAME = "autoupdater-poll-results";
+static const char *BACKOFF_NAME = "autoupdater-backoff";
+
+static const char *MACHINE_ID_PATH = SYSCONFDIR "/machine-id";
 
 static const char *CONFIG_FILE_PATH = SYSCONFDIR "/eos-updater/eos-autoupdater.conf";
 static const char *OLD_CONFIG_FILE_PATH = SYSCONFDIR "/eos-updater.conf";
@@ -79,6 +90,7 @@ static const char *LAST_STEP_KEY = "LastAutomaticStep";
 static const char *INTERVAL_KEY = "IntervalDays";
 static const char *RANDOMIZED_DELAY_KEY = "RandomizedDelayDays";
 static const char *USER_VISIBLE_DELAY_KEY = "UserVisibleUpdateDelayDays";
+static const char *FETCH_ALLOWED_TIMES_KEY = "FetchAllowedTimes";
 
 /* Ensures that the updater never tries to poll twice in one run */
 static gboolean polled_already = FALSE;
@@ -101,6 +113,20 @@ static gboolean force_fetch = FALSE;
 /* Microseconds to delay user visible updates. */
 static guint64 user_visible_delay_usecs = 0;
 
+/* Set when the server reported that it’s overloaded, so we should back off */
+static gboolean server_overloaded = FALSE;
+
+/* Times of day when fetching is allowed; empty if there are no restrictions.
+ * (element-type EuuTimeWindow) */
+static GArray *fetch_windows = NULL;
+
+/* Set when fetching the available update was deferred, either because it is
+ * not being rolled out to this machine yet, or because it’s outside the allowed
+ * fetch times. The stamp file is then written so that the next check happens
+ * after @fetch_recheck_secs, rather than after the full update interval. */
+static gboolean fetch_deferred = FALSE;
+static guint64 fetch_recheck_secs = FETCH_DEFERRED_RECHECK_SECS;
+
 static GMainLoop *main_loop = NULL;
 static gchar *volume_path = NULL;
 
@@ -502,6 +528,108 @@ update_poll_results (EosUpdater *proxy)
   poll_results = used_results;
 }
 
+static gchar *
+get_backoff_path (void)
+{
+  return g_build_filename (get_state_dir (), BACKOFF_NAME, NULL);
+}
+
+/* Called after the server reported being overloaded. Work out when to try
+ * again, with exponential backoff, and store it in the backoff file. Like the
+ * stamp file, there’s no harm in this failing. */
+static void
+back_off (void)
+{
+  g_autofree gchar *backoff_path = get_backoff_path ();
+  guint64 now_secs = (guint64) MAX (0, g_get_real_time ()) / G_USEC_PER_SEC;
+  guint64 delay_secs;
+  g_autoptr(GError) error = NULL;
+
+  if (mkdir_print_errors (get_state_dir (), 0755) != 0)
+    return;
+
+  if (!euu_backoff_record_overload (backoff_path, now_secs, NULL, &delay_secs, &error))
+    {
+      critical (EOS_UPDATER_STAMP_ERROR_MSGID,
+                "Failed to write autoupdater backoff file %s: %s",
+                backoff_path, error->message);
+      return;
+    }
+
+  info (EOS_UPDATER_NOT_TIME_MSGID,
+        "Update server is overloaded; backing off for %" G_GUINT64_FORMAT " seconds",
+        delay_secs);
+}
+
+/* Called after a successful run, to reset the backoff. */
+static void
+clear_backoff_file (void)
+{
+  g_autofree gchar *backoff_path = get_backoff_path ();
+  g_autoptr(GError) error = NULL;
+
+  if (!euu_backoff_clear (backoff_path, &error))
+    warning (EOS_UPDATER_STAMP_ERROR_MSGID,
+             "Failed to remove autoupdater backoff file %s: %s",
+             backoff_path, error->message);
+}
+
+static gboolean
+is_backing_off (void)
+{
+  g_autofree gchar *backoff_path = get_backoff_path ();
+  guint64 now_secs = (guint64) MAX (0, g_get_real_time ()) / G_USEC_PER_SEC;
+  g_autoptr(GError) error = NULL;
+  gboolean backing_off;
+
+  backing_off = euu_backoff_is_active (backoff_path, now_secs, &error);
+  if (error != NULL)
+    warning (EOS_UPDATER_STAMP_ERROR_MSGID,
+             "Failed to read autoupdater backoff file %s: %s",
+             backoff_path, error->message);
+
+  return backing_off;
+}
+
+/* Check whether the update advertised by @proxy is being rolled out to this
+ * machine yet, according to its UpdateRolloutPercentage. */
+static gboolean
+is_update_in_rollout (EosUpdater *proxy)
+{
+  g_autoptr(GVariant) percentage_variant = NULL;
+  const gchar *update_id = eos_updater_get_update_id (proxy);
+  const gchar *machine_id_path = get_envvar_or ("EOS_UPDATER_TEST_AUTOUPDATER_MACHINE_ID_PATH",
+                                                MACHINE_ID_PATH);
+  g_autofree gchar *machine_id = NULL;
+  g_autoptr(GError) error = NULL;
+  guint percentage;
+
+  /* Older versions of eos-updater don’t support staged rollouts. */
+  percentage_variant = g_dbus_proxy_get_cached_property (G_DBUS_PROXY (proxy),
+                                                         "UpdateRolloutPercentage");
+  if (percentage_variant == NULL)
+    return TRUE;
+
+  percentage = eos_updater_get_update_rollout_percentage (proxy);
+  if (percentage >= 100)
+    return TRUE;
+
+  /* If the machine ID can’t be read, don’t hold the update back forever. */
+  if (!g_file_get_contents (machine_id_path, &machine_id, NULL, &error))
+    {
+      g_message ("Failed to read machine ID: %s", error->message);
+      return TRUE;
+    }
+
+  g_strstrip (machine_id);
+
+  g_debug ("Update %s is being rolled out to %u%% of machines; "
+           "this machine is in bucket %u",
+           update_id, percentage, euu_rollout_get_bucket (machine_id, update_id));
+
+  return euu_rollout_includes_machine (percentage, machine_id, update_id);
+}
+
 /* Called on completion of the async dbus calls to check whether they
  * succeeded. Success doesn't mean that the operation succeeded, but it
  * does mean the call reached the daemon.
@@ -574,6 +702,35 @@ do_update_step (UpdateStep step, EosUpdater *proxy)
     case UPDATE_STEP_FETCH:
       {
         g_auto(GVariantDict) options_dict = G_VARIANT_DICT_INIT (NULL);
+
+        if (!force_update && !is_update_in_rollout (proxy))
+          {
+            info (EOS_UPDATER_NOT_TIME_MSGID,
+                  "Update %s is not being rolled out to this machine yet",
+                  eos_updater_get_update_id (proxy));
+            fetch_deferred = TRUE;
+            return FALSE;
+          }
+
+        if (!force_update)
+          {
+            g_autoptr(GDateTime) now = g_date_time_new_now_local ();
+
+            if (!euu_time_windows_contain (fetch_windows, now))
+              {
+                guint minutes_until_open =
+                  euu_time_windows_get_minutes_until_open (fetch_windows, now);
+
+                info (EOS_UPDATER_NOT_TIME_MSGID,
+                      "Not fetching update %s outside the allowed times",
+                      eos_updater_get_update_id (proxy));
+                fetch_deferred = TRUE;
+                fetch_recheck_secs = MIN (FETCH_DEFERRED_RECHECK_SECS,
+                                          (guint64) minutes_until_open * 60);
+                return FALSE;
+              }
+          }
+
         g_variant_dict_insert (&options_dict, "force", "b", force_update || force_fetch);
 
         eos_updater_call_fetch_full (proxy, g_variant_dict_end (&options_dict),
@@ -657,7 +814,20 @@ on_state_changed (EosUpdater *proxy, EosUpdaterState state)
       break;
 
     case EOS_UPDATER_STATE_ERROR: /* Log error and quit */
+      /* eos-updater’s own configuration may restrict the fetch times too;
+       * that’s not a failure, so try again next time. */
+      if (g_strcmp0 (eos_updater_get_error_name (proxy), OUTSIDE_FETCH_WINDOW_ERROR_NAME) == 0)
+        {
+          info (EOS_UPDATER_NOT_TIME_MSGID, "Not fetching update: %s",
+                eos_updater_get_error_message (proxy));
+          fetch_deferred = TRUE;
+          continue_running = FALSE;
+          break;
+        }
+
       report_error_status (proxy);
+      if (g_strcmp0 (eos_updater_get_error_name (proxy), SERVER_OVERLOADED_ERROR_NAME) == 0)
+        server_overloaded = TRUE;
       should_exit_failure = TRUE;
       continue_running = FALSE;
       break;
@@ -744,6 +914,7 @@ read_config_file (const gchar *config_path,
   guint _update_interval_days;
   guint _randomized_delay_days;
   guint _user_visible_delay_days;
+  g_auto(GStrv) allowed_times = NULL;
   const gchar * const paths[] =
     {
       config_path,  /* typically CONFIG_FILE_PATH unless testing */
@@ -838,6 +1009,20 @@ _Pragma ("GCC diagnostic pop")
     }
   user_visible_delay_usecs = (guint64) _user_visible_delay_days * USEC_PER_DAY;
 
+  allowed_times = euu_config_file_get_strv (config, AUTOMATIC_GROUP,
+                                            FETCH_ALLOWED_TIMES_KEY, NULL,
+                                            &error);
+  if (allowed_times != NULL)
+    fetch_windows = euu_time_windows_parse ((const gchar * const *) allowed_times,
+                                            &error);
+  if (error != NULL)
+    {
+      warning (EOS_UPDATER_CONFIGURATION_ERROR_MSGID,
+               "Unable to read key '%s' in config file: %s",
+               FETCH_ALLOWED_TIMES_KEY, error->message);
+      return FALSE;
+    }
+
   return TRUE;
 }
 
@@ -1080,6 +1265,12 @@ main (int argc, char **argv)
     force_update = TRUE;
 
   if (!force_update) {
+    if (is_backing_off ()) {
+      info (EOS_UPDATER_NOT_TIME_MSGID,
+            "Backing off as the update server was overloaded. Exiting");
+      return EXIT_OK;
+    }
+
     if (!is_time_to_update (update_interval_days, randomized_delay_days)) {
       info (EOS_UPDATER_NOT_TIME_MSGID,
             "Less than %s since last update. Exiting",
@@ -1121,9 +1312,40 @@ main (int argc, char **argv)
 out:
   g_main_loop_unref (main_loop);
   g_free (volume_path);
+  g_clear_pointer (&fetch_windows, g_array_unref);
 
   if (should_exit_failure) /* All paths setting this print an error message */
-    return EXIT_FAILED;
+    {
+      if (server_overloaded)
+        back_off ();
+      return EXIT_FAILED;
+    }
+
+  clear_backoff_file ();
+
+  /* If the update was held back for a staged rollout or the fetch times,
+   * check for it again sooner than the full update interval, by which time
+   * the rollout may have reached this machine. Still write the stamp file, so
+   * that the server isn’t polled on every run of the timer in the meantime. */
+  if (fetch_deferred)
+    {
+      guint64 now_secs = (guint64) g_get_real_time () / G_USEC_PER_SEC;
+      guint64 update_interval_secs = (guint64) update_interval_days * SEC_PER_DAY;
+      guint64 last_update_secs;
+
+      /* Fake the time of the last update so that the next one is due in
+       * @fetch_recheck_secs. */
+      last_update_secs = now_secs - MIN (now_secs, update_interval_secs);
+      last_update_secs += MIN (fetch_recheck_secs, update_interval_secs);
+
+      update_stamp_file (last_update_secs, update_interval_days, 0);
+      info (EOS_UPDATER_SUCCESS_MSGID,
+            "Updater finished; checking for the deferred update again in %"
+            G_GUINT64_FORMAT " minutes",
+            MIN (fetch_recheck_secs, update_interval_secs) / 60);
+
+      return EXIT_OK;
+    }
 
   /* Update the stamp file since all configured steps have succeeded. */
   update_stamp_file ((guint64) g_get_real_time () / G_USEC_PER_SEC,
@@ -25,8 +25,10 @@
  */
 
 #include <libeos-update-server/config.h>
+#include <libeos-update-server/load-hint.h>
 #include <libeos-update-server/repo.h>
 #include <libeos-update-server/server.h>
+#include <libeos-updater-util/avahi-service-file.h>
 #include <libeos-updater-util/config-util.h>
 #include <libeos-updater-util/util.h>
 
@@ -320,6 +322,184 @@ timeout_data_clear (TimeoutData *data)
 
 G_DEFINE_AUTO_CLEANUP_CLEAR_FUNC (TimeoutData, timeout_data_clear)
 
+typedef struct
+{
+  EusServer *server;
+  gulong notify_id;
+  guint max_active_streams;
+  gchar *path;
+
+  /* The hint last written to (or read from) @path, if any. */
+  gboolean have_written_hint;
+  EosOstreeAvahiLoadHint written_hint;
+  /* Wall clock time of the last write, in microseconds. This is loaded from
+   * the modification time of @path on startup, so the rate limit holds across
+   * socket activations. */
+  gint64 last_write_time;
+
+  guint timeout_id;
+} LoadHintData;
+
+#define LOAD_HINT_DATA_CLEARED { NULL, 0, 0u, NULL, FALSE, { 0, 0, FALSE }, 0, 0u }
+
+static void
+load_hint_data_write (LoadHintData                 *data,
+                      const EosOstreeAvahiLoadHint *hint)
+{
+  g_autoptr(GFile) file = g_file_new_for_path (data->path);
+  g_autoptr(GFile) parent = g_file_get_parent (file);
+  g_autoptr(GBytes) bytes = eos_ostree_avahi_load_hint_to_bytes (hint);
+  g_autoptr(GError) error = NULL;
+
+  /* Don’t retry immediately if this fails. */
+  data->last_write_time = g_get_real_time ();
+
+  if (!g_file_make_directory_with_parents (parent, NULL, &error) &&
+      !g_error_matches (error, G_IO_ERROR, G_IO_ERROR_EXISTS))
+    {
+      g_message ("Failed to create directory for load hint file ‘%s’: %s",
+                 data->path, error->message);
+      return;
+    }
+
+  g_clear_error (&error);
+
+  if (!g_file_replace_contents (file,
+                                g_bytes_get_data (bytes, NULL),
+                                g_bytes_get_size (bytes),
+                                NULL,  /* no etag */
+                                FALSE,  /* no backup */
+                                G_FILE_CREATE_NONE,
+                                NULL,  /* no new etag */
+                                NULL,  /* no cancellable */
+                                &error))
+    {
+      g_message ("Failed to write load hint file ‘%s’: %s",
+                 data->path, error->message);
+      return;
+    }
+
+  g_debug ("%s: Wrote load hint: %u active streams, capacity %u, saturated %s",
+           G_STRFUNC, (guint) hint->active_streams, (guint) hint->capacity,
+           hint->saturated ? "yes" : "no");
+
+  data->have_written_hint = TRUE;
+  data->written_hint = *hint;
+}
+
+static gboolean
+load_hint_timeout_cb (gpointer user_data);
+
+/* Update the load hint file to match the server’s current load, unless it
+ * was updated less than %EUS_LOAD_HINT_MIN_INTERVAL_SECONDS ago, in which case
+ * schedule an update for when the interval has passed. */
+static void
+load_hint_data_update (LoadHintData *data)
+{
+  EosOstreeAvahiLoadHint hint;
+  guint delay_seconds;
+
+  eus_load_hint_compute (eus_server_get_pending_requests (data->server),
+                         data->max_active_streams, &hint);
+
+  if (data->have_written_hint && eus_load_hint_equal (&hint, &data->written_hint))
+    {
+      clear_source (&data->timeout_id);
+      return;
+    }
+
+  if (data->timeout_id != 0)
+    return;
+
+  delay_seconds = eus_load_hint_get_write_delay (data->last_write_time,
+                                                 g_get_real_time ());
+
+  if (delay_seconds == 0)
+    load_hint_data_write (data, &hint);
+  else
+    data->timeout_id = g_timeout_add_seconds (delay_seconds,
+                                              load_hint_timeout_cb, data);
+}
+
+static gboolean
+load_hint_timeout_cb (gpointer user_data)
+{
+  LoadHintData *data = user_data;
+
+  data->timeout_id = 0;
+  load_hint_data_update (data);
+
+  return G_SOURCE_REMOVE;
+}
+
+static void
+pending_requests_notify_cb (GObject    *object,
+                            GParamSpec *pspec,
+                            gpointer    user_data)
+{
+  load_hint_data_update (user_data);
+}
+
+static void
+load_hint_data_init (LoadHintData *data,
+                     EusServer    *server,
+                     guint         max_active_streams)
+{
+  g_autoptr(GFile) file = NULL;
+  g_autoptr(GFileInfo) info = NULL;
+  g_autoptr(GBytes) bytes = NULL;
+
+  memset (data, 0, sizeof (*data));
+  data->server = g_object_ref (server);
+  data->max_active_streams = max_active_streams;
+  data->path = g_strdup (eos_avahi_load_hint_file_get_path ());
+
+  /* Avoid rewriting the file (and hence the Avahi service file) every time the
+   * server is socket activated, if the hint hasn’t changed since it last
+   * exited, or if it was last written less than the minimum interval ago. */
+  file = g_file_new_for_path (data->path);
+  if (eos_updater_read_file_to_bytes (file, NULL, &bytes, NULL) &&
+      eos_ostree_avahi_load_hint_from_bytes (bytes, &data->written_hint, NULL))
+    data->have_written_hint = TRUE;
+
+  info = g_file_query_info (file, G_FILE_ATTRIBUTE_TIME_MODIFIED,
+                            G_FILE_QUERY_INFO_NONE, NULL, NULL);
+  if (info != NULL && g_file_info_has_attribute (info, G_FILE_ATTRIBUTE_TIME_MODIFIED))
+    data->last_write_time = (gint64) g_file_info_get_attribute_uint64 (info, G_FILE_ATTRIBUTE_TIME_MODIFIED) * G_USEC_PER_SEC;
+
+  data->notify_id = g_signal_connect (server, "notify::pending-requests",
+                                      G_CALLBACK (pending_requests_notify_cb),
+                                      data);
+
+  load_hint_data_update (data);
+}
+
+static void
+load_hint_data_clear (LoadHintData *data)
+{
+  /* Write the final load hint, ignoring the rate limit, so the advertisement
+   * is accurate while the server isn’t running. This is normally a no-op, as
+   * the server exits when idle, which is the state it starts in. */
+  if (data->server != NULL)
+    {
+      EosOstreeAvahiLoadHint hint;
+
+      eus_load_hint_compute (eus_server_get_pending_requests (data->server),
+                             data->max_active_streams, &hint);
+      if (!data->have_written_hint || !eus_load_hint_equal (&hint, &data->written_hint))
+        load_hint_data_write (data, &hint);
+    }
+
+  clear_source (&data->timeout_id);
+  if (data->notify_id != 0)
+    g_signal_handler_disconnect (data->server, data->notify_id);
+  data->notify_id = 0;
+  g_clear_object (&data->server);
+  g_clear_pointer (&data->path, g_free);
+}
+
+G_DEFINE_AUTO_CLEANUP_CLEAR_FUNC (LoadHintData, load_hint_data_clear)
+
 static gboolean
 get_first_uri_from_server (SoupServer  *server,
                            GUri       **out_uri,
@@ -482,7 +662,9 @@ main (int argc, char **argv)
   g_autoptr(SoupServer) soup_server = NULL;
   g_autoptr(EusServer) eus_server = NULL;
   g_auto(TimeoutData) data = TIMEOUT_DATA_CLEARED;
+  g_auto(LoadHintData) load_hint_data = LOAD_HINT_DATA_CLEARED;
   gboolean advertise_updates = FALSE;
+  guint max_active_streams = 0;
   g_autoptr(GPtrArray) repository_configs = NULL;
   gsize i;
 
@@ -496,7 +678,7 @@ main (int argc, char **argv)
 
   /* Load our configuration. */
   if (!eus_read_config_file (options.config_file, &advertise_updates,
-                             &repository_configs, &error))
+                             &max_active_streams, &repository_configs, &error))
     {
       g_message ("Failed to load configuration file: %s", error->message);
       return EXIT_BAD_CONFIGURATION;
@@ -562,6 +744,9 @@ main (int argc, char **argv)
       return EXIT_FAILED;
     }
 
+  /* Publish our load for eos-updater-avahi to advertise. */
+  load_hint_data_init (&load_hint_data, eus_server, max_active_streams);
+
   /* Listen! */
   if (!start_listening (soup_server, &options, &error))
     {
@@ -24,16 +24,22 @@
  */
 
 #include <glib.h>
+#include <glib-unix.h>
 #include <libeos-update-server/config.h>
 #include <libeos-updater-util/avahi-service-file.h>
 #include <libeos-updater-util/ostree-util.h>
 #include <libeos-updater-util/util.h>
 #include <locale.h>
 #include <ostree.h>
+#include <signal.h>
 #include <stdlib.h>
+#include <systemd/sd-daemon.h>
 
+/* List the refs in @repo to advertise. If @match_collection_id is non-%NULL,
+ * only refs with that collection ID are returned. */
 static gboolean
 get_refs (OstreeRepo            *repo,
+          const gchar           *match_collection_id,
           OstreeCollectionRef ***out_refs,
           GCancellable          *cancellable,
           GError               **error)
@@ -44,7 +50,7 @@ get_refs (OstreeRepo            *repo,
   g_autoptr(GPtrArray) refs_array = NULL;
 
   if (!ostree_repo_list_collection_refs (repo,
-                                         /* match_collection_id: */ NULL,
+                                         match_collection_id,
                                          &refs,
                                          OSTREE_REPO_LIST_REFS_EXT_NONE,
                                          cancellable,
@@ -84,7 +90,13 @@ get_raw_summary_timestamp_from_metadata (GBytes    *summary,
   g_autoptr(GVariant) additional_metadata = NULL;
   g_autoptr(GVariant) value = NULL;
 
-  if (!g_variant_is_normal_form (summary_variant))
+  /* The summary can be several megabytes if the repository contains a lot of
+   * refs, so only validate the additional metadata dictionary, rather than the
+   * ref map too. Accessing children of an untrusted variant is safe, even if
+   * the rest of it is not in normal form. */
+  additional_metadata = g_variant_get_child_value (summary_variant, 1);
+
+  if (!g_variant_is_normal_form (additional_metadata))
     {
       *out_found = FALSE;
       *out_timestamp = 0;
@@ -93,7 +105,6 @@ get_raw_summary_timestamp_from_metadata (GBytes    *summary,
       return FALSE;
     }
 
-  additional_metadata = g_variant_get_child_value (summary_variant, 1);
   value = g_variant_lookup_value (additional_metadata, "ostree.summary.last-modified", G_VARIANT_TYPE_UINT64);
 
   g_assert (out_found != NULL);
@@ -154,8 +165,17 @@ get_summary_timestamp (OstreeRepo    *repo,
   guint64 raw_timestamp;
   gboolean found = FALSE;
   g_autoptr(GBytes) summary_bytes = NULL;
-
-  if (!eos_updater_read_file_to_bytes (summary_file, cancellable, &summary_bytes, error))
+  g_autoptr(GMappedFile) summary_mapping = NULL;
+  g_autofree gchar *summary_path = g_file_get_path (summary_file);
+
+  /* Map the summary rather than reading it in, since only a small part of it
+   * is needed. Fall back to reading it if mmap() is not supported by the
+   * underlying file system; this also reports a missing summary file as
+   * %G_IO_ERROR_NOT_FOUND. */
+  summary_mapping = g_mapped_file_new (summary_path, FALSE, NULL);
+  if (summary_mapping != NULL)
+    summary_bytes = g_mapped_file_get_bytes (summary_mapping);
+  else if (!eos_updater_read_file_to_bytes (summary_file, cancellable, &summary_bytes, error))
     return FALSE;
 
   if (summary_bytes != NULL)
@@ -215,7 +235,7 @@ get_refs_and_summary_timestamp (OstreeSysroot         *sysroot,
                                 error))
     return FALSE;
 
-  if (!get_refs (repo, &refs, cancellable, error))
+  if (!get_refs (repo, NULL, &refs, cancellable, error))
     return FALSE;
 
   if (!get_summary_timestamp (repo, &summary_timestamp, cancellable, error))
@@ -228,13 +248,62 @@ get_refs_and_summary_timestamp (OstreeSysroot         *sysroot,
   return TRUE;
 }
 
+/* Build the options for eos_ostree_avahi_service_file_generate(), including
+ * the load hint from eos-update-server if it has written one. The load hint is
+ * advisory, so any problems with it are not fatal. */
+static GVariant *
+get_service_file_options (guint16       repository_index,
+                          GCancellable *cancellable)
+{
+  g_auto(GVariantDict) options_dict = G_VARIANT_DICT_INIT (NULL);
+  const gchar *load_hint_path = eos_avahi_load_hint_file_get_path ();
+  g_autoptr(GFile) load_hint_file = g_file_new_for_path (load_hint_path);
+  g_autoptr(GBytes) load_hint_bytes = NULL;
+  EosOstreeAvahiLoadHint load_hint;
+  g_autoptr(GError) local_error = NULL;
+
+  g_variant_dict_insert (&options_dict, EOS_OSTREE_AVAHI_OPTION_REPO_INDEX_Q,
+                         "q", repository_index);
+
+  if (!eos_updater_read_file_to_bytes (load_hint_file, cancellable,
+                                       &load_hint_bytes, &local_error))
+    {
+      if (g_error_matches (local_error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND))
+        g_debug ("No load hint file ‘%s’; not advertising load",
+                 load_hint_path);
+      else
+        g_debug ("Error reading load hint file ‘%s’; ignoring: %s",
+                 load_hint_path, local_error->message);
+    }
+  else if (!eos_ostree_avahi_load_hint_from_bytes (load_hint_bytes, &load_hint,
+                                                   &local_error))
+    {
+      g_debug ("Error parsing load hint file ‘%s’; ignoring: %s",
+               load_hint_path, local_error->message);
+    }
+  else
+    {
+      g_variant_dict_insert (&options_dict,
+                             EOS_OSTREE_AVAHI_OPTION_LOAD_ACTIVE_STREAMS_Q,
+                             "q", load_hint.active_streams);
+      g_variant_dict_insert (&options_dict,
+                             EOS_OSTREE_AVAHI_OPTION_LOAD_CAPACITY_Y,
+                             "y", (guint8) load_hint.capacity);
+      g_variant_dict_insert (&options_dict,
+                             EOS_OSTREE_AVAHI_OPTION_LOAD_SATURATED_B,
+                             "b", load_hint.saturated);
+    }
+
+  return g_variant_dict_end (&options_dict);
+}
+
 static gboolean
-update_service_file (gboolean       advertise_updates,
-                     const gchar   *avahi_service_directory,
-                     GCancellable  *cancellable,
-                     GError       **error)
+update_service_file (OstreeSysroot  *sysroot,
+                     gboolean        advertise_updates,
+                     const gchar    *avahi_service_directory,
+                     GCancellable   *cancellable,
+                     GError        **error)
 {
-  g_autoptr(OstreeSysroot) sysroot = NULL;
   g_autofree gchar *commit_checksum = NULL;
   g_autofree gchar *commit_ostree_path = NULL;
   guint64 commit_timestamp;
@@ -243,15 +312,15 @@ update_service_file (gboolean       advertise_updates,
   gboolean delete;
   g_autoptr(GError) local_error = NULL;
 
+  g_return_val_if_fail (OSTREE_IS_SYSROOT (sysroot), FALSE);
   g_return_val_if_fail (avahi_service_directory != NULL, FALSE);
   g_return_val_if_fail (cancellable == NULL || G_IS_CANCELLABLE (cancellable),
                         FALSE);
   g_return_val_if_fail (error == NULL || *error == NULL, FALSE);
 
   /* Work out what commit we would advertise. Errors here are not fatal, as we
-   * want to delete the file on failure. */
-  sysroot = ostree_sysroot_new_default ();
-
+   * want to delete the file on failure. If @sysroot is being reused, this only
+   * reloads it if the deployments have changed. */
   if (!ostree_sysroot_load (sysroot, cancellable, &local_error))
     {
       g_warning ("Error loading sysroot: %s", local_error->message);
@@ -338,7 +407,7 @@ update_service_file (gboolean       advertise_updates,
       if (!eos_ostree_avahi_service_file_generate (avahi_service_directory,
                                                    refs,
                                                    summary_timestamp,
-                                                   NULL, /* no options, use defaults */
+                                                   get_service_file_options (0, cancellable),
                                                    cancellable,
                                                    error))
         {
@@ -360,6 +429,406 @@ update_service_file (gboolean       advertise_updates,
     }
 }
 
+/* Work out the timestamp to advertise for a repository with no summary file.
+ * eos-update-server generates a summary on demand in that case, so it will be
+ * as new as the newest commit which the refs point to. */
+static gboolean
+get_latest_commit_timestamp (OstreeRepo           *repo,
+                             OstreeCollectionRef **refs,
+                             GDateTime           **out_timestamp,
+                             GCancellable         *cancellable,
+                             GError              **error)
+{
+  guint64 latest_timestamp = 0;
+  gsize i;
+
+  for (i = 0; refs[i] != NULL; i++)
+    {
+      g_autofree gchar *checksum = NULL;
+      g_autoptr(GVariant) commit = NULL;
+      g_autoptr(GError) local_error = NULL;
+
+      if (!ostree_repo_resolve_collection_ref (repo, refs[i], FALSE,
+                                               OSTREE_REPO_RESOLVE_REV_EXT_NONE,
+                                               &checksum, cancellable,
+                                               &local_error) ||
+          !ostree_repo_load_commit (repo, checksum, &commit, NULL, &local_error))
+        {
+          g_debug ("Error loading commit for (%s, %s); ignoring: %s",
+                   refs[i]->collection_id, refs[i]->ref_name,
+                   local_error->message);
+          continue;
+        }
+
+      latest_timestamp = MAX (latest_timestamp, ostree_commit_get_timestamp (commit));
+    }
+
+  if (latest_timestamp == 0)
+    {
+      g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND,
+                           "No summary file or commits found");
+      return FALSE;
+    }
+
+  return get_summary_timestamp_from_guint64 (latest_timestamp, out_timestamp,
+                                             error);
+}
+
+/* Generate the service file for one of the additional repositories configured
+ * in a `[Repository 1–65535]` section of eos-update-server.conf.
+ * eos-update-server only serves the refs of the configured `RemoteName=` from
+ * it, so only refs with that remote’s collection ID are advertised, and only
+ * their commits are used for the fallback timestamp. */
+static gboolean
+update_repository_service_file (const EusRepoConfig  *config,
+                                const gchar          *avahi_service_directory,
+                                GCancellable         *cancellable,
+                                GError              **error)
+{
+  g_autoptr(GFile) repo_path = g_file_new_for_path (config->path);
+  g_autoptr(OstreeRepo) repo = ostree_repo_new (repo_path);
+  g_auto(OstreeCollectionRefv) refs = NULL;
+  g_autoptr(GDateTime) summary_timestamp = NULL;
+  g_autofree gchar *collection_id = NULL;
+  g_autoptr(GError) local_error = NULL;
+
+  if (!ostree_repo_open (repo, cancellable, error))
+    return FALSE;
+
+  if (!ostree_repo_get_remote_option (repo, config->remote_name,
+                                      "collection-id", NULL,
+                                      &collection_id, error))
+    return FALSE;
+
+  if (collection_id == NULL)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND,
+                   "remote ‘%s’ has no collection ID", config->remote_name);
+      return FALSE;
+    }
+
+  if (!get_refs (repo, collection_id, &refs, cancellable, error))
+    return FALSE;
+
+  if (!get_summary_timestamp (repo, &summary_timestamp, cancellable, &local_error))
+    {
+      if (!g_error_matches (local_error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND))
+        {
+          g_propagate_error (error, g_steal_pointer (&local_error));
+          return FALSE;
+        }
+
+      g_clear_error (&local_error);
+
+      if (!get_latest_commit_timestamp (repo, refs, &summary_timestamp,
+                                        cancellable, error))
+        return FALSE;
+    }
+
+  g_message ("Advertising %u refs from repository %" G_GUINT16_FORMAT " (‘%s’).",
+             g_strv_length ((gchar **) refs), config->index, config->path);
+
+  return eos_ostree_avahi_service_file_generate (avahi_service_directory,
+                                                 refs,
+                                                 summary_timestamp,
+                                                 get_service_file_options (config->index,
+                                                                           cancellable),
+                                                 cancellable,
+                                                 error);
+}
+
+/* Update the service files for all the repositories served by
+ * eos-update-server, and delete those for repositories which are no longer
+ * configured. Repository 0 is always the system repository. Failure to
+ * advertise one of the additional repositories is not fatal. */
+static gboolean
+update_service_files (OstreeSysroot  *sysroot,
+                      gboolean        advertise_updates,
+                      GPtrArray      *repository_configs,
+                      const gchar    *avahi_service_directory,
+                      GCancellable   *cancellable,
+                      GError        **error)
+{
+  g_autoptr(GArray) keep_indices = g_array_new (FALSE, FALSE, sizeof (guint16));
+  const guint16 system_repository_index = 0;
+  g_autoptr(GError) system_error = NULL;
+  gsize i;
+
+  /* update_service_file() creates or deletes this itself. */
+  g_array_append_val (keep_indices, system_repository_index);
+  update_service_file (sysroot, advertise_updates, avahi_service_directory,
+                       cancellable, &system_error);
+
+  for (i = 0; advertise_updates && i < repository_configs->len; i++)
+    {
+      const EusRepoConfig *config = g_ptr_array_index (repository_configs, i);
+      g_autoptr(GError) local_error = NULL;
+
+      if (config->index == system_repository_index)
+        continue;
+
+      if (!update_repository_service_file (config, avahi_service_directory,
+                                           cancellable, &local_error))
+        {
+          g_message ("Not advertising repository %" G_GUINT16_FORMAT " (‘%s’): %s",
+                     config->index, config->path, local_error->message);
+          continue;
+        }
+
+      g_array_append_val (keep_indices, config->index);
+    }
+
+  if (!eos_ostree_avahi_service_file_cleanup_directory_except (avahi_service_directory,
+                                                               (const guint16 *) keep_indices->data,
+                                                               keep_indices->len,
+                                                               cancellable,
+                                                               error))
+    return FALSE;
+
+  if (system_error != NULL)
+    {
+      g_propagate_error (error, g_steal_pointer (&system_error));
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+/* How long to wait for a burst of changes to the inputs (such as the several
+ * deployment refs which are updated while deploying an update) to settle
+ * before updating the service files. */
+#define WATCH_DEBOUNCE_SECONDS 2
+
+/* State for the long-running --watch mode, which watches the same inputs as
+ * eos-updater-avahi.path and updates the service files when they change,
+ * reusing the loaded sysroot between updates. */
+typedef struct
+{
+  OstreeSysroot *sysroot;  /* (owned) */
+  const gchar *config_file;  /* (unowned) (nullable) */
+  const gchar *avahi_service_directory;  /* (unowned) */
+  gboolean start_socket;  /* start eos-update-server.socket after updates */
+  GPtrArray *monitors;  /* (owned) (element-type GFileMonitor) */
+  guint debounce_id;
+  GMainLoop *loop;  /* (owned) */
+} WatchData;
+
+#define WATCH_DATA_CLEARED { NULL, NULL, NULL, FALSE, NULL, 0, NULL }
+
+static void
+watch_data_clear_monitors (WatchData *data)
+{
+  gsize i;
+
+  for (i = 0; i < data->monitors->len; i++)
+    {
+      GFileMonitor *monitor = g_ptr_array_index (data->monitors, i);
+
+      g_signal_handlers_disconnect_by_data (monitor, data);
+      g_file_monitor_cancel (monitor);
+    }
+
+  g_ptr_array_set_size (data->monitors, 0);
+}
+
+static void
+watch_data_clear (WatchData *data)
+{
+  if (data->monitors != NULL)
+    watch_data_clear_monitors (data);
+  g_clear_pointer (&data->monitors, g_ptr_array_unref);
+  g_clear_handle_id (&data->debounce_id, g_source_remove);
+  g_clear_pointer (&data->loop, g_main_loop_unref);
+  g_clear_object (&data->sysroot);
+}
+
+G_DEFINE_AUTO_CLEANUP_CLEAR_FUNC (WatchData, watch_data_clear)
+
+static void watch_data_refresh (WatchData *data);
+
+static gboolean
+debounce_cb (gpointer user_data)
+{
+  WatchData *data = user_data;
+
+  data->debounce_id = 0;
+  watch_data_refresh (data);
+
+  return G_SOURCE_REMOVE;
+}
+
+static void
+monitor_changed_cb (GFileMonitor      *monitor,
+                    GFile             *file,
+                    GFile             *other_file,
+                    GFileMonitorEvent  event_type,
+                    gpointer           user_data)
+{
+  WatchData *data = user_data;
+  g_autofree gchar *path = g_file_get_path (file);
+
+  g_debug ("%s: ‘%s’ changed (event %u)", G_STRFUNC, path, (guint) event_type);
+
+  /* Restart the timeout on every change, so that a burst of changes results in
+   * a single update once it has finished. */
+  g_clear_handle_id (&data->debounce_id, g_source_remove);
+  data->debounce_id = g_timeout_add_seconds (WATCH_DEBOUNCE_SECONDS,
+                                             debounce_cb, data);
+}
+
+static void
+watch_data_add_monitor (WatchData *data,
+                        GFile     *file)
+{
+  g_autoptr(GFileMonitor) monitor = NULL;
+  g_autoptr(GError) local_error = NULL;
+
+  /* This works for files which don’t exist yet, too. */
+  monitor = g_file_monitor_file (file, G_FILE_MONITOR_NONE, NULL, &local_error);
+  if (monitor == NULL)
+    {
+      g_autofree gchar *path = g_file_get_path (file);
+
+      g_message ("Error watching ‘%s’ for changes; ignoring: %s",
+                 path, local_error->message);
+      return;
+    }
+
+  g_signal_connect (monitor, "changed", G_CALLBACK (monitor_changed_cb), data);
+  g_ptr_array_add (data->monitors, g_steal_pointer (&monitor));
+}
+
+/* Watch the inputs to the service files. This should be kept in sync with
+ * eos-updater-avahi.path. The set of repositories can change with the
+ * configuration, so this is redone on each refresh. */
+static void
+watch_data_update_monitors (WatchData *data,
+                            GPtrArray *repository_configs)
+{
+  g_auto(GStrv) config_file_paths = eus_get_config_file_paths (data->config_file);
+  GFile *sysroot_path = ostree_sysroot_get_path (data->sysroot);
+  guint boot_version, subboot_version, deployment_index;
+  gsize i;
+
+  watch_data_clear_monitors (data);
+
+  /* The deployment refs, in the format
+   * ostree/$bootversion/$subbootversion/$deployindex. We only ever expect two
+   * deployments. See generate_deployment_refs() in ostree.git. */
+  for (boot_version = 0; boot_version <= 1; boot_version++)
+    for (subboot_version = 0; subboot_version <= 1; subboot_version++)
+      for (deployment_index = 0; deployment_index <= 1; deployment_index++)
+        {
+          g_autofree gchar *ref_path = g_strdup_printf ("ostree/repo/refs/heads/ostree/%u/%u/%u",
+                                                        boot_version,
+                                                        subboot_version,
+                                                        deployment_index);
+          g_autoptr(GFile) ref_file = g_file_resolve_relative_path (sysroot_path,
+                                                                    ref_path);
+
+          watch_data_add_monitor (data, ref_file);
+        }
+
+  for (i = 0; config_file_paths[i] != NULL; i++)
+    {
+      g_autoptr(GFile) config_file = g_file_new_for_path (config_file_paths[i]);
+      watch_data_add_monitor (data, config_file);
+    }
+
+  for (i = 0; i < repository_configs->len; i++)
+    {
+      const EusRepoConfig *config = g_ptr_array_index (repository_configs, i);
+      g_autofree gchar *summary_path = NULL;
+      g_autoptr(GFile) summary_file = NULL;
+
+      if (config->index == 0)
+        continue;
+
+      summary_path = g_build_filename (config->path, "summary", NULL);
+      summary_file = g_file_new_for_path (summary_path);
+      watch_data_add_monitor (data, summary_file);
+    }
+
+    {
+      g_autoptr(GFile) load_hint_file = g_file_new_for_path (eos_avahi_load_hint_file_get_path ());
+      g_autoptr(GFile) flatpak_changed_file = g_file_new_for_path (LOCALSTATEDIR "/lib/flatpak/.changed");
+
+      watch_data_add_monitor (data, load_hint_file);
+      watch_data_add_monitor (data, flatpak_changed_file);
+    }
+}
+
+/* eos-update-server.socket has a condition on the system service file
+ * existing, which systemd only checks when starting it. When run once per
+ * change, eos-updater-avahi.service pulls the socket in with Wants= each time;
+ * when watching, start it explicitly after each update instead. Starting it
+ * again while it is already active does nothing. */
+static void
+start_update_server_socket (void)
+{
+  g_autoptr(GDBusConnection) connection = NULL;
+  g_autoptr(GVariant) reply = NULL;
+  g_autoptr(GError) local_error = NULL;
+
+  connection = g_bus_get_sync (G_BUS_TYPE_SYSTEM, NULL, &local_error);
+  if (connection != NULL)
+    reply = g_dbus_connection_call_sync (connection,
+                                         "org.freedesktop.systemd1",
+                                         "/org/freedesktop/systemd1",
+                                         "org.freedesktop.systemd1.Manager",
+                                         "StartUnit",
+                                         g_variant_new ("(ss)",
+                                                        "eos-update-server.socket",
+                                                        "replace"),
+                                         G_VARIANT_TYPE ("(o)"),
+                                         G_DBUS_CALL_FLAGS_NONE,
+                                         -1,
+                                         NULL,
+                                         &local_error);
+
+  if (reply == NULL)
+    g_message ("Error starting eos-update-server.socket; ignoring: %s",
+               local_error->message);
+}
+
+/* Reload the configuration and update the service files. Failures are not
+ * fatal, as the next change to the inputs might fix them. */
+static void
+watch_data_refresh (WatchData *data)
+{
+  gboolean advertise_updates = FALSE;
+  g_autoptr(GPtrArray) repository_configs = NULL;
+  g_autoptr(GError) local_error = NULL;
+
+  if (!eus_read_config_file (data->config_file, &advertise_updates, NULL,
+                             &repository_configs, &local_error))
+    {
+      g_message ("Failed to load configuration file; not updating service "
+                 "files: %s", local_error->message);
+      return;
+    }
+
+  /* Update the monitors first, so no changes are missed while updating. */
+  watch_data_update_monitors (data, repository_configs);
+
+  if (!update_service_files (data->sysroot, advertise_updates,
+                             repository_configs, data->avahi_service_directory,
+                             NULL, &local_error))
+    g_message ("Failed to update service files: %s", local_error->message);
+  else if (advertise_updates && data->start_socket)
+    start_update_server_socket ();
+}
+
+static gboolean
+quit_signal_cb (gpointer user_data)
+{
+  WatchData *data = user_data;
+
+  g_main_loop_quit (data->loop);
+
+  return G_SOURCE_CONTINUE;
+}
+
 /* main() exit codes. */
 enum
 {
@@ -441,6 +910,11 @@ main (int    argc,
   g_autofree gchar *avahi_service_directory = NULL;
   g_autofree gchar *config_file = NULL;
   gboolean quiet = FALSE;
+  gboolean watch = FALSE;
+  g_autoptr(GPtrArray) repository_configs = NULL;
+  g_autoptr(OstreeSysroot) sysroot = NULL;
+  g_auto(WatchData) data = WATCH_DATA_CLEARED;
+  guint sigint_id, sigterm_id;
 
   const GOptionEntry entries[] =
     {
@@ -455,6 +929,9 @@ main (int    argc,
         SYSCONFDIR "/eos-updater/eos-update-server.conf" ")", "PATH" },
       { "quiet", 'q', G_OPTION_FLAG_NONE, G_OPTION_ARG_NONE, &quiet,
         "Do not print anything; check exit status for success", NULL },
+      { "watch", 'w', G_OPTION_FLAG_NONE, G_OPTION_ARG_NONE, &watch,
+        "Keep running, and update the service files whenever their inputs "
+        "change", NULL },
       { NULL }
     };
 
@@ -483,19 +960,62 @@ main (int    argc,
     avahi_service_directory = g_strdup (eos_avahi_service_file_get_directory ());
 
   /* Load our configuration. */
-  if (!eus_read_config_file (config_file, &advertise_updates, NULL, &error))
+  if (!eus_read_config_file (config_file, &advertise_updates, NULL,
+                             &repository_configs, &error))
     {
       return fail (quiet, EXIT_BAD_CONFIGURATION,
                    "Failed to load configuration file: %s", error->message);
     }
 
-  /* Update the Avahi configuration file to match. */
-  if (!update_service_file (advertise_updates, avahi_service_directory, NULL,
-                            &error))
+  sysroot = ostree_sysroot_new_default ();
+
+  /* Update the Avahi configuration files to match, once. */
+  if (!watch)
+    {
+      if (!update_service_files (sysroot, advertise_updates, repository_configs,
+                                 avahi_service_directory, NULL, &error))
+        {
+          return fail (quiet, EXIT_FAILED,
+                       "Failed to update service files: %s", error->message);
+        }
+
+      return EXIT_OK;
+    }
+
+  /* Or keep them up to date. Start watching before the first update, so no
+   * changes are missed. The socket is only started for the real service
+   * directory, which its condition checks. */
+  data.sysroot = g_object_ref (sysroot);
+  data.config_file = config_file;
+  data.avahi_service_directory = avahi_service_directory;
+  data.start_socket = g_str_equal (avahi_service_directory,
+                                   eos_avahi_service_file_get_directory ());
+  data.monitors = g_ptr_array_new_with_free_func (g_object_unref);
+  data.loop = g_main_loop_new (NULL, FALSE);
+
+  watch_data_update_monitors (&data, repository_configs);
+
+  /* The first update can fail for the same reasons as later ones, so carry on
+   * watching, as a later change might fix it. */
+  if (!update_service_files (sysroot, advertise_updates, repository_configs,
+                             avahi_service_directory, NULL, &error))
     {
-      return fail (quiet, EXIT_FAILED,
-                   "Failed to update service file: %s", error->message);
+      if (!quiet)
+        g_message ("Failed to update service files: %s", error->message);
+      g_clear_error (&error);
     }
 
+  /* Tell systemd the initial update is done, so that eos-update-server.socket,
+   * which is ordered after us, sees the service files. */
+  sd_notify (0, "READY=1");
+
+  sigint_id = g_unix_signal_add (SIGINT, quit_signal_cb, &data);
+  sigterm_id = g_unix_signal_add (SIGTERM, quit_signal_cb, &data);
+
+  g_main_loop_run (data.loop);
+
+  g_source_remove (sigterm_id);
+  g_source_remove (sigint_id);
+
   return EXIT_OK;
 }
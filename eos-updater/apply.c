@@ -25,6 +25,9 @@
 #include <eos-updater/apply.h>
 #include <eos-updater/data.h>
 #include <eos-updater/object.h>
+#include <eos-updater/sysroot-cache.h>
+#include <eos-updater/updater-config.h>
+#include <libeos-updater-util/config-util.h>
 #include <libeos-updater-util/ostree-util.h>
 #include <libeos-updater-util/types.h>
 #include <libeos-updater-util/util.h>
@@ -59,6 +62,7 @@ apply_finished (GObject *object,
                 gpointer user_data)
 {
   EosUpdater *updater = EOS_UPDATER (object);
+  EosUpdaterData *data = user_data;
   GTask *task;
   GError *error = NULL;
 
@@ -67,6 +71,10 @@ apply_finished (GObject *object,
 
   task = G_TASK (res);
 
+  /* The deployments have (probably) changed, even if the apply failed part
+   * way through. Don’t wait for the file monitor to notice. */
+  eos_sysroot_cache_invalidate (data->sysroot_cache);
+
   if (!g_task_propagate_boolean (task, &error))
     {
       eos_updater_set_error (updater, error);
@@ -229,6 +237,32 @@ update_remote_branches (OstreeRepo   *repo,
   return TRUE;
 }
 
+#if OSTREE_CHECK_VERSION(2023, 8)
+/* Whether @deployment (if non-%NULL) is a deployment of @update_id with
+ * @update_refspec as its origin, i.e. whether it can be used as the new
+ * deployment when applying that update. */
+static gboolean
+is_deployment_for_update (OstreeDeployment *deployment,
+                          const gchar      *update_id,
+                          const gchar      *update_refspec)
+{
+  GKeyFile *origin;
+  g_autofree gchar *origin_refspec = NULL;
+
+  if (deployment == NULL ||
+      g_strcmp0 (ostree_deployment_get_csum (deployment), update_id) != 0)
+    return FALSE;
+
+  origin = ostree_deployment_get_origin (deployment);
+  if (origin == NULL)
+    return FALSE;
+
+  origin_refspec = g_key_file_get_string (origin, "origin", "refspec", NULL);
+
+  return (g_strcmp0 (origin_refspec, update_refspec) == 0);
+}
+#endif  /* OSTREE_CHECK_VERSION(2023, 8) */
+
 static gboolean
 apply_internal (ApplyData     *apply_data,
                 GCancellable  *cancellable,
@@ -277,7 +311,32 @@ apply_internal (ApplyData     *apply_data,
    * suite), deploy the finalized tree immediately.
    */
   staged_deploy = ostree_sysroot_is_booted (sysroot);
+
+#if OSTREE_CHECK_VERSION(2023, 8)
+  /* If the deployment was already staged in the background by
+   * prepare_internal(), all that’s left to do is allow it to be finalized. */
   if (staged_deploy)
+    {
+      OstreeDeployment *staged_deployment = ostree_sysroot_get_staged_deployment (sysroot);
+
+      if (is_deployment_for_update (staged_deployment, update_id, update_refspec) &&
+          ostree_deployment_is_finalization_locked (staged_deployment))
+        {
+          g_message ("Unlocking staged deployment for revision %s prepared in the background",
+                     update_id);
+          if (!ostree_sysroot_change_finalization (sysroot, staged_deployment, error))
+            return FALSE;
+
+          new_deployment = g_object_ref (staged_deployment);
+        }
+    }
+#endif
+
+  if (new_deployment != NULL)
+    {
+      /* Already staged above. */
+    }
+  else if (staged_deploy)
     {
       g_message ("Creating staged deployment for revision %s", update_id);
       if (!ostree_sysroot_stage_tree (sysroot,
@@ -348,18 +407,21 @@ apply_internal (ApplyData     *apply_data,
         }
     }
 
-  /* FIXME: Cleaning up after update should be non-fatal, since we've
+  /* When using staged deployments, there's nothing useful to clean up yet:
+   * the old rollback deployment isn't removed until the staged deployment is
+   * finalized during system shutdown. The finalization drop-in for
+   * ostree-finalize-staged.service then flags the sysroot for cleanup, and
+   * eos-updater-autocleanup.service prunes it in the background, at idle
+   * priority, on the next boot. Doing it here would only delay Apply().
+   *
+   * FIXME: Cleaning up after update should be non-fatal, since we've
    * already successfully deployed the new OS. This clearly is a
    * workaround for a more serious issue, likely related to concurrent
    * prunes (https://phabricator.endlessm.com/T16736).
-   *
-   * TODO: When using staged deployments, there's likely nothing to
-   * prune since the old rollback deployment isn't removed until the
-   * staged deployment is finalized during system shutdown. Pruning
-   * happens during the subsequent boot, so this cleanup could be
-   * skipped for staged deploys.
    */
-  if (!ostree_sysroot_cleanup (sysroot, cancellable, &local_error))
+  if (staged_deploy)
+    g_message ("Deferring sysroot cleanup until after the staged deployment is finalized");
+  else if (!ostree_sysroot_cleanup (sysroot, cancellable, &local_error))
     g_warning ("Failed to clean up the sysroot after successful deployment: %s",
                local_error->message);
   g_clear_error (&local_error);
@@ -393,7 +455,12 @@ apply (GTask *task,
   g_autoptr(GError) local_error = NULL;
   ApplyData *apply_data = task_data;
   g_autoptr(GMainContext) task_context = g_main_context_new ();
+  g_auto(EosUpdaterThreadPriorityState) priority_state = EOS_UPDATER_THREAD_PRIORITY_STATE_CLEARED;
 
+  /* Applying the update is the last step before the user can reboot into it,
+   * and is usually waited for, so never deprioritise it. Any idle priority
+   * background preparation has already been cancelled by handle_apply(). */
+  eos_updater_set_worker_thread_priority (TRUE, &priority_state);
   g_main_context_push_thread_default (task_context);
 
   if (!apply_internal (apply_data,
@@ -406,6 +473,182 @@ apply (GTask *task,
   g_main_context_pop_thread_default (task_context);
 }
 
+/* Stage a deployment of the update in @apply_data, but lock it so that it is
+ * not finalized on shutdown unless apply_internal() later unlocks it. This does
+ * the slow checkout of the new deployment ahead of time, at a low priority, so
+ * that Apply() completes quickly. */
+static gboolean
+prepare_internal (ApplyData     *apply_data,
+                  GCancellable  *cancellable,
+                  GError       **error)
+{
+#if OSTREE_CHECK_VERSION(2023, 8)
+  const gchar *update_id = apply_data->update_id;
+  const gchar *update_refspec = apply_data->update_refspec;
+  g_autoptr(OstreeSysroot) sysroot = NULL;
+  g_autoptr(OstreeDeployment) booted_deployment = NULL;
+  g_autoptr(OstreeDeployment) new_deployment = NULL;
+  g_autoptr(GKeyFile) origin = NULL;
+  OstreeSysrootDeployTreeOpts opts = { .locked = TRUE };
+  const gchar *osname = get_test_osname ();
+
+  sysroot = ostree_sysroot_new_default ();
+  if (!ostree_sysroot_lock (sysroot, error))
+    return FALSE;
+  if (!ostree_sysroot_load (sysroot, cancellable, error))
+    return FALSE;
+
+  /* Only staged deployments can be locked, and those are only used when booted
+   * into an OSTree system. Otherwise (primarily the test suite), everything is
+   * done in Apply(). */
+  if (!ostree_sysroot_is_booted (sysroot))
+    {
+      g_message ("Not preparing deployment in background: not booted into an OSTree system");
+      return TRUE;
+    }
+
+  if (is_deployment_for_update (ostree_sysroot_get_staged_deployment (sysroot),
+                                update_id, update_refspec))
+    {
+      g_message ("Deployment for revision %s is already staged", update_id);
+      return TRUE;
+    }
+
+  booted_deployment = eos_updater_get_booted_deployment_from_loaded_sysroot (sysroot,
+                                                                             error);
+  if (booted_deployment == NULL)
+    return FALSE;
+
+  origin = ostree_sysroot_origin_new_from_refspec (sysroot, update_refspec);
+
+  g_message ("Preparing locked staged deployment for revision %s in the background",
+             update_id);
+  if (!ostree_sysroot_stage_tree_with_options (sysroot,
+                                               osname,
+                                               update_id,
+                                               origin,
+                                               booted_deployment,
+                                               &opts,
+                                               &new_deployment,
+                                               cancellable,
+                                               error))
+    return FALSE;
+
+  g_message ("Prepared deployment for revision %s; it will be used by Apply()",
+             update_id);
+
+  return TRUE;
+#else  /* if !OSTREE_CHECK_VERSION(2023, 8) */
+  g_message ("Not preparing deployment in background: not supported by this "
+             "version of OSTree");
+  return TRUE;
+#endif  /* !OSTREE_CHECK_VERSION(2023, 8) */
+}
+
+static void
+prepare (GTask        *task,
+         gpointer      object,
+         gpointer      task_data,
+         GCancellable *cancellable)
+{
+  g_autoptr(GError) local_error = NULL;
+  ApplyData *apply_data = task_data;
+  g_autoptr(GMainContext) task_context = g_main_context_new ();
+  g_auto(EosUpdaterThreadPriorityState) priority_state = EOS_UPDATER_THREAD_PRIORITY_STATE_CLEARED;
+
+  if (!eos_updater_set_thread_priority (EOS_UPDATER_THREAD_PRIORITY_IDLE,
+                                        &priority_state, &local_error))
+    {
+      g_message ("Preparing deployment at inherited priority: %s", local_error->message);
+      g_clear_error (&local_error);
+    }
+
+  g_main_context_push_thread_default (task_context);
+
+  if (!prepare_internal (apply_data, cancellable, &local_error))
+    g_task_return_error (task, g_steal_pointer (&local_error));
+  else
+    g_task_return_boolean (task, TRUE);
+
+  g_main_context_pop_thread_default (task_context);
+}
+
+static void
+prepare_finished (GObject      *object,
+                  GAsyncResult *res,
+                  gpointer      user_data)
+{
+  EosUpdaterData *data = user_data;
+  GTask *task = G_TASK (res);
+  g_autoptr(GError) local_error = NULL;
+
+  if (data->prepare_cancellable == g_task_get_cancellable (task))
+    g_clear_object (&data->prepare_cancellable);
+
+  /* Failing to prepare is not an error: Apply() will do all the work. */
+  if (!g_task_propagate_boolean (task, &local_error) &&
+      !g_error_matches (local_error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+    g_message ("Failed to prepare deployment in background: %s",
+               local_error->message);
+}
+
+/**
+ * eos_updater_prepare_apply:
+ * @updater: an #EosUpdater in state %EOS_UPDATER_STATE_UPDATE_READY
+ * @data: the updater’s data
+ *
+ * If enabled by `PrepareInBackground` in the configuration, start preparing
+ * the deployment for the fetched update in a worker thread, at low priority,
+ * so that a later Apply() call only has to finalise it.
+ *
+ * Any preparation already in progress (for a previous update) is cancelled.
+ * This must only be called from the main thread.
+ */
+void
+eos_updater_prepare_apply (EosUpdater     *updater,
+                           EosUpdaterData *data)
+{
+  g_autoptr(EuuConfigFile) config = NULL;
+  g_autoptr(ApplyData) apply_data = NULL;
+  g_autoptr(GTask) task = NULL;
+  g_autoptr(GError) local_error = NULL;
+  gboolean prepare_in_background;
+
+  g_return_if_fail (eos_updater_get_state (updater) == EOS_UPDATER_STATE_UPDATE_READY);
+
+  config = eos_updater_config_file_new ();
+  prepare_in_background = euu_config_file_get_boolean (config, "Apply",
+                                                       "PrepareInBackground",
+                                                       &local_error);
+  if (local_error != NULL)
+    {
+      g_message ("Not preparing deployment in background: %s",
+                 local_error->message);
+      return;
+    }
+
+  if (!prepare_in_background)
+    return;
+
+  if (data->prepare_cancellable != NULL)
+    g_cancellable_cancel (data->prepare_cancellable);
+  g_clear_object (&data->prepare_cancellable);
+  data->prepare_cancellable = g_cancellable_new ();
+
+  apply_data = g_new0 (ApplyData, 1);
+  apply_data->update_id = g_strdup (eos_updater_get_update_id (updater));
+  apply_data->update_refspec = g_strdup (eos_updater_get_update_refspec (updater));
+  apply_data->orig_refspec = g_strdup (eos_updater_get_original_refspec (updater));
+  apply_data->repo = g_object_ref (data->repo);
+
+  /* This doesn’t change the updater state, and it doesn’t use @data, so it
+   * may safely run alongside the worker thread of a later operation. It
+   * holds the sysroot lock, so Apply() cancels it before starting. */
+  task = g_task_new (updater, data->prepare_cancellable, prepare_finished, data);
+  g_task_set_task_data (task, g_steal_pointer (&apply_data), (GDestroyNotify) apply_data_free);
+  g_task_run_in_thread (task, prepare);
+}
+
 gboolean
 handle_apply (EosUpdater            *updater,
               GDBusMethodInvocation *call,
@@ -431,9 +674,20 @@ handle_apply (EosUpdater            *updater,
   apply_data->orig_refspec = g_strdup (eos_updater_get_original_refspec (updater));
   apply_data->repo = g_object_ref (data->repo);
 
+  /* A background preparation still in progress holds the sysroot lock at idle
+   * priority, so apply() would wait behind it for as long as the rest of the
+   * system is busy. Cancel it instead; apply() either finds the deployment it
+   * staged, or stages one itself. */
+  if (data->prepare_cancellable != NULL)
+    {
+      g_message ("Cancelling background preparation of deployment for Apply()");
+      g_cancellable_cancel (data->prepare_cancellable);
+      g_clear_object (&data->prepare_cancellable);
+    }
+
   eos_updater_data_reset_cancellable (data);
   eos_updater_clear_error (updater, EOS_UPDATER_STATE_APPLYING_UPDATE);
-  task = g_task_new (updater, data->cancellable, apply_finished, NULL);
+  task = g_task_new (updater, data->cancellable, apply_finished, data);
   g_task_set_task_data (task, g_steal_pointer (&apply_data), (GDestroyNotify) apply_data_free);
   g_task_run_in_thread (task, apply);
 
@@ -24,6 +24,7 @@
 
 #pragma once
 
+#include <eos-updater/data.h>
 #include <eos-updater/dbus.h>
 #include <gio/gio.h>
 
@@ -33,4 +34,7 @@ gboolean handle_apply (EosUpdater            *updater,
                        GDBusMethodInvocation *call,
                        gpointer               user_data);
 
+void eos_updater_prepare_apply (EosUpdater     *updater,
+                                EosUpdaterData *data);
+
 G_END_DECLS
@@ -0,0 +1,178 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * Copyright 2024 Endless OS Foundation LLC <maintainers@endlessos.org>
+ *
+ * SPDX-License-Identifier: LGPL-2.1-or-later
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "config.h"
+
+#include <eos-updater/broken-deltas.h>
+#include <errno.h>
+#include <gio/gio.h>
+#include <glib.h>
+#include <libeos-updater-util/util.h>
+
+/* A record of static deltas which have been found to be broken (pulling them
+ * failed with %G_IO_ERROR_NOT_FOUND), so that later fetches of the same update
+ * can go straight to pulling objects rather than downloading part of the delta
+ * and failing again.
+ *
+ * It’s stored as a key file with one group per broken delta, named after the
+ * remote and the delta (`from-to`, or just `to` for a from-scratch delta),
+ * each with an `Expires` key giving the UNIX time after which the entry is
+ * ignored; the delta may have been regenerated on the server by then.
+ *
+ * These functions are only called from the fetch worker thread, and only one
+ * fetch may run at once, so they are not protected by a lock. */
+
+#define BROKEN_DELTA_EXPIRY_SECONDS (7 * 24 * 60 * 60)
+
+static const gchar *
+broken_deltas_path (void)
+{
+  return eos_updater_get_envvar_or ("EOS_UPDATER_TEST_UPDATER_BROKEN_DELTAS_PATH",
+                                    LOCALSTATEDIR "/lib/eos-updater/broken-static-deltas");
+}
+
+static gchar *
+broken_delta_group_name (const gchar *remote_name,
+                         const gchar *from_checksum,
+                         const gchar *to_checksum)
+{
+  if (from_checksum != NULL && *from_checksum != '\0')
+    return g_strdup_printf ("%s %s-%s", remote_name, from_checksum, to_checksum);
+  else
+    return g_strdup_printf ("%s %s", remote_name, to_checksum);
+}
+
+static GKeyFile *
+load_broken_deltas (GError **error)
+{
+  g_autoptr(GKeyFile) key_file = g_key_file_new ();
+  g_autoptr(GError) local_error = NULL;
+
+  if (!g_key_file_load_from_file (key_file, broken_deltas_path (),
+                                  G_KEY_FILE_NONE, &local_error) &&
+      !g_error_matches (local_error, G_FILE_ERROR, G_FILE_ERROR_NOENT))
+    {
+      g_propagate_error (error, g_steal_pointer (&local_error));
+      return NULL;
+    }
+
+  return g_steal_pointer (&key_file);
+}
+
+/**
+ * eos_broken_deltas_contains:
+ * @remote_name: name of the remote the delta would be pulled from
+ * @from_checksum: (nullable): checksum of the commit the delta starts from, or
+ *    %NULL for a from-scratch delta
+ * @to_checksum: checksum of the commit the delta ends at
+ *
+ * Check whether the given static delta has been recorded as broken by
+ * eos_broken_deltas_add(), and the record has not yet expired. Errors loading
+ * the record are logged and treated as the delta not being broken.
+ *
+ * Returns: %TRUE if the delta is known to be broken, %FALSE otherwise
+ */
+gboolean
+eos_broken_deltas_contains (const gchar *remote_name,
+                            const gchar *from_checksum,
+                            const gchar *to_checksum)
+{
+  g_autoptr(GKeyFile) key_file = NULL;
+  g_autofree gchar *group_name = NULL;
+  g_autoptr(GError) local_error = NULL;
+  gint64 expires;
+
+  g_return_val_if_fail (remote_name != NULL, FALSE);
+  g_return_val_if_fail (to_checksum != NULL, FALSE);
+
+  key_file = load_broken_deltas (&local_error);
+  if (key_file == NULL)
+    {
+      g_message ("Error loading list of broken static deltas: %s",
+                 local_error->message);
+      return FALSE;
+    }
+
+  group_name = broken_delta_group_name (remote_name, from_checksum, to_checksum);
+  expires = g_key_file_get_int64 (key_file, group_name, "Expires", NULL);
+
+  return (expires > g_get_real_time () / G_USEC_PER_SEC);
+}
+
+/**
+ * eos_broken_deltas_add:
+ * @remote_name: name of the remote the delta was pulled from
+ * @from_checksum: (nullable): checksum of the commit the delta starts from, or
+ *    %NULL for a from-scratch delta
+ * @to_checksum: checksum of the commit the delta ends at
+ * @error: return location for a #GError, or %NULL
+ *
+ * Record that the given static delta is broken, so that
+ * eos_broken_deltas_contains() returns %TRUE for it for the next few days.
+ * Any expired records are dropped at the same time.
+ *
+ * Returns: %TRUE on success, %FALSE otherwise
+ */
+gboolean
+eos_broken_deltas_add (const gchar  *remote_name,
+                       const gchar  *from_checksum,
+                       const gchar  *to_checksum,
+                       GError      **error)
+{
+  const gchar *path = broken_deltas_path ();
+  g_autofree gchar *dir = NULL;
+  g_autoptr(GKeyFile) key_file = NULL;
+  g_autofree gchar *group_name = NULL;
+  g_auto(GStrv) groups = NULL;
+  gint64 now = g_get_real_time () / G_USEC_PER_SEC;
+  gsize i;
+
+  g_return_val_if_fail (remote_name != NULL, FALSE);
+  g_return_val_if_fail (to_checksum != NULL, FALSE);
+  g_return_val_if_fail (error == NULL || *error == NULL, FALSE);
+
+  key_file = load_broken_deltas (error);
+  if (key_file == NULL)
+    return FALSE;
+
+  groups = g_key_file_get_groups (key_file, NULL);
+  for (i = 0; groups[i] != NULL; i++)
+    {
+      if (g_key_file_get_int64 (key_file, groups[i], "Expires", NULL) <= now)
+        g_key_file_remove_group (key_file, groups[i], NULL);
+    }
+
+  group_name = broken_delta_group_name (remote_name, from_checksum, to_checksum);
+  g_key_file_set_int64 (key_file, group_name, "Expires",
+                        now + BROKEN_DELTA_EXPIRY_SECONDS);
+
+  dir = g_path_get_dirname (path);
+  if (g_mkdir_with_parents (dir, 0755) != 0)
+    {
+      int saved_errno = errno;
+      g_set_error (error, G_IO_ERROR, g_io_error_from_errno (saved_errno),
+                   "Error creating directory ‘%s’: %s",
+                   dir, g_strerror (saved_errno));
+      return FALSE;
+    }
+
+  return g_key_file_save_to_file (key_file, path, error);
+}
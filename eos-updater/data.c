@@ -36,6 +36,7 @@ eos_updater_data_init (EosUpdaterData *data,
   memset (data, 0, sizeof *data);
   data->repo = g_object_ref (repo);
   data->cancellable = g_cancellable_new ();
+  data->sysroot_cache = eos_sysroot_cache_new ();
 }
 
 void
@@ -47,6 +48,11 @@ eos_updater_data_clear (EosUpdaterData *data)
   g_clear_pointer (&data->overridden_urls, g_strfreev);
   g_clear_object (&data->repo);
   g_clear_object (&data->cancellable);
+  g_clear_object (&data->sysroot_cache);
+
+  if (data->prepare_cancellable != NULL)
+    g_cancellable_cancel (data->prepare_cancellable);
+  g_clear_object (&data->prepare_cancellable);
 }
 
 void
@@ -24,6 +24,7 @@
 
 #pragma once
 
+#include <eos-updater/sysroot-cache.h>
 #include <ostree.h>
 
 G_BEGIN_DECLS
@@ -62,9 +63,21 @@ struct EosUpdaterData
    * able to cancel them. Upon cancellation (which is done by the Cancel()
    * method), the object is renewed (unreffed + replaced by a new instance). */
   GCancellable *cancellable;
+
+  /* Snapshot of the booted deployment and its commit, shared between all the
+   * stages so that each poll does not have to reload the sysroot. It is
+   * invalidated when the deployments change on disk, or after an apply. Its
+   * snapshots may be taken from worker threads. */
+  EosSysrootCache *sysroot_cache;
+
+  /* Cancellable for the background preparation of the deployment for the
+   * update in the UPDATE_READY state (see eos_updater_prepare_apply()), or
+   * %NULL if no preparation is in progress. This is separate from
+   * @cancellable, since the preparation is not tied to the updater state. */
+  GCancellable *prepare_cancellable;
 };
 
-#define EOS_UPDATER_DATA_CLEARED { NULL, NULL, NULL, FALSE, NULL }
+#define EOS_UPDATER_DATA_CLEARED { NULL, NULL, NULL, FALSE, NULL, NULL, NULL }
 
 void eos_updater_data_init (EosUpdaterData *data,
                             OstreeRepo *repo);
@@ -22,11 +22,15 @@
  *  - Vivek Dasmohapatra <vivek@etla.org>
  */
 
+#include <eos-updater/apply.h>
+#include <eos-updater/broken-deltas.h>
 #include <eos-updater/data.h>
 #include <eos-updater/fetch.h>
 #include <eos-updater/object.h>
+#include <eos-updater/updater-config.h>
 #include <flatpak.h>
 #include <libeos-updater-util/flatpak-util.h>
+#include <libeos-updater-util/ostree-util.h>
 #include <libeos-updater-util/types.h>
 #include <libeos-updater-util/util.h>
 #include <libmogwai-schedule-client/schedule-entry.h>
@@ -34,6 +38,59 @@
 
 #define APP_CENTER_OS_UPDATES_PRIORITY 30
 
+/* Keys which the fetch worker thread sets on the #OstreeAsyncProgress, in
+ * addition to those set by libostree, to tell update_progress() what it is
+ * doing. Both are strings. */
+#define PROGRESS_KEY_PHASE "eos-updater-phase"
+#define PROGRESS_KEY_SOURCE "eos-updater-source"
+
+/* Time constant (in microseconds) of the exponential smoothing applied to the
+ * download rate. */
+#define DOWNLOAD_RATE_SMOOTHING_USEC (5 * G_USEC_PER_SEC)
+
+/* Minimum interval (in milliseconds) between updates of the progress
+ * properties, each of which causes a `PropertiesChanged` broadcast on the
+ * system bus. This limits emissions to 4 Hz. */
+#define PROGRESS_EMISSION_INTERVAL_MSEC 250
+
+/* State for update_progress(), owned by the #OstreeAsyncProgress signal
+ * connection. This is only accessed from the main thread.
+ *
+ * Progress updates are accumulated here and only copied to the #EosUpdater
+ * properties at most once every %PROGRESS_EMISSION_INTERVAL_MSEC, by
+ * fetch_progress_state_flush(). */
+typedef struct
+{
+  EosUpdater *updater;  /* (owned) */
+  guint64 last_bytes;
+  gint64 last_time_usec;  /* monotonic; 0 if no samples yet */
+  gdouble rate;  /* bytes per second, smoothed */
+
+  /* Values waiting to be flushed to @updater. */
+  gboolean dirty;
+  gint64 downloaded_bytes;  /* highest value reported so far */
+  gint64 time_remaining;
+  guint fetched_objects;
+  guint requested_objects;
+  gchar *phase;  /* (owned) (nullable) */
+  gchar *source;  /* (owned) (nullable) */
+
+  gint64 last_flush_usec;  /* monotonic; 0 if never flushed */
+  guint flush_source_id;  /* 0 if no flush is scheduled */
+} FetchProgressState;
+
+static void
+fetch_progress_state_free (FetchProgressState *state)
+{
+  if (state->flush_source_id != 0)
+    g_source_remove (state->flush_source_id);
+
+  g_clear_object (&state->updater);
+  g_free (state->phase);
+  g_free (state->source);
+  g_free (state);
+}
+
 /* Closure containing the data for the fetch worker thread. The
  * worker thread must not access EosUpdater or EosUpdaterData directly,
  * as they are not thread safe. */
@@ -51,6 +108,7 @@ typedef struct
 
   /* Progress. */
   OstreeAsyncProgress *progress;  /* (owned) */
+  FetchProgressState *progress_state;  /* (unowned); owned by the signal handler on @progress */
 } FetchData;
 
 static void
@@ -72,6 +130,11 @@ typedef struct {
   gulong download_now_handler_id;
   gulong invalidated_handler_id;
   gulong cancellables_bind_handler_id;
+
+  /* Set if @scheduled_entry_cancellable was cancelled because the scheduler
+   * no longer allows downloading, rather than because the fetch was
+   * cancelled or the entry invalidated. The download can be resumed later. */
+  gboolean paused;
 } ScheduledEntryCancellableHelper;
 
 static void
@@ -102,6 +165,51 @@ scheduled_entry_cancellable_helper_free (ScheduledEntryCancellableHelper *helper
 
 G_DEFINE_AUTOPTR_CLEANUP_FUNC (ScheduledEntryCancellableHelper, scheduled_entry_cancellable_helper_free)
 
+/* Copy any pending progress to the #EosUpdater properties now. This is called
+ * when the rate limit allows, and when the fetch finishes, so the final
+ * progress is never lost. */
+static void
+fetch_progress_state_flush (FetchProgressState *state)
+{
+  EosUpdater *updater = state->updater;
+
+  if (state->flush_source_id != 0)
+    {
+      g_source_remove (state->flush_source_id);
+      state->flush_source_id = 0;
+    }
+
+  if (!state->dirty)
+    return;
+
+  state->dirty = FALSE;
+  state->last_flush_usec = g_get_monotonic_time ();
+
+  /* The flush could have been scheduled after the fetch completed, make sure
+   * we don't override the downloaded bytes */
+  if (eos_updater_get_state (updater) != EOS_UPDATER_STATE_FETCHING)
+    return;
+
+  eos_updater_set_downloaded_bytes (updater, state->downloaded_bytes);
+  eos_updater_set_download_rate (updater, (gint64) state->rate);
+  eos_updater_set_download_time_remaining (updater, state->time_remaining);
+  eos_updater_set_fetched_objects (updater, state->fetched_objects);
+  eos_updater_set_requested_objects (updater, state->requested_objects);
+  eos_updater_set_fetch_phase (updater, (state->phase != NULL) ? state->phase : "");
+  eos_updater_set_fetch_source (updater, (state->source != NULL) ? state->source : "");
+}
+
+static gboolean
+fetch_progress_state_flush_cb (gpointer user_data)
+{
+  FetchProgressState *state = user_data;
+
+  state->flush_source_id = 0;
+  fetch_progress_state_flush (state);
+
+  return G_SOURCE_REMOVE;
+}
+
 static void
 content_fetch_finished (GObject *object,
                         GAsyncResult *res,
@@ -120,7 +228,10 @@ content_fetch_finished (GObject *object,
   fetch_data = g_task_get_task_data (task);
   progress = fetch_data->progress;
 
+  /* Make sure the final progress is reported before the state changes. */
   ostree_async_progress_finish (progress);
+  fetch_progress_state_flush (fetch_data->progress_state);
+  eos_updater_clear_fetch_progress (updater);
   g_task_propagate_boolean (task, &error);
 
   if (error)
@@ -139,6 +250,7 @@ content_fetch_finished (GObject *object,
   else
     {
       eos_updater_clear_error (updater, EOS_UPDATER_STATE_UPDATE_READY);
+      eos_updater_prepare_apply (updater, fetch_data->data);
     }
 
   return;
@@ -151,23 +263,131 @@ content_fetch_finished (GObject *object,
   g_assert_not_reached ();
 }
 
+static void
+set_progress_string (OstreeAsyncProgress *progress,
+                     const gchar         *key,
+                     const gchar         *value)
+{
+  ostree_async_progress_set_variant (progress, key,
+                                     g_variant_new_string ((value != NULL) ? value : ""));
+}
+
+static gchar *
+dup_progress_string (OstreeAsyncProgress *progress,
+                     const gchar         *key)
+{
+  g_autoptr(GVariant) value = ostree_async_progress_get_variant (progress, key);
+
+  if (value == NULL || !g_variant_is_of_type (value, G_VARIANT_TYPE_STRING))
+    return g_strdup ("");
+
+  return g_variant_dup_string (value, NULL);
+}
+
 /* This will be executed in the same thread as handle_fetch(). */
 static void
 update_progress (OstreeAsyncProgress *progress,
-                 gpointer object)
+                 gpointer             user_data)
 {
-  EosUpdater *updater = EOS_UPDATER (object);
+  FetchProgressState *state = user_data;
+  EosUpdater *updater = state->updater;
   guint64 bytes = ostree_async_progress_get_uint64 (progress,
                                                     "bytes-transferred");
+  guint total_delta_parts = ostree_async_progress_get_uint (progress, "total-delta-parts");
+  guint outstanding_metadata_fetches = ostree_async_progress_get_uint (progress, "outstanding-metadata-fetches");
+  gint64 now_usec = g_get_monotonic_time ();
+  gint64 download_size;
+  gint64 next_flush_msec;
+  g_autofree gchar *phase = NULL;
+
+  /* Idle could have been scheduled after the fetch completed, make sure we
+   * don't override the downloaded bytes */
+  if (eos_updater_get_state (updater) != EOS_UPDATER_STATE_FETCHING)
+    return;
+
+  /* Smooth the download rate. If the pull was restarted (for example, to retry
+   * without static deltas), `bytes-transferred` starts again from zero, so
+   * count everything since the restart. */
+  if (state->last_time_usec != 0 && now_usec > state->last_time_usec)
+    {
+      guint64 delta_bytes = (bytes >= state->last_bytes) ? bytes - state->last_bytes : bytes;
+      gdouble delta_usec = (gdouble) (now_usec - state->last_time_usec);
+      gdouble sample_rate = (gdouble) delta_bytes * G_USEC_PER_SEC / delta_usec;
+      gdouble weight = delta_usec / (delta_usec + DOWNLOAD_RATE_SMOOTHING_USEC);
+
+      state->rate += weight * (sample_rate - state->rate);
+    }
+
+  state->last_bytes = bytes;
+  state->last_time_usec = now_usec;
 
   /* FIXME: Cap to the limit of eos_updater_set_downloaded_bytes(). */
   if (bytes > G_MAXINT64)
     bytes = G_MAXINT64;
 
-  /* Idle could have been scheduled after the fetch completed, make sure we
-   * don't override the downloaded bytes */
-  if (eos_updater_get_state (updater) == EOS_UPDATER_STATE_FETCHING)
-    eos_updater_set_downloaded_bytes (updater, (gint64) bytes);
+  /* Never let `DownloadedBytes` go backwards when the pull is restarted; the
+   * progress bar would jump around otherwise. */
+  state->downloaded_bytes = MAX (state->downloaded_bytes, (gint64) bytes);
+
+  download_size = eos_updater_get_download_size (updater);
+  if (download_size > 0 && state->rate >= 1.0)
+    {
+      gint64 remaining_bytes = MAX (download_size - state->downloaded_bytes, 0);
+      state->time_remaining = (gint64) ((gdouble) remaining_bytes / state->rate);
+    }
+  else
+    {
+      state->time_remaining = -1;
+    }
+
+  /* The worker thread sets the phase explicitly once it moves on from the OS
+   * pull; until then, work it out from what libostree is doing. */
+  phase = dup_progress_string (progress, PROGRESS_KEY_PHASE);
+
+  if (*phase == '\0')
+    {
+      g_free (phase);
+
+      if (total_delta_parts > 0)
+        phase = g_strdup ("deltas");
+      else if (outstanding_metadata_fetches > 0 ||
+               ostree_async_progress_get_uint (progress, "requested") == 0)
+        phase = g_strdup ("metadata");
+      else
+        phase = g_strdup ("objects");
+    }
+
+  if (g_str_equal (phase, "deltas"))
+    {
+      state->fetched_objects = ostree_async_progress_get_uint (progress, "fetched-delta-parts");
+      state->requested_objects = total_delta_parts;
+    }
+  else if (!g_str_equal (phase, "flatpaks"))
+    {
+      state->fetched_objects = ostree_async_progress_get_uint (progress, "fetched");
+      state->requested_objects = ostree_async_progress_get_uint (progress, "requested");
+    }
+
+  g_free (state->phase);
+  state->phase = g_steal_pointer (&phase);
+  g_free (state->source);
+  state->source = dup_progress_string (progress, PROGRESS_KEY_SOURCE);
+  state->dirty = TRUE;
+
+  /* Coalesce updates which arrive within the rate limit into a single flush
+   * at the end of the interval. */
+  if (state->flush_source_id != 0)
+    return;
+
+  next_flush_msec = PROGRESS_EMISSION_INTERVAL_MSEC -
+                    (now_usec - state->last_flush_usec) / 1000;
+
+  if (state->last_flush_usec == 0 || next_flush_msec <= 0)
+    fetch_progress_state_flush (state);
+  else
+    state->flush_source_id = g_timeout_add ((guint) next_flush_msec,
+                                            fetch_progress_state_flush_cb,
+                                            state);
 }
 
 static GVariant *
@@ -189,19 +409,68 @@ get_options_for_pull (const gchar *ref,
   return g_variant_builder_end (&builder);
 }
 
+/* Work out which commit a static delta to the update would start from: the
+ * booted commit, which is the newest complete commit in the local repository.
+ * The local copy of the ref can’t be used, as Poll() has already moved it to
+ * the update commit (with only its metadata pulled). Returns %NULL (a
+ * from-scratch delta) if the booted deployment can’t be found. */
+static gchar *
+get_delta_from_checksum (EosSysrootCache *sysroot_cache,
+                         GCancellable    *cancellable)
+{
+  g_autoptr(EosSysrootSnapshot) snapshot = NULL;
+  g_autoptr(GError) local_error = NULL;
+
+  snapshot = eos_sysroot_cache_dup_snapshot (sysroot_cache, cancellable, &local_error);
+  if (snapshot == NULL)
+    {
+      g_debug ("Error finding booted commit to use as static delta base: %s",
+               local_error->message);
+      return NULL;
+    }
+
+  return g_strdup (snapshot->booted_checksum);
+}
+
+static void
+record_broken_delta (const gchar *remote_name,
+                     const gchar *from_checksum,
+                     const gchar *to_checksum)
+{
+  g_autoptr(GError) local_error = NULL;
+
+  if (!eos_broken_deltas_add (remote_name, from_checksum, to_checksum, &local_error))
+    g_message ("Error recording static delta %s-%s from %s as broken: %s",
+               (from_checksum != NULL) ? from_checksum : "",
+               to_checksum, remote_name, local_error->message);
+}
+
 static gboolean
 repo_pull (OstreeRepo *self,
            const gchar *remote_name,
            const gchar *ref,
            const gchar *url_override,
+           const gchar *delta_from_checksum,
+           const gchar *delta_to_checksum,
            OstreeAsyncProgress *progress,
            GCancellable *cancellable,
            GError **error)
 {
-  g_autoptr(GVariant) options = get_options_for_pull (ref, url_override, FALSE);
+  g_autoptr(GVariant) options = NULL;
   g_autoptr(GError) local_error = NULL;
+  gboolean delta_known_broken;
 
-  /* FIXME: progress bar will go crazy here if it fails */
+  delta_known_broken = eos_broken_deltas_contains (remote_name,
+                                                   delta_from_checksum,
+                                                   delta_to_checksum);
+  if (delta_known_broken)
+    g_message ("Static delta for %s from %s is known to be broken; "
+               "pulling without static deltas", ref, remote_name);
+
+  options = get_options_for_pull (ref, url_override, delta_known_broken);
+
+  /* If this fails and is retried, update_progress() copes with
+   * `bytes-transferred` starting again from zero. */
   if (!ostree_repo_pull_with_options (self, remote_name, options,
                                       progress, cancellable, &local_error))
     {
@@ -211,7 +480,8 @@ repo_pull (OstreeRepo *self,
        * retries for broken static deltas, so this case for
        * %G_IO_ERROR_NOT_FOUND could be dropped.
        * See https://github.com/ostreedev/ostree/pull/1612. */
-      if (!g_error_matches (local_error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND))
+      if (delta_known_broken ||
+          !g_error_matches (local_error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND))
         {
           g_propagate_error (error, g_steal_pointer (&local_error));
           return FALSE;
@@ -223,6 +493,10 @@ repo_pull (OstreeRepo *self,
                  remote_name,
                  (url_override != NULL) ? url_override : "not overridden",
                  local_error->message);
+      record_broken_delta (remote_name, delta_from_checksum, delta_to_checksum);
+
+      /* Objects written by the failed attempt are kept in the repository’s
+       * staging directory, so the retry won’t download them again. */
       fallback_options = get_options_for_pull (ref, url_override, TRUE);
 
       return ostree_repo_pull_with_options (self, remote_name, fallback_options,
@@ -241,19 +515,49 @@ async_result_cb (GObject      *source_object,
   *out_result = g_object_ref (result);
 }
 
+static GVariant *
+get_options_without_static_deltas (GVariant *options)
+{
+  g_auto(GVariantDict) dict = { 0, };
+
+  g_variant_dict_init (&dict, options);
+  g_variant_dict_insert (&dict, "disable-static-deltas", "b", TRUE);
+
+  return g_variant_ref_sink (g_variant_dict_end (&dict));
+}
+
 static gboolean
 repo_pull_from_remotes (OstreeRepo                            *repo,
                         const OstreeRepoFinderResult * const  *results,
                         GVariant                              *options,
+                        const gchar                           *delta_remote_name,
+                        const gchar                           *delta_from_checksum,
+                        const gchar                           *delta_to_checksum,
                         OstreeAsyncProgress                   *progress,
                         GMainContext                          *context,
                         GCancellable                          *cancellable,
                         GError                               **error)
 {
   g_autoptr(GAsyncResult) pull_result = NULL;
+  g_autoptr(GVariant) no_delta_options = NULL;
   g_autoptr(GError) local_error = NULL;
+  gboolean delta_known_broken;
 
-  /* FIXME: progress bar will go crazy here if it fails */
+  delta_known_broken = (delta_remote_name != NULL &&
+                        eos_broken_deltas_contains (delta_remote_name,
+                                                    delta_from_checksum,
+                                                    delta_to_checksum));
+  if (delta_known_broken)
+    {
+      g_message ("Static delta for %s from %s is known to be broken; "
+                 "pulling without static deltas",
+                 delta_to_checksum, delta_remote_name);
+      no_delta_options = get_options_without_static_deltas (options);
+      options = no_delta_options;
+    }
+
+  /* If this fails and is retried, update_progress() copes with
+   * `bytes-transferred` starting again from zero. */
   ostree_repo_pull_from_remotes_async (repo, results, options, progress,
                                        cancellable, async_result_cb, &pull_result);
 
@@ -262,27 +566,30 @@ repo_pull_from_remotes (OstreeRepo                            *repo,
 
   if (!ostree_repo_pull_from_remotes_finish (repo, pull_result, &local_error))
     {
-      g_auto(GVariantDict) dict = { 0, };
       g_autoptr(GVariant) fallback_options = NULL;
 
       /* FIXME: In future, it’s likely that OSTree will internally handle
        * retries for broken static deltas, so this case for
        * %G_IO_ERROR_NOT_FOUND could be dropped.
        * See https://github.com/ostreedev/ostree/pull/1612. */
-      if (!g_error_matches (local_error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND))
+      if (delta_known_broken ||
+          !g_error_matches (local_error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND))
         {
           g_propagate_error (error, g_steal_pointer (&local_error));
           return FALSE;
         }
-      g_clear_error (&local_error);
 
       g_warning ("Pulling results %p failed because some object was not found; "
                  "will try again, this time without static deltas: %s",
                  results, local_error->message);
+      g_clear_error (&local_error);
 
-      g_variant_dict_init (&dict, options);
-      g_variant_dict_insert (&dict, "disable-static-deltas", "b", TRUE);
-      fallback_options = g_variant_dict_end (&dict);
+      if (delta_remote_name != NULL)
+        record_broken_delta (delta_remote_name, delta_from_checksum, delta_to_checksum);
+
+      /* Objects written by the failed attempt are kept in the repository’s
+       * staging directory, so the retry won’t download them again. */
+      fallback_options = get_options_without_static_deltas (options);
 
       g_clear_object (&pull_result);
       ostree_repo_pull_from_remotes_async (repo, results, fallback_options, progress,
@@ -304,13 +611,50 @@ content_fetch_new (FetchData     *fetch_data,
                    GError       **error)
 {
   EosUpdaterData *data = fetch_data->data;
+  const OstreeRepoFinderResult *result;
+  g_autofree gchar *remote_url = NULL;
+  g_autofree gchar *remote = NULL;
+  g_autofree gchar *ref = NULL;
+  g_autofree gchar *delta_from_checksum = NULL;
+  const gchar *delta_to_checksum = fetch_data->update_id;
 
   g_assert (data->results != NULL);
 
-  return repo_pull_from_remotes (data->repo,
-                                 (const OstreeRepoFinderResult * const *) data->results,
-                                 NULL  /* options */, fetch_data->progress, context,
-                                 cancellable, error);
+  /* Broken static deltas are recorded against the remote the update was
+   * polled for, whichever peer the objects end up coming from. */
+  if (fetch_data->update_refspec != NULL &&
+      delta_to_checksum != NULL && *delta_to_checksum != '\0' &&
+      ostree_parse_refspec (fetch_data->update_refspec, &remote, &ref, NULL) &&
+      remote != NULL)
+    delta_from_checksum = get_delta_from_checksum (data->sysroot_cache, cancellable);
+  else
+    g_clear_pointer (&remote, g_free);
+
+  /* Results are sorted by priority, so the first one is the most likely to be
+   * used for the pull. */
+  result = data->results[0];
+  if (result != NULL)
+    {
+      remote_url = ostree_remote_get_url (result->remote);
+      set_progress_string (fetch_data->progress, PROGRESS_KEY_SOURCE,
+                           (remote_url != NULL) ? remote_url : ostree_remote_get_name (result->remote));
+    }
+
+  if (!repo_pull_from_remotes (data->repo,
+                               (const OstreeRepoFinderResult * const *) data->results,
+                               NULL  /* options */,
+                               remote, delta_from_checksum, delta_to_checksum,
+                               fetch_data->progress, context,
+                               cancellable, error))
+    {
+      g_autofree gchar *origin_url =
+        eos_updater_get_refspec_remote_url (data->repo, fetch_data->update_refspec);
+
+      eos_updater_map_pull_error (origin_url, remote_url, error);
+      return FALSE;
+    }
+
+  return TRUE;
 }
 
 static gboolean
@@ -325,6 +669,7 @@ content_fetch_old (FetchData     *fetch_data,
   g_autofree gchar *ref = NULL;
   const gchar *commit_id = fetch_data->update_id;
   const gchar *url_override = NULL;
+  g_autofree gchar *delta_from_checksum = NULL;
   OstreeRepo *repo = data->repo;
 
   if (refspec == NULL || *refspec == '\0')
@@ -360,14 +705,30 @@ content_fetch_old (FetchData     *fetch_data,
 
       url_override = data->overridden_urls[idx];
     }
+
+  set_progress_string (fetch_data->progress, PROGRESS_KEY_SOURCE,
+                       (url_override != NULL) ? url_override : remote);
   /* rather than re-resolving the update, we get the last ID that the
    * user Poll()ed. We do this because that is the last update for which
    * we had size data: If there's been a new update since, then the
    * system hasn;t seen the download/unpack sizes for that so it cannot
    * be considered to have been approved.
    */
-  if (!repo_pull (repo, remote, commit_id, url_override, fetch_data->progress, cancellable, error))
-    return FALSE;
+  delta_from_checksum = get_delta_from_checksum (data->sysroot_cache, cancellable);
+
+  if (!repo_pull (repo, remote, commit_id, url_override,
+                  delta_from_checksum, commit_id,
+                  fetch_data->progress, cancellable, error))
+    {
+      g_autofree gchar *remote_url = NULL;
+      const gchar *pull_url;
+
+      if (url_override == NULL)
+        ostree_repo_remote_get_url (repo, remote, &remote_url, NULL);
+      pull_url = (url_override != NULL) ? url_override : remote_url;
+      eos_updater_map_pull_error (pull_url, pull_url, error);
+      return FALSE;
+    }
 
   g_message ("Fetch: pull() completed");
 
@@ -483,87 +844,72 @@ transition_pending_ref_action_collection_ids_to_remote_names (FlatpakInstallatio
   return TRUE;
 }
 
+/* Add @action to @transaction, so that its ref is pulled when the transaction
+ * is run. If the ref for an install action is already installed, it is updated
+ * to the most recent version instead; if the ref for an update action is not
+ * installed, nothing is added. @out_added is set to %TRUE if an operation was
+ * added to @transaction. */
 static gboolean
-perform_install_preparation (FlatpakInstallation             *installation,
-                             EuuFlatpakLocationRef           *ref,
-                             EuuFlatpakRemoteRefActionFlags   action_flags,
-                             GCancellable                    *cancellable,
-                             GError                         **error)
+add_action_preparation_to_transaction (FlatpakTransaction         *transaction,
+                                       EuuFlatpakRemoteRefAction  *action,
+                                       gboolean                   *out_added,
+                                       GError                    **error)
 {
-  const gchar *remote = ref->remote;
+  EuuFlatpakLocationRef *ref = action->ref;
   g_autofree char *formatted_ref = flatpak_ref_format_ref (ref->ref);
-  gboolean no_deploy = !(action_flags & EUU_FLATPAK_REMOTE_REF_ACTION_FLAG_IS_DEPENDENCY);
   g_autoptr(GError) local_error = NULL;
 
-  /* Note here the no_deploy parameter. Dependency ref actions are immediately
-   * deployed upon the fetch() stage as opposed to waiting for
-   * eos-updater-flatpak-installer to handle them. This is because we can
-   * deploy them "safely" as they are "invisible" to the user. This saves us
-   * from having to maintain dependency state in the ostree repo across
-   * reboots.
-   */
-  if (!euu_flatpak_transaction_install (installation,
-                                        remote,
-                                        formatted_ref,
-                                        no_deploy,
-                                        FALSE, /* no_pull */
-                                        cancellable,
-                                        &local_error))
+  *out_added = FALSE;
+
+  if (action->type == EUU_FLATPAK_REMOTE_REF_ACTION_INSTALL)
     {
-      if (g_error_matches (local_error, FLATPAK_ERROR, FLATPAK_ERROR_ALREADY_INSTALLED))
+      if (flatpak_transaction_add_install (transaction,
+                                           ref->remote,
+                                           formatted_ref,
+                                           NULL, /* subpaths */
+                                           &local_error))
         {
-          g_message ("%s:%s already installed, updating to most recent version instead",
-                     remote,
-                     formatted_ref);
-          g_clear_error (&local_error);
-
-          return euu_flatpak_transaction_update (installation,
-                                                 formatted_ref,
-                                                 no_deploy,
-                                                 FALSE, /* no_pull */
-                                                 TRUE, /* no_prune */
-                                                 cancellable,
-                                                 error);
+          *out_added = TRUE;
+          return TRUE;
         }
-      else
+
+      if (!g_error_matches (local_error, FLATPAK_ERROR, FLATPAK_ERROR_ALREADY_INSTALLED))
         {
-          /* Something unexpected failed, return early now.
-           *
-           * We are not able to meaningfully clean up here - the refs will remain
-           * in the flatpak ostree repo for the next time we want to install them
-           * but there's nothing in the public API that will allow us to get rid of
-           * them. */
           g_message ("Error occurred whilst pulling flatpak %s:%s: %s",
-                     remote,
+                     ref->remote,
                      formatted_ref,
                      local_error->message);
           g_propagate_error (error, g_steal_pointer (&local_error));
           return FALSE;
         }
-    }
 
-  return TRUE;
-}
+      g_message ("%s:%s already installed, updating to most recent version instead",
+                 ref->remote,
+                 formatted_ref);
+      g_clear_error (&local_error);
 
-static gboolean
-perform_update_preparation (FlatpakInstallation             *installation,
-                            EuuFlatpakLocationRef           *ref,
-                            EuuFlatpakRemoteRefActionFlags   action_flags,
-                            GCancellable                    *cancellable,
-                            GError                         **error)
-{
-  g_autofree char *formatted_ref = flatpak_ref_format_ref (ref->ref);
-  gboolean no_deploy = !(action_flags & EUU_FLATPAK_REMOTE_REF_ACTION_FLAG_IS_DEPENDENCY);
-  g_autoptr(GError) local_error = NULL;
+      if (!flatpak_transaction_add_update (transaction,
+                                           formatted_ref,
+                                           NULL, /* subpaths */
+                                           NULL, /* commit */
+                                           error))
+        return FALSE;
 
-  if (!euu_flatpak_transaction_update (installation,
-                                       formatted_ref,
-                                       no_deploy,
-                                       FALSE, /* no_pull */
-                                       TRUE, /* no_prune */
-                                       cancellable,
-                                       &local_error))
+      *out_added = TRUE;
+      return TRUE;
+    }
+  else if (action->type == EUU_FLATPAK_REMOTE_REF_ACTION_UPDATE)
     {
+      if (flatpak_transaction_add_update (transaction,
+                                          formatted_ref,
+                                          NULL, /* subpaths */
+                                          NULL, /* commit */
+                                          &local_error))
+        {
+          *out_added = TRUE;
+          return TRUE;
+        }
+
       if (!g_error_matches (local_error, FLATPAK_ERROR, FLATPAK_ERROR_NOT_INSTALLED))
         {
           g_propagate_error (error, g_steal_pointer (&local_error));
@@ -571,41 +917,31 @@ perform_update_preparation (FlatpakInstallation             *installation,
         }
 
       g_message ("%s is not installed, so not updating", formatted_ref);
-      g_clear_error (&local_error);
+      return TRUE;
     }
 
+  /* Nothing to prepare for uninstalls. */
   return TRUE;
 }
 
-static gboolean
-perform_action_preparation (FlatpakInstallation        *installation,
-                            EuuFlatpakRemoteRefAction  *action,
-                            GCancellable               *cancellable,
-                            GError                    **error)
+static FlatpakTransaction *
+new_preparation_transaction (FlatpakInstallation  *installation,
+                             gboolean              no_deploy,
+                             GCancellable         *cancellable,
+                             GError              **error)
 {
-  EuuFlatpakLocationRef *ref = action->ref;
+  g_autoptr(FlatpakTransaction) transaction = NULL;
 
-  switch (action->type)
-    {
-      case EUU_FLATPAK_REMOTE_REF_ACTION_INSTALL:
-        return perform_install_preparation (installation,
-                                            ref,
-                                            action->flags,
-                                            cancellable,
-                                            error);
-      case EUU_FLATPAK_REMOTE_REF_ACTION_UPDATE:
-        return perform_update_preparation (installation,
-                                           ref,
-                                           action->flags,
-                                           cancellable,
-                                           error);
-      case EUU_FLATPAK_REMOTE_REF_ACTION_UNINSTALL:
-        return TRUE;
-      default:
-        g_assert_not_reached ();
-        return FALSE;
-    }
+  transaction = flatpak_transaction_new_for_installation (installation, cancellable, error);
+  if (transaction == NULL)
+    return NULL;
 
+  flatpak_transaction_set_no_interaction (transaction, TRUE);
+  flatpak_transaction_set_no_deploy (transaction, no_deploy);
+  flatpak_transaction_set_no_pull (transaction, FALSE);
+  flatpak_transaction_set_disable_prune (transaction, TRUE);
+
+  return g_steal_pointer (&transaction);
 }
 
 static gboolean
@@ -615,6 +951,10 @@ pull_flatpaks (FlatpakInstallation  *installation,
                GError              **error)
 {
   gsize i;
+  g_autoptr(FlatpakTransaction) deploy_transaction = NULL;
+  g_autoptr(FlatpakTransaction) no_deploy_transaction = NULL;
+  gboolean deploy_transaction_has_ops = FALSE;
+  gboolean no_deploy_transaction_has_ops = FALSE;
 
   if (!installation)
     return FALSE;
@@ -631,18 +971,54 @@ pull_flatpaks (FlatpakInstallation  *installation,
                                                                      error))
     return FALSE;
 
+  /* Rather than running a transaction per action, which would resolve,
+   * lock the installation and fetch the remote metadata once for each of
+   * them, batch all the actions into (at most) two transactions and let
+   * flatpak order the operations, including any runtimes they need.
+   *
+   * Dependency ref actions are immediately deployed upon the fetch() stage as
+   * opposed to waiting for eos-updater-flatpak-installer to handle them. This
+   * is because we can deploy them "safely" as they are "invisible" to the
+   * user. This saves us from having to maintain dependency state in the ostree
+   * repo across reboots. All other actions are only pulled (no_deploy). */
   for (i = 0; i < pending_flatpak_ref_actions->len; ++i)
     {
       EuuFlatpakRemoteRefAction *action = g_ptr_array_index (pending_flatpak_ref_actions, i);
+      gboolean is_dependency = (action->flags & EUU_FLATPAK_REMOTE_REF_ACTION_FLAG_IS_DEPENDENCY) != 0;
+      FlatpakTransaction **transaction = is_dependency ? &deploy_transaction : &no_deploy_transaction;
+      gboolean added = FALSE;
 
       if (!(action->type == EUU_FLATPAK_REMOTE_REF_ACTION_INSTALL ||
             action->type == EUU_FLATPAK_REMOTE_REF_ACTION_UPDATE))
         continue;
 
-      if (!perform_action_preparation (installation, action, cancellable, error))
+      if (*transaction == NULL)
+        {
+          *transaction = new_preparation_transaction (installation, !is_dependency,
+                                                      cancellable, error);
+          if (*transaction == NULL)
+            return FALSE;
+        }
+
+      if (!add_action_preparation_to_transaction (*transaction, action, &added, error))
         return FALSE;
+
+      if (is_dependency)
+        deploy_transaction_has_ops |= added;
+      else
+        no_deploy_transaction_has_ops |= added;
     }
 
+  /* Deploy the dependencies first, so they are in place before anything
+   * which needs them is pulled. */
+  if (deploy_transaction_has_ops &&
+      !euu_flatpak_transaction_run (deploy_transaction, cancellable, error))
+    return FALSE;
+
+  if (no_deploy_transaction_has_ops &&
+      !euu_flatpak_transaction_run (no_deploy_transaction, cancellable, error))
+    return FALSE;
+
   return TRUE;
 }
 
@@ -797,7 +1173,10 @@ schedule_download (FetchData     *fetch_data,
     return FALSE;
 
   /* Schedule the download. Similar reasoning applies to the timeout as above. */
-  g_variant_dict_insert (&parameters_dict, "resumable", "b", FALSE);
+  /* The download is resumable: if the scheduler stops allowing it part way
+   * through, the pull is interrupted and resumed later, keeping the objects
+   * which have already been downloaded. See content_fetch(). */
+  g_variant_dict_insert (&parameters_dict, "resumable", "b", TRUE);
   /* Add the highest priority that the App Center uses as this will be compared
    * at the same level in Mogwai */
   g_variant_dict_insert (&parameters_dict, "priority", "u", APP_CENTER_OS_UPDATES_PRIORITY);
@@ -860,22 +1239,23 @@ unschedule_download (FetchData     *fetch_data,
 }
 
 static void
-cancel_if_download_forbidden_cb (GObject    *obj,
-                                 GParamSpec *pspec,
-                                 gpointer    user_data)
+pause_if_download_forbidden_cb (GObject    *obj,
+                                GParamSpec *pspec,
+                                gpointer    user_data)
 {
   MwscScheduleEntry *entry = MWSC_SCHEDULE_ENTRY (obj);
-  GCancellable *cancellable = user_data;
+  ScheduledEntryCancellableHelper *helper = user_data;
 
-  /* FIXME: Eventually add support for resuming OS update downloads when allowed
-   * to by the scheduler. When that happens `get_download_now()` will return
-   * %TRUE again; while waiting for that to happen, eos-updater should stay in
-   * the `fetching` state. For now, we end up the `error` state instead. */
+  /* Interrupt the ongoing pull. content_fetch() will notice that the download
+   * was paused, rather than cancelled, and will wait for `get_download_now()`
+   * to return %TRUE again before resuming the pull, staying in the `fetching`
+   * state in the meantime. */
   if (!mwsc_schedule_entry_get_download_now (entry))
     {
-      g_message ("Fetch cancelled because Mogwai's scheduled entry %s can no "
+      g_message ("Fetch paused because Mogwai's scheduled entry %s can no "
                  "longer download.", mwsc_schedule_entry_get_id (entry));
-      g_cancellable_cancel (cancellable);
+      helper->paused = TRUE;
+      g_cancellable_cancel (helper->scheduled_entry_cancellable);
     }
 }
 
@@ -884,11 +1264,12 @@ cancel_on_entry_invalidated_cb (MwscScheduleEntry *entry,
                                 const GError      *error,
                                 gpointer           user_data)
 {
-  GCancellable *cancellable = user_data;
+  ScheduledEntryCancellableHelper *helper = user_data;
 
   g_message ("Fetch cancelled because Mogwai's scheduled entry %s has "
              "been invalidated.", mwsc_schedule_entry_get_id (entry));
-  g_cancellable_cancel (cancellable);
+  helper->paused = FALSE;
+  g_cancellable_cancel (helper->scheduled_entry_cancellable);
 }
 
 static gboolean
@@ -977,10 +1358,8 @@ check_scheduler (FetchData     *fetch_data,
   g_signal_handler_disconnect (fetch_data->schedule_entry, invalidated_id);
   g_signal_handler_disconnect (fetch_data->schedule_entry, notify_id);
 
-  /* Get downloading!
-   * FIXME: In future, we will want to monitor notify::download-now and cancel
-   * the ongoing download if the scheduler tells us to. For now, just download
-   * through from start to finish. */
+  /* Get downloading! content_fetch() monitors notify::download-now from here
+   * on, and pauses the download if the scheduler tells us to. */
   if (download_now)
     {
       g_message ("Fetch: got positive response from download scheduler");
@@ -1043,48 +1422,152 @@ connect_cancellable_to_entry (MwscScheduleEntry *entry,
   helper->scheduled_entry = g_object_ref (entry);
   helper->download_now_handler_id = g_signal_connect (entry,
                                                       "notify::download-now",
-                                                      (GCallback) cancel_if_download_forbidden_cb,
-                                                      helper->scheduled_entry_cancellable);
+                                                      (GCallback) pause_if_download_forbidden_cb,
+                                                      helper);
   helper->invalidated_handler_id = g_signal_connect (entry,
                                                      "invalidated",
                                                      (GCallback) cancel_on_entry_invalidated_cb,
-                                                     helper->scheduled_entry_cancellable);
+                                                     helper);
 
   return helper;
 }
 
+/* Replace the scheduled entry cancellable, which was cancelled when the
+ * download was paused, with a new one for resuming the download. #GCancellable
+ * can’t safely be reset, so this creates a new instance and binds it to the
+ * general cancellable again. Returns the new cancellable. */
+static GCancellable *
+scheduled_entry_cancellable_helper_renew (ScheduledEntryCancellableHelper *helper)
+{
+  if (helper->cancellables_bind_handler_id > 0)
+    g_cancellable_disconnect (helper->general_cancellable, helper->cancellables_bind_handler_id);
+  helper->cancellables_bind_handler_id = 0;
+
+  g_clear_object (&helper->scheduled_entry_cancellable);
+  helper->scheduled_entry_cancellable = g_cancellable_new ();
+  helper->paused = FALSE;
+
+  helper->cancellables_bind_handler_id =
+    g_cancellable_connect (helper->general_cancellable,
+                           (GCallback) general_cancellable_cancelled_cb,
+                           helper->scheduled_entry_cancellable,
+                           NULL);
+
+  return helper->scheduled_entry_cancellable;
+}
+
+/* Wait for the download scheduler to allow a paused download to resume. The
+ * updater stays in the `fetching` state while waiting. This must be run in the
+ * same worker thread as content_fetch(), with a #GMainContext used only in
+ * that thread. */
 static gboolean
-content_fetch (FetchData     *fetch_data,
-               GMainContext  *context,
-               GCancellable  *cancellable,
-               GError       **error)
+wait_for_download_resume (FetchData     *fetch_data,
+                          GMainContext  *context,
+                          GCancellable  *cancellable,
+                          GError       **error)
 {
-  g_autoptr(GError) local_error = NULL;
-  const gchar *update_id = fetch_data->update_id;
-  EosUpdaterData *data = fetch_data->data;
-  GCancellable *fetch_cancellable = cancellable;
-  g_autoptr(ScheduledEntryCancellableHelper) cancellable_helper = NULL;
+  gboolean download_now;
+  g_autoptr(GError) invalidated_error = NULL;
+  g_autoptr(GSource) cancellable_source = NULL;
+  gulong notify_id, invalidated_id;
 
-  /* Query the scheduler here. Just fail if downloads aren’t allowed; the
-   * updater will return a D-Bus error which the caller can interpret. */
-  if (!check_scheduler (fetch_data, context, cancellable, error))
+  download_now = mwsc_schedule_entry_get_download_now (fetch_data->schedule_entry);
+  notify_id = g_signal_connect (fetch_data->schedule_entry, "notify::download-now",
+                                (GCallback) download_now_cb, &download_now);
+  invalidated_id = g_signal_connect (fetch_data->schedule_entry, "invalidated",
+                                     (GCallback) invalidated_cb, &invalidated_error);
+
+  cancellable_source = g_cancellable_source_new (cancellable);
+  g_source_set_callback (cancellable_source, G_SOURCE_FUNC (cancellable_source_cb), NULL, NULL);
+  g_source_attach (cancellable_source, context);
+
+  g_message ("Fetch: waiting for download scheduler to allow the download to resume");
+
+  while (!download_now && !g_cancellable_is_cancelled (cancellable) &&
+         invalidated_error == NULL)
+    g_main_context_iteration (context, TRUE);
+
+  g_source_destroy (cancellable_source);
+  g_signal_handler_disconnect (fetch_data->schedule_entry, invalidated_id);
+  g_signal_handler_disconnect (fetch_data->schedule_entry, notify_id);
+
+  if (download_now)
     {
-      g_message ("Fetch: not fetching due to download scheduler decision");
-      return FALSE;
+      g_message ("Fetch: resuming download as allowed by download scheduler");
+      return TRUE;
     }
 
-  if (fetch_data->schedule_entry != NULL)
+  if (invalidated_error != NULL)
     {
-      /* Connect the signals again now that we know a download will be started so
-       * we can cancel it if the entry cannot download anymore */
-      cancellable_helper = connect_cancellable_to_entry (fetch_data->schedule_entry,
-                                                         cancellable);
+      g_autofree gchar *message = g_strdup_printf ("Download scheduler disappeared unexpectedly: %s",
+                                                   invalidated_error->message);
+      g_set_error (error,
+                   EOS_UPDATER_ERROR, EOS_UPDATER_ERROR_METERED_CONNECTION,
+                   "Error fetching update: %s", message);
+    }
+  else
+    g_cancellable_set_error_if_cancelled (cancellable, error);
 
-      /* we use a different cancellable for the content fetching since it may
-       * get canceled by the scheduled entry (when download-now is false) */
-      fetch_cancellable = cancellable_helper->scheduled_entry_cancellable;
+  return FALSE;
+}
+
+/* Check that this fetch is allowed to start now, according to the `[Download]`
+ * section of the configuration file. Forced fetches are started by the user,
+ * and fetches from offline (LAN/USB) sources don’t use the internet
+ * connection, so neither is restricted by the configuration. */
+static gboolean
+apply_fetch_policy (FetchData  *fetch_data,
+                    GError    **error)
+{
+  g_autoptr(EuuConfigFile) config = NULL;
+  g_auto(GStrv) allowed_times = NULL;
+  g_autoptr(GArray) windows = NULL;
+  g_autoptr(GDateTime) now = NULL;
+
+  if (fetch_data->force || fetch_data->data->offline_results_only)
+    return TRUE;
+
+  config = eos_updater_config_file_new ();
+
+  allowed_times = euu_config_file_get_strv (config, "Download", "AllowedTimes",
+                                            NULL, error);
+  if (allowed_times == NULL)
+    return FALSE;
+
+  windows = euu_time_windows_parse ((const gchar * const *) allowed_times, error);
+  if (windows == NULL)
+    return FALSE;
+
+  now = g_date_time_new_now_local ();
+  if (!euu_time_windows_contain (windows, now))
+    {
+      g_autofree gchar *allowed_times_str = g_strjoinv (", ", allowed_times);
+      g_set_error (error, EOS_UPDATER_ERROR,
+                   EOS_UPDATER_ERROR_OUTSIDE_FETCH_WINDOW,
+                   "Fetching updates is only allowed at %s",
+                   allowed_times_str);
+      return FALSE;
     }
 
+  return TRUE;
+}
+
+/* Pull the OS commit and any flatpaks needed for it. Both are resumable: a
+ * cancelled libostree pull keeps the objects it has already written in the
+ * repository’s staging directory and reuses them next time, so calling this
+ * again after it was cancelled only downloads what is still missing. */
+static gboolean
+content_fetch_os_and_flatpaks (FetchData     *fetch_data,
+                               GMainContext  *context,
+                               GCancellable  *cancellable,
+                               GError       **error)
+{
+  g_autoptr(GError) local_error = NULL;
+  EosUpdaterData *data = fetch_data->data;
+
+  /* Let update_progress() work out the phase of the OS pull from libostree. */
+  set_progress_string (fetch_data->progress, PROGRESS_KEY_PHASE, "");
+
   /* Do we want to use the new libostree code for P2P, or fall back on the old
    * eos-updater code?
    * FIXME: Eventually drop the old code. See:
@@ -1093,10 +1576,13 @@ content_fetch (FetchData     *fetch_data,
     {
       g_message ("Fetch: using results %p", data->results);
 
-      if (content_fetch_new (fetch_data, context, fetch_cancellable, &local_error))
+      if (content_fetch_new (fetch_data, context, cancellable, &local_error))
         g_message ("Fetch: finished pulling using libostree P2P code");
       else if (g_error_matches (local_error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
-        goto error;
+        {
+          g_propagate_error (error, g_steal_pointer (&local_error));
+          return FALSE;
+        }
       else
         g_warning ("Error fetching updates using libostree P2P code; falling back to old code: %s",
                    local_error->message);
@@ -1109,20 +1595,82 @@ content_fetch (FetchData     *fetch_data,
       if (data->results == NULL)
         g_message ("Fetch: using old code due to lack of repo finder results");
 
-      if (content_fetch_old (fetch_data, context, fetch_cancellable, &local_error))
+      if (content_fetch_old (fetch_data, context, cancellable, &local_error))
         g_message ("Fetch: finished pulling using old code");
       else
         {
           g_message ("Fetch: error pulling using old code: %s", local_error->message);
-          goto error;
+          g_propagate_error (error, g_steal_pointer (&local_error));
+          return FALSE;
         }
     }
 
   g_message ("Fetch: pulling any necessary new flatpaks for this update");
-  if (!prepare_flatpaks_to_deploy (data->repo, update_id, fetch_cancellable, &local_error))
+  set_progress_string (fetch_data->progress, PROGRESS_KEY_PHASE, "flatpaks");
+  set_progress_string (fetch_data->progress, PROGRESS_KEY_SOURCE, "");
+  if (!prepare_flatpaks_to_deploy (data->repo, fetch_data->update_id, cancellable, &local_error))
     {
       g_message ("Fetch: failed to pull necessary new flatpaks for update: %s", local_error->message);
-      goto error;
+      g_propagate_error (error, g_steal_pointer (&local_error));
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+static gboolean
+content_fetch (FetchData     *fetch_data,
+               GMainContext  *context,
+               GCancellable  *cancellable,
+               GError       **error)
+{
+  g_autoptr(GError) local_error = NULL;
+  GCancellable *fetch_cancellable = cancellable;
+  g_autoptr(ScheduledEntryCancellableHelper) cancellable_helper = NULL;
+
+  /* Check the configured time windows. */
+  if (!apply_fetch_policy (fetch_data, error))
+    {
+      g_message ("Fetch: not fetching due to configuration");
+      return FALSE;
+    }
+
+  /* Query the scheduler here. Just fail if downloads aren’t allowed; the
+   * updater will return a D-Bus error which the caller can interpret. */
+  if (!check_scheduler (fetch_data, context, cancellable, error))
+    {
+      g_message ("Fetch: not fetching due to download scheduler decision");
+      return FALSE;
+    }
+
+  if (fetch_data->schedule_entry != NULL)
+    {
+      /* Connect the signals again now that we know a download will be started so
+       * we can pause it if the entry cannot download anymore */
+      cancellable_helper = connect_cancellable_to_entry (fetch_data->schedule_entry,
+                                                         cancellable);
+
+      /* we use a different cancellable for the content fetching since it may
+       * get canceled by the scheduled entry (when download-now is false) */
+      fetch_cancellable = cancellable_helper->scheduled_entry_cancellable;
+    }
+
+  /* If the scheduler pauses the download part way through, wait until it
+   * allows downloading again and then pick up where we left off. */
+  while (!content_fetch_os_and_flatpaks (fetch_data, context, fetch_cancellable, &local_error))
+    {
+      if (cancellable_helper == NULL ||
+          !cancellable_helper->paused ||
+          !g_error_matches (local_error, G_IO_ERROR, G_IO_ERROR_CANCELLED) ||
+          g_cancellable_is_cancelled (cancellable))
+        goto error;
+
+      g_clear_error (&local_error);
+
+      if (!wait_for_download_resume (fetch_data, context, cancellable, &local_error))
+        goto error;
+
+      fetch_cancellable = scheduled_entry_cancellable_helper_renew (cancellable_helper);
     }
 
   /* No longer need to worry about invalidation. Remove it now before it
@@ -1160,7 +1708,10 @@ content_fetch_task (GTask        *task,
   FetchData *fetch_data = task_data;
   g_autoptr(GError) error = NULL;
   g_autoptr(GMainContext) task_context = g_main_context_new ();
+  g_auto(EosUpdaterThreadPriorityState) priority_state = EOS_UPDATER_THREAD_PRIORITY_STATE_CLEARED;
 
+  /* A forced fetch is one the user is waiting for, so don’t hold it back. */
+  eos_updater_set_worker_thread_priority (fetch_data->force, &priority_state);
   g_main_context_push_thread_default (task_context);
 
   if (!content_fetch (fetch_data, task_context, cancellable, &error))
@@ -1189,6 +1740,7 @@ handle_fetch_full (EosUpdater            *updater,
   EosUpdaterState state = eos_updater_get_state (updater);
   EosUpdaterData *data = user_data;
   g_autoptr(FetchData) fetch_data = NULL;
+  FetchProgressState *progress_state = NULL;
   gboolean force = FALSE;
   guint scheduling_timeout_seconds = 0;  /* default to an infinite timeout */
 
@@ -1214,13 +1766,21 @@ handle_fetch_full (EosUpdater            *updater,
   fetch_data->scheduling_timeout_seconds = scheduling_timeout_seconds;
   fetch_data->update_id = g_strdup (eos_updater_get_update_id (updater));
   fetch_data->update_refspec = g_strdup (eos_updater_get_update_refspec (updater));
-  fetch_data->progress = ostree_async_progress_new_and_connect (update_progress, updater);
+  fetch_data->progress = ostree_async_progress_new ();
+
+  progress_state = g_new0 (FetchProgressState, 1);
+  progress_state->updater = g_object_ref (updater);
+  fetch_data->progress_state = progress_state;
+  g_signal_connect_data (fetch_data->progress, "changed",
+                         G_CALLBACK (update_progress), progress_state,
+                         (GClosureNotify) fetch_progress_state_free, 0);
 
   /* FIXME: Passing the EosUpdaterData to the worker thread is not thread safe.
    * See: https://phabricator.endlessm.com/T15923 */
   fetch_data->data = data;
 
   eos_updater_data_reset_cancellable (data);
+  eos_updater_clear_fetch_progress (updater);
   eos_updater_clear_error (updater, EOS_UPDATER_STATE_FETCHING);
   task = g_task_new (updater, data->cancellable, content_fetch_finished, NULL);
   g_task_set_task_data (task, g_steal_pointer (&fetch_data), (GDestroyNotify) fetch_data_free);
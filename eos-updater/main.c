@@ -30,6 +30,7 @@
 #include <eos-updater/live-boot.h>
 #include <eos-updater/object.h>
 #include <eos-updater/poll.h>
+#include <eos-updater/sysroot-cache.h>
 #include <libeos-updater-util/ostree-util.h>
 #include <libeos-updater-util/util.h>
 
@@ -121,7 +122,7 @@ on_bus_acquired (GDBusConnection *connection,
   EosUpdater *updater = NULL;
   LocalData *local_data = user_data;
   GError *error = NULL;
-  g_autofree gchar *sum = NULL;
+  g_autoptr(EosSysrootSnapshot) booted_snapshot = NULL;
 
   g_message ("Acquired a message bus connection");
 
@@ -140,16 +141,19 @@ on_bus_acquired (GDBusConnection *connection,
   updater = local_data->updater;
   eos_object_skeleton_set_updater (object, updater);
 
-  sum = eos_updater_get_booted_checksum (&error);
-  if (sum != NULL)
+  booted_snapshot = eos_sysroot_cache_dup_snapshot (local_data->data->sysroot_cache,
+                                                    NULL, &error);
+  if (booted_snapshot != NULL)
     {
-      eos_updater_set_current_id (updater, sum);
+      eos_updater_set_current_id (updater, booted_snapshot->booted_checksum);
       eos_updater_set_download_size (updater, 0);
       eos_updater_set_downloaded_bytes (updater, 0);
       eos_updater_set_unpacked_size (updater, 0);
       eos_updater_set_update_id (updater, "");
       eos_updater_set_update_is_user_visible (updater, FALSE);
       eos_updater_set_release_notes_uri (updater, "");
+      eos_updater_set_update_rollout_percentage (updater, 100);
+      eos_updater_clear_fetch_progress (updater);
       eos_updater_clear_error (updater, EOS_UPDATER_STATE_READY);
     }
   else if (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND) ||
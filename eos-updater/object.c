@@ -117,3 +117,17 @@ G_GNUC_END_IGNORE_DEPRECATIONS
   eos_updater_set_error_message (updater, "");
   eos_updater_set_state_changed (updater, state);
 }
+
+/* Reset the properties which describe the progress of an ongoing fetch, other
+ * than `DownloadedBytes` (which is tied to `DownloadSize`). Like
+ * eos_updater_clear_error(), this must only be called from the main thread. */
+void
+eos_updater_clear_fetch_progress (EosUpdater *updater)
+{
+  eos_updater_set_download_rate (updater, 0);
+  eos_updater_set_download_time_remaining (updater, -1);
+  eos_updater_set_fetched_objects (updater, 0);
+  eos_updater_set_requested_objects (updater, 0);
+  eos_updater_set_fetch_phase (updater, "");
+  eos_updater_set_fetch_source (updater, "");
+}
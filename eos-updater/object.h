@@ -38,5 +38,6 @@ void eos_updater_set_error (EosUpdater *updater,
                             const GError *error);
 void eos_updater_clear_error (EosUpdater *updater,
                               EosUpdaterState state);
+void eos_updater_clear_fetch_progress (EosUpdater *updater);
 
 G_END_DECLS
@@ -0,0 +1,488 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * Copyright 2024 Endless OS Foundation LLC <maintainers@endlessos.org>
+ *
+ * SPDX-License-Identifier: LGPL-2.1-or-later
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "config.h"
+
+#include <avahi-client/client.h>
+#include <avahi-client/lookup.h>
+#include <avahi-common/address.h>
+#include <avahi-common/error.h>
+#include <avahi-common/malloc.h>
+#include <avahi-common/strlst.h>
+#include <avahi-glib/glib-watch.h>
+#include <eos-updater/peer-load.h>
+#include <gio/gio.h>
+#include <glib.h>
+#include <libeos-updater-util/avahi-service-file.h>
+#include <ostree.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Servers on the local network advertise a load hint in their DNS-SD TXT
+ * records (see eos_ostree_avahi_service_file_generate()), but
+ * #OstreeRepoFinderAvahi doesn’t expose TXT records to its callers. So browse
+ * for the services again here (this is answered from the Avahi daemon’s cache,
+ * as the finder has just browsed for them) and match the load hints to the
+ * finder results by address and port.
+ *
+ * ostree_repo_pull_from_remotes_async() pulls each ref from the first result
+ * which has its latest commit, so reordering results of equal priority by load
+ * spreads clients across peers, rather than them all using whichever peer
+ * happened to be listed first. */
+
+/* Maximum time to wait for the Avahi daemon to resolve services. */
+#define BROWSE_TIMEOUT_MS 1000
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (AvahiGLibPoll, avahi_glib_poll_free)
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (AvahiClient, avahi_client_free)
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (AvahiServiceBrowser, avahi_service_browser_free)
+
+typedef struct
+{
+  AvahiClient *client;  /* (unowned) */
+  GHashTable *hints;  /* (owned) (element-type utf8 EosOstreeAvahiLoadHint) */
+  GPtrArray *resolvers;  /* (owned) (element-type AvahiServiceResolver) */
+  guint n_pending_resolvers;
+  gboolean all_for_now;
+  gboolean done;
+} BrowseData;
+
+static gchar *
+make_hint_key (const gchar *host,
+               guint16      port)
+{
+  /* Drop any IPv6 zone ID, as it’s formatted inconsistently. */
+  g_autofree gchar *bare_host = g_strndup (host, strcspn (host, "%"));
+
+  return g_strdup_printf ("%s:%u", bare_host, (guint) port);
+}
+
+/**
+ * eos_peer_load_hint_from_txt:
+ * @txt: (nullable): TXT records of a resolved service
+ * @out_hint: (out caller-allocates): return location for the load hint
+ * @error: return location for a #GError
+ *
+ * Find the load hint TXT record (%EOS_OSTREE_AVAHI_LOAD_HINT_TXT_KEY) in @txt
+ * and parse it. @txt comes from the network, so is untrusted.
+ *
+ * Returns: %TRUE on success, %FALSE if there is no load hint (with
+ *    %G_IO_ERROR_NOT_FOUND) or it is invalid (with %G_IO_ERROR_INVALID_DATA)
+ */
+gboolean
+eos_peer_load_hint_from_txt (AvahiStringList         *txt,
+                             EosOstreeAvahiLoadHint  *out_hint,
+                             GError                 **error)
+{
+  AvahiStringList *item;
+  char *key = NULL;
+  char *value = NULL;
+  size_t value_size = 0;
+  g_autoptr(GBytes) hint_bytes = NULL;
+
+  g_return_val_if_fail (out_hint != NULL, FALSE);
+  g_return_val_if_fail (error == NULL || *error == NULL, FALSE);
+
+  item = avahi_string_list_find (txt, EOS_OSTREE_AVAHI_LOAD_HINT_TXT_KEY);
+  if (item == NULL ||
+      avahi_string_list_get_pair (item, &key, &value, &value_size) < 0 ||
+      value == NULL)
+    {
+      avahi_free (key);
+      avahi_free (value);
+      g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND,
+                           "No load hint TXT record");
+      return FALSE;
+    }
+
+  hint_bytes = g_bytes_new (value, value_size);
+  avahi_free (key);
+  avahi_free (value);
+
+  return eos_ostree_avahi_load_hint_from_bytes (hint_bytes, out_hint, error);
+}
+
+static void
+browse_data_check_done (BrowseData *data)
+{
+  if (data->all_for_now && data->n_pending_resolvers == 0)
+    data->done = TRUE;
+}
+
+static void
+resolve_cb (AvahiServiceResolver   *resolver,
+            AvahiIfIndex            interface,
+            AvahiProtocol           protocol,
+            AvahiResolverEvent      event,
+            const char             *name,
+            const char             *type,
+            const char             *domain,
+            const char             *host_name,
+            const AvahiAddress     *address,
+            uint16_t                port,
+            AvahiStringList        *txt,
+            AvahiLookupResultFlags  flags,
+            void                   *user_data)
+{
+  BrowseData *data = user_data;
+  char address_string[AVAHI_ADDRESS_STR_MAX];
+  EosOstreeAvahiLoadHint hint;
+  g_autoptr(GError) local_error = NULL;
+
+  g_assert (data->n_pending_resolvers > 0);
+  data->n_pending_resolvers--;
+  browse_data_check_done (data);
+
+  if (event != AVAHI_RESOLVER_FOUND)
+    {
+      g_debug ("%s: Failed to resolve service ‘%s’: %s", G_STRFUNC, name,
+               avahi_strerror (avahi_client_errno (data->client)));
+      return;
+    }
+
+  if (!eos_peer_load_hint_from_txt (txt, &hint, &local_error))
+    {
+      g_debug ("%s: Ignoring load hint for service ‘%s’: %s",
+               G_STRFUNC, name, local_error->message);
+      return;
+    }
+
+  avahi_address_snprint (address_string, sizeof (address_string), address);
+  g_hash_table_replace (data->hints, make_hint_key (address_string, port),
+                        g_memdup2 (&hint, sizeof (hint)));
+}
+
+static void
+browse_cb (AvahiServiceBrowser    *browser,
+           AvahiIfIndex            interface,
+           AvahiProtocol           protocol,
+           AvahiBrowserEvent       event,
+           const char             *name,
+           const char             *type,
+           const char             *domain,
+           AvahiLookupResultFlags  flags,
+           void                   *user_data)
+{
+  BrowseData *data = user_data;
+  AvahiServiceResolver *resolver;
+
+  switch (event)
+    {
+    case AVAHI_BROWSER_NEW:
+      resolver = avahi_service_resolver_new (data->client, interface, protocol,
+                                             name, type, domain,
+                                             AVAHI_PROTO_UNSPEC, 0,
+                                             resolve_cb, data);
+      if (resolver == NULL)
+        {
+          g_debug ("%s: Failed to start resolving service ‘%s’: %s",
+                   G_STRFUNC, name,
+                   avahi_strerror (avahi_client_errno (data->client)));
+          break;
+        }
+
+      g_ptr_array_add (data->resolvers, resolver);
+      data->n_pending_resolvers++;
+      break;
+
+    case AVAHI_BROWSER_ALL_FOR_NOW:
+      data->all_for_now = TRUE;
+      browse_data_check_done (data);
+      break;
+
+    case AVAHI_BROWSER_FAILURE:
+      g_debug ("%s: Browsing failed: %s", G_STRFUNC,
+               avahi_strerror (avahi_client_errno (data->client)));
+      data->done = TRUE;
+      break;
+
+    case AVAHI_BROWSER_REMOVE:
+    case AVAHI_BROWSER_CACHE_EXHAUSTED:
+    default:
+      break;
+    }
+}
+
+static void
+client_cb (AvahiClient      *client,
+           AvahiClientState  state,
+           void             *user_data)
+{
+  BrowseData *data = user_data;
+
+  if (state == AVAHI_CLIENT_FAILURE)
+    {
+      g_debug ("%s: Avahi client failed: %s", G_STRFUNC,
+               avahi_strerror (avahi_client_errno (client)));
+      data->done = TRUE;
+    }
+}
+
+static gboolean
+browse_timeout_cb (gpointer user_data)
+{
+  BrowseData *data = user_data;
+
+  g_debug ("%s: Timed out waiting for services to be resolved", G_STRFUNC);
+  data->done = TRUE;
+
+  return G_SOURCE_REMOVE;
+}
+
+/* Returns a map from `address:port` to the #EosOstreeAvahiLoadHint advertised
+ * by the service there. It’s empty if the Avahi daemon isn’t available. */
+static GHashTable *
+query_load_hints (GMainContext *context,
+                  GCancellable *cancellable)
+{
+  g_autoptr(AvahiGLibPoll) glib_poll = NULL;
+  g_autoptr(AvahiClient) client = NULL;
+  g_autoptr(AvahiServiceBrowser) browser = NULL;
+  g_autoptr(GSource) timeout_source = NULL;
+  BrowseData data = { NULL, NULL, NULL, 0, FALSE, FALSE };
+  g_autoptr(GHashTable) hints = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                       g_free, g_free);
+  int error_code = 0;
+
+  data.hints = hints;
+
+  glib_poll = avahi_glib_poll_new (context, G_PRIORITY_DEFAULT);
+  client = avahi_client_new (avahi_glib_poll_get (glib_poll), 0, client_cb,
+                             &data, &error_code);
+  if (client == NULL)
+    {
+      g_debug ("%s: Failed to create Avahi client: %s", G_STRFUNC,
+               avahi_strerror (error_code));
+      return g_steal_pointer (&hints);
+    }
+
+  data.client = client;
+  data.resolvers = g_ptr_array_new_with_free_func ((GDestroyNotify) avahi_service_resolver_free);
+
+  browser = avahi_service_browser_new (client, AVAHI_IF_UNSPEC,
+                                       AVAHI_PROTO_UNSPEC, "_ostree_repo._tcp",
+                                       NULL, 0, browse_cb, &data);
+  if (browser == NULL)
+    {
+      g_debug ("%s: Failed to browse for services: %s", G_STRFUNC,
+               avahi_strerror (avahi_client_errno (client)));
+      g_ptr_array_unref (data.resolvers);
+      return g_steal_pointer (&hints);
+    }
+
+  timeout_source = g_timeout_source_new (BROWSE_TIMEOUT_MS);
+  g_source_set_callback (timeout_source, browse_timeout_cb, &data, NULL);
+  g_source_attach (timeout_source, context);
+
+  while (!data.done && !g_cancellable_is_cancelled (cancellable))
+    g_main_context_iteration (context, TRUE);
+
+  g_source_destroy (timeout_source);
+
+  /* Resolvers must be freed before the client. */
+  g_ptr_array_unref (data.resolvers);
+  g_clear_pointer (&browser, avahi_service_browser_free);
+
+  return g_steal_pointer (&hints);
+}
+
+static const EosOstreeAvahiLoadHint *
+lookup_result_hint (GHashTable                   *hints,  /* (nullable) */
+                    const OstreeRepoFinderResult *result)
+{
+  g_autofree gchar *url = ostree_remote_get_url (result->remote);
+  g_autoptr(GUri) uri = NULL;
+  g_autofree gchar *key = NULL;
+
+  if (url == NULL)
+    return NULL;
+
+  uri = g_uri_parse (url, G_URI_FLAGS_NONE, NULL);
+  if (uri == NULL || g_uri_get_host (uri) == NULL || g_uri_get_port (uri) <= 0)
+    return NULL;
+
+  key = make_hint_key (g_uri_get_host (uri), (guint16) g_uri_get_port (uri));
+  return (hints != NULL) ? g_hash_table_lookup (hints, key) : NULL;
+}
+
+typedef struct
+{
+  OstreeRepoFinderResult *result;  /* (unowned) */
+  const EosOstreeAvahiLoadHint *hint;  /* (unowned) (nullable) */
+  guint32 tie_breaker;
+} RankedResult;
+
+/**
+ * eos_peer_load_hint_compare:
+ * @a: (nullable): a load hint
+ * @b: (nullable): another load hint
+ *
+ * Compare two load hints so that less loaded peers are ordered first.
+ * Saturated peers come last; otherwise peers with more spare capacity come
+ * first, then those with fewer active streams. Peers which don’t advertise a
+ * load hint (%NULL, such as older servers) are treated as having medium
+ * capacity.
+ *
+ * Returns: negative if @a is less loaded than @b, positive if it is more
+ *    loaded, and 0 if there is nothing to choose between them
+ */
+gint
+eos_peer_load_hint_compare (const EosOstreeAvahiLoadHint *a,
+                            const EosOstreeAvahiLoadHint *b)
+{
+  gboolean saturated_a = (a != NULL && a->saturated);
+  gboolean saturated_b = (b != NULL && b->saturated);
+  EosOstreeAvahiLoadCapacity capacity_a = (a != NULL) ? a->capacity : EOS_OSTREE_AVAHI_LOAD_CAPACITY_MEDIUM;
+  EosOstreeAvahiLoadCapacity capacity_b = (b != NULL) ? b->capacity : EOS_OSTREE_AVAHI_LOAD_CAPACITY_MEDIUM;
+
+  if (saturated_a != saturated_b)
+    return saturated_a ? 1 : -1;
+  if (capacity_a != capacity_b)
+    return (capacity_a > capacity_b) ? -1 : 1;
+  if (a != NULL && b != NULL &&
+      a->active_streams != b->active_streams)
+    return (a->active_streams < b->active_streams) ? -1 : 1;
+  return 0;
+}
+
+/* Order less loaded peers first. Ties are broken randomly, so that clients
+ * don’t all pick the same peer. */
+static gint
+ranked_result_compare (gconstpointer a,
+                       gconstpointer b)
+{
+  const RankedResult *ra = a, *rb = b;
+  gint cmp = eos_peer_load_hint_compare (ra->hint, rb->hint);
+
+  if (cmp != 0)
+    return cmp;
+  if (ra->tie_breaker != rb->tie_breaker)
+    return (ra->tie_breaker < rb->tie_breaker) ? -1 : 1;
+  return 0;
+}
+
+/* Whether any run of equal-priority results in @results contains more than
+ * one result from a peer on the local network. Only then is there a choice
+ * for the load hints to inform, and so only then is it worth the time to
+ * browse for them. */
+static gboolean
+have_tied_peer_results (OstreeRepoFinderResult **results)
+{
+  gsize i, n_peers_in_run = 0;
+
+  for (i = 0; results[i] != NULL; i++)
+    {
+      if (i > 0 && results[i]->priority != results[i - 1]->priority)
+        n_peers_in_run = 0;
+
+      if (results[i]->finder != NULL &&
+          OSTREE_IS_REPO_FINDER_AVAHI (results[i]->finder) &&
+          ++n_peers_in_run > 1)
+        return TRUE;
+    }
+
+  return FALSE;
+}
+
+/**
+ * eos_peer_load_sort_results:
+ * @results: (array zero-terminated=1): results from
+ *    ostree_repo_find_remotes_finish(), sorted by priority
+ * @context: main context to iterate while querying Avahi
+ * @cancellable: (nullable): a #GCancellable
+ *
+ * Reorder each run of equal-priority results in @results so that the least
+ * loaded peers, according to the load hints they advertise over DNS-SD, come
+ * first. Results of different priorities are never reordered relative to each
+ * other.
+ *
+ * The Avahi daemon is only queried if some run contains more than one peer
+ * result. This is best effort: if the daemon isn’t queried, or can’t be,
+ * results are only shuffled within each run.
+ */
+void
+eos_peer_load_sort_results (OstreeRepoFinderResult **results,
+                            GMainContext            *context,
+                            GCancellable            *cancellable)
+{
+  g_autoptr(GHashTable) hints = NULL;
+  g_autofree RankedResult *ranked = NULL;
+  gsize n_results, i, run_start;
+  gboolean have_tie = FALSE;
+
+  g_return_if_fail (results != NULL);
+  g_return_if_fail (cancellable == NULL || G_IS_CANCELLABLE (cancellable));
+
+  for (n_results = 0; results[n_results] != NULL; n_results++)
+    {
+      if (n_results > 0 &&
+          results[n_results]->priority == results[n_results - 1]->priority)
+        have_tie = TRUE;
+    }
+
+  /* Nothing to choose between? */
+  if (!have_tie)
+    return;
+
+  if (have_tied_peer_results (results))
+    {
+      hints = query_load_hints (context, cancellable);
+      g_debug ("%s: Found load hints for %u peers", G_STRFUNC,
+               g_hash_table_size (hints));
+    }
+
+  ranked = g_new0 (RankedResult, n_results);
+  for (i = 0; i < n_results; i++)
+    {
+      ranked[i].result = results[i];
+      ranked[i].hint = lookup_result_hint (hints, results[i]);
+      ranked[i].tie_breaker = g_random_int ();
+    }
+
+  for (run_start = 0; run_start < n_results; run_start = i)
+    {
+      i = run_start + 1;
+      while (i < n_results &&
+             ranked[i].result->priority == ranked[run_start].result->priority)
+        i++;
+
+      if (i - run_start > 1)
+        qsort (ranked + run_start, i - run_start, sizeof (*ranked),
+               ranked_result_compare);
+    }
+
+  for (i = 0; i < n_results; i++)
+    {
+      results[i] = ranked[i].result;
+
+      if (ranked[i].hint != NULL)
+        g_debug ("%s: Result %" G_GSIZE_FORMAT ": %s, priority %d, "
+                 "%u active streams, capacity %u, saturated %s",
+                 G_STRFUNC, i, ostree_remote_get_name (results[i]->remote),
+                 results[i]->priority, (guint) ranked[i].hint->active_streams,
+                 (guint) ranked[i].hint->capacity,
+                 ranked[i].hint->saturated ? "yes" : "no");
+      else
+        g_debug ("%s: Result %" G_GSIZE_FORMAT ": %s, priority %d, no load hint",
+                 G_STRFUNC, i, ostree_remote_get_name (results[i]->remote),
+                 results[i]->priority);
+    }
+}
@@ -0,0 +1,41 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * Copyright 2024 Endless OS Foundation LLC <maintainers@endlessos.org>
+ *
+ * SPDX-License-Identifier: LGPL-2.1-or-later
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+#include <avahi-common/strlst.h>
+#include <glib.h>
+#include <libeos-updater-util/avahi-service-file.h>
+#include <ostree.h>
+
+G_BEGIN_DECLS
+
+gboolean eos_peer_load_hint_from_txt (AvahiStringList         *txt,
+                                      EosOstreeAvahiLoadHint  *out_hint,
+                                      GError                 **error);
+gint eos_peer_load_hint_compare (const EosOstreeAvahiLoadHint *a,
+                                 const EosOstreeAvahiLoadHint *b);
+
+void eos_peer_load_sort_results (OstreeRepoFinderResult **results,
+                                 GMainContext            *context,
+                                 GCancellable            *cancellable);
+
+G_END_DECLS
@@ -27,6 +27,7 @@
 #include "config.h"
 
 #include <eos-updater/object.h>
+#include <eos-updater/peer-load.h>
 #include <eos-updater/poll-common.h>
 #include <gio/gunixmounts.h>
 #include <glib.h>
@@ -115,6 +116,7 @@ compare_major_versions (const char *version_a,
 /**
  * is_checksum_an_update:
  * @repo: the #OstreeRepo
+ * @booted_snapshot: snapshot of the currently booted deployment
  * @update_checksum: checksum of the commit to potentially update to
  * @booted_ref: ref which is currently booted
  * @update_ref: ref of the branch to potentially update to
@@ -145,6 +147,7 @@ compare_major_versions (const char *version_a,
  */
 gboolean
 is_checksum_an_update (OstreeRepo *repo,
+                       EosSysrootSnapshot *booted_snapshot,
                        const gchar *update_checksum,
                        const gchar *booted_ref,
                        const gchar *update_ref,
@@ -158,7 +161,7 @@ is_checksum_an_update (OstreeRepo *repo,
   g_autoptr(GVariant) update_commit = NULL;
   g_autoptr(GVariant) current_commit_metadata = NULL;
   g_autoptr(GVariant) update_commit_metadata = NULL;
-  g_autofree gchar *booted_checksum = NULL;
+  const gchar *booted_checksum;
   gboolean is_newer;
   gboolean is_update_user_visible;
   guint64 update_timestamp, current_timestamp;
@@ -166,6 +169,7 @@ is_checksum_an_update (OstreeRepo *repo,
   g_autoptr(GError) local_error = NULL;
 
   g_return_val_if_fail (OSTREE_IS_REPO (repo), FALSE);
+  g_return_val_if_fail (booted_snapshot != NULL, FALSE);
   g_return_val_if_fail (update_checksum != NULL, FALSE);
   g_return_val_if_fail (out_commit != NULL, FALSE);
   g_return_val_if_fail (out_is_update_user_visible != NULL, FALSE);
@@ -179,9 +183,7 @@ is_checksum_an_update (OstreeRepo *repo,
   if (out_update_version != NULL)
     *out_update_version = NULL;
 
-  booted_checksum = eos_updater_get_booted_checksum (error);
-  if (booted_checksum == NULL)
-    return FALSE;
+  booted_checksum = booted_snapshot->booted_checksum;
 
   /* We need to check if the offered checksum on the server
    * was the same as the booted checksum. It is possible for the timestamp
@@ -192,7 +194,12 @@ is_checksum_an_update (OstreeRepo *repo,
 
   g_debug ("%s: current: %s, update: %s", G_STRFUNC, booted_checksum, update_checksum);
 
-  if (!ostree_repo_load_commit (repo, booted_checksum, &current_commit, NULL, &local_error))
+  /* The snapshot may not have the booted commit if it was missing from the
+   * repository when the snapshot was taken; try again in case it’s since
+   * been pulled. */
+  if (booted_snapshot->booted_commit != NULL)
+    current_commit = g_variant_ref (booted_snapshot->booted_commit);
+  else if (!ostree_repo_load_commit (repo, booted_checksum, &current_commit, NULL, &local_error))
     {
       g_warning ("Error loading current commit ‘%s’ to check if ‘%s’ is an update (assuming it is): %s",
                  booted_checksum, update_checksum, local_error->message);
@@ -357,6 +364,82 @@ eos_update_info_get_commit_timestamp (EosUpdateInfo *info)
   return g_date_time_new_from_unix_utc ((gint64) ostree_commit_get_timestamp (info->commit));
 }
 
+/* Look up a rollout metadata key in @metadata. These are normally `u`, but also
+ * accept a decimal number in a string, as that’s easier to add with some
+ * tooling. */
+static gboolean
+lookup_rollout_metadata (GVariant    *metadata,
+                         const gchar *key,
+                         guint64      max,
+                         guint64     *out_value)
+{
+  g_autoptr(GVariant) value = g_variant_lookup_value (metadata, key, NULL);
+
+  if (value == NULL)
+    return FALSE;
+
+  if (g_variant_is_of_type (value, G_VARIANT_TYPE_UINT32))
+    {
+      *out_value = MIN (g_variant_get_uint32 (value), max);
+      return TRUE;
+    }
+  else if (g_variant_is_of_type (value, G_VARIANT_TYPE_STRING) &&
+           g_ascii_string_to_unsigned (g_variant_get_string (value, NULL), 10,
+                                       0, max, out_value, NULL))
+    {
+      return TRUE;
+    }
+
+  g_warning ("Ignoring invalid value for commit metadata key ‘%s’", key);
+  return FALSE;
+}
+
+/**
+ * eos_update_info_get_rollout_percentage:
+ * @info: an #EosUpdateInfo
+ *
+ * Get the percentage of machines which should currently download the update in
+ * @info automatically, from its commit metadata.
+ *
+ * `eos-updater.rollout-percentage` gives the percentage when the update is
+ * published (at its commit timestamp). If `eos-updater.rollout-period-hours` is
+ * also set, the percentage increases linearly to 100% over that many hours;
+ * otherwise it stays the same until a new commit is published.
+ *
+ * Returns: rollout percentage, between 0 and 100 inclusive
+ */
+guint
+eos_update_info_get_rollout_percentage (EosUpdateInfo *info)
+{
+  g_autoptr(GVariant) metadata = NULL;
+  guint64 initial_percentage, period_hours;
+  guint64 commit_secs, now_secs, period_secs, elapsed_secs;
+
+  g_return_val_if_fail (EOS_IS_UPDATE_INFO (info), 100);
+
+  metadata = g_variant_get_child_value (info->commit, 0);
+
+  if (!lookup_rollout_metadata (metadata, "eos-updater.rollout-percentage",
+                                100, &initial_percentage))
+    return 100;
+
+  if (!lookup_rollout_metadata (metadata, "eos-updater.rollout-period-hours",
+                                G_MAXUINT32, &period_hours) ||
+      period_hours == 0)
+    return (guint) initial_percentage;
+
+  commit_secs = ostree_commit_get_timestamp (info->commit);
+  now_secs = (guint64) MAX (0, g_get_real_time ()) / G_USEC_PER_SEC;
+  elapsed_secs = (now_secs > commit_secs) ? now_secs - commit_secs : 0;
+  period_secs = period_hours * 60 * 60;
+
+  if (elapsed_secs >= period_secs)
+    return 100;
+
+  return (guint) (initial_percentage +
+                  (100 - initial_percentage) * elapsed_secs / period_secs);
+}
+
 static gchar *
 cleanstr (gchar *s)
 {
@@ -526,30 +609,39 @@ get_booted_refspec (OstreeDeployment     *booted_deployment,
 }
 
 static gboolean
-get_ref_to_upgrade_on_from_deployment (OstreeSysroot     *sysroot,
-                                       OstreeDeployment  *booted_deployment,
-                                       const gchar       *booted_ref,
-                                       gchar            **out_ref_to_upgrade_from_deployment,
-                                       GError           **error)
+get_ref_to_upgrade_on_from_deployment (EosSysrootSnapshot  *booted_snapshot,
+                                       const gchar         *booted_ref,
+                                       gchar              **out_ref_to_upgrade_from_deployment,
+                                       GError             **error)
 {
-  const gchar *checksum = ostree_deployment_get_csum (booted_deployment);
+  const gchar *checksum = booted_snapshot->booted_checksum;
   g_autoptr(GVariant) commit = NULL;
   g_autoptr(GVariant) metadata = NULL;
   g_autoptr(GVariant) ref_for_deployment_variant = NULL;
   const gchar *refspec_for_deployment = NULL;
   g_autofree gchar *remote = NULL;
   g_autofree gchar *ref = NULL;
+  g_autoptr(OstreeSysroot) sysroot = NULL;
   g_autoptr(OstreeRepo) repo = NULL;
   g_autoptr(GError) local_error = NULL;
 
   g_return_val_if_fail (out_ref_to_upgrade_from_deployment != NULL, FALSE);
 
-  if (!ostree_sysroot_get_repo (sysroot, &repo, NULL, error))
+  /* The snapshot is shared with other threads, so anything which isn’t in it
+   * has to be loaded from a sysroot and repository private to this thread. */
+  sysroot = ostree_sysroot_new (booted_snapshot->sysroot_path);
+
+  if (booted_snapshot->booted_commit != NULL)
+    commit = g_variant_ref (booted_snapshot->booted_commit);
+
+  if (commit == NULL &&
+      !ostree_sysroot_get_repo (sysroot, &repo, NULL, error))
    return FALSE;
 
   /* We need to be resilient if the $checksum.commit object is missing from the
    * local repository (for some reason). */
-  if (!ostree_repo_load_variant (repo,
+  if (commit == NULL &&
+      !ostree_repo_load_variant (repo,
                                  OSTREE_OBJECT_TYPE_COMMIT,
                                  checksum,
                                  &commit,
@@ -615,7 +707,8 @@ get_ref_to_upgrade_on_from_deployment (OstreeSysroot     *sysroot,
 
 /* @refspec_to_upgrade_on is guaranteed to include a remote and a ref name. */
 gboolean
-get_refspec_to_upgrade_on (gchar               **refspec_to_upgrade_on,
+get_refspec_to_upgrade_on (EosSysrootSnapshot   *booted_snapshot,
+                           gchar               **refspec_to_upgrade_on,
                            gchar               **remote_to_upgrade_on,
                            gchar               **ref_to_upgrade_on,
                            OstreeCollectionRef **collection_ref_to_upgrade_on,
@@ -626,28 +719,19 @@ get_refspec_to_upgrade_on (gchar               **refspec_to_upgrade_on,
   g_autofree gchar *booted_ref = NULL;
   g_autoptr(OstreeCollectionRef) booted_collection_ref = NULL;
   g_autofree gchar *checkpoint_ref_for_deployment = NULL;
-  g_autoptr(OstreeSysroot) sysroot = ostree_sysroot_new_default ();
-  g_autoptr(OstreeDeployment) booted_deployment = NULL;
-
-  if (!ostree_sysroot_load (sysroot, NULL, error))
-    return FALSE;
-
-  booted_deployment = eos_updater_get_booted_deployment_from_loaded_sysroot (sysroot,
-                                                                             error);
 
-  if (booted_deployment == NULL)
-    return FALSE;
+  g_return_val_if_fail (booted_snapshot != NULL, FALSE);
+  g_return_val_if_fail (error == NULL || *error == NULL, FALSE);
 
-  if (!get_booted_refspec (booted_deployment,
-                           &booted_refspec,
-                           &booted_remote,
-                           &booted_ref,
-                           &booted_collection_ref,
-                           error))
+  if (!eos_sysroot_snapshot_get_booted_refspec (booted_snapshot,
+                                                &booted_refspec,
+                                                &booted_remote,
+                                                &booted_ref,
+                                                &booted_collection_ref,
+                                                error))
     return FALSE;
 
-  if (!get_ref_to_upgrade_on_from_deployment (sysroot,
-                                              booted_deployment,
+  if (!get_ref_to_upgrade_on_from_deployment (booted_snapshot,
                                               booted_ref,
                                               &checkpoint_ref_for_deployment,
                                               error))
@@ -710,6 +794,126 @@ get_repo_pull_options (const gchar *url_override,
   return g_variant_ref_sink (g_variant_builder_end (&builder));
 };
 
+/* Whether @refspec already resolves to @checksum in @repo, and the commit
+ * object for it is present. If so, the result of pulling the commit metadata
+ * for @refspec again would be the same as what is already in the repository,
+ * so the pull can be skipped. Errors are not fatal: they just mean the pull
+ * has to happen. */
+static gboolean
+is_commit_already_pulled (OstreeRepo   *repo,
+                          const gchar  *refspec,
+                          const gchar  *checksum,
+                          GCancellable *cancellable)
+{
+  g_autofree gchar *local_checksum = NULL;
+  gboolean have_commit = FALSE;
+  g_autoptr(GError) local_error = NULL;
+
+  if (checksum == NULL)
+    return FALSE;
+
+  if (!ostree_repo_resolve_rev (repo, refspec, TRUE, &local_checksum, &local_error))
+    {
+      g_debug ("%s: Error resolving ‘%s’: %s", G_STRFUNC, refspec, local_error->message);
+      return FALSE;
+    }
+
+  if (g_strcmp0 (local_checksum, checksum) != 0)
+    return FALSE;
+
+  if (!ostree_repo_has_object (repo, OSTREE_OBJECT_TYPE_COMMIT, checksum,
+                               &have_commit, cancellable, &local_error))
+    {
+      g_debug ("%s: Error checking for commit ‘%s’: %s", G_STRFUNC, checksum, local_error->message);
+      return FALSE;
+    }
+
+  return have_commit;
+}
+
+/* Get the checksum which @remote_name currently advertises for @ref in its
+ * summary file, or %NULL if that can’t be determined (for example, if the
+ * remote has no summary file). libostree caches summary files along with
+ * their HTTP validators, so if the summary hasn’t changed since the last poll,
+ * this costs a single conditional request. */
+static gchar *
+get_summary_checksum_for_ref (OstreeRepo   *repo,
+                              const gchar  *remote_name,
+                              const gchar  *url_override,
+                              const gchar  *ref,
+                              GCancellable *cancellable)
+{
+  g_auto(GVariantBuilder) builder = G_VARIANT_BUILDER_INIT (G_VARIANT_TYPE ("a{sv}"));
+  g_autoptr(GVariant) options = NULL;
+  g_autoptr(GBytes) summary_bytes = NULL;
+  g_autoptr(GVariant) summary = NULL;
+  g_autoptr(GVariant) refs = NULL;
+  g_autoptr(GError) local_error = NULL;
+  gsize i, n_refs;
+
+  if (url_override != NULL)
+    g_variant_builder_add (&builder, "{s@v}", "override-url",
+                           g_variant_new_variant (g_variant_new_string (url_override)));
+  options = g_variant_ref_sink (g_variant_builder_end (&builder));
+
+  if (!ostree_repo_remote_fetch_summary_with_options (repo, remote_name, options,
+                                                      &summary_bytes, NULL,
+                                                      cancellable, &local_error))
+    {
+      g_debug ("%s: Error fetching summary for remote ‘%s’: %s",
+               G_STRFUNC, remote_name, local_error->message);
+      return NULL;
+    }
+
+  if (summary_bytes == NULL)
+    return NULL;
+
+  summary = g_variant_ref_sink (g_variant_new_from_bytes (OSTREE_SUMMARY_GVARIANT_FORMAT,
+                                                          summary_bytes, FALSE));
+  refs = g_variant_get_child_value (summary, 0);
+  n_refs = g_variant_n_children (refs);
+
+  for (i = 0; i < n_refs; i++)
+    {
+      const gchar *ref_name = NULL;
+      g_autoptr(GVariant) csum_v = NULL;
+
+      g_variant_get_child (refs, i, "(&s(t@ay@a{sv}))", &ref_name, NULL, &csum_v, NULL);
+
+      if (g_strcmp0 (ref_name, ref) != 0)
+        continue;
+
+      if (!ostree_validate_structureof_csum_v (csum_v, NULL))
+        return NULL;
+
+      return ostree_checksum_from_bytes_v (csum_v);
+    }
+
+  return NULL;
+}
+
+/* Get the checksum which the best of @results advertises for @collection_ref.
+ * ostree_repo_find_remotes_async() only lists the newest commit for each ref,
+ * so this is the commit which ostree_repo_pull_from_remotes_async() would
+ * pull. */
+static const gchar *
+get_results_checksum_for_ref (const OstreeRepoFinderResult * const *results,
+                              const OstreeCollectionRef           *collection_ref)
+{
+  gsize i;
+
+  for (i = 0; results[i] != NULL; i++)
+    {
+      const gchar *checksum = g_hash_table_lookup (results[i]->ref_to_checksum,
+                                                   collection_ref);
+
+      if (checksum != NULL)
+        return checksum;
+    }
+
+  return NULL;
+}
+
 /* @refspec *must* contain a remote and ref name (not just a ref name).
  * @out_new_refspec is guaranteed to include a remote and a ref name. */
 gboolean
@@ -766,6 +970,8 @@ fetch_latest_commit (OstreeRepo *repo,
     {
       if (finders == NULL)
         {
+          g_autofree gchar *summary_checksum = NULL;
+
           g_clear_pointer (&remote_name, g_free);
           g_clear_pointer (&ref, g_free);
 
@@ -773,14 +979,36 @@ fetch_latest_commit (OstreeRepo *repo,
             return FALSE;
           g_assert (remote_name != NULL);  /* caller must guarantee this */
 
-          options = get_repo_pull_options (url_override, ref);
-          if (!ostree_repo_pull_with_options (repo,
-                                              remote_name,
-                                              options,
-                                              NULL,
-                                              cancellable,
-                                              error))
-            return FALSE;
+          summary_checksum = get_summary_checksum_for_ref (repo, remote_name,
+                                                           url_override, ref,
+                                                           cancellable);
+
+          if (is_commit_already_pulled (repo, upgrade_refspec, summary_checksum, cancellable))
+            {
+              g_debug ("%s: Commit %s for ‘%s’ is unchanged; not pulling it again",
+                       G_STRFUNC, summary_checksum, upgrade_refspec);
+            }
+          else
+            {
+              g_clear_pointer (&options, g_variant_unref);
+              options = get_repo_pull_options (url_override, ref);
+              if (!ostree_repo_pull_with_options (repo,
+                                                  remote_name,
+                                                  options,
+                                                  NULL,
+                                                  cancellable,
+                                                  error))
+                {
+                  g_autofree gchar *remote_url = NULL;
+                  const gchar *pull_url;
+
+                  if (url_override == NULL)
+                    ostree_repo_remote_get_url (repo, remote_name, &remote_url, NULL);
+                  pull_url = (url_override != NULL) ? url_override : remote_url;
+                  eos_updater_map_pull_error (pull_url, pull_url, error);
+                  return FALSE;
+                }
+            }
         }
       else
         {
@@ -806,8 +1034,23 @@ fetch_latest_commit (OstreeRepo *repo,
           if (results == NULL)
             return FALSE;
 
-          /* Only pull commit metadata if there's an update available. */
-          if (results[0] != NULL)
+          /* Prefer less loaded peers on the local network. The order is kept
+           * for the fetch, too. */
+          eos_peer_load_sort_results (results, context, cancellable);
+
+          /* Only pull commit metadata if there's an update available, and
+           * it's not already in the local repository from a previous poll. */
+          if (results[0] != NULL &&
+              is_commit_already_pulled (repo, upgrade_refspec,
+                                        get_results_checksum_for_ref ((const OstreeRepoFinderResult * const *) results,
+                                                                      upgrade_collection_ref),
+                                        cancellable))
+            {
+              g_debug ("%s: Commit for (%s, %s) is unchanged; not pulling it again",
+                       G_STRFUNC, upgrade_collection_ref->collection_id,
+                       upgrade_collection_ref->ref_name);
+            }
+          else if (results[0] != NULL)
             {
               g_variant_builder_add (&builder, "{s@v}", "flags",
                                      g_variant_new_variant (g_variant_new_int32 (OSTREE_REPO_PULL_FLAGS_COMMIT_ONLY)));
@@ -822,7 +1065,13 @@ fetch_latest_commit (OstreeRepo *repo,
                 g_main_context_iteration (context, TRUE);
 
               if (!ostree_repo_pull_from_remotes_finish (repo, pull_result, error))
-                return FALSE;
+                {
+                  g_autofree gchar *origin_url = eos_updater_get_refspec_remote_url (repo, upgrade_refspec);
+                  g_autofree gchar *remote_url = ostree_remote_get_url (results[0]->remote);
+
+                  eos_updater_map_pull_error (origin_url, remote_url, error);
+                  return FALSE;
+                }
             }
         }
 
@@ -1144,12 +1393,13 @@ get_latest_update (GArray *sources,
 }
 
 EosUpdateInfo *
-run_fetchers (OstreeRepo   *repo,
-              GMainContext *context,
-              GCancellable *cancellable,
-              GPtrArray    *fetchers,
-              GArray       *sources,
-              GError      **error)
+run_fetchers (OstreeRepo         *repo,
+              EosSysrootSnapshot *booted_snapshot,
+              GMainContext       *context,
+              GCancellable       *cancellable,
+              GPtrArray          *fetchers,
+              GArray             *sources,
+              GError            **error)
 {
   guint idx;
   g_autoptr(GHashTable) source_to_update = g_hash_table_new_full (NULL,
@@ -1158,6 +1408,7 @@ run_fetchers (OstreeRepo   *repo,
                                                                   (GDestroyNotify) g_object_unref);
 
   g_return_val_if_fail (OSTREE_IS_REPO (repo), NULL);
+  g_return_val_if_fail (booted_snapshot != NULL, NULL);
   g_return_val_if_fail (context != NULL, NULL);
   g_return_val_if_fail (cancellable == NULL || G_IS_CANCELLABLE (cancellable), NULL);
   g_return_val_if_fail (fetchers != NULL, NULL);
@@ -1174,7 +1425,7 @@ run_fetchers (OstreeRepo   *repo,
       const gchar *name = download_source_to_string (source);
       g_autoptr(GError) local_error = NULL;
 
-      if (!fetcher (repo, context, &info, cancellable, &local_error))
+      if (!fetcher (repo, booted_snapshot, context, &info, cancellable, &local_error))
         {
           if (g_error_matches (local_error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
             {
@@ -1367,6 +1618,8 @@ metadata_fetch_finished (GObject *object,
       eos_updater_set_version (updater, info->version);
       eos_updater_set_update_is_user_visible (updater, info->is_user_visible);
       eos_updater_set_release_notes_uri (updater, info->release_notes_uri);
+      eos_updater_set_update_rollout_percentage (updater,
+                                                 eos_update_info_get_rollout_percentage (info));
 
       g_variant_get_child (info->commit, 3, "&s", &label);
       g_variant_get_child (info->commit, 4, "&s", &message);
@@ -25,6 +25,7 @@
 #pragma once
 
 #include <eos-updater/data.h>
+#include <eos-updater/sysroot-cache.h>
 #include <glib.h>
 #include <gio/gio.h>
 #include <ostree.h>
@@ -33,6 +34,7 @@ G_BEGIN_DECLS
 
 gboolean
 is_checksum_an_update (OstreeRepo *repo,
+                       EosSysrootSnapshot *booted_snapshot,
                        const gchar *update_checksum,
                        const gchar *booted_ref,
                        const gchar *update_ref,
@@ -81,11 +83,15 @@ eos_update_info_new (const gchar *csum,
 GDateTime *
 eos_update_info_get_commit_timestamp (EosUpdateInfo *info);
 
-typedef gboolean (*MetadataFetcher) (OstreeRepo     *repo,
-                                     GMainContext   *context,
-                                     EosUpdateInfo **out_info,
-                                     GCancellable   *cancellable,
-                                     GError        **error);
+guint
+eos_update_info_get_rollout_percentage (EosUpdateInfo *info);
+
+typedef gboolean (*MetadataFetcher) (OstreeRepo          *repo,
+                                     EosSysrootSnapshot  *booted_snapshot,
+                                     GMainContext        *context,
+                                     EosUpdateInfo      **out_info,
+                                     GCancellable        *cancellable,
+                                     GError             **error);
 
 gboolean get_booted_refspec (OstreeDeployment     *booted_deployment,
                              gchar               **booted_refspec,
@@ -94,7 +100,8 @@ gboolean get_booted_refspec (OstreeDeployment     *booted_deployment,
                              OstreeCollectionRef **booted_collection_ref,
                              GError              **error);
 
-gboolean get_refspec_to_upgrade_on (gchar               **refspec_to_upgrade_on,
+gboolean get_refspec_to_upgrade_on (EosSysrootSnapshot   *booted_snapshot,
+                                    gchar               **refspec_to_upgrade_on,
                                     gchar               **remote_to_upgrade_on,
                                     gchar               **ref_to_upgrade_on,
                                     OstreeCollectionRef **booted_collection_ref,
@@ -145,12 +152,13 @@ gboolean string_to_download_source (const gchar *str,
                                     EosUpdaterDownloadSource *source,
                                     GError **error);
 
-EosUpdateInfo *run_fetchers (OstreeRepo   *repo,
-                             GMainContext *context,
-                             GCancellable *cancellable,
-                             GPtrArray    *fetchers,
-                             GArray       *sources,
-                             GError      **error);
+EosUpdateInfo *run_fetchers (OstreeRepo         *repo,
+                             EosSysrootSnapshot *booted_snapshot,
+                             GMainContext       *context,
+                             GCancellable       *cancellable,
+                             GPtrArray          *fetchers,
+                             GArray             *sources,
+                             GError            **error);
 
 void metadata_fetch_finished (GObject *object,
                               GAsyncResult *res,
@@ -28,14 +28,12 @@
 #include <eos-updater/object.h>
 #include <eos-updater/poll-common.h>
 #include <eos-updater/poll.h>
-#include <eos-updater/resources.h>
+#include <eos-updater/sysroot-cache.h>
+#include <eos-updater/updater-config.h>
 #include <libeos-updater-util/config-util.h>
 #include <libeos-updater-util/ostree-util.h>
 #include <libeos-updater-util/util.h>
 
-static const gchar *const CONFIG_FILE_PATH = SYSCONFDIR "/eos-updater/eos-updater.conf";
-static const gchar *const LOCAL_CONFIG_FILE_PATH = PREFIX "/local/share/eos-updater/eos-updater.conf";
-static const gchar *const STATIC_CONFIG_FILE_PATH = DATADIR "/eos-updater/eos-updater.conf";
 static const gchar *const DOWNLOAD_GROUP = "Download";
 static const gchar *const ORDER_KEY = "Order";
 
@@ -79,13 +77,6 @@ strv_to_download_order (gchar **sources,
   return TRUE;
 }
 
-static const gchar *
-get_config_file_path (void)
-{
-  return eos_updater_get_envvar_or ("EOS_UPDATER_TEST_UPDATER_CONFIG_FILE_PATH",
-                                    CONFIG_FILE_PATH);
-}
-
 typedef struct
 {
   GArray *download_order;
@@ -105,24 +96,15 @@ sources_config_clear (SourcesConfig *config)
 G_DEFINE_AUTO_CLEANUP_CLEAR_FUNC (SourcesConfig, sources_config_clear)
 
 static gboolean
-read_config (const gchar *config_file_path,
-             SourcesConfig *sources_config,
+read_config (SourcesConfig *sources_config,
              GError **error)
 {
   g_autoptr(EuuConfigFile) config = NULL;
   g_auto(GStrv) download_order_strv = NULL;
   g_autofree gchar *group_name = NULL;
-  const gchar * const paths[] =
-    {
-      config_file_path,  /* typically CONFIG_FILE_PATH unless testing */
-      LOCAL_CONFIG_FILE_PATH,
-      STATIC_CONFIG_FILE_PATH,
-      NULL
-    };
 
   /* Load the config file. */
-  config = euu_config_file_new (paths, eos_updater_resources_get_resource (),
-                                "/com/endlessm/Updater/config/eos-updater.conf");
+  config = eos_updater_config_file_new ();
 
   /* Parse the options. */
   download_order_strv = euu_config_file_get_strv (config,
@@ -309,33 +291,6 @@ update_ref_info_clear (UpdateRefInfo *update_ref_info)
 
 G_DEFINE_AUTO_CLEANUP_CLEAR_FUNC (UpdateRefInfo, update_ref_info_clear)
 
-static gboolean
-get_booted_refspec_from_default_booted_sysroot_deployment (gchar               **out_refspec,
-                                                           gchar               **out_remote,
-                                                           gchar               **out_ref,
-                                                           OstreeCollectionRef **out_collection_ref,
-                                                           GError              **error)
-{
-  g_autoptr(OstreeSysroot) sysroot = ostree_sysroot_new_default ();
-  g_autoptr(OstreeDeployment) booted_deployment = NULL;
-
-  if (!ostree_sysroot_load (sysroot, NULL, error))
-    return FALSE;
-
-  booted_deployment = eos_updater_get_booted_deployment_from_loaded_sysroot (sysroot,
-                                                                             error);
-
-  if (booted_deployment == NULL)
-    return FALSE;
-
-  return get_booted_refspec (booted_deployment,
-                             out_refspec,
-                             out_remote,
-                             out_ref,
-                             out_collection_ref,
-                             error);
-}
-
 /* Replace any placeholders in the given @template release notes URI with the
  * appropriate values, which depend on the update path being taken, and return
  * the resulting release notes URI. */
@@ -354,6 +309,7 @@ format_release_notes_uri (const gchar *template,
 
 static gboolean
 check_for_update_using_booted_branch (OstreeRepo           *repo,
+                                      EosSysrootSnapshot   *booted_snapshot,
                                       gboolean             *out_is_update,
                                       UpdateRefInfo        *out_update_ref_info,
                                       GPtrArray            *finders, /* (element-type OstreeRepoFinder) */
@@ -373,8 +329,6 @@ check_for_update_using_booted_branch (OstreeRepo           *repo,
   g_autofree gchar *checksum = NULL;
   g_autoptr(GVariant) commit = NULL;
   gboolean is_update_user_visible = FALSE;
-  g_autoptr(OstreeSysroot) sysroot = ostree_sysroot_new_default ();
-  g_autoptr(OstreeDeployment) booted_deployment = NULL;
   g_auto(OstreeRepoFinderResultv) results = NULL;
   g_autofree gchar *booted_version = NULL;
   g_autofree gchar *update_version = NULL;
@@ -383,11 +337,12 @@ check_for_update_using_booted_branch (OstreeRepo           *repo,
   g_return_val_if_fail (out_update_ref_info != NULL, FALSE);
   g_return_val_if_fail (error == NULL || *error == NULL, FALSE);
 
-  if (!get_booted_refspec_from_default_booted_sysroot_deployment (&booted_refspec,
-                                                                  &remote,
-                                                                  &ref,
-                                                                  &collection_ref,
-                                                                  error))
+  if (!eos_sysroot_snapshot_get_booted_refspec (booted_snapshot,
+                                                &booted_refspec,
+                                                &remote,
+                                                &ref,
+                                                &collection_ref,
+                                                error))
     return FALSE;
 
   if (!fetch_latest_commit (repo,
@@ -409,6 +364,7 @@ check_for_update_using_booted_branch (OstreeRepo           *repo,
     return FALSE;
 
   if (!is_checksum_an_update (repo,
+                              booted_snapshot,
                               checksum,
                               ref,
                               new_ref,
@@ -445,12 +401,13 @@ check_for_update_using_booted_branch (OstreeRepo           *repo,
 }
 
 static gboolean
-check_for_update_following_checkpoint_commits (OstreeRepo     *repo,
-                                               UpdateRefInfo  *out_update_ref_info,
-                                               GPtrArray      *finders, /* (element-type OstreeRepoFinder) */
-                                               GMainContext   *context,
-                                               GCancellable   *cancellable,
-                                               GError        **error)
+check_for_update_following_checkpoint_commits (OstreeRepo          *repo,
+                                               EosSysrootSnapshot  *booted_snapshot,
+                                               UpdateRefInfo       *out_update_ref_info,
+                                               GPtrArray           *finders, /* (element-type OstreeRepoFinder) */
+                                               GMainContext        *context,
+                                               GCancellable        *cancellable,
+                                               GError             **error)
 {
   g_autofree gchar *upgrade_refspec = NULL;
   g_autofree gchar *remote = NULL;
@@ -475,11 +432,12 @@ check_for_update_following_checkpoint_commits (OstreeRepo     *repo,
   /* Get the booted refspec. We'll use this to work out whether
    * we are pulling from a different refspec than the one we booted
    * on, which has implications for cleanup later. */
-  if (!get_booted_refspec_from_default_booted_sysroot_deployment (&booted_refspec,
-                                                                  NULL,
-                                                                  &booted_ref,
-                                                                  NULL,
-                                                                  error))
+  if (!eos_sysroot_snapshot_get_booted_refspec (booted_snapshot,
+                                                &booted_refspec,
+                                                NULL,
+                                                &booted_ref,
+                                                NULL,
+                                                error))
     return FALSE;
 
   /* Get the refspec to upgrade on. This typically the "checkpoint commit"
@@ -488,7 +446,7 @@ check_for_update_following_checkpoint_commits (OstreeRepo     *repo,
    * if we are booted in a given commit. This is used to ensure that the updater
    * or its dependencies supports a particular feature that we'll need in order
    * to be able to upgrade properly to newer versions. */
-  if (!get_refspec_to_upgrade_on (&upgrade_refspec, &remote, &ref, &collection_ref, error))
+  if (!get_refspec_to_upgrade_on (booted_snapshot, &upgrade_refspec, &remote, &ref, &collection_ref, error))
     return FALSE;
 
   /* Fetch the latest commit on the upgrade refspec, potentially following
@@ -518,6 +476,7 @@ check_for_update_following_checkpoint_commits (OstreeRepo     *repo,
    * on ref_after_following_rebases represents an update to
    * whatever we currently have booted. If it isn't, abort. */
   if (!is_checksum_an_update (repo,
+                              booted_snapshot,
                               checksum,
                               booted_ref,
                               ref_after_following_rebases,
@@ -560,12 +519,13 @@ check_for_update_following_checkpoint_commits (OstreeRepo     *repo,
 }
 
 static gboolean
-check_for_update_following_checkpoint_if_allowed (OstreeRepo     *repo,
-                                                  UpdateRefInfo  *out_update_ref_info,
-                                                  GPtrArray      *finders, /* (element-type OstreeRepoFinder) */
-                                                  GMainContext   *context,
-                                                  GCancellable   *cancellable,
-                                                  GError        **error)
+check_for_update_following_checkpoint_if_allowed (OstreeRepo          *repo,
+                                                  EosSysrootSnapshot  *booted_snapshot,
+                                                  UpdateRefInfo       *out_update_ref_info,
+                                                  GPtrArray           *finders, /* (element-type OstreeRepoFinder) */
+                                                  GMainContext        *context,
+                                                  GCancellable        *cancellable,
+                                                  GError             **error)
 {
   gboolean had_update_on_branch = FALSE;
 
@@ -577,6 +537,7 @@ check_for_update_following_checkpoint_if_allowed (OstreeRepo     *repo,
    * on the booted refspec after the checkpoint and we don't want
    * to transition users on to the new branch just yet */
   if (!check_for_update_using_booted_branch (repo,
+                                             booted_snapshot,
                                              &had_update_on_branch,
                                              out_update_ref_info,
                                              finders,
@@ -593,6 +554,7 @@ check_for_update_following_checkpoint_if_allowed (OstreeRepo     *repo,
       update_ref_info_clear (out_update_ref_info);
 
       if (!check_for_update_following_checkpoint_commits (repo,
+                                                          booted_snapshot,
                                                           out_update_ref_info,
                                                           finders,
                                                           context,
@@ -608,11 +570,12 @@ check_for_update_following_checkpoint_if_allowed (OstreeRepo     *repo,
  * found on the Internet, the local network, or a removable drive. May return
  * NULL without setting an error if no updates were found. */
 static EosUpdateInfo *
-metadata_fetch_new (OstreeRepo    *repo,
-                    SourcesConfig *config,
-                    GMainContext  *context,
-                    GCancellable  *cancellable,
-                    GError       **error)
+metadata_fetch_new (OstreeRepo          *repo,
+                    EosSysrootSnapshot  *booted_snapshot,
+                    SourcesConfig       *config,
+                    GMainContext        *context,
+                    GCancellable        *cancellable,
+                    GError             **error)
 {
   g_auto(OstreeRepoFinderResultv) results = NULL;
   g_autoptr(EosUpdateInfo) info = NULL;
@@ -637,6 +600,7 @@ metadata_fetch_new (OstreeRepo    *repo,
    * the checkpoint refspec. */
   if (offline_finders->len > 0 &&
       !check_for_update_following_checkpoint_if_allowed (repo,
+                                                         booted_snapshot,
                                                          &update_ref_info,
                                                          offline_finders,
                                                          context,
@@ -655,6 +619,7 @@ metadata_fetch_new (OstreeRepo    *repo,
 
       if (online_finders->len > 0 &&
           !check_for_update_following_checkpoint_if_allowed (repo,
+                                                             booted_snapshot,
                                                              &update_ref_info,
                                                              online_finders,
                                                              context,
@@ -690,11 +655,12 @@ metadata_fetch_new (OstreeRepo    *repo,
  * checking the Internet not peer sources. May return NULL without setting an
  * error if no updates were found. */
 static gboolean
-metadata_fetch_from_main (OstreeRepo     *repo,
-                          GMainContext   *context,
-                          EosUpdateInfo **out_info,
-                          GCancellable   *cancellable,
-                          GError        **error)
+metadata_fetch_from_main (OstreeRepo          *repo,
+                          EosSysrootSnapshot  *booted_snapshot,
+                          GMainContext        *context,
+                          EosUpdateInfo      **out_info,
+                          GCancellable        *cancellable,
+                          GError             **error)
 {
   g_auto(UpdateRefInfo) update_ref_info = { 0 };
   g_autofree gchar *ref = NULL;
@@ -708,6 +674,7 @@ metadata_fetch_from_main (OstreeRepo     *repo,
   g_return_val_if_fail (error == NULL || *error == NULL, FALSE);
 
   if (!check_for_update_following_checkpoint_if_allowed (repo,
+                                                         booted_snapshot,
                                                          &update_ref_info,
                                                          NULL,
                                                          context,
@@ -732,16 +699,46 @@ metadata_fetch_from_main (OstreeRepo     *repo,
   return TRUE;
 }
 
+/* Get a snapshot of the booted deployment, mapping the errors which mean there
+ * is no booted deployment (such as on a dev-converted system) to
+ * %EOS_UPDATER_ERROR_NOT_OSTREE_SYSTEM. */
+static EosSysrootSnapshot *
+dup_booted_snapshot (EosSysrootCache  *sysroot_cache,
+                     GCancellable     *cancellable,
+                     GError          **error)
+{
+  g_autoptr(EosSysrootSnapshot) snapshot = NULL;
+  g_autoptr(GError) local_error = NULL;
+
+  snapshot = eos_sysroot_cache_dup_snapshot (sysroot_cache, cancellable, &local_error);
+  if (g_error_matches (local_error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND) ||
+      g_error_matches (local_error, G_IO_ERROR, G_IO_ERROR_FAILED))
+    {
+      g_set_error (error, EOS_UPDATER_ERROR,
+                   EOS_UPDATER_ERROR_NOT_OSTREE_SYSTEM,
+                   "Not an OSTree-based system: cannot update it.");
+      return NULL;
+    }
+  else if (local_error != NULL)
+    {
+      g_propagate_error (error, g_steal_pointer (&local_error));
+      return NULL;
+    }
+
+  return g_steal_pointer (&snapshot);
+}
+
 static gboolean
-metadata_fetch_internal (OstreeRepo     *repo,
-                         EosUpdateInfo **out_info,
-                         GCancellable   *cancellable,
-                         GError        **error)
+metadata_fetch_internal (OstreeRepo       *repo,
+                         EosSysrootCache  *sysroot_cache,
+                         EosUpdateInfo   **out_info,
+                         GCancellable     *cancellable,
+                         GError          **error)
 {
   g_autoptr(GError) local_error = NULL;
   g_autoptr(GMainContext) task_context = g_main_context_ref_thread_default ();
   g_auto(SourcesConfig) config = SOURCES_CONFIG_CLEARED;
-  g_autoptr(OstreeDeployment) deployment = NULL;
+  g_autoptr(EosSysrootSnapshot) booted_snapshot = NULL;
   g_autoptr(EosUpdateInfo) info = NULL;
   gboolean use_new_code = TRUE;
   /* TODO: link this --^ to failure of the fetch or apply stages?
@@ -750,20 +747,12 @@ metadata_fetch_internal (OstreeRepo     *repo,
   gboolean disable_old_code = (g_getenv ("EOS_UPDATER_DISABLE_FALLBACK_FETCHERS") != NULL);
 
   /* Check we’re not on a dev-converted system. */
-  deployment = eos_updater_get_booted_deployment (&local_error);
-  if (g_error_matches (local_error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND) ||
-      g_error_matches (local_error, G_IO_ERROR, G_IO_ERROR_FAILED))
-    {
-      g_set_error (error, EOS_UPDATER_ERROR,
-                   EOS_UPDATER_ERROR_NOT_OSTREE_SYSTEM,
-                   "Not an OSTree-based system: cannot update it.");
-      return FALSE;
-    }
-
-  g_clear_error (&local_error);
+  booted_snapshot = dup_booted_snapshot (sysroot_cache, cancellable, error);
+  if (booted_snapshot == NULL)
+    return FALSE;
 
   /* Work out which sources to poll. */
-  if (!read_config (get_config_file_path (), &config, error))
+  if (!read_config (&config, error))
     return FALSE;
 
   /* Do we want to use the new libostree code for P2P, or fall back on the old
@@ -772,7 +761,7 @@ metadata_fetch_internal (OstreeRepo     *repo,
    * https://phabricator.endlessm.com/T19606 */
   if (use_new_code)
     {
-      info = metadata_fetch_new (repo, &config, task_context, cancellable, &local_error);
+      info = metadata_fetch_new (repo, booted_snapshot, &config, task_context, cancellable, &local_error);
 
       if (local_error != NULL)
         {
@@ -830,6 +819,7 @@ metadata_fetch_internal (OstreeRepo     *repo,
           g_array_append_val (order, main_source);
 
           info = run_fetchers (repo,
+                               booted_snapshot,
                                task_context,
                                cancellable,
                                fetchers,
@@ -856,6 +846,35 @@ metadata_fetch_internal (OstreeRepo     *repo,
   return TRUE;
 }
 
+typedef struct
+{
+  OstreeRepo *repo;  /* (owned) */
+  EosSysrootCache *sysroot_cache;  /* (owned) */
+} PollData;
+
+static void
+poll_data_free (PollData *data)
+{
+  g_clear_object (&data->repo);
+  g_clear_object (&data->sysroot_cache);
+  g_free (data);
+}
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (PollData, poll_data_free)
+
+static PollData *
+poll_data_new (OstreeRepo      *repo,
+               EosSysrootCache *sysroot_cache)
+{
+  g_autoptr(PollData) data = NULL;
+
+  data = g_new (PollData, 1);
+  data->repo = g_object_ref (repo);
+  data->sysroot_cache = g_object_ref (sysroot_cache);
+
+  return g_steal_pointer (&data);
+}
+
 static void
 metadata_fetch (GTask *task,
                 gpointer object,
@@ -863,13 +882,16 @@ metadata_fetch (GTask *task,
                 GCancellable *cancellable)
 {
   g_autoptr(GError) local_error = NULL;
-  OstreeRepo *repo = task_data;
+  PollData *poll_data = task_data;
   g_autoptr(EosUpdateInfo) info = NULL;
   g_autoptr(GMainContext) task_context = g_main_context_new ();
+  g_auto(EosUpdaterThreadPriorityState) priority_state = EOS_UPDATER_THREAD_PRIORITY_STATE_CLEARED;
 
+  eos_updater_set_worker_thread_priority (FALSE, &priority_state);
   g_main_context_push_thread_default (task_context);
 
-  if (!metadata_fetch_internal (repo,
+  if (!metadata_fetch_internal (poll_data->repo,
+                                poll_data->sysroot_cache,
                                 &info,
                                 cancellable,
                                 &local_error))
@@ -914,7 +936,8 @@ handle_poll (EosUpdater            *updater,
   eos_updater_data_reset_cancellable (data);
   eos_updater_clear_error (updater, EOS_UPDATER_STATE_POLLING);
   task = g_task_new (updater, data->cancellable, metadata_fetch_finished, data);
-  g_task_set_task_data (task, g_object_ref (data->repo), g_object_unref);
+  g_task_set_task_data (task, poll_data_new (data->repo, data->sysroot_cache),
+                        (GDestroyNotify) poll_data_free);
   g_task_run_in_thread (task, metadata_fetch);
 
   eos_updater_complete_poll (updater, call);
@@ -925,6 +948,7 @@ handle_poll (EosUpdater            *updater,
 typedef struct
 {
   OstreeRepo *repo;  /* (owned) */
+  EosSysrootCache *sysroot_cache;  /* (owned) */
   gchar *volume_path;  /* (owned) */
 } PollVolumeData;
 
@@ -932,6 +956,7 @@ static void
 poll_volume_data_free (PollVolumeData *data)
 {
   g_free (data->volume_path);
+  g_clear_object (&data->sysroot_cache);
   g_clear_object (&data->repo);
   g_free (data);
 }
@@ -939,13 +964,15 @@ poll_volume_data_free (PollVolumeData *data)
 G_DEFINE_AUTOPTR_CLEANUP_FUNC (PollVolumeData, poll_volume_data_free)
 
 static PollVolumeData *
-poll_volume_data_new (OstreeRepo  *repo,
-                      const gchar *path)
+poll_volume_data_new (OstreeRepo      *repo,
+                      EosSysrootCache *sysroot_cache,
+                      const gchar     *path)
 {
   g_autoptr(PollVolumeData) data = NULL;
 
   data = g_new (PollVolumeData, 1);
   data->repo = g_object_ref (repo);
+  data->sysroot_cache = g_object_ref (sysroot_cache);
   data->volume_path = g_strdup (path);
 
   return g_steal_pointer (&data);
@@ -960,23 +987,15 @@ poll_volume_internal (PollVolumeData  *poll_volume_data,
   g_autoptr(GError) local_error = NULL;
   g_autoptr(GMainContext) task_context = g_main_context_ref_thread_default ();
   g_auto(SourcesConfig) config = SOURCES_CONFIG_CLEARED;
-  g_autoptr(OstreeDeployment) deployment = NULL;
+  g_autoptr(EosSysrootSnapshot) booted_snapshot = NULL;
   g_autoptr(EosUpdateInfo) info = NULL;
   EosUpdaterDownloadSource idx;
   g_autofree gchar *repo_path = NULL;
 
   /* Check we’re not on a dev-converted system. */
-  deployment = eos_updater_get_booted_deployment (&local_error);
-  if (g_error_matches (local_error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND) ||
-      g_error_matches (local_error, G_IO_ERROR, G_IO_ERROR_FAILED))
-    {
-      g_set_error (error, EOS_UPDATER_ERROR,
-                   EOS_UPDATER_ERROR_NOT_OSTREE_SYSTEM,
-                   "Not an OSTree-based system: cannot update it.");
-      return FALSE;
-    }
-
-  g_clear_error (&local_error);
+  booted_snapshot = dup_booted_snapshot (poll_volume_data->sysroot_cache, cancellable, error);
+  if (booted_snapshot == NULL)
+    return FALSE;
 
   config.download_order = g_array_new (FALSE, /* not null terminated */
                                        FALSE, /* no clearing */
@@ -988,7 +1007,7 @@ poll_volume_internal (PollVolumeData  *poll_volume_data,
   config.override_uris = g_new0 (gchar *, 2);
   config.override_uris[0] = g_strconcat ("file://", repo_path, NULL);
 
-  info = metadata_fetch_new (poll_volume_data->repo, &config, task_context, cancellable, &local_error);
+  info = metadata_fetch_new (poll_volume_data->repo, booted_snapshot, &config, task_context, cancellable, &local_error);
 
   if (local_error != NULL)
     {
@@ -1012,7 +1031,11 @@ poll_volume (GTask        *task,
   PollVolumeData *poll_volume_data = task_data;
   g_autoptr(EosUpdateInfo) info = NULL;
   g_autoptr(GMainContext) task_context = g_main_context_new ();
+  g_auto(EosUpdaterThreadPriorityState) priority_state = EOS_UPDATER_THREAD_PRIORITY_STATE_CLEARED;
 
+  /* Polling a volume is only ever done at the user’s request, when they have
+   * plugged in a USB drive with updates on it. */
+  eos_updater_set_worker_thread_priority (TRUE, &priority_state);
   g_main_context_push_thread_default (task_context);
 
   if (!poll_volume_internal (poll_volume_data,
@@ -1058,7 +1081,7 @@ handle_poll_volume (EosUpdater            *updater,
     }
 
   /* FIXME: The #OstreeRepo instance here is not thread safe. */
-  poll_volume_data = poll_volume_data_new (data->repo, path);
+  poll_volume_data = poll_volume_data_new (data->repo, data->sysroot_cache, path);
 
   eos_updater_data_reset_cancellable (data);
   eos_updater_clear_error (updater, EOS_UPDATER_STATE_POLLING);
@@ -0,0 +1,379 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * Copyright 2024 Endless OS Foundation LLC <maintainers@endlessos.org>
+ *
+ * SPDX-License-Identifier: LGPL-2.1-or-later
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include <eos-updater/poll-common.h>
+#include <eos-updater/sysroot-cache.h>
+#include <gio/gio.h>
+#include <glib.h>
+#include <libeos-updater-util/ostree-util.h>
+#include <ostree.h>
+
+/**
+ * eos_sysroot_snapshot_ref:
+ * @snapshot: an #EosSysrootSnapshot
+ *
+ * Increment the reference count on @snapshot and return it. This is thread
+ * safe.
+ *
+ * Returns: (transfer full): @snapshot
+ */
+EosSysrootSnapshot *
+eos_sysroot_snapshot_ref (EosSysrootSnapshot *snapshot)
+{
+  g_return_val_if_fail (snapshot != NULL, NULL);
+  g_return_val_if_fail (snapshot->ref_count > 0, NULL);
+  g_return_val_if_fail (snapshot->ref_count < G_MAXINT, NULL);
+
+  g_atomic_int_inc (&snapshot->ref_count);
+  return snapshot;
+}
+
+/**
+ * eos_sysroot_snapshot_unref:
+ * @snapshot: (transfer full): an #EosSysrootSnapshot
+ *
+ * Decrement the reference count on @snapshot, freeing it if the count reaches
+ * zero. This is thread safe.
+ */
+void
+eos_sysroot_snapshot_unref (EosSysrootSnapshot *snapshot)
+{
+  g_return_if_fail (snapshot != NULL);
+  g_return_if_fail (snapshot->ref_count > 0);
+
+  if (!g_atomic_int_dec_and_test (&snapshot->ref_count))
+    return;
+
+  g_clear_object (&snapshot->sysroot_path);
+  g_clear_pointer (&snapshot->booted_checksum, g_free);
+  g_clear_pointer (&snapshot->booted_commit, g_variant_unref);
+  g_clear_pointer (&snapshot->booted_refspec, g_free);
+  g_clear_pointer (&snapshot->booted_remote, g_free);
+  g_clear_pointer (&snapshot->booted_ref, g_free);
+  g_clear_pointer (&snapshot->booted_collection_ref, ostree_collection_ref_free);
+  g_clear_error (&snapshot->booted_refspec_error);
+
+  g_free (snapshot);
+}
+
+/* Load the default sysroot and everything we routinely need to know about its
+ * booted deployment. Errors finding the booted deployment are fatal, as they
+ * mean this is not an OSTree system; errors loading the booted commit or
+ * parsing its origin are stored in the snapshot so the callers can decide how
+ * to handle them, as they did before there was a cache.
+ *
+ * The loaded sysroot is private to the calling thread and is dropped once the
+ * snapshot has been filled in, so it is never shared between threads. */
+static EosSysrootSnapshot *
+sysroot_snapshot_new (GCancellable  *cancellable,
+                      GError       **error)
+{
+  g_autoptr(OstreeSysroot) sysroot = ostree_sysroot_new_default ();
+  g_autoptr(OstreeDeployment) booted_deployment = NULL;
+  g_autoptr(OstreeRepo) repo = NULL;
+  g_autoptr(EosSysrootSnapshot) snapshot = NULL;
+  g_autoptr(GError) local_error = NULL;
+
+  if (!ostree_sysroot_load (sysroot, cancellable, error))
+    return NULL;
+
+  booted_deployment = eos_updater_get_booted_deployment_from_loaded_sysroot (sysroot,
+                                                                             error);
+  if (booted_deployment == NULL)
+    return NULL;
+
+  snapshot = g_new0 (EosSysrootSnapshot, 1);
+  snapshot->ref_count = 1;
+  snapshot->sysroot_path = g_object_ref (ostree_sysroot_get_path (sysroot));
+  snapshot->booted_checksum = g_strdup (ostree_deployment_get_csum (booted_deployment));
+
+  /* The booted commit may be missing from the repository (see T22805), so
+   * this is not fatal. Users of the snapshot must handle a %NULL commit. */
+  if (!ostree_sysroot_get_repo (sysroot, &repo, cancellable, &local_error) ||
+      !ostree_repo_load_commit (repo, snapshot->booted_checksum,
+                                &snapshot->booted_commit, NULL, &local_error))
+    {
+      g_debug ("%s: Error loading booted commit ‘%s’: %s",
+               G_STRFUNC, snapshot->booted_checksum, local_error->message);
+      g_clear_error (&local_error);
+    }
+
+  if (!get_booted_refspec (booted_deployment,
+                           &snapshot->booted_refspec,
+                           &snapshot->booted_remote,
+                           &snapshot->booted_ref,
+                           &snapshot->booted_collection_ref,
+                           &snapshot->booted_refspec_error))
+    g_debug ("%s: Error getting booted refspec: %s",
+             G_STRFUNC, snapshot->booted_refspec_error->message);
+
+  return g_steal_pointer (&snapshot);
+}
+
+/**
+ * eos_sysroot_snapshot_get_booted_refspec:
+ * @snapshot: an #EosSysrootSnapshot
+ * @out_refspec: (out) (optional) (transfer full): return location for the
+ *    booted refspec
+ * @out_remote: (out) (optional) (transfer full): return location for the
+ *    remote in the booted refspec
+ * @out_ref: (out) (optional) (transfer full): return location for the ref in
+ *    the booted refspec
+ * @out_collection_ref: (out) (optional) (nullable) (transfer full): return
+ *    location for the collection–ref of the booted refspec, or %NULL if the
+ *    remote has no collection ID
+ * @error: return location for a #GError
+ *
+ * Get the booted refspec, as parsed from the origin file of the booted
+ * deployment when @snapshot was taken. See get_booted_refspec().
+ *
+ * Returns: %TRUE on success, %FALSE otherwise
+ */
+gboolean
+eos_sysroot_snapshot_get_booted_refspec (EosSysrootSnapshot   *snapshot,
+                                         gchar               **out_refspec,
+                                         gchar               **out_remote,
+                                         gchar               **out_ref,
+                                         OstreeCollectionRef **out_collection_ref,
+                                         GError              **error)
+{
+  g_return_val_if_fail (snapshot != NULL, FALSE);
+  g_return_val_if_fail (error == NULL || *error == NULL, FALSE);
+
+  if (snapshot->booted_refspec_error != NULL)
+    {
+      g_propagate_error (error, g_error_copy (snapshot->booted_refspec_error));
+      return FALSE;
+    }
+
+  if (out_refspec != NULL)
+    *out_refspec = g_strdup (snapshot->booted_refspec);
+  if (out_remote != NULL)
+    *out_remote = g_strdup (snapshot->booted_remote);
+  if (out_ref != NULL)
+    *out_ref = g_strdup (snapshot->booted_ref);
+  if (out_collection_ref != NULL)
+    *out_collection_ref = (snapshot->booted_collection_ref != NULL) ?
+                          ostree_collection_ref_dup (snapshot->booted_collection_ref) : NULL;
+
+  return TRUE;
+}
+
+/* Cache of the most recent #EosSysrootSnapshot. The snapshot is dropped
+ * whenever anything changes in the deployments directory (libostree bumps the
+ * mtime of /ostree/deploy on every deployment change), or when
+ * eos_sysroot_cache_invalidate() is called after an Apply() operation.
+ *
+ * The cache is created and invalidated on the main thread, but snapshots are
+ * taken from the worker threads, so access to @snapshot is locked. */
+struct _EosSysrootCache
+{
+  GObject parent_instance;
+
+  GMutex lock;
+  EosSysrootSnapshot *snapshot;  /* (owned) (nullable) (locked-by lock) */
+  guint generation;  /* (locked-by lock) */
+
+  /* If we can’t monitor the sysroot for changes, we can’t safely cache
+   * anything, so every call to eos_sysroot_cache_dup_snapshot() reloads it.
+   * This is immutable after construction. */
+  gboolean cacheable;
+
+  GFileMonitor *monitor;  /* (owned) (nullable) */
+  gulong monitor_changed_id;
+};
+
+G_DEFINE_TYPE (EosSysrootCache, eos_sysroot_cache, G_TYPE_OBJECT)
+
+static void
+eos_sysroot_cache_dispose (GObject *object)
+{
+  EosSysrootCache *self = EOS_SYSROOT_CACHE (object);
+
+  g_clear_signal_handler (&self->monitor_changed_id, self->monitor);
+  g_clear_object (&self->monitor);
+
+  G_OBJECT_CLASS (eos_sysroot_cache_parent_class)->dispose (object);
+}
+
+static void
+eos_sysroot_cache_finalize (GObject *object)
+{
+  EosSysrootCache *self = EOS_SYSROOT_CACHE (object);
+
+  g_clear_pointer (&self->snapshot, eos_sysroot_snapshot_unref);
+  g_mutex_clear (&self->lock);
+
+  G_OBJECT_CLASS (eos_sysroot_cache_parent_class)->finalize (object);
+}
+
+static void
+eos_sysroot_cache_class_init (EosSysrootCacheClass *self_class)
+{
+  GObjectClass *object_class = G_OBJECT_CLASS (self_class);
+
+  object_class->dispose = eos_sysroot_cache_dispose;
+  object_class->finalize = eos_sysroot_cache_finalize;
+}
+
+static void
+eos_sysroot_cache_init (EosSysrootCache *self)
+{
+  g_mutex_init (&self->lock);
+}
+
+static void
+deployments_changed_cb (GFileMonitor      *monitor,
+                        GFile             *file,
+                        GFile             *other_file,
+                        GFileMonitorEvent  event_type,
+                        gpointer           user_data)
+{
+  EosSysrootCache *self = EOS_SYSROOT_CACHE (user_data);
+
+  g_debug ("%s: Deployments changed (event %u on ‘%s’); invalidating cached sysroot",
+           G_STRFUNC, (guint) event_type, g_file_peek_path (file));
+
+  eos_sysroot_cache_invalidate (self);
+}
+
+/**
+ * eos_sysroot_cache_new:
+ *
+ * Create a new #EosSysrootCache for the default sysroot. This must be called
+ * on the main thread, as change notifications for the sysroot are delivered
+ * in the thread-default main context at the time of construction.
+ *
+ * Returns: (transfer full): a new #EosSysrootCache
+ */
+EosSysrootCache *
+eos_sysroot_cache_new (void)
+{
+  g_autoptr(EosSysrootCache) self = NULL;
+  g_autoptr(OstreeSysroot) sysroot = ostree_sysroot_new_default ();
+  g_autoptr(GFile) deploy_dir = NULL;
+  g_autoptr(GError) local_error = NULL;
+
+  self = g_object_new (EOS_TYPE_SYSROOT_CACHE, NULL);
+
+  deploy_dir = g_file_resolve_relative_path (ostree_sysroot_get_path (sysroot),
+                                             "ostree/deploy");
+  self->monitor = g_file_monitor_directory (deploy_dir, G_FILE_MONITOR_NONE,
+                                            NULL, &local_error);
+
+  if (self->monitor == NULL)
+    {
+      g_warning ("Failed to monitor ‘%s’ for deployment changes; not caching sysroot state: %s",
+                 g_file_peek_path (deploy_dir), local_error->message);
+      return g_steal_pointer (&self);
+    }
+
+  self->monitor_changed_id = g_signal_connect (self->monitor, "changed",
+                                               G_CALLBACK (deployments_changed_cb),
+                                               self);
+  self->cacheable = TRUE;
+
+  return g_steal_pointer (&self);
+}
+
+/**
+ * eos_sysroot_cache_dup_snapshot:
+ * @self: an #EosSysrootCache
+ * @cancellable: (nullable): a #GCancellable
+ * @error: return location for a #GError
+ *
+ * Get a snapshot of the booted deployment in the default sysroot. If there is
+ * a valid cached snapshot, it is returned without touching the disk; otherwise
+ * the sysroot is loaded and the new snapshot cached for future calls.
+ *
+ * If the system is not an OSTree system, the error from
+ * eos_updater_get_booted_deployment_from_loaded_sysroot() is returned.
+ *
+ * This may be called from any thread.
+ *
+ * Returns: (transfer full): a snapshot of the sysroot
+ */
+EosSysrootSnapshot *
+eos_sysroot_cache_dup_snapshot (EosSysrootCache  *self,
+                                GCancellable     *cancellable,
+                                GError          **error)
+{
+  g_autoptr(EosSysrootSnapshot) snapshot = NULL;
+  guint generation;
+
+  g_return_val_if_fail (EOS_IS_SYSROOT_CACHE (self), NULL);
+  g_return_val_if_fail (cancellable == NULL || G_IS_CANCELLABLE (cancellable), NULL);
+  g_return_val_if_fail (error == NULL || *error == NULL, NULL);
+
+  g_mutex_lock (&self->lock);
+  if (self->snapshot != NULL)
+    snapshot = eos_sysroot_snapshot_ref (self->snapshot);
+  generation = self->generation;
+  g_mutex_unlock (&self->lock);
+
+  if (snapshot != NULL)
+    {
+      g_debug ("%s: Using cached sysroot snapshot for booted commit %s",
+               G_STRFUNC, snapshot->booted_checksum);
+      return g_steal_pointer (&snapshot);
+    }
+
+  /* Load the sysroot without holding the lock, so that invalidations from the
+   * main thread are not blocked on disk I/O. If an invalidation happens in the
+   * meantime, the generation will have changed and the (possibly stale)
+   * snapshot is returned to this caller but not cached. */
+  snapshot = sysroot_snapshot_new (cancellable, error);
+  if (snapshot == NULL)
+    return NULL;
+
+  g_mutex_lock (&self->lock);
+  if (self->cacheable &&
+      self->snapshot == NULL &&
+      self->generation == generation)
+    self->snapshot = eos_sysroot_snapshot_ref (snapshot);
+  g_mutex_unlock (&self->lock);
+
+  return g_steal_pointer (&snapshot);
+}
+
+/**
+ * eos_sysroot_cache_invalidate:
+ * @self: an #EosSysrootCache
+ *
+ * Drop any cached snapshot, so that the next call to
+ * eos_sysroot_cache_dup_snapshot() reloads the sysroot. Snapshots which have
+ * already been handed out remain valid.
+ *
+ * This may be called from any thread.
+ */
+void
+eos_sysroot_cache_invalidate (EosSysrootCache *self)
+{
+  g_autoptr(EosSysrootSnapshot) old_snapshot = NULL;
+
+  g_return_if_fail (EOS_IS_SYSROOT_CACHE (self));
+
+  g_mutex_lock (&self->lock);
+  old_snapshot = g_steal_pointer (&self->snapshot);
+  self->generation++;
+  g_mutex_unlock (&self->lock);
+}
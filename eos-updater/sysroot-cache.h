@@ -0,0 +1,91 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * Copyright 2024 Endless OS Foundation LLC <maintainers@endlessos.org>
+ *
+ * SPDX-License-Identifier: LGPL-2.1-or-later
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <gio/gio.h>
+#include <glib.h>
+#include <ostree.h>
+
+G_BEGIN_DECLS
+
+/**
+ * EosSysrootSnapshot:
+ * @sysroot_path: path of the sysroot the snapshot was taken from
+ * @booted_checksum: checksum of the commit in the booted (or faked, in tests)
+ *    deployment
+ * @booted_commit: (nullable): the booted commit variant, or %NULL if it is
+ *    missing from the local repository
+ *
+ * An immutable view of the state of the booted deployment, taken when the
+ * sysroot was last loaded. Snapshots are handed out by #EosSysrootCache and are
+ * shared between worker threads, so they must not be modified.
+ *
+ * #OstreeSysroot is not thread safe, so a snapshot deliberately holds only
+ * plain data copied out of the sysroot it was loaded from, and not the sysroot
+ * itself. Callers which need an #OstreeSysroot must create their own from
+ * @sysroot_path.
+ */
+typedef struct
+{
+  /*< private >*/
+  gint ref_count;
+
+  /*< public >*/
+  GFile *sysroot_path;  /* (owned) */
+  gchar *booted_checksum;  /* (owned) */
+  GVariant *booted_commit;  /* (owned) (nullable) */
+
+  /*< private >*/
+  gchar *booted_refspec;  /* (owned) (nullable) */
+  gchar *booted_remote;  /* (owned) (nullable) */
+  gchar *booted_ref;  /* (owned) (nullable) */
+  OstreeCollectionRef *booted_collection_ref;  /* (owned) (nullable) */
+  GError *booted_refspec_error;  /* (owned) (nullable) */
+} EosSysrootSnapshot;
+
+EosSysrootSnapshot *eos_sysroot_snapshot_ref (EosSysrootSnapshot *snapshot);
+void eos_sysroot_snapshot_unref (EosSysrootSnapshot *snapshot);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (EosSysrootSnapshot, eos_sysroot_snapshot_unref)
+
+gboolean eos_sysroot_snapshot_get_booted_refspec (EosSysrootSnapshot   *snapshot,
+                                                  gchar               **out_refspec,
+                                                  gchar               **out_remote,
+                                                  gchar               **out_ref,
+                                                  OstreeCollectionRef **out_collection_ref,
+                                                  GError              **error);
+
+#define EOS_TYPE_SYSROOT_CACHE eos_sysroot_cache_get_type ()
+G_DECLARE_FINAL_TYPE (EosSysrootCache,
+                      eos_sysroot_cache,
+                      EOS,
+                      SYSROOT_CACHE,
+                      GObject)
+
+EosSysrootCache *eos_sysroot_cache_new (void);
+
+EosSysrootSnapshot *eos_sysroot_cache_dup_snapshot (EosSysrootCache  *self,
+                                                    GCancellable     *cancellable,
+                                                    GError          **error);
+
+void eos_sysroot_cache_invalidate (EosSysrootCache *self);
+
+G_END_DECLS
@@ -0,0 +1,176 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * Copyright 2024 Endless OS Foundation LLC
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library; if not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: LGPL-2.1-or-later
+ */
+
+#include <eos-updater/broken-deltas.h>
+#include <gio/gio.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <libeos-updater-util/util.h>
+#include <locale.h>
+
+#define FROM_CHECKSUM "d6fe1a4b9e2b0c7f4f0c4c4b4f1f0e7a5c4e3d2b1a0f9e8d7c6b5a4f3e2d1c0b"
+#define TO_CHECKSUM "0b1c2d3e4f5a6b7c8d9e0f1a2b3c4d5e6f7a8b9c0d1e2f3a4b5c6d7e8f9a0b1c"
+
+typedef struct
+{
+  gchar *tmp_dir;  /* (owned) */
+  gchar *path;  /* (owned) */
+} Fixture;
+
+static void
+setup (Fixture       *fixture,
+       gconstpointer  test_data)
+{
+  g_autoptr(GError) error = NULL;
+
+  fixture->tmp_dir = g_dir_make_tmp ("eos-updater-test-broken-deltas-XXXXXX", &error);
+  g_assert_no_error (error);
+
+  /* Use a subdirectory to check that eos_broken_deltas_add() creates it. */
+  fixture->path = g_build_filename (fixture->tmp_dir, "lib", "broken-static-deltas", NULL);
+  g_setenv ("EOS_UPDATER_TEST_UPDATER_BROKEN_DELTAS_PATH", fixture->path, TRUE);
+}
+
+static void
+teardown (Fixture       *fixture,
+          gconstpointer  test_data)
+{
+  g_autoptr(GFile) tmp_dir = g_file_new_for_path (fixture->tmp_dir);
+  g_autoptr(GError) error = NULL;
+
+  eos_updater_remove_recursive (tmp_dir, NULL, &error);
+  g_assert_no_error (error);
+
+  g_unsetenv ("EOS_UPDATER_TEST_UPDATER_BROKEN_DELTAS_PATH");
+  g_free (fixture->path);
+  g_free (fixture->tmp_dir);
+}
+
+/* Test that a recorded delta is found, and only that one: the remote, both
+ * ends of the delta, and whether it’s a from-scratch delta all matter. */
+static void
+test_broken_deltas_record (Fixture       *fixture,
+                           gconstpointer  test_data)
+{
+  g_autoptr(GError) error = NULL;
+
+  /* Nothing has been recorded yet, and the file doesn’t exist. */
+  g_assert_false (eos_broken_deltas_contains ("eos", FROM_CHECKSUM, TO_CHECKSUM));
+
+  eos_broken_deltas_add ("eos", FROM_CHECKSUM, TO_CHECKSUM, &error);
+  g_assert_no_error (error);
+  g_assert_true (g_file_test (fixture->path, G_FILE_TEST_IS_REGULAR));
+
+  g_assert_true (eos_broken_deltas_contains ("eos", FROM_CHECKSUM, TO_CHECKSUM));
+  g_assert_false (eos_broken_deltas_contains ("other", FROM_CHECKSUM, TO_CHECKSUM));
+  g_assert_false (eos_broken_deltas_contains ("eos", TO_CHECKSUM, FROM_CHECKSUM));
+  g_assert_false (eos_broken_deltas_contains ("eos", NULL, TO_CHECKSUM));
+
+  /* From-scratch deltas, with an empty or %NULL from checksum. */
+  eos_broken_deltas_add ("eos", NULL, FROM_CHECKSUM, &error);
+  g_assert_no_error (error);
+
+  g_assert_true (eos_broken_deltas_contains ("eos", NULL, FROM_CHECKSUM));
+  g_assert_true (eos_broken_deltas_contains ("eos", "", FROM_CHECKSUM));
+  g_assert_false (eos_broken_deltas_contains ("eos", TO_CHECKSUM, FROM_CHECKSUM));
+
+  /* Adding the second record kept the first. */
+  g_assert_true (eos_broken_deltas_contains ("eos", FROM_CHECKSUM, TO_CHECKSUM));
+}
+
+/* Test that expired records are ignored, and dropped from the file when
+ * another delta is recorded. */
+static void
+test_broken_deltas_expiry (Fixture       *fixture,
+                           gconstpointer  test_data)
+{
+  g_autoptr(GKeyFile) key_file = g_key_file_new ();
+  g_autofree gchar *group_name = g_strdup_printf ("eos %s-%s", FROM_CHECKSUM, TO_CHECKSUM);
+  gint64 now = g_get_real_time () / G_USEC_PER_SEC;
+  g_autoptr(GError) error = NULL;
+
+  /* Record a delta, then make its record expire. */
+  eos_broken_deltas_add ("eos", FROM_CHECKSUM, TO_CHECKSUM, &error);
+  g_assert_no_error (error);
+  g_assert_true (eos_broken_deltas_contains ("eos", FROM_CHECKSUM, TO_CHECKSUM));
+
+  g_key_file_load_from_file (key_file, fixture->path, G_KEY_FILE_NONE, &error);
+  g_assert_no_error (error);
+  g_assert_true (g_key_file_has_group (key_file, group_name));
+  g_assert_cmpint (g_key_file_get_int64 (key_file, group_name, "Expires", NULL), >, now);
+
+  g_key_file_set_int64 (key_file, group_name, "Expires", now - 1);
+  g_key_file_save_to_file (key_file, fixture->path, &error);
+  g_assert_no_error (error);
+
+  g_assert_false (eos_broken_deltas_contains ("eos", FROM_CHECKSUM, TO_CHECKSUM));
+
+  /* Recording another delta prunes the expired record. */
+  eos_broken_deltas_add ("eos", NULL, TO_CHECKSUM, &error);
+  g_assert_no_error (error);
+
+  g_key_file_load_from_file (key_file, fixture->path, G_KEY_FILE_NONE, &error);
+  g_assert_no_error (error);
+  g_assert_false (g_key_file_has_group (key_file, group_name));
+  g_assert_true (eos_broken_deltas_contains ("eos", NULL, TO_CHECKSUM));
+  g_assert_false (eos_broken_deltas_contains ("eos", FROM_CHECKSUM, TO_CHECKSUM));
+
+  /* Recording the expired delta again makes it current. */
+  eos_broken_deltas_add ("eos", FROM_CHECKSUM, TO_CHECKSUM, &error);
+  g_assert_no_error (error);
+  g_assert_true (eos_broken_deltas_contains ("eos", FROM_CHECKSUM, TO_CHECKSUM));
+}
+
+/* Test that a corrupt record is treated as empty by
+ * eos_broken_deltas_contains(), but not overwritten by eos_broken_deltas_add(). */
+static void
+test_broken_deltas_invalid (Fixture       *fixture,
+                            gconstpointer  test_data)
+{
+  g_autofree gchar *dir = g_path_get_dirname (fixture->path);
+  g_autoptr(GError) error = NULL;
+
+  g_assert_cmpint (g_mkdir_with_parents (dir, 0755), ==, 0);
+  g_file_set_contents (fixture->path, "not a key file", -1, &error);
+  g_assert_no_error (error);
+
+  g_assert_false (eos_broken_deltas_contains ("eos", FROM_CHECKSUM, TO_CHECKSUM));
+
+  g_assert_false (eos_broken_deltas_add ("eos", FROM_CHECKSUM, TO_CHECKSUM, &error));
+  g_assert_error (error, G_KEY_FILE_ERROR, G_KEY_FILE_ERROR_PARSE);
+}
+
+int
+main (int   argc,
+      char *argv[])
+{
+  setlocale (LC_ALL, "");
+
+  g_test_init (&argc, &argv, G_TEST_OPTION_ISOLATE_DIRS, NULL);
+
+  g_test_add ("/broken-deltas/record", Fixture, NULL, setup,
+              test_broken_deltas_record, teardown);
+  g_test_add ("/broken-deltas/expiry", Fixture, NULL, setup,
+              test_broken_deltas_expiry, teardown);
+  g_test_add ("/broken-deltas/invalid", Fixture, NULL, setup,
+              test_broken_deltas_invalid, teardown);
+
+  return g_test_run ();
+}
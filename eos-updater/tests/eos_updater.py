@@ -102,6 +102,8 @@ def load(mock, parameters):
                 dbus.Boolean(parameters.get('UpdateIsUserVisible', False)),
             'ReleaseNotesUri':
                 dbus.String(parameters.get('ReleaseNotesUri', '')),
+            'UpdateRolloutPercentage':
+                dbus.UInt32(parameters.get('UpdateRolloutPercentage', 100)),
             'DownloadSize': dbus.Int64(parameters.get('DownloadSize', 0)),
             'DownloadedBytes':
                 dbus.Int64(parameters.get('DownloadedBytes', 0)),
@@ -110,6 +112,15 @@ def load(mock, parameters):
                 dbus.Int64(parameters.get('FullDownloadSize', 0)),
             'FullUnpackedSize':
                 dbus.Int64(parameters.get('FullUnpackedSize', 0)),
+            'DownloadRate': dbus.Int64(parameters.get('DownloadRate', 0)),
+            'DownloadTimeRemaining':
+                dbus.Int64(parameters.get('DownloadTimeRemaining', -1)),
+            'FetchedObjects':
+                dbus.UInt32(parameters.get('FetchedObjects', 0)),
+            'RequestedObjects':
+                dbus.UInt32(parameters.get('RequestedObjects', 0)),
+            'FetchPhase': dbus.String(parameters.get('FetchPhase', '')),
+            'FetchSource': dbus.String(parameters.get('FetchSource', '')),
             'ErrorCode': dbus.UInt32(parameters.get('ErrorCode', 0)),
             'ErrorName': dbus.String(parameters.get('ErrorName', '')),
             'ErrorMessage': dbus.String(parameters.get('ErrorMessage', '')),
@@ -390,6 +401,14 @@ def FinishFetch(self, success_cb, error_cb):
             self.__set_properties(self, MAIN_IFACE, {
                 'DownloadedBytes':
                     dbus.Int64(downloaded_bytes, variant_level=1),
+                # Each step is simulated to take 100ms.
+                'DownloadRate':
+                    dbus.Int64(download_size / 10.0, variant_level=1),
+                'DownloadTimeRemaining':
+                    dbus.Int64((100 - i) / 10, variant_level=1),
+                'FetchedObjects': dbus.UInt32(i, variant_level=1),
+                'RequestedObjects': dbus.UInt32(100, variant_level=1),
+                'FetchPhase': dbus.String('objects', variant_level=1),
             })
 
             i += 1
@@ -400,6 +419,13 @@ def FinishFetch(self, success_cb, error_cb):
 
             # When the download is complete, change the service state and
             # finish the asynchronous FinishFetch() call.
+            self.__set_properties(self, MAIN_IFACE, {
+                'DownloadRate': dbus.Int64(0, variant_level=1),
+                'DownloadTimeRemaining': dbus.Int64(-1, variant_level=1),
+                'FetchedObjects': dbus.UInt32(0, variant_level=1),
+                'RequestedObjects': dbus.UInt32(0, variant_level=1),
+                'FetchPhase': dbus.String('', variant_level=1),
+            })
             self.__change_state(self, UpdaterState.UPDATE_READY)
             success_cb()
             return False
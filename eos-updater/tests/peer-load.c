@@ -0,0 +1,193 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * Copyright 2024 Endless OS Foundation LLC
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library; if not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: LGPL-2.1-or-later
+ */
+
+#include <avahi-common/strlst.h>
+#include <eos-updater/peer-load.h>
+#include <gio/gio.h>
+#include <glib.h>
+#include <libeos-updater-util/avahi-service-file.h>
+#include <locale.h>
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (AvahiStringList, avahi_string_list_free)
+
+static AvahiStringList *
+txt_new_with_hint_value (const guint8 *value,
+                         gsize         value_size)
+{
+  AvahiStringList *txt = NULL;
+
+  txt = avahi_string_list_add_pair (txt, "v", "1");
+  txt = avahi_string_list_add_pair_arbitrary (txt,
+                                              EOS_OSTREE_AVAHI_LOAD_HINT_TXT_KEY,
+                                              value, value_size);
+  txt = avahi_string_list_add_pair (txt, "rb", "unused");
+
+  return txt;
+}
+
+/* Test that a load hint can be found in a set of TXT records and parsed. */
+static void
+test_peer_load_hint_from_txt (void)
+{
+  const EosOstreeAvahiLoadHint expected = { 300, EOS_OSTREE_AVAHI_LOAD_CAPACITY_LOW, FALSE };
+  g_autoptr(GBytes) bytes = eos_ostree_avahi_load_hint_to_bytes (&expected);
+  g_autoptr(AvahiStringList) txt = NULL;
+  EosOstreeAvahiLoadHint hint;
+  g_autoptr(GError) error = NULL;
+  gboolean success;
+
+  txt = txt_new_with_hint_value (g_bytes_get_data (bytes, NULL),
+                                 g_bytes_get_size (bytes));
+
+  success = eos_peer_load_hint_from_txt (txt, &hint, &error);
+  g_assert_no_error (error);
+  g_assert_true (success);
+
+  g_assert_cmpuint (hint.active_streams, ==, expected.active_streams);
+  g_assert_cmpint (hint.capacity, ==, expected.capacity);
+  g_assert_cmpint (hint.saturated, ==, expected.saturated);
+}
+
+/* Test that a missing load hint TXT record is reported as such. */
+static void
+test_peer_load_hint_from_txt_missing (void)
+{
+  g_autoptr(AvahiStringList) txt = NULL;
+  EosOstreeAvahiLoadHint hint;
+  g_autoptr(GError) error = NULL;
+
+  /* No TXT records at all. */
+  g_assert_false (eos_peer_load_hint_from_txt (NULL, &hint, &error));
+  g_assert_error (error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND);
+  g_clear_error (&error);
+
+  /* Other TXT records only. */
+  txt = avahi_string_list_add_pair (NULL, "v", "1");
+  g_assert_false (eos_peer_load_hint_from_txt (txt, &hint, &error));
+  g_assert_error (error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND);
+  g_clear_error (&error);
+  g_clear_pointer (&txt, avahi_string_list_free);
+
+  /* The key with no value. */
+  txt = avahi_string_list_add (NULL, EOS_OSTREE_AVAHI_LOAD_HINT_TXT_KEY);
+  g_assert_false (eos_peer_load_hint_from_txt (txt, &hint, &error));
+  g_assert_error (error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND);
+}
+
+/* Test that invalid load hints from the network are rejected. */
+static void
+test_peer_load_hint_from_txt_invalid (void)
+{
+  const struct
+    {
+      const guint8 *value;
+      gsize value_size;
+    }
+  vectors[] =
+    {
+      /* Empty. */
+      { (const guint8 *) "", 0 },
+      /* Too short. */
+      { (const guint8 *) "\x00\x01\x03", 3 },
+      /* Too long. */
+      { (const guint8 *) "\x00\x01\x03\x00\x00", 5 },
+      /* Unknown capacity. */
+      { (const guint8 *) "\x00\x01\x63\x00", 4 },
+      /* Boolean not in normal form. */
+      { (const guint8 *) "\x00\x01\x03\x02", 4 },
+    };
+  gsize i;
+
+  for (i = 0; i < G_N_ELEMENTS (vectors); i++)
+    {
+      g_autoptr(AvahiStringList) txt = NULL;
+      EosOstreeAvahiLoadHint hint;
+      g_autoptr(GError) error = NULL;
+
+      g_test_message ("Vector %" G_GSIZE_FORMAT, i);
+
+      txt = txt_new_with_hint_value (vectors[i].value, vectors[i].value_size);
+
+      g_assert_false (eos_peer_load_hint_from_txt (txt, &hint, &error));
+      g_assert_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA);
+    }
+}
+
+/* Test that peers are ranked by saturation, then capacity, then active
+ * streams, and that peers without a load hint rank as medium capacity. */
+static void
+test_peer_load_hint_compare (void)
+{
+  /* In order from least to most loaded. */
+  const EosOstreeAvahiLoadHint vectors[] =
+    {
+      { 0, EOS_OSTREE_AVAHI_LOAD_CAPACITY_HIGH, FALSE },
+      { 1, EOS_OSTREE_AVAHI_LOAD_CAPACITY_HIGH, FALSE },
+      { 0, EOS_OSTREE_AVAHI_LOAD_CAPACITY_MEDIUM, FALSE },
+      { 5, EOS_OSTREE_AVAHI_LOAD_CAPACITY_MEDIUM, FALSE },
+      { 1, EOS_OSTREE_AVAHI_LOAD_CAPACITY_LOW, FALSE },
+      { 2, EOS_OSTREE_AVAHI_LOAD_CAPACITY_LOW, FALSE },
+      /* Saturated peers come last, even if they claim spare capacity. */
+      { 0, EOS_OSTREE_AVAHI_LOAD_CAPACITY_HIGH, TRUE },
+      { 6, EOS_OSTREE_AVAHI_LOAD_CAPACITY_NONE, TRUE },
+    };
+  gsize i, j;
+
+  for (i = 0; i < G_N_ELEMENTS (vectors); i++)
+    {
+      g_test_message ("Vector %" G_GSIZE_FORMAT, i);
+
+      g_assert_cmpint (eos_peer_load_hint_compare (&vectors[i], &vectors[i]), ==, 0);
+
+      for (j = i + 1; j < G_N_ELEMENTS (vectors); j++)
+        {
+          g_assert_cmpint (eos_peer_load_hint_compare (&vectors[i], &vectors[j]), <, 0);
+          g_assert_cmpint (eos_peer_load_hint_compare (&vectors[j], &vectors[i]), >, 0);
+        }
+    }
+
+  /* Without a hint, a peer ranks as medium capacity, and as its active
+   * streams are unknown, it ties with any other medium capacity peer. */
+  g_assert_cmpint (eos_peer_load_hint_compare (NULL, NULL), ==, 0);
+  g_assert_cmpint (eos_peer_load_hint_compare (&vectors[1], NULL), <, 0);
+  g_assert_cmpint (eos_peer_load_hint_compare (NULL, &vectors[1]), >, 0);
+  g_assert_cmpint (eos_peer_load_hint_compare (&vectors[2], NULL), ==, 0);
+  g_assert_cmpint (eos_peer_load_hint_compare (NULL, &vectors[3]), ==, 0);
+  g_assert_cmpint (eos_peer_load_hint_compare (NULL, &vectors[4]), <, 0);
+  g_assert_cmpint (eos_peer_load_hint_compare (&vectors[6], NULL), >, 0);
+}
+
+int
+main (int   argc,
+      char *argv[])
+{
+  setlocale (LC_ALL, "");
+
+  g_test_init (&argc, &argv, NULL);
+
+  g_test_add_func ("/peer-load/hint-from-txt", test_peer_load_hint_from_txt);
+  g_test_add_func ("/peer-load/hint-from-txt/missing",
+                   test_peer_load_hint_from_txt_missing);
+  g_test_add_func ("/peer-load/hint-from-txt/invalid",
+                   test_peer_load_hint_from_txt_invalid);
+  g_test_add_func ("/peer-load/hint-compare", test_peer_load_hint_compare);
+
+  return g_test_run ();
+}
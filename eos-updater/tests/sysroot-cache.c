@@ -0,0 +1,330 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * Copyright 2024 Endless OS Foundation LLC
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library; if not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: LGPL-2.1-or-later
+ */
+
+#include <eos-updater/sysroot-cache.h>
+#include <gio/gio.h>
+#include <glib.h>
+#include <libeos-updater-util/util.h>
+#include <locale.h>
+#include <ostree.h>
+#include <string.h>
+
+#define OSNAME "eos"
+#define REMOTE_NAME "eos"
+#define REF "os/eos/amd64/test"
+
+/* Maximum time to wait for a deployment change to be noticed. */
+#define MONITOR_TIMEOUT_SECONDS 30
+
+/* The cache always uses the default sysroot, and libostree only reads
+ * `OSTREE_SYSROOT` once per process, so all the tests share one sysroot, set
+ * up in main(). */
+static gchar *sysroot_dir = NULL;  /* (owned) */
+static gchar *deployed_checksum = NULL;  /* (owned) */
+
+static void
+write_file (GFile       *root,
+            const gchar *rel_path,
+            const gchar *contents)
+{
+  g_autoptr(GFile) file = g_file_resolve_relative_path (root, rel_path);
+  g_autoptr(GFile) parent = g_file_get_parent (file);
+  g_autoptr(GError) error = NULL;
+
+  g_file_make_directory_with_parents (parent, NULL, &error);
+  if (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_EXISTS))
+    g_clear_error (&error);
+  g_assert_no_error (error);
+
+  g_file_replace_contents (file, contents, strlen (contents), NULL, FALSE,
+                           G_FILE_CREATE_NONE, NULL, NULL, &error);
+  g_assert_no_error (error);
+}
+
+/* Deploy the commit for %REF, replacing any existing deployment. libostree
+ * bumps the mtime of `ostree/deploy` when it does this. */
+static void
+deploy (OstreeSysroot *sysroot)
+{
+  g_autoptr(GKeyFile) origin = NULL;
+  g_autoptr(OstreeDeployment) deployment = NULL;
+  g_autoptr(GError) error = NULL;
+
+  origin = ostree_sysroot_origin_new_from_refspec (sysroot, REMOTE_NAME ":" REF);
+  ostree_sysroot_deploy_tree (sysroot, OSNAME, deployed_checksum, origin,
+                              NULL, NULL, &deployment, NULL, &error);
+  g_assert_no_error (error);
+
+  ostree_sysroot_simple_write_deployment (sysroot, OSNAME, deployment, NULL,
+                                          OSTREE_SYSROOT_SIMPLE_WRITE_DEPLOYMENT_FLAGS_NONE,
+                                          NULL, &error);
+  g_assert_no_error (error);
+}
+
+/* Set up a sysroot in @sysroot_dir with a single deployment of a minimal
+ * commit. */
+static void
+set_up_sysroot (void)
+{
+  g_autoptr(GFile) sysroot_path = g_file_new_for_path (sysroot_dir);
+  g_autoptr(OstreeSysroot) sysroot = ostree_sysroot_new (sysroot_path);
+  g_autoptr(OstreeRepo) repo = NULL;
+  g_autoptr(GKeyFile) config = NULL;
+  g_autofree gchar *tree_dir = NULL;
+  g_autoptr(GFile) tree = NULL;
+  g_autoptr(OstreeMutableTree) mtree = NULL;
+  g_autoptr(GFile) root = NULL;
+  g_autoptr(GError) error = NULL;
+
+  ostree_sysroot_ensure_initialized (sysroot, NULL, &error);
+  g_assert_no_error (error);
+  ostree_sysroot_init_osname (sysroot, OSNAME, NULL, &error);
+  g_assert_no_error (error);
+  ostree_sysroot_load (sysroot, NULL, &error);
+  g_assert_no_error (error);
+  ostree_sysroot_get_repo (sysroot, &repo, NULL, &error);
+  g_assert_no_error (error);
+
+  /* Only write boot loader spec entries. */
+  config = ostree_repo_copy_config (repo);
+  g_key_file_set_string (config, "sysroot", "bootloader", "none");
+  ostree_repo_write_config (repo, config, &error);
+  g_assert_no_error (error);
+
+  ostree_repo_remote_add (repo, REMOTE_NAME, "http://127.0.0.1/", NULL, NULL, &error);
+  g_assert_no_error (error);
+
+  /* Commit a tree with just enough in it to be deployable. */
+  tree_dir = g_build_filename (sysroot_dir, "tree", NULL);
+  tree = g_file_new_for_path (tree_dir);
+  write_file (tree, "usr/lib/modules/1.0/vmlinuz", "kernel");
+  write_file (tree, "usr/lib/modules/1.0/initramfs.img", "initramfs");
+  write_file (tree, "usr/etc/os-release", "ID=eos\n");
+
+  ostree_repo_prepare_transaction (repo, NULL, NULL, &error);
+  g_assert_no_error (error);
+
+  mtree = ostree_mutable_tree_new ();
+  ostree_repo_write_directory_to_mtree (repo, tree, mtree, NULL, NULL, &error);
+  g_assert_no_error (error);
+  ostree_repo_write_mtree (repo, mtree, &root, NULL, &error);
+  g_assert_no_error (error);
+  ostree_repo_write_commit (repo, NULL, "Test commit", NULL, NULL,
+                            OSTREE_REPO_FILE (root), &deployed_checksum,
+                            NULL, &error);
+  g_assert_no_error (error);
+  ostree_repo_transaction_set_ref (repo, REMOTE_NAME, REF, deployed_checksum);
+
+  ostree_repo_commit_transaction (repo, NULL, NULL, &error);
+  g_assert_no_error (error);
+
+  deploy (sysroot);
+}
+
+/* Test that a snapshot is cached, and is for the booted deployment. */
+static void
+test_sysroot_cache_hit (void)
+{
+  g_autoptr(EosSysrootCache) cache = eos_sysroot_cache_new ();
+  g_autoptr(EosSysrootSnapshot) snapshot1 = NULL;
+  g_autoptr(EosSysrootSnapshot) snapshot2 = NULL;
+  g_autofree gchar *booted_refspec = NULL;
+  g_autoptr(GError) error = NULL;
+
+  snapshot1 = eos_sysroot_cache_dup_snapshot (cache, NULL, &error);
+  g_assert_no_error (error);
+  g_assert_nonnull (snapshot1);
+
+  g_assert_cmpstr (g_file_peek_path (snapshot1->sysroot_path), ==, sysroot_dir);
+  g_assert_cmpstr (snapshot1->booted_checksum, ==, deployed_checksum);
+  g_assert_nonnull (snapshot1->booted_commit);
+
+  eos_sysroot_snapshot_get_booted_refspec (snapshot1, &booted_refspec, NULL,
+                                           NULL, NULL, &error);
+  g_assert_no_error (error);
+  g_assert_cmpstr (booted_refspec, ==, REMOTE_NAME ":" REF);
+
+  snapshot2 = eos_sysroot_cache_dup_snapshot (cache, NULL, &error);
+  g_assert_no_error (error);
+  g_assert_true (snapshot2 == snapshot1);
+}
+
+/* Test that invalidating the cache causes the sysroot to be reloaded, without
+ * affecting snapshots which have already been handed out. */
+static void
+test_sysroot_cache_reload (void)
+{
+  g_autoptr(EosSysrootCache) cache = eos_sysroot_cache_new ();
+  g_autoptr(EosSysrootSnapshot) snapshot1 = NULL;
+  g_autoptr(EosSysrootSnapshot) snapshot2 = NULL;
+  g_autoptr(EosSysrootSnapshot) snapshot3 = NULL;
+  g_autoptr(GError) error = NULL;
+
+  snapshot1 = eos_sysroot_cache_dup_snapshot (cache, NULL, &error);
+  g_assert_no_error (error);
+
+  eos_sysroot_cache_invalidate (cache);
+
+  snapshot2 = eos_sysroot_cache_dup_snapshot (cache, NULL, &error);
+  g_assert_no_error (error);
+  g_assert_true (snapshot2 != snapshot1);
+  g_assert_cmpstr (snapshot2->booted_checksum, ==, deployed_checksum);
+  g_assert_cmpstr (snapshot1->booted_checksum, ==, deployed_checksum);
+
+  /* The reloaded snapshot is cached in turn. */
+  snapshot3 = eos_sysroot_cache_dup_snapshot (cache, NULL, &error);
+  g_assert_no_error (error);
+  g_assert_true (snapshot3 == snapshot2);
+}
+
+static gboolean
+monitor_timeout_cb (gpointer user_data)
+{
+  gboolean *timed_out = user_data;
+
+  *timed_out = TRUE;
+  return G_SOURCE_REMOVE;
+}
+
+/* Test that the cache is invalidated when the deployments change, without
+ * eos_sysroot_cache_invalidate() being called. */
+static void
+test_sysroot_cache_deployment_change (void)
+{
+  g_autoptr(EosSysrootCache) cache = eos_sysroot_cache_new ();
+  g_autoptr(EosSysrootSnapshot) snapshot1 = NULL;
+  g_autoptr(EosSysrootSnapshot) snapshot2 = NULL;
+  g_autoptr(GFile) sysroot_path = g_file_new_for_path (sysroot_dir);
+  g_autoptr(OstreeSysroot) sysroot = ostree_sysroot_new (sysroot_path);
+  gboolean timed_out = FALSE;
+  guint timeout_id;
+  g_autoptr(GError) error = NULL;
+
+  snapshot1 = eos_sysroot_cache_dup_snapshot (cache, NULL, &error);
+  g_assert_no_error (error);
+
+  ostree_sysroot_load (sysroot, NULL, &error);
+  g_assert_no_error (error);
+  deploy (sysroot);
+
+  /* Change notifications arrive in the main context the cache was created
+   * in. */
+  timeout_id = g_timeout_add_seconds (MONITOR_TIMEOUT_SECONDS,
+                                      monitor_timeout_cb, &timed_out);
+
+  while (TRUE)
+    {
+      snapshot2 = eos_sysroot_cache_dup_snapshot (cache, NULL, &error);
+      g_assert_no_error (error);
+
+      if (snapshot2 != snapshot1 || timed_out)
+        break;
+
+      g_clear_pointer (&snapshot2, eos_sysroot_snapshot_unref);
+      g_main_context_iteration (NULL, TRUE);
+    }
+
+  g_assert_false (timed_out);
+  g_source_remove (timeout_id);
+
+  g_assert_true (snapshot2 != snapshot1);
+  g_assert_cmpstr (snapshot2->booted_checksum, ==, deployed_checksum);
+}
+
+#define N_THREADS 4
+#define N_ITERATIONS 50
+
+static gpointer
+dup_snapshots_thread_cb (gpointer user_data)
+{
+  EosSysrootCache *cache = user_data;
+  gsize i;
+
+  for (i = 0; i < N_ITERATIONS; i++)
+    {
+      g_autoptr(EosSysrootSnapshot) snapshot = NULL;
+      g_autoptr(GError) error = NULL;
+
+      snapshot = eos_sysroot_cache_dup_snapshot (cache, NULL, &error);
+      g_assert_no_error (error);
+      g_assert_cmpstr (snapshot->booted_checksum, ==, deployed_checksum);
+    }
+
+  return NULL;
+}
+
+/* Test that snapshots can be taken from several threads at once while the
+ * cache is being invalidated, as happens with concurrent Poll() and
+ * PollVolume() calls. */
+static void
+test_sysroot_cache_threads (void)
+{
+  g_autoptr(EosSysrootCache) cache = eos_sysroot_cache_new ();
+  GThread *threads[N_THREADS];
+  gsize i;
+
+  for (i = 0; i < G_N_ELEMENTS (threads); i++)
+    threads[i] = g_thread_new ("sysroot-cache-test", dup_snapshots_thread_cb, cache);
+
+  for (i = 0; i < N_ITERATIONS; i++)
+    eos_sysroot_cache_invalidate (cache);
+
+  for (i = 0; i < G_N_ELEMENTS (threads); i++)
+    g_thread_join (threads[i]);
+}
+
+int
+main (int   argc,
+      char *argv[])
+{
+  g_autoptr(GFile) sysroot_file = NULL;
+  g_autoptr(GError) error = NULL;
+  int retval;
+
+  setlocale (LC_ALL, "");
+
+  g_test_init (&argc, &argv, NULL);
+
+  sysroot_dir = g_dir_make_tmp ("eos-updater-test-sysroot-cache-XXXXXX", &error);
+  g_assert_no_error (error);
+
+  g_setenv ("OSTREE_SYSROOT", sysroot_dir, TRUE);
+  g_setenv ("OSTREE_SYSROOT_DEBUG", "mutable-deployments", TRUE);
+  g_setenv ("EOS_UPDATER_TEST_UPDATER_DEPLOYMENT_FALLBACK", "1", TRUE);
+
+  set_up_sysroot ();
+
+  g_test_add_func ("/sysroot-cache/hit", test_sysroot_cache_hit);
+  g_test_add_func ("/sysroot-cache/reload", test_sysroot_cache_reload);
+  g_test_add_func ("/sysroot-cache/deployment-change",
+                   test_sysroot_cache_deployment_change);
+  g_test_add_func ("/sysroot-cache/threads", test_sysroot_cache_threads);
+
+  retval = g_test_run ();
+
+  sysroot_file = g_file_new_for_path (sysroot_dir);
+  eos_updater_remove_recursive (sysroot_file, NULL, &error);
+  g_assert_no_error (error);
+
+  g_free (deployed_checksum);
+  g_free (sysroot_dir);
+
+  return retval;
+}
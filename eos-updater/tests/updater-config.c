@@ -0,0 +1,175 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * Copyright 2024 Endless OS Foundation LLC
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library; if not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: LGPL-2.1-or-later
+ */
+
+#include <eos-updater/updater-config.h>
+#include <gio/gio.h>
+#include <glib.h>
+#include <libeos-updater-util/util.h>
+#include <locale.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+typedef struct
+{
+  gchar *tmp_dir;  /* (owned) */
+  gchar *path;  /* (owned) */
+} Fixture;
+
+static void
+setup (Fixture       *fixture,
+       gconstpointer  test_data)
+{
+  g_autoptr(GError) error = NULL;
+
+  fixture->tmp_dir = g_dir_make_tmp ("eos-updater-test-updater-config-XXXXXX", &error);
+  g_assert_no_error (error);
+
+  fixture->path = g_build_filename (fixture->tmp_dir, "eos-updater.conf", NULL);
+  g_setenv ("EOS_UPDATER_TEST_UPDATER_CONFIG_FILE_PATH", fixture->path, TRUE);
+}
+
+static void
+teardown (Fixture       *fixture,
+          gconstpointer  test_data)
+{
+  g_autoptr(GFile) tmp_dir = g_file_new_for_path (fixture->tmp_dir);
+  g_autoptr(GError) error = NULL;
+
+  eos_updater_remove_recursive (tmp_dir, NULL, &error);
+  g_assert_no_error (error);
+
+  g_unsetenv ("EOS_UPDATER_TEST_UPDATER_CONFIG_FILE_PATH");
+  g_free (fixture->path);
+  g_free (fixture->tmp_dir);
+}
+
+static void
+write_worker_priority (Fixture     *fixture,
+                       const gchar *priority)
+{
+  g_autofree gchar *contents = g_strdup_printf ("[Scheduling]\n"
+                                                "WorkerPriority=%s\n",
+                                                priority);
+  g_autoptr(GError) error = NULL;
+
+  g_file_set_contents (fixture->path, contents, -1, &error);
+  g_assert_no_error (error);
+}
+
+/* Test that background operations use the configured worker priority, and
+ * that user-initiated ones are escalated to normal priority whatever it is. */
+static void
+test_worker_priority_configured (Fixture       *fixture,
+                                 gconstpointer  test_data)
+{
+  const struct
+    {
+      const gchar *config_value;
+      EosUpdaterThreadPriority expected_background;
+    }
+  vectors[] =
+    {
+      { "normal", EOS_UPDATER_THREAD_PRIORITY_NORMAL },
+      { "low", EOS_UPDATER_THREAD_PRIORITY_LOW },
+      { "idle", EOS_UPDATER_THREAD_PRIORITY_IDLE },
+    };
+  gsize i;
+
+  for (i = 0; i < G_N_ELEMENTS (vectors); i++)
+    {
+      g_test_message ("WorkerPriority=%s", vectors[i].config_value);
+      write_worker_priority (fixture, vectors[i].config_value);
+
+      g_assert_cmpint (eos_updater_get_worker_thread_priority (FALSE), ==,
+                       vectors[i].expected_background);
+      g_assert_cmpint (eos_updater_get_worker_thread_priority (TRUE), ==,
+                       EOS_UPDATER_THREAD_PRIORITY_NORMAL);
+    }
+}
+
+/* Test that the default configuration deprioritises background operations,
+ * but not user-initiated ones. */
+static void
+test_worker_priority_default (Fixture       *fixture,
+                              gconstpointer  test_data)
+{
+  g_assert_false (g_file_test (fixture->path, G_FILE_TEST_EXISTS));
+
+  g_assert_cmpint (eos_updater_get_worker_thread_priority (FALSE), ==,
+                   EOS_UPDATER_THREAD_PRIORITY_IDLE);
+  g_assert_cmpint (eos_updater_get_worker_thread_priority (TRUE), ==,
+                   EOS_UPDATER_THREAD_PRIORITY_NORMAL);
+}
+
+static gint
+get_thread_nice_value (void)
+{
+  return getpriority (PRIO_PROCESS, (id_t) syscall (SYS_gettid));
+}
+
+/* Test that a user-initiated operation on a worker thread which was last used
+ * for a background operation runs at normal priority, and that the background
+ * priority is restored afterwards. */
+static void
+test_worker_priority_escalation (Fixture       *fixture,
+                                 gconstpointer  test_data)
+{
+  g_auto(EosUpdaterThreadPriorityState) background_state = EOS_UPDATER_THREAD_PRIORITY_STATE_CLEARED;
+
+  write_worker_priority (fixture, "low");
+
+  /* Lowering the priority is always allowed. */
+  eos_updater_set_worker_thread_priority (FALSE, &background_state);
+  g_assert_cmpint (get_thread_nice_value (), ==, 10);
+
+    {
+      g_auto(EosUpdaterThreadPriorityState) user_state = EOS_UPDATER_THREAD_PRIORITY_STATE_CLEARED;
+
+      eos_updater_set_worker_thread_priority (TRUE, &user_state);
+
+      /* Raising it again needs CAP_SYS_NICE, unless RLIMIT_NICE allows it. */
+      if (get_thread_nice_value () != 0)
+        {
+          g_test_skip ("Not allowed to raise thread priority");
+          return;
+        }
+    }
+
+  g_assert_cmpint (get_thread_nice_value (), ==, 10);
+}
+
+int
+main (int   argc,
+      char *argv[])
+{
+  setlocale (LC_ALL, "");
+
+  g_test_init (&argc, &argv, G_TEST_OPTION_ISOLATE_DIRS, NULL);
+
+  g_test_add ("/updater-config/worker-priority/configured", Fixture, NULL,
+              setup, test_worker_priority_configured, teardown);
+  g_test_add ("/updater-config/worker-priority/default", Fixture, NULL,
+              setup, test_worker_priority_default, teardown);
+  g_test_add ("/updater-config/worker-priority/escalation", Fixture, NULL,
+              setup, test_worker_priority_escalation, teardown);
+
+  return g_test_run ();
+}
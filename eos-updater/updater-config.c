@@ -0,0 +1,128 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * Copyright 2024 Endless OS Foundation LLC <maintainers@endlessos.org>
+ *
+ * SPDX-License-Identifier: LGPL-2.1-or-later
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <eos-updater/resources.h>
+#include <eos-updater/updater-config.h>
+#include <glib.h>
+#include <libeos-updater-util/config-util.h>
+#include <libeos-updater-util/util.h>
+
+static const gchar *const CONFIG_FILE_PATH = SYSCONFDIR "/eos-updater/eos-updater.conf";
+static const gchar *const LOCAL_CONFIG_FILE_PATH = PREFIX "/local/share/eos-updater/eos-updater.conf";
+static const gchar *const STATIC_CONFIG_FILE_PATH = DATADIR "/eos-updater/eos-updater.conf";
+
+static const gchar *
+get_config_file_path (void)
+{
+  return eos_updater_get_envvar_or ("EOS_UPDATER_TEST_UPDATER_CONFIG_FILE_PATH",
+                                    CONFIG_FILE_PATH);
+}
+
+/**
+ * eos_updater_config_file_new:
+ *
+ * Create an #EuuConfigFile for `eos-updater.conf`, falling back to the copies
+ * in `/usr/local` and `/usr`, and finally to the defaults compiled into the
+ * daemon. The files are only loaded when a key is first looked up, so this is
+ * cheap enough to call at the start of each operation; changes to the
+ * configuration then take effect without restarting the daemon.
+ *
+ * Returns: (transfer full): the loaded configuration
+ */
+EuuConfigFile *
+eos_updater_config_file_new (void)
+{
+  const gchar * const paths[] =
+    {
+      get_config_file_path (),  /* typically CONFIG_FILE_PATH unless testing */
+      LOCAL_CONFIG_FILE_PATH,
+      STATIC_CONFIG_FILE_PATH,
+      NULL
+    };
+
+  return euu_config_file_new (paths, eos_updater_resources_get_resource (),
+                              "/com/endlessm/Updater/config/eos-updater.conf");
+}
+
+/**
+ * eos_updater_get_worker_thread_priority:
+ * @user_initiated: %TRUE if the operation was explicitly requested by the
+ *    user, and hence should not be deprioritised
+ *
+ * Get the priority to run a worker thread at. This is the `WorkerPriority`
+ * configuration key for background operations, or
+ * %EOS_UPDATER_THREAD_PRIORITY_NORMAL if @user_initiated is %TRUE, since then
+ * the user is waiting for the operation to finish.
+ *
+ * Returns: priority for the worker thread
+ */
+EosUpdaterThreadPriority
+eos_updater_get_worker_thread_priority (gboolean user_initiated)
+{
+  EosUpdaterThreadPriority priority = EOS_UPDATER_THREAD_PRIORITY_NORMAL;
+  g_autoptr(EuuConfigFile) config = NULL;
+  g_autofree gchar *priority_str = NULL;
+  g_autoptr(GError) local_error = NULL;
+
+  if (user_initiated)
+    return EOS_UPDATER_THREAD_PRIORITY_NORMAL;
+
+  config = eos_updater_config_file_new ();
+  priority_str = euu_config_file_get_string (config, "Scheduling",
+                                             "WorkerPriority", &local_error);
+  if (priority_str == NULL ||
+      !eos_updater_thread_priority_from_string (priority_str, &priority,
+                                                &local_error))
+    {
+      g_warning ("Error loading worker priority from configuration; "
+                 "using idle priority: %s", local_error->message);
+      return EOS_UPDATER_THREAD_PRIORITY_IDLE;
+    }
+
+  return priority;
+}
+
+/**
+ * eos_updater_set_worker_thread_priority:
+ * @user_initiated: %TRUE if the operation was explicitly requested by the
+ *    user, and hence should not be deprioritised
+ * @out_old_state: (out caller-allocates): return location for the thread’s
+ *    previous priority
+ *
+ * Set the priority of the calling worker thread to that returned by
+ * eos_updater_get_worker_thread_priority(). The process’ own priority (set by
+ * its systemd unit) is overridden either way.
+ *
+ * Errors are not fatal: the operation will just run at the inherited priority.
+ * @out_old_state must be restored using
+ * eos_updater_thread_priority_state_restore() before the thread returns.
+ */
+void
+eos_updater_set_worker_thread_priority (gboolean                       user_initiated,
+                                        EosUpdaterThreadPriorityState *out_old_state)
+{
+  EosUpdaterThreadPriority priority = eos_updater_get_worker_thread_priority (user_initiated);
+  g_autoptr(GError) local_error = NULL;
+
+  if (!eos_updater_set_thread_priority (priority, out_old_state, &local_error))
+    g_message ("Running worker thread at inherited priority: %s",
+               local_error->message);
+}
@@ -0,0 +1,36 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * Copyright 2024 Endless OS Foundation LLC <maintainers@endlessos.org>
+ *
+ * SPDX-License-Identifier: LGPL-2.1-or-later
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <glib.h>
+#include <libeos-updater-util/config-util.h>
+#include <libeos-updater-util/util.h>
+
+G_BEGIN_DECLS
+
+EuuConfigFile *eos_updater_config_file_new (void);
+
+EosUpdaterThreadPriority eos_updater_get_worker_thread_priority (gboolean user_initiated);
+
+void eos_updater_set_worker_thread_priority (gboolean                       user_initiated,
+                                             EosUpdaterThreadPriorityState *out_old_state);
+
+G_END_DECLS
@@ -57,6 +57,7 @@ static const char *LOCAL_CONFIG_FILE_PATH = PREFIX "/local/share/eos-updater/eos
 /* Configuration file keys. */
 static const char *LOCAL_NETWORK_UPDATES_GROUP = "Local Network Updates";
 static const char *ADVERTISE_UPDATES_KEY = "AdvertiseUpdates";
+static const char *MAX_ACTIVE_STREAMS_KEY = "MaxActiveStreams";
 
 static const gchar *REPOSITORY_GROUP = "Repository ";  /* should be followed by an integer */
 static const gchar *PATH_KEY = "Path";
@@ -110,12 +111,46 @@ repository_configs_contains_index (GPtrArray *repository_configs,
   return FALSE;
 }
 
+/**
+ * eus_get_config_file_paths:
+ * @config_file_path: (nullable): path to the configuration file to load, or
+ *    %NULL to use the default search paths
+ *
+ * Get the paths which eus_read_config_file() will load the configuration from
+ * for the given @config_file_path, in priority order. This is intended for
+ * callers which need to watch the configuration for changes.
+ *
+ * Returns: (transfer full) (array zero-terminated=1): configuration file paths
+ * Since: UNRELEASED
+ */
+GStrv
+eus_get_config_file_paths (const gchar *config_file_path)
+{
+  const gchar * const default_paths[] =
+    {
+      CONFIG_FILE_PATH,
+      LOCAL_CONFIG_FILE_PATH,
+      STATIC_CONFIG_FILE_PATH,
+      NULL
+    };
+  const gchar * const override_paths[] =
+    {
+      config_file_path,
+      STATIC_CONFIG_FILE_PATH,
+      NULL
+    };
+
+  return g_strdupv ((gchar **) ((config_file_path != NULL) ? override_paths : default_paths));
+}
+
 /**
  * eus_read_config_file:
  * @config_file_path: (nullable): path to the configuration file, or %NULL to
  *    use the system search paths
  * @out_advertise_updates: (out caller-allocates) (optional): return location
  *    for the `AdvertiseUpdates=` parameter
+ * @out_max_active_streams: (out caller-allocates) (optional): return location
+ *    for the `MaxActiveStreams=` parameter
  * @out_repository_configs: (out callee-allocates) (transfer container)
  *    (element-type EusRepoConfig) (optional): return location for the
  *    `[Repository 0–65535]` sections
@@ -127,7 +162,8 @@ repository_configs_contains_index (GPtrArray *repository_configs,
  * [`eos-update-server.conf(5)`](man:eos-update-server.conf(5)).
  *
  * The configuration values loaded from the file will be returned in
- * @out_advertise_updates and @out_repository_configs. See
+ * @out_advertise_updates, @out_max_active_streams and @out_repository_configs.
+ * See
  * [`eos-update-server.conf(5)`](man:eos-update-server.conf(5)) for the
  * semantics of the options.
  *
@@ -140,32 +176,22 @@ repository_configs_contains_index (GPtrArray *repository_configs,
 gboolean
 eus_read_config_file (const gchar  *config_file_path,
                       gboolean     *out_advertise_updates,
+                      guint        *out_max_active_streams,
                       GPtrArray   **out_repository_configs,
                       GError      **error)
 {
   g_autoptr(EuuConfigFile) config = NULL;
   g_autoptr(GError) local_error = NULL;
-  const gchar * const default_paths[] =
-    {
-      CONFIG_FILE_PATH,
-      LOCAL_CONFIG_FILE_PATH,
-      STATIC_CONFIG_FILE_PATH,
-      NULL
-    };
-  const gchar * const override_paths[] =
-    {
-      config_file_path,
-      STATIC_CONFIG_FILE_PATH,
-      NULL
-    };
+  g_auto(GStrv) paths = eus_get_config_file_paths (config_file_path);
   g_auto(GStrv) groups = NULL;
   gsize n_groups, i;
   gboolean advertise_updates;
+  guint max_active_streams;
   g_autoptr(GPtrArray) repository_configs = NULL;
 
   g_return_val_if_fail (error == NULL || *error == NULL, FALSE);
 
-  config = euu_config_file_new ((config_file_path != NULL) ? override_paths : default_paths,
+  config = euu_config_file_new ((const gchar * const *) paths,
                                 eus_resources_get_resource (),
                                 "/com/endlessm/Updater/config/eos-update-server.conf");
 
@@ -179,6 +205,17 @@ eus_read_config_file (const gchar  *config_file_path,
       return FALSE;
     }
 
+  max_active_streams = euu_config_file_get_uint (config,
+                                                 LOCAL_NETWORK_UPDATES_GROUP,
+                                                 MAX_ACTIVE_STREAMS_KEY,
+                                                 1, G_MAXUINT16,
+                                                 &local_error);
+  if (local_error != NULL)
+    {
+      g_propagate_error (error, g_steal_pointer (&local_error));
+      return FALSE;
+    }
+
   /* Load all the repositories configured in all the config files. Note that
    * this means it’s currently impossible to disable a repository config from
    * one config file in another config file which has higher priority. If that’s
@@ -240,6 +277,8 @@ eus_read_config_file (const gchar  *config_file_path,
   /* Success. */
   if (out_advertise_updates != NULL)
     *out_advertise_updates = advertise_updates;
+  if (out_max_active_streams != NULL)
+    *out_max_active_streams = max_active_streams;
   if (out_repository_configs != NULL)
     *out_repository_configs = g_steal_pointer (&repository_configs);
 
@@ -60,7 +60,10 @@ G_DEFINE_AUTOPTR_CLEANUP_FUNC (EusRepoConfig, eus_repo_config_free)
 
 gboolean eus_read_config_file (const gchar  *config_file_path,
                                gboolean     *out_advertise_updates,
+                               guint        *out_max_active_streams,
                                GPtrArray   **out_repository_configs,
                                GError      **error);
 
+GStrv eus_get_config_file_paths (const gchar *config_file_path);
+
 G_END_DECLS
@@ -0,0 +1,109 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * Copyright 2024 Endless OS Foundation LLC
+ *
+ * SPDX-License-Identifier: LGPL-2.1-or-later
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include <glib.h>
+#include <libeos-update-server/load-hint.h>
+#include <libeos-updater-util/avahi-service-file.h>
+
+/**
+ * eus_load_hint_compute:
+ * @pending_requests: number of requests the server is currently serving
+ * @max_active_streams: number of requests the server can serve at once
+ * @out_hint: (out caller-allocates): return location for the load hint
+ *
+ * Work out the load hint to advertise for a server with @pending_requests out
+ * of @max_active_streams in use. The spare capacity is split into thirds; a
+ * server with no spare streams is saturated.
+ */
+void
+eus_load_hint_compute (guint                   pending_requests,
+                       guint                   max_active_streams,
+                       EosOstreeAvahiLoadHint *out_hint)
+{
+  guint free_streams = (pending_requests < max_active_streams) ? max_active_streams - pending_requests : 0;
+
+  g_return_if_fail (out_hint != NULL);
+
+  out_hint->active_streams = (guint16) MIN (pending_requests, G_MAXUINT16);
+  out_hint->saturated = (free_streams == 0);
+
+  if (free_streams == 0)
+    out_hint->capacity = EOS_OSTREE_AVAHI_LOAD_CAPACITY_NONE;
+  else if ((guint64) free_streams * 3 > (guint64) max_active_streams * 2)
+    out_hint->capacity = EOS_OSTREE_AVAHI_LOAD_CAPACITY_HIGH;
+  else if ((guint64) free_streams * 3 > max_active_streams)
+    out_hint->capacity = EOS_OSTREE_AVAHI_LOAD_CAPACITY_MEDIUM;
+  else
+    out_hint->capacity = EOS_OSTREE_AVAHI_LOAD_CAPACITY_LOW;
+}
+
+/**
+ * eus_load_hint_equal:
+ * @a: a load hint
+ * @b: another load hint
+ *
+ * Check whether @a and @b advertise the same state. @active_streams is not
+ * compared: it changes with almost every request and is only informational,
+ * so the load hint file (and hence the mDNS records) is only rewritten when
+ * the capacity class or saturated state changes.
+ *
+ * Returns: %TRUE if @a and @b advertise the same state, %FALSE otherwise
+ */
+gboolean
+eus_load_hint_equal (const EosOstreeAvahiLoadHint *a,
+                     const EosOstreeAvahiLoadHint *b)
+{
+  g_return_val_if_fail (a != NULL, FALSE);
+  g_return_val_if_fail (b != NULL, FALSE);
+
+  return (a->capacity == b->capacity &&
+          !a->saturated == !b->saturated);
+}
+
+/**
+ * eus_load_hint_get_write_delay:
+ * @last_write_time: wall clock time the load hint file was last written, in
+ *    microseconds, or 0 if it has never been written
+ * @now: current wall clock time, in microseconds
+ *
+ * Work out how long to wait before the load hint file can be written again,
+ * so that it’s not written more than once every
+ * %EUS_LOAD_HINT_MIN_INTERVAL_SECONDS. If the clock has gone backwards since
+ * @last_write_time, don’t wait for it to catch up.
+ *
+ * Returns: number of seconds to wait, or 0 to write the file now
+ */
+guint
+eus_load_hint_get_write_delay (gint64 last_write_time,
+                               gint64 now)
+{
+  gint64 elapsed = now - last_write_time;
+
+  if (last_write_time == 0 || elapsed < 0 ||
+      elapsed >= EUS_LOAD_HINT_MIN_INTERVAL_SECONDS * G_USEC_PER_SEC)
+    return 0;
+
+  /* Round up, so the interval has definitely passed by the time the delay
+   * expires. */
+  return (guint) (EUS_LOAD_HINT_MIN_INTERVAL_SECONDS -
+                  elapsed / G_USEC_PER_SEC);
+}
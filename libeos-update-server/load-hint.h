@@ -0,0 +1,45 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * Copyright 2024 Endless OS Foundation LLC
+ *
+ * SPDX-License-Identifier: LGPL-2.1-or-later
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <glib.h>
+#include <libeos-updater-util/avahi-service-file.h>
+
+G_BEGIN_DECLS
+
+/**
+ * EUS_LOAD_HINT_MIN_INTERVAL_SECONDS:
+ *
+ * Minimum interval between updates to the load hint file. Each update causes
+ * eos-updater-avahi to regenerate the Avahi service file, and Avahi to
+ * re-announce the service on the network, so this must not be too short.
+ */
+#define EUS_LOAD_HINT_MIN_INTERVAL_SECONDS 60
+
+void eus_load_hint_compute (guint                   pending_requests,
+                            guint                   max_active_streams,
+                            EosOstreeAvahiLoadHint *out_hint);
+gboolean eus_load_hint_equal (const EosOstreeAvahiLoadHint *a,
+                              const EosOstreeAvahiLoadHint *b);
+guint eus_load_hint_get_write_delay (gint64 last_write_time,
+                                     gint64 now);
+
+G_END_DECLS
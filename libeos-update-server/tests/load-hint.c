@@ -0,0 +1,144 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * Copyright 2024 Endless OS Foundation LLC
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library; if not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: LGPL-2.1-or-later
+ */
+
+#include <glib.h>
+#include <libeos-update-server/load-hint.h>
+#include <libeos-updater-util/avahi-service-file.h>
+#include <locale.h>
+
+/* Test that the capacity class is chosen from the number of free streams, and
+ * that a server with no free streams is saturated. */
+static void
+test_load_hint_compute (void)
+{
+  const struct
+    {
+      guint pending_requests;
+      guint max_active_streams;
+      EosOstreeAvahiLoadCapacity expected_capacity;
+      gboolean expected_saturated;
+    }
+  vectors[] =
+    {
+      { 0, 6, EOS_OSTREE_AVAHI_LOAD_CAPACITY_HIGH, FALSE },
+      { 1, 6, EOS_OSTREE_AVAHI_LOAD_CAPACITY_HIGH, FALSE },
+      { 2, 6, EOS_OSTREE_AVAHI_LOAD_CAPACITY_MEDIUM, FALSE },
+      { 3, 6, EOS_OSTREE_AVAHI_LOAD_CAPACITY_MEDIUM, FALSE },
+      { 4, 6, EOS_OSTREE_AVAHI_LOAD_CAPACITY_LOW, FALSE },
+      { 5, 6, EOS_OSTREE_AVAHI_LOAD_CAPACITY_LOW, FALSE },
+      { 6, 6, EOS_OSTREE_AVAHI_LOAD_CAPACITY_NONE, TRUE },
+      /* More requests than streams, e.g. if the limit was lowered. */
+      { 10, 6, EOS_OSTREE_AVAHI_LOAD_CAPACITY_NONE, TRUE },
+      { 0, 1, EOS_OSTREE_AVAHI_LOAD_CAPACITY_HIGH, FALSE },
+      { 1, 1, EOS_OSTREE_AVAHI_LOAD_CAPACITY_NONE, TRUE },
+      { 0, 0, EOS_OSTREE_AVAHI_LOAD_CAPACITY_NONE, TRUE },
+      /* Clamped to fit in the TXT record. */
+      { G_MAXUINT16 + 1, G_MAXUINT, EOS_OSTREE_AVAHI_LOAD_CAPACITY_HIGH, FALSE },
+    };
+  gsize i;
+
+  for (i = 0; i < G_N_ELEMENTS (vectors); i++)
+    {
+      EosOstreeAvahiLoadHint hint;
+
+      g_test_message ("Vector %" G_GSIZE_FORMAT ": %u of %u streams",
+                      i, vectors[i].pending_requests,
+                      vectors[i].max_active_streams);
+
+      eus_load_hint_compute (vectors[i].pending_requests,
+                             vectors[i].max_active_streams, &hint);
+
+      g_assert_cmpint (hint.capacity, ==, vectors[i].expected_capacity);
+      g_assert_cmpint (hint.saturated, ==, vectors[i].expected_saturated);
+      g_assert_cmpuint (hint.active_streams, ==,
+                        MIN (vectors[i].pending_requests, G_MAXUINT16));
+    }
+}
+
+/* Test that only changes to the capacity class or saturated state count as
+ * changes to the load hint. */
+static void
+test_load_hint_equal (void)
+{
+  EosOstreeAvahiLoadHint a, b;
+
+  eus_load_hint_compute (0, 6, &a);
+  eus_load_hint_compute (1, 6, &b);
+  g_assert_cmpuint (a.active_streams, !=, b.active_streams);
+  g_assert_true (eus_load_hint_equal (&a, &b));
+  g_assert_true (eus_load_hint_equal (&b, &a));
+
+  eus_load_hint_compute (2, 6, &b);
+  g_assert_false (eus_load_hint_equal (&a, &b));
+
+  eus_load_hint_compute (6, 6, &a);
+  eus_load_hint_compute (7, 6, &b);
+  g_assert_true (eus_load_hint_equal (&a, &b));
+
+  /* Saturated with spare capacity can’t come out of
+   * eus_load_hint_compute(), but it must still count as a change. */
+  b = a;
+  b.saturated = FALSE;
+  g_assert_false (eus_load_hint_equal (&a, &b));
+}
+
+/* Test that the load hint file is written at most once per interval. */
+static void
+test_load_hint_write_delay (void)
+{
+  const gint64 interval = EUS_LOAD_HINT_MIN_INTERVAL_SECONDS * G_USEC_PER_SEC;
+  const gint64 last = 1000 * G_USEC_PER_SEC;
+
+  /* Never written before. */
+  g_assert_cmpuint (eus_load_hint_get_write_delay (0, last), ==, 0);
+
+  /* Written just now: wait the full interval. */
+  g_assert_cmpuint (eus_load_hint_get_write_delay (last, last), ==,
+                    EUS_LOAD_HINT_MIN_INTERVAL_SECONDS);
+
+  /* Part way through the interval: wait for the rest of it, rounded up. */
+  g_assert_cmpuint (eus_load_hint_get_write_delay (last, last + 10 * G_USEC_PER_SEC), ==,
+                    EUS_LOAD_HINT_MIN_INTERVAL_SECONDS - 10);
+  g_assert_cmpuint (eus_load_hint_get_write_delay (last, last + 10 * G_USEC_PER_SEC + 1), ==,
+                    EUS_LOAD_HINT_MIN_INTERVAL_SECONDS - 10);
+  g_assert_cmpuint (eus_load_hint_get_write_delay (last, last + interval - 1), ==, 1);
+
+  /* Interval has passed. */
+  g_assert_cmpuint (eus_load_hint_get_write_delay (last, last + interval), ==, 0);
+  g_assert_cmpuint (eus_load_hint_get_write_delay (last, last + 10 * interval), ==, 0);
+
+  /* Clock has gone backwards. */
+  g_assert_cmpuint (eus_load_hint_get_write_delay (last, last - 1), ==, 0);
+}
+
+int
+main (int   argc,
+      char *argv[])
+{
+  setlocale (LC_ALL, "");
+
+  g_test_init (&argc, &argv, NULL);
+
+  g_test_add_func ("/load-hint/compute", test_load_hint_compute);
+  g_test_add_func ("/load-hint/equal", test_load_hint_equal);
+  g_test_add_func ("/load-hint/write-delay", test_load_hint_write_delay);
+
+  return g_test_run ();
+}
@@ -68,47 +68,61 @@ try_update_application (FlatpakInstallation       *installation,
   return TRUE;
 }
 
+/* Check that @remote_name is the remote configured for @collection_id, if
+ * there is one, so an install action can’t pull from the wrong remote. */
+static gboolean
+check_remote_for_collection_id (FlatpakInstallation  *installation,
+                                const gchar          *collection_id,
+                                const gchar          *remote_name,
+                                GError              **error)
+{
+  g_autofree gchar *candidate_remote_name = NULL;
+
+  g_assert (remote_name != NULL);
+
+  if (collection_id == NULL)
+    return TRUE;
+
+  g_message ("Finding remote name for %s", collection_id);
+
+  /* Ignore errors here. We always have the @remote_name to use. */
+  candidate_remote_name = euu_lookup_flatpak_remote_for_collection_id (installation,
+                                                                       collection_id,
+                                                                       NULL);
+
+  if (candidate_remote_name != NULL &&
+      g_strcmp0 (remote_name, candidate_remote_name) != 0)
+    {
+      g_set_error (error,
+                   EOS_UPDATER_ERROR,
+                   EOS_UPDATER_ERROR_FLATPAK_REMOTE_CONFLICT,
+                   "Specified flatpak remote ‘%s’ conflicts with the remote "
+                   "detected for collection ID ‘%s’ (‘%s’), cannot continue.",
+                   remote_name,
+                   collection_id,
+                   candidate_remote_name);
+      return FALSE;
+    }
+
+  g_message ("Remote name for %s is %s", collection_id, remote_name);
+
+  return TRUE;
+}
+
 static gboolean
 try_install_application (FlatpakInstallation       *installation,
                          const gchar               *collection_id,
-                         const gchar               *in_remote_name,
+                         const gchar               *remote_name,
                          FlatpakRef                *ref,
                          EosUpdaterInstallerFlags   flags,
                          GError                   **error)
 {
   g_autofree gchar *formatted_ref = flatpak_ref_format_ref (ref);
-  g_autofree gchar *candidate_remote_name = NULL;
-  const gchar *remote_name = in_remote_name;
   gboolean no_pull = !(flags & EU_INSTALLER_FLAGS_ALSO_PULL);
   g_autoptr(GError) local_error = NULL;
 
-  g_assert (in_remote_name != NULL);
-
-  if (collection_id != NULL)
-    {
-      g_message ("Finding remote name for %s", collection_id);
-
-      /* Ignore errors here. We always have the @in_remote_name to use. */
-      candidate_remote_name = euu_lookup_flatpak_remote_for_collection_id (installation,
-                                                                           collection_id,
-                                                                           NULL);
-
-      if (candidate_remote_name != NULL &&
-          g_strcmp0 (in_remote_name, candidate_remote_name) != 0)
-        {
-          g_set_error (error,
-                       EOS_UPDATER_ERROR,
-                       EOS_UPDATER_ERROR_FLATPAK_REMOTE_CONFLICT,
-                       "Specified flatpak remote ‘%s’ conflicts with the remote "
-                       "detected for collection ID ‘%s’ (‘%s’), cannot continue.",
-                       in_remote_name,
-                       collection_id,
-                       candidate_remote_name);
-          return FALSE;
-        }
-
-      g_message ("Remote name for %s is %s", collection_id, remote_name);
-    }
+  if (!check_remote_for_collection_id (installation, collection_id, remote_name, error))
+    return FALSE;
 
   g_message ("Attempting to install %s:%s", remote_name, formatted_ref);
 
@@ -209,6 +223,181 @@ perform_action (FlatpakInstallation        *installation,
     }
 }
 
+/* Work out how many of the @actions, starting at index @start, can be applied
+ * together in a single transaction. This is the longest run of actions of the
+ * same type on distinct refs: each type of action needs different transaction
+ * settings (see perform_action_batch()), and keeping the types apart keeps
+ * the ordering of uninstalls relative to installs. #FlatpakTransaction orders
+ * the actions within a run by their dependencies itself. The result is always
+ * at least 1. */
+static guint
+plan_action_batch (GPtrArray *actions  /* (element-type EuuFlatpakRemoteRefAction) */,
+                   guint      start)
+{
+  g_autoptr(GHashTable) refs = g_hash_table_new (euu_flatpak_ref_hash, euu_flatpak_ref_equal);
+  const EuuFlatpakRemoteRefAction *first_action = g_ptr_array_index (actions, start);
+  guint end;
+
+  for (end = start; end < actions->len; end++)
+    {
+      const EuuFlatpakRemoteRefAction *action = g_ptr_array_index (actions, end);
+
+      if (action->type != first_action->type ||
+          !g_hash_table_add (refs, action->ref->ref))
+        break;
+    }
+
+  return end - start;
+}
+
+/* Add @action to @transaction, with the same fallbacks as perform_action():
+ * updating or uninstalling a ref which is not installed does nothing.
+ * Installing a ref which is already installed updates it instead, but that
+ * needs different transaction settings, so the formatted ref is added to
+ * @already_installed for the caller to update separately. */
+static gboolean
+transaction_add_action (FlatpakTransaction         *transaction,
+                        FlatpakInstallation        *installation,
+                        EuuFlatpakRemoteRefAction  *action,
+                        GPtrArray                  *already_installed  /* (element-type utf8) */,
+                        GError                    **error)
+{
+  g_autofree gchar *formatted_ref = flatpak_ref_format_ref (action->ref->ref);
+  const gchar *remote_name = action->ref->remote;
+  g_autoptr(GError) local_error = NULL;
+
+  switch (action->type)
+    {
+      case EUU_FLATPAK_REMOTE_REF_ACTION_INSTALL:
+        if (!check_remote_for_collection_id (installation,
+                                             action->ref->collection_id,
+                                             remote_name,
+                                             error))
+          return FALSE;
+
+        if (flatpak_transaction_add_install (transaction,
+                                             remote_name,
+                                             formatted_ref,
+                                             NULL, /* subpaths */
+                                             &local_error))
+          return TRUE;
+
+        if (!g_error_matches (local_error, FLATPAK_ERROR, FLATPAK_ERROR_ALREADY_INSTALLED))
+          {
+            g_propagate_error (error, g_steal_pointer (&local_error));
+            return FALSE;
+          }
+
+        g_message ("%s:%s already installed, updating", remote_name, formatted_ref);
+        g_ptr_array_add (already_installed, g_steal_pointer (&formatted_ref));
+        return TRUE;
+      case EUU_FLATPAK_REMOTE_REF_ACTION_UPDATE:
+        if (flatpak_transaction_add_update (transaction,
+                                            formatted_ref,
+                                            NULL, /* subpaths */
+                                            NULL, /* commit */
+                                            &local_error))
+          return TRUE;
+        break;
+      case EUU_FLATPAK_REMOTE_REF_ACTION_UNINSTALL:
+        if (flatpak_transaction_add_uninstall (transaction,
+                                               formatted_ref,
+                                               &local_error))
+          return TRUE;
+        break;
+      default:
+        g_assert_not_reached ();
+    }
+
+  if (g_error_matches (local_error, FLATPAK_ERROR, FLATPAK_ERROR_NOT_INSTALLED))
+    {
+      g_message ("%s is not installed, so not %s", formatted_ref,
+                 (action->type == EUU_FLATPAK_REMOTE_REF_ACTION_UPDATE) ? "updating" : "uninstalling");
+      return TRUE;
+    }
+
+  g_propagate_error (error, g_steal_pointer (&local_error));
+  return FALSE;
+}
+
+/* Apply the @n_actions actions from @actions starting at index @start in a
+ * single transaction, as planned by plan_action_batch(). The transaction
+ * settings match those perform_action() uses for the type of the actions.
+ * On failure, any subset of the actions may have been applied. */
+static gboolean
+perform_action_batch (FlatpakInstallation       *installation,
+                      GPtrArray                 *actions  /* (element-type EuuFlatpakRemoteRefAction) */,
+                      guint                      start,
+                      guint                      n_actions,
+                      EosUpdaterInstallerFlags   flags,
+                      GError                   **error)
+{
+  g_autoptr(FlatpakTransaction) transaction = NULL;
+  g_autoptr(GPtrArray) already_installed = g_ptr_array_new_with_free_func (g_free);
+  const EuuFlatpakRemoteRefAction *first_action = g_ptr_array_index (actions, start);
+  gboolean no_pull = !(flags & EU_INSTALLER_FLAGS_ALSO_PULL);
+  guint i;
+
+  transaction = flatpak_transaction_new_for_installation (installation, NULL, error);
+  if (transaction == NULL)
+    return FALSE;
+
+  flatpak_transaction_set_no_interaction (transaction, TRUE);
+
+  switch (first_action->type)
+    {
+      case EUU_FLATPAK_REMOTE_REF_ACTION_INSTALL:
+        flatpak_transaction_set_no_deploy (transaction, FALSE);
+        flatpak_transaction_set_no_pull (transaction, no_pull);
+        break;
+      case EUU_FLATPAK_REMOTE_REF_ACTION_UPDATE:
+        flatpak_transaction_set_no_deploy (transaction, FALSE);
+        flatpak_transaction_set_no_pull (transaction, no_pull);
+        flatpak_transaction_set_disable_prune (transaction, TRUE);
+        break;
+      case EUU_FLATPAK_REMOTE_REF_ACTION_UNINSTALL:
+        flatpak_transaction_set_disable_prune (transaction, TRUE);
+        break;
+      default:
+        g_assert_not_reached ();
+    }
+
+  for (i = start; i < start + n_actions; i++)
+    {
+      if (!transaction_add_action (transaction, installation,
+                                   g_ptr_array_index (actions, i),
+                                   already_installed, error))
+        return FALSE;
+    }
+
+  if (!flatpak_transaction_is_empty (transaction))
+    {
+      g_message ("Attempting to apply %u actions in one transaction", n_actions);
+
+      if (!euu_flatpak_transaction_run (transaction, NULL, error))
+        return FALSE;
+    }
+
+  /* Update the refs which were to be installed but already are, as
+   * try_install_application() does. */
+  for (i = 0; i < already_installed->len; i++)
+    {
+      const gchar *formatted_ref = g_ptr_array_index (already_installed, i);
+
+      if (!euu_flatpak_transaction_update (installation,
+                                           formatted_ref,
+                                           FALSE, /* no_deploy */
+                                           no_pull,
+                                           TRUE, /* no_prune */
+                                           NULL, /* cancellable */
+                                           error))
+        return FALSE;
+    }
+
+  g_message ("Successfully applied %u actions", n_actions);
+  return TRUE;
+}
+
 static void
 complain_about_failure_to_update_system_installation_counter (const gchar  *failing_name,
                                                               const gchar  *counter_path,
@@ -306,6 +495,11 @@ update_counter_complain_on_error (const gchar *failing_name,
  * @state_counter_path to the last successfully applied action. The actions are
  * only actually performed if @mode is set to %EU_INSTALLER_MODE_PERFORM.
  *
+ * Runs of independent actions are applied together in a single transaction.
+ * If such a transaction fails, its actions are retried one at a time, so the
+ * state counter still records exactly the actions before the first one which
+ * fails.
+ *
  * Returns: %TRUE on success, %FALSE otherwise
  */
 gboolean
@@ -316,7 +510,7 @@ eufi_apply_flatpak_ref_actions (FlatpakInstallation       *installation,
                                 EosUpdaterInstallerFlags   flags,
                                 GError                   **error)
 {
-  gsize i;
+  guint i, j, n_batched;
   g_autoptr(GHashTable) new_progresses = g_hash_table_new_full (g_str_hash, g_str_equal, NULL, NULL);
 
   g_return_val_if_fail (FLATPAK_IS_INSTALLATION (installation), FALSE);
@@ -325,36 +519,62 @@ eufi_apply_flatpak_ref_actions (FlatpakInstallation       *installation,
   g_return_val_if_fail (mode != EU_INSTALLER_MODE_CHECK, FALSE);
   g_return_val_if_fail (error == NULL || *error == NULL, FALSE);
 
-  for (i = 0; i < actions->len; ++i)
+  for (i = 0; i < actions->len; i += n_batched)
     {
-      EuuFlatpakRemoteRefAction *pending_action = g_ptr_array_index (actions, i);
-      const gchar *source = pending_action->source;
-      gboolean is_dependency = (pending_action->flags & EUU_FLATPAK_REMOTE_REF_ACTION_FLAG_IS_DEPENDENCY) != 0;
+      gboolean batch_applied = FALSE;
 
-      /* Dependencies should not be passed through this function - they
-       * were meant to be deployed earlier. Uninstall dependencies will
-       * be handled implicitly. Allow them if we’re running
-       * `eos-updater-flatpak-installer --mode deploy --pull` manually though. */
-      g_assert (!is_dependency || flags & EU_INSTALLER_FLAGS_ALSO_PULL);
+      n_batched = 1;
 
       /* Only perform actions if we’re in the "perform" mode. Otherwise
        * we just pretend to perform actions and update the counter
        * accordingly */
-      if (mode == EU_INSTALLER_MODE_PERFORM &&
-          !perform_action (installation, pending_action, flags, error))
+      if (mode == EU_INSTALLER_MODE_PERFORM)
         {
-          /* If we fail, we should still update the state of the counter
-           * to the last successful one before we get out. This is to ensure
-           * that we don’t perform the same action again next time. */
-          update_counter_complain_on_error (source,
-                                            state_counter_path,
-                                            new_progresses);
-          return FALSE;
+          g_autoptr(GError) batch_error = NULL;
+
+          n_batched = plan_action_batch (actions, i);
+
+          if (n_batched > 1)
+            {
+              batch_applied = perform_action_batch (installation, actions,
+                                                    i, n_batched, flags,
+                                                    &batch_error);
+
+              if (!batch_applied)
+                g_message ("Failed to apply %u actions in one transaction, "
+                           "applying them one at a time: %s",
+                           n_batched, batch_error->message);
+            }
         }
 
-      g_hash_table_replace (new_progresses,
-                            (gpointer) source,
-                            GINT_TO_POINTER (pending_action->serial));
+      for (j = i; j < i + n_batched; j++)
+        {
+          EuuFlatpakRemoteRefAction *pending_action = g_ptr_array_index (actions, j);
+          const gchar *source = pending_action->source;
+          gboolean is_dependency = (pending_action->flags & EUU_FLATPAK_REMOTE_REF_ACTION_FLAG_IS_DEPENDENCY) != 0;
+
+          /* Dependencies should not be passed through this function - they
+           * were meant to be deployed earlier. Uninstall dependencies will
+           * be handled implicitly. Allow them if we’re running
+           * `eos-updater-flatpak-installer --mode deploy --pull` manually though. */
+          g_assert (!is_dependency || flags & EU_INSTALLER_FLAGS_ALSO_PULL);
+
+          if (mode == EU_INSTALLER_MODE_PERFORM && !batch_applied &&
+              !perform_action (installation, pending_action, flags, error))
+            {
+              /* If we fail, we should still update the state of the counter
+               * to the last successful one before we get out. This is to ensure
+               * that we don’t perform the same action again next time. */
+              update_counter_complain_on_error (source,
+                                                state_counter_path,
+                                                new_progresses);
+              return FALSE;
+            }
+
+          g_hash_table_replace (new_progresses,
+                                (gpointer) source,
+                                GINT_TO_POINTER (pending_action->serial));
+        }
     }
 
     /* Once we’re done, update the state of the counter, but bail out
@@ -367,44 +587,24 @@ eufi_apply_flatpak_ref_actions (FlatpakInstallation       *installation,
   return TRUE;
 }
 
+/* @installed_refs is the set of installed refs, from
+ * euu_flatpak_installation_list_installed_refs_set(). */
 static gboolean
-check_if_flatpak_is_installed (FlatpakInstallation        *installation,
-                               EuuFlatpakRemoteRefAction  *action,
-                               gboolean                   *out_is_installed,
-                               GError                    **error)
+check_if_flatpak_is_installed (GHashTable                 *installed_refs,
+                               EuuFlatpakRemoteRefAction  *action)
 {
-  g_autoptr(GError) local_error = NULL;
-  g_autoptr(FlatpakInstalledRef) installed_ref = NULL;
-  FlatpakRef *ref = action->ref->ref;
   g_autofree gchar *formatted_ref = flatpak_ref_format_ref (action->ref->ref);
-
-  g_return_val_if_fail (out_is_installed != NULL, FALSE);
+  gboolean is_installed;
 
   g_message ("Checking if flatpak described by ref %s is installed",
              formatted_ref);
 
-  installed_ref = flatpak_installation_get_installed_ref (installation,
-                                                          flatpak_ref_get_kind (ref),
-                                                          flatpak_ref_get_name (ref),
-                                                          flatpak_ref_get_arch (ref),
-                                                          flatpak_ref_get_branch (ref),
-                                                          NULL,
-                                                          &local_error);
-
-  if (installed_ref == NULL &&
-      !g_error_matches (local_error, FLATPAK_ERROR, FLATPAK_ERROR_NOT_INSTALLED))
-    {
-      g_propagate_error (error, g_steal_pointer (&local_error));
-      return FALSE;
-    }
-  g_clear_error (&local_error);
-
-  *out_is_installed = (installed_ref != NULL);
+  is_installed = g_hash_table_contains (installed_refs, action->ref->ref);
   g_message ("Flatpak described by ref %s is %s",
              formatted_ref,
-             *out_is_installed ? "installed": "not installed");
+             is_installed ? "installed": "not installed");
 
-  return TRUE;
+  return is_installed;
 }
 
 /**
@@ -425,28 +625,26 @@ eufi_check_ref_actions_applied (FlatpakInstallation  *installation,
                                 GPtrArray            *actions,
                                 GError              **error)
 {
-  g_autoptr(GError) local_error = NULL;
   g_autoptr(GString) deltas = g_string_new ("");
+  g_autoptr(GHashTable) installed_refs = NULL;
   gsize i;
 
   g_return_val_if_fail (installation != NULL, FALSE);
 
+  /* List the installed refs once, rather than querying each one separately. */
+  installed_refs = euu_flatpak_installation_list_installed_refs_set (installation, NULL, error);
+  if (installed_refs == NULL)
+    return FALSE;
+
   for (i = 0; i < actions->len; ++i)
     {
       EuuFlatpakRemoteRefAction *pending_action = g_ptr_array_index (actions, i);
       const gchar *name = pending_action->source;
-      gboolean is_installed;
 
       switch (pending_action->type)
         {
           case EUU_FLATPAK_REMOTE_REF_ACTION_INSTALL:
-            if (!check_if_flatpak_is_installed (installation,
-                                                pending_action,
-                                                &is_installed,
-                                                error))
-              return FALSE;
-
-            if (!is_installed)
+            if (!check_if_flatpak_is_installed (installed_refs, pending_action))
               {
                 g_autofree gchar *formatted_ref = flatpak_ref_format_ref (pending_action->ref->ref);
                 g_autofree gchar *msg = g_strdup_printf ("Flatpak %s should have been installed by "
@@ -457,13 +655,7 @@ eufi_check_ref_actions_applied (FlatpakInstallation  *installation,
               }
             break;
           case EUU_FLATPAK_REMOTE_REF_ACTION_UNINSTALL:
-            if (!check_if_flatpak_is_installed (installation,
-                                                pending_action,
-                                                &is_installed,
-                                                error))
-              return FALSE;
-
-            if (is_installed)
+            if (check_if_flatpak_is_installed (installed_refs, pending_action))
               {
                 g_autofree gchar *formatted_ref = flatpak_ref_format_ref (pending_action->ref->ref);
                 g_autofree gchar *msg = g_strdup_printf ("Flatpak %s should have been uninstalled by "
@@ -438,6 +438,98 @@ test_deploy_failure_resume_from_latest (FlatpakDeploymentsFixture *fixture,
   g_assert (g_file_test (directory_expected_to_fail_initially_path, G_FILE_TEST_EXISTS));
 }
 
+static EuuFlatpakRemoteRefAction *
+sample_flatpak_ref_action (const gchar                   *source,
+                           const gchar                   *name,
+                           EuuFlatpakRemoteRefActionType  action_type,
+                           gint32                         serial)
+{
+  g_autoptr(FlatpakRef) ref = g_object_new (FLATPAK_TYPE_REF,
+                                            "kind", FLATPAK_REF_KIND_APP,
+                                            "name", name,
+                                            "arch", euu_get_system_architecture_string (),
+                                            "branch", "stable",
+                                            NULL);
+  g_autoptr(EuuFlatpakLocationRef) location_ref = euu_flatpak_location_ref_new (ref,
+                                                                                "test-repo",
+                                                                                NULL);
+
+  return euu_flatpak_remote_ref_action_new (action_type,
+                                            location_ref,
+                                            source,
+                                            serial,
+                                            EUU_FLATPAK_REMOTE_REF_ACTION_FLAG_NONE);
+}
+
+/* Apply a mixture of installs and uninstalls from two sources, which will be
+ * split into several transactions, and check they are all applied and the
+ * counter for each source is updated. */
+static void
+test_deploy_mixed_actions (FlatpakDeploymentsFixture *fixture,
+                           gconstpointer              user G_GNUC_UNUSED)
+{
+  g_autoptr(GError) error = NULL;
+  g_autoptr(GPtrArray) actions = g_ptr_array_new_with_free_func ((GDestroyNotify) euu_flatpak_remote_ref_action_unref);
+  g_autofree gchar *state_counter_path = g_file_get_path (fixture->counter_file);
+  g_autoptr(FlatpakInstallation) installation = flatpak_installation_new_for_path (fixture->flatpak_installation_directory,
+                                                                                   TRUE,
+                                                                                   NULL,
+                                                                                   &error);
+  g_autofree gchar *installation_directory_path = g_file_get_path (fixture->flatpak_installation_directory);
+  const gchar *expected_installed[] = { "org.test.Test", "org.test.Test2", "org.test.Test3", NULL };
+  g_autofree gchar *uninstalled_path = g_build_filename (installation_directory_path,
+                                                         "app",
+                                                         "org.test.Preinstalled",
+                                                         NULL);
+  g_autoptr(GKeyFile) counter_key_file = g_key_file_new ();
+  gsize i;
+
+  g_assert_no_error (error);
+
+  g_ptr_array_add (actions, sample_flatpak_ref_action ("autoinstall", "org.test.Test",
+                                                       EUU_FLATPAK_REMOTE_REF_ACTION_INSTALL, 1));
+  g_ptr_array_add (actions, sample_flatpak_ref_action ("other", "org.test.Test2",
+                                                       EUU_FLATPAK_REMOTE_REF_ACTION_INSTALL, 5));
+  g_ptr_array_add (actions, sample_flatpak_ref_action ("autoinstall", "org.test.Preinstalled",
+                                                       EUU_FLATPAK_REMOTE_REF_ACTION_UNINSTALL, 2));
+  g_ptr_array_add (actions, sample_flatpak_ref_action ("autoinstall", "org.test.Test3",
+                                                       EUU_FLATPAK_REMOTE_REF_ACTION_INSTALL, 3));
+  /* Actions on the same ref are never applied in the same transaction, so
+   * this goes in a later one. */
+  g_ptr_array_add (actions, sample_flatpak_ref_action ("other", "org.test.Test3",
+                                                       EUU_FLATPAK_REMOTE_REF_ACTION_UPDATE, 6));
+
+  g_assert_true (g_file_test (uninstalled_path, G_FILE_TEST_EXISTS));
+
+  eufi_apply_flatpak_ref_actions (installation,
+                                  state_counter_path,
+                                  actions,
+                                  EU_INSTALLER_MODE_PERFORM,
+                                  TRUE,
+                                  &error);
+  g_assert_no_error (error);
+
+  for (i = 0; expected_installed[i] != NULL; i++)
+    {
+      g_autofree gchar *installed_path = g_build_filename (installation_directory_path,
+                                                           "app",
+                                                           expected_installed[i],
+                                                           NULL);
+      g_assert_true (g_file_test (installed_path, G_FILE_TEST_EXISTS));
+    }
+
+  g_assert_false (g_file_test (uninstalled_path, G_FILE_TEST_EXISTS));
+
+  g_key_file_load_from_file (counter_key_file,
+                             state_counter_path,
+                             G_KEY_FILE_NONE,
+                             &error);
+  g_assert_no_error (error);
+
+  g_assert_cmpint (g_key_file_get_integer (counter_key_file, "autoinstall", "Progress", NULL), ==, 3);
+  g_assert_cmpint (g_key_file_get_integer (counter_key_file, "other", "Progress", NULL), ==, 6);
+}
+
 static void
 test_flatpak_check_succeeds_if_actions_are_up_to_date (FlatpakDeploymentsFixture *fixture,
                                                        gconstpointer              user G_GNUC_UNUSED)
@@ -611,6 +703,12 @@ main (int   argc,
               flatpak_deployments_fixture_setup,
               test_deploy_failure_resume_from_latest,
               flatpak_deployments_fixture_teardown);
+  g_test_add ("/flatpak/deploy-mixed-actions",
+              FlatpakDeploymentsFixture,
+              NULL,
+              flatpak_deployments_fixture_setup,
+              test_deploy_mixed_actions,
+              flatpak_deployments_fixture_teardown);
 
   g_test_add ("/flatpak/check-succeeds-if-actions-are-up-to-date",
               FlatpakDeploymentsFixture,
@@ -30,6 +30,7 @@
 #include <glib.h>
 #include <libeos-updater-util/avahi-service-file.h>
 #include <libeos-updater-util/util.h>
+#include <math.h>
 #include <string.h>
 
 #include "ostree-bloom-private.h"
@@ -185,10 +186,13 @@ get_and_check_txt_records_size_level (GVariantDict  *options_dict,
     }
 }
 
+/* Get the maximum total size of the TXT records, in bytes, according to the
+ * %EOS_OSTREE_AVAHI_OPTION_TXT_RECORDS_SIZE_LEVEL_Y option. %G_MAXUINT64 means
+ * there is no limit. */
 static gboolean
-validate_total_size (gsize          total_size,
-                     GVariantDict  *options_dict,
-                     GError       **error)
+get_txt_records_size_limit (GVariantDict  *options_dict,
+                            guint64       *out_limit,
+                            GError       **error)
 {
   guint8 size_level;
   guint64 limit;
@@ -229,12 +233,28 @@ validate_total_size (gsize          total_size,
       break;
 
     case EOS_OSTREE_AVAHI_SIZE_LEVEL_ABSOLUTELY_LAX:
-      return TRUE;
+      limit = G_MAXUINT64;
+      break;
 
     default:
       g_assert_not_reached ();
     }
 
+  g_assert (out_limit != NULL);
+  *out_limit = limit;
+  return TRUE;
+}
+
+static gboolean
+validate_total_size (gsize          total_size,
+                     GVariantDict  *options_dict,
+                     GError       **error)
+{
+  guint64 limit;
+
+  if (!get_txt_records_size_limit (options_dict, &limit, error))
+    return FALSE;
+
   if (total_size > limit)
     {
       g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
@@ -338,6 +358,7 @@ generate_avahi_service_template_to_file (GFile         *path,
                                          GError       **error)
 {
   g_autoptr(GBytes) contents = NULL;
+  g_autoptr(GBytes) old_contents = NULL;
   gconstpointer raw;
   gsize raw_len;
   g_autoptr(GVariant) reffed_txt_records = g_variant_ref_sink (txt_records);
@@ -351,6 +372,16 @@ generate_avahi_service_template_to_file (GFile         *path,
   if (contents == NULL)
     return FALSE;
 
+  /* Avahi re-announces the service whenever the file is modified, so leave it
+   * alone if the advertisement hasn’t actually changed. */
+  if (eos_updater_read_file_to_bytes (path, cancellable, &old_contents, NULL) &&
+      g_bytes_equal (old_contents, contents))
+    {
+      g_autofree gchar *path_str = g_file_get_path (path);
+      g_debug ("%s: Service file ‘%s’ is unchanged", G_STRFUNC, path_str);
+      return TRUE;
+    }
+
   raw = g_bytes_get_data (contents, &raw_len);
   return g_file_replace_contents (path,
                                   raw,
@@ -382,6 +413,27 @@ eos_avahi_service_file_get_directory (void)
                                     SYSCONFDIR "/avahi/services");
 }
 
+/**
+ * eos_avahi_load_hint_file_get_path:
+ *
+ * Get the path of the file where eos-update-server stores its current
+ * #EosOstreeAvahiLoadHint, for eos-updater-avahi to advertise. The file
+ * contains the output of eos_ostree_avahi_load_hint_to_bytes(), and may not
+ * exist.
+ *
+ * This may be overridden by specifying the
+ * `EOS_UPDATER_TEST_UPDATE_SERVER_LOAD_HINT_PATH` environment variable. This
+ * is intended for testing only.
+ *
+ * Returns: load hint file path
+ */
+const gchar *
+eos_avahi_load_hint_file_get_path (void)
+{
+  return eos_updater_get_envvar_or ("EOS_UPDATER_TEST_UPDATE_SERVER_LOAD_HINT_PATH",
+                                    LOCALSTATEDIR "/lib/eos-updater/update-server-load");
+}
+
 static gboolean
 delete_file_if_exists (GFile         *file,
                        GCancellable  *cancellable,
@@ -412,6 +464,11 @@ delete_file_if_exists (GFile         *file,
 #define EOS_OSTREE_AVAHI_V1_SUMMARY_TIMESTAMP_VARIANT_TYPE G_VARIANT_TYPE_UINT64
 #define EOS_OSTREE_AVAHI_V1_REPOSITORY_INDEX_FIELD "ri"
 #define EOS_OSTREE_AVAHI_V1_REPOSITORY_INDEX_VARIANT_TYPE G_VARIANT_TYPE_UINT16
+#define EOS_OSTREE_AVAHI_V1_LOAD_HINT_FIELD EOS_OSTREE_AVAHI_LOAD_HINT_TXT_KEY
+#define EOS_OSTREE_AVAHI_V1_LOAD_HINT_VARIANT_TYPE (G_VARIANT_TYPE ("(qyb)"))
+#define EOS_OSTREE_AVAHI_V1_LOAD_HINT_SIZE 4  /* bytes, fixed by the variant type */
+
+#define DEFAULT_BLOOM_TARGET_FPR 0.01
 
 static GFile *
 get_ostree_service_file (const gchar *avahi_service_directory,
@@ -527,6 +584,29 @@ get_and_check_bloom_k (GVariantDict  *options_dict,
   return TRUE;
 }
 
+static gboolean
+get_and_check_bloom_target_fpr (GVariantDict  *options_dict,
+                                gdouble       *out_target_fpr,
+                                GError       **error)
+{
+  gdouble target_fpr = DEFAULT_BLOOM_TARGET_FPR;
+
+  g_variant_dict_lookup (options_dict, EOS_OSTREE_AVAHI_OPTION_BLOOM_TARGET_FPR_D,
+                         "d", &target_fpr);
+  /* This is written to reject NaN too. */
+  if (!(target_fpr > 0.0 && target_fpr < 1.0))
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                   "bloom target false positive rate %g must be greater than "
+                   "zero and less than one", target_fpr);
+      return FALSE;
+    }
+
+  if (out_target_fpr)
+    *out_target_fpr = target_fpr;
+  return TRUE;
+}
+
 static gboolean
 get_and_check_bloom_hash_func_id (GVariantDict         *options_dict,
                                   guint8               *out_bloom_hash_func_id,
@@ -540,6 +620,7 @@ get_and_check_bloom_hash_func_id (GVariantDict         *options_dict,
   switch (bloom_hash_id)
     {
     case EOS_OSTREE_AVAHI_BLOOM_HASH_ID_OSTREE_COLLECTION_REF:
+    case EOS_OSTREE_AVAHI_BLOOM_HASH_ID_OSTREE_COLLECTION_REF_BLOCKED:
       if (out_bloom_hash_func_id)
         *out_bloom_hash_func_id = bloom_hash_id;
       return TRUE;
@@ -551,52 +632,252 @@ get_and_check_bloom_hash_func_id (GVariantDict         *options_dict,
     }
 }
 
+/* An explicit bloom filter size for a blocked filter is rounded down to whole
+ * blocks, so that it still fits in the TXT records; so it must be at least one
+ * block. */
+static gboolean
+get_and_check_blocked_bloom_size (GVariantDict  *options_dict,
+                                  guint32       *out_bloom_size,
+                                  GError       **error)
+{
+  guint32 bloom_size;
+
+  if (!get_and_check_bloom_size (options_dict, &bloom_size, error))
+    return FALSE;
+
+  if (bloom_size < OSTREE_BLOOM_BLOCK_SIZE)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                   "blocked bloom filter with size %" G_GUINT32_FORMAT " is "
+                   "too small, minimum size is %u",
+                   bloom_size, (guint) OSTREE_BLOOM_BLOCK_SIZE);
+      return FALSE;
+    }
+
+  if (out_bloom_size)
+    *out_bloom_size = bloom_size / OSTREE_BLOOM_BLOCK_SIZE * OSTREE_BLOOM_BLOCK_SIZE;
+  return TRUE;
+}
+
+static gboolean
+is_valid_load_capacity (guint8 capacity)
+{
+  switch (capacity)
+    {
+    case EOS_OSTREE_AVAHI_LOAD_CAPACITY_NONE:
+    case EOS_OSTREE_AVAHI_LOAD_CAPACITY_LOW:
+    case EOS_OSTREE_AVAHI_LOAD_CAPACITY_MEDIUM:
+    case EOS_OSTREE_AVAHI_LOAD_CAPACITY_HIGH:
+      return TRUE;
+
+    default:
+      return FALSE;
+    }
+}
+
+/* The load hint is optional: @out_has_load_hint is set to %FALSE if
+ * %EOS_OSTREE_AVAHI_OPTION_LOAD_ACTIVE_STREAMS_Q is not set. */
+static gboolean
+get_and_check_load_hint (GVariantDict            *options_dict,
+                         gboolean                *out_has_load_hint,
+                         EosOstreeAvahiLoadHint  *out_load_hint,
+                         GError                 **error)
+{
+  guint16 active_streams = 0;
+  guint8 capacity = EOS_OSTREE_AVAHI_LOAD_CAPACITY_HIGH;
+  gboolean saturated = FALSE;
+  gboolean has_load_hint;
+
+  has_load_hint = g_variant_dict_lookup (options_dict,
+                                         EOS_OSTREE_AVAHI_OPTION_LOAD_ACTIVE_STREAMS_Q,
+                                         "q", &active_streams);
+  g_variant_dict_lookup (options_dict, EOS_OSTREE_AVAHI_OPTION_LOAD_CAPACITY_Y,
+                         "y", &capacity);
+  g_variant_dict_lookup (options_dict, EOS_OSTREE_AVAHI_OPTION_LOAD_SATURATED_B,
+                         "b", &saturated);
+
+  if (!is_valid_load_capacity (capacity))
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                   "unknown value %u for the %s option", capacity,
+                   EOS_OSTREE_AVAHI_OPTION_LOAD_CAPACITY_Y);
+      return FALSE;
+    }
+
+  if (out_has_load_hint != NULL)
+    *out_has_load_hint = has_load_hint;
+  if (out_load_hint != NULL)
+    {
+      out_load_hint->active_streams = active_streams;
+      out_load_hint->capacity = capacity;
+      out_load_hint->saturated = saturated;
+    }
+  return TRUE;
+}
+
+/* The hash ID identifies both the hash function and the layout of the filter,
+ * since a client needs to know both to query it. */
 static guint8
-hash_func_to_id (OstreeBloomHashFunc hash_func)
+hash_func_to_id (OstreeBloomHashFunc hash_func,
+                 gboolean            is_blocked)
 {
   if (hash_func == ostree_collection_ref_bloom_hash)
-    return EOS_OSTREE_AVAHI_BLOOM_HASH_ID_OSTREE_COLLECTION_REF;
+    return is_blocked ? EOS_OSTREE_AVAHI_BLOOM_HASH_ID_OSTREE_COLLECTION_REF_BLOCKED :
+                        EOS_OSTREE_AVAHI_BLOOM_HASH_ID_OSTREE_COLLECTION_REF;
 
   g_assert_not_reached ();
 }
 
-static OstreeBloomHashFunc
-id_to_hash_func (guint8 id)
+static OstreeBloom *
+id_to_bloom (guint8  id,
+             gsize   n_bytes,
+             guint8  k)
 {
   switch (id)
     {
     case EOS_OSTREE_AVAHI_BLOOM_HASH_ID_OSTREE_COLLECTION_REF:
-      return ostree_collection_ref_bloom_hash;
+      return ostree_bloom_new (n_bytes, k, ostree_collection_ref_bloom_hash);
+
+    case EOS_OSTREE_AVAHI_BLOOM_HASH_ID_OSTREE_COLLECTION_REF_BLOCKED:
+      return ostree_bloom_new_blocked (n_bytes, k, ostree_collection_ref_bloom_hash);
 
     default:
       g_assert_not_reached ();
     }
 }
 
+/* Size of the TXT records other than the bloom filter bits. Each record is a
+ * length byte, the key, an equals sign and the value. */
+static gsize
+get_v1_txt_records_overhead (GVariantDict *options_dict)
+{
+  gsize overhead = (1 + strlen (EOS_OSTREE_AVAHI_VERSION_FIELD) + 1 + 1 /* y */) +
+                   (1 + strlen (EOS_OSTREE_AVAHI_V1_REFS_BLOOM_FILTER_FIELD) + 1 + 2 /* yy */) +
+                   (1 + strlen (EOS_OSTREE_AVAHI_V1_SUMMARY_TIMESTAMP_FIELD) + 1 + 8 /* t */) +
+                   (1 + strlen (EOS_OSTREE_AVAHI_V1_REPOSITORY_INDEX_FIELD) + 1 + 2 /* q */);
+
+  if (g_variant_dict_contains (options_dict, EOS_OSTREE_AVAHI_OPTION_LOAD_ACTIVE_STREAMS_Q))
+    overhead += 1 + strlen (EOS_OSTREE_AVAHI_V1_LOAD_HINT_FIELD) + 1 + EOS_OSTREE_AVAHI_V1_LOAD_HINT_SIZE;
+
+  return overhead;
+}
+
+/* Choose the bloom filter size and k to give a false positive rate of
+ * @target_fpr for @n_elements, using the standard formulae for the optimal
+ * number of bits, `m = -n ln(p) / ln(2)²`, and hash functions,
+ * `k = (m / n) ln(2)`. If that doesn’t fit in the TXT records, use the largest
+ * filter which does, and the optimal k for that size. Blocked filters are
+ * always a whole number of %OSTREE_BLOOM_BLOCK_SIZE blocks, so the size is
+ * rounded to that before choosing k. */
+static gboolean
+get_auto_bloom_size_and_k (GVariantDict  *options_dict,
+                           gsize          n_elements,
+                           gboolean       is_blocked,
+                           guint32       *out_bloom_size,
+                           guint8        *out_bloom_k,
+                           GError       **error)
+{
+  gdouble target_fpr;
+  guint64 size_limit;
+  gsize overhead = get_v1_txt_records_overhead (options_dict);
+  guint32 max_bloom_size;
+  gdouble ideal_bits, ideal_k;
+  guint32 bloom_size;
+
+  if (!get_and_check_bloom_target_fpr (options_dict, &target_fpr, error))
+    return FALSE;
+
+  if (!get_and_check_bloom_size (options_dict, &max_bloom_size, error))
+    return FALSE;
+
+  if (!get_txt_records_size_limit (options_dict, &size_limit, error))
+    return FALSE;
+
+  /* If even a one-byte filter doesn’t fit, validate_total_size() will report
+   * it later. */
+  if (size_limit > overhead)
+    max_bloom_size = (guint32) MIN (max_bloom_size, size_limit - overhead);
+  max_bloom_size = MAX (max_bloom_size, 1);
+
+  n_elements = MAX (n_elements, 1);
+  ideal_bits = ceil (-(gdouble) n_elements * log (target_fpr) / (G_LN2 * G_LN2));
+
+  if (ideal_bits >= (gdouble) max_bloom_size * 8)
+    bloom_size = max_bloom_size;
+  else
+    bloom_size = MAX ((guint32) ((ideal_bits + 7) / 8), 1);
+
+  /* Round up to whole blocks if that still fits, otherwise down; but always
+   * use at least one block. If that doesn’t fit, validate_total_size() will
+   * report it later. */
+  if (is_blocked)
+    {
+      guint32 n_blocks = (bloom_size + OSTREE_BLOOM_BLOCK_SIZE - 1) / OSTREE_BLOOM_BLOCK_SIZE;
+
+      if (n_blocks * OSTREE_BLOOM_BLOCK_SIZE > max_bloom_size)
+        n_blocks = max_bloom_size / OSTREE_BLOOM_BLOCK_SIZE;
+
+      bloom_size = MAX (n_blocks, 1) * OSTREE_BLOOM_BLOCK_SIZE;
+    }
+
+  ideal_k = round ((gdouble) bloom_size * 8 / (gdouble) n_elements * G_LN2);
+
+  g_assert (out_bloom_size != NULL);
+  g_assert (out_bloom_k != NULL);
+  *out_bloom_size = bloom_size;
+  *out_bloom_k = (guint8) CLAMP (ideal_k, 1, G_MAXUINT8);
+
+  g_debug ("Using bloom filter of %" G_GUINT32_FORMAT " bytes with k = %u for "
+           "%" G_GSIZE_FORMAT " elements (target false positive rate %g)",
+           *out_bloom_size, (guint) *out_bloom_k, n_elements, target_fpr);
+
+  return TRUE;
+}
+
 static gboolean
 get_clean_bloom_filter (GVariantDict  *options_dict,
+                        gsize          n_elements,
                         OstreeBloom  **out_bloom_filter,
                         GError       **error)
 {
   guint32 bloom_size;
   guint8 bloom_k;
   guint8 bloom_hash_func_id;
-
-  if (!get_and_check_bloom_size (options_dict, &bloom_size, error))
-    return FALSE;
-
-  if (!get_and_check_bloom_k (options_dict, &bloom_k, error))
-    return FALSE;
+  gboolean is_blocked;
 
   if (!get_and_check_bloom_hash_func_id (options_dict,
                                          &bloom_hash_func_id,
                                          error))
     return FALSE;
 
+  is_blocked = (bloom_hash_func_id == EOS_OSTREE_AVAHI_BLOOM_HASH_ID_OSTREE_COLLECTION_REF_BLOCKED);
+
+  /* Size the filter automatically unless the caller has chosen the size or k
+   * explicitly. An explicit size for a blocked filter is rounded down to whole
+   * blocks, so it never takes more space in the TXT records than requested. */
+  if (!g_variant_dict_contains (options_dict, EOS_OSTREE_AVAHI_OPTION_BLOOM_SIZE_U) &&
+      !g_variant_dict_contains (options_dict, EOS_OSTREE_AVAHI_OPTION_BLOOM_K_Y))
+    {
+      if (!get_auto_bloom_size_and_k (options_dict, n_elements, is_blocked,
+                                      &bloom_size, &bloom_k, error))
+        return FALSE;
+    }
+  else
+    {
+      if (is_blocked)
+        {
+          if (!get_and_check_blocked_bloom_size (options_dict, &bloom_size, error))
+            return FALSE;
+        }
+      else if (!get_and_check_bloom_size (options_dict, &bloom_size, error))
+        return FALSE;
+
+      if (!get_and_check_bloom_k (options_dict, &bloom_k, error))
+        return FALSE;
+    }
+
   g_assert (out_bloom_filter != NULL);
-  *out_bloom_filter = ostree_bloom_new (bloom_size,
-                                        bloom_k,
-                                        id_to_hash_func (bloom_hash_func_id));
+  *out_bloom_filter = id_to_bloom (bloom_hash_func_id, bloom_size, bloom_k);
   return TRUE;
 }
 
@@ -610,8 +891,12 @@ get_bloom_filter_data (OstreeCollectionRef **refs_to_advertise,
 {
   g_autoptr(OstreeBloom) filter = NULL;
   OstreeCollectionRef **iter;
+  gsize n_refs = 0;
 
-  if (!get_clean_bloom_filter (options_dict, &filter, error))
+  for (iter = refs_to_advertise; *iter != NULL; ++iter)
+    n_refs++;
+
+  if (!get_clean_bloom_filter (options_dict, n_refs, &filter, error))
     return FALSE;
 
   for (iter = refs_to_advertise; *iter != NULL; ++iter)
@@ -621,7 +906,8 @@ get_bloom_filter_data (OstreeCollectionRef **refs_to_advertise,
   g_assert (out_bloom_hash_func_id != NULL);
   g_assert (out_bloom_filter_bits != NULL);
   *out_bloom_k = ostree_bloom_get_k (filter);
-  *out_bloom_hash_func_id = hash_func_to_id (ostree_bloom_get_hash_func (filter));
+  *out_bloom_hash_func_id = hash_func_to_id (ostree_bloom_get_hash_func (filter),
+                                             ostree_bloom_is_blocked (filter));
   *out_bloom_filter_bits = ostree_bloom_seal (filter);
   return TRUE;
 }
@@ -685,6 +971,20 @@ get_bloom_filter_variant (guint8  bloom_k,
   return variant;
 }
 
+static GVariant *
+get_load_hint_variant (const EosOstreeAvahiLoadHint *load_hint)
+{
+  GVariant *variant = g_variant_new ("(qyb)",
+                                     GUINT16_TO_BE (load_hint->active_streams),
+                                     (guint8) load_hint->capacity,
+                                     load_hint->saturated);
+
+  g_assert (g_variant_is_of_type (variant,
+                                  EOS_OSTREE_AVAHI_V1_LOAD_HINT_VARIANT_TYPE));
+
+  return variant;
+}
+
 static GVariant *
 variant_to_binary_variant (GVariant *variant)
 {
@@ -704,6 +1004,7 @@ generate_ostree_avahi_v1_service_file_from_variants (GFile         *service_file
                                                      GVariant      *refs_bloom_filter_variant,
                                                      GVariant      *summary_timestamp_variant,
                                                      GVariant      *repository_index_variant,
+                                                     GVariant      *load_hint_variant,
                                                      GVariantDict  *options_dict,
                                                      GCancellable  *cancellable,
                                                      GError       **error)
@@ -726,6 +1027,10 @@ generate_ostree_avahi_v1_service_file_from_variants (GFile         *service_file
   g_variant_builder_add (&records_builder, "(sv)",
                          EOS_OSTREE_AVAHI_V1_REPOSITORY_INDEX_FIELD,
                          variant_to_binary_variant (g_steal_pointer (&repository_index_variant)));
+  if (load_hint_variant != NULL)
+    g_variant_builder_add (&records_builder, "(sv)",
+                           EOS_OSTREE_AVAHI_V1_LOAD_HINT_FIELD,
+                           variant_to_binary_variant (g_steal_pointer (&load_hint_variant)));
 
   return generate_avahi_service_template_to_file (service_file,
                                                   "EOS OSTree update service on %h",
@@ -771,6 +1076,8 @@ generate_ostree_avahi_v1_service_file (const gchar          *avahi_service_direc
   guint16 port;
   guint16 repository_index;
   guint64 summary_timestamp_unix;
+  gboolean has_load_hint;
+  EosOstreeAvahiLoadHint load_hint;
   g_autoptr(GFile) service_file = NULL;
 
   if (!get_bloom_filter_data (refs_to_advertise,
@@ -787,6 +1094,9 @@ generate_ostree_avahi_v1_service_file (const gchar          *avahi_service_direc
   if (!get_unix_summary_timestamp (summary_timestamp, &summary_timestamp_unix, error))
     return FALSE;
 
+  if (!get_and_check_load_hint (options_dict, &has_load_hint, &load_hint, error))
+    return FALSE;
+
   repository_index = get_repository_index (options_dict);
   service_file = get_ostree_service_file (avahi_service_directory,
                                           repository_index);
@@ -798,6 +1108,7 @@ generate_ostree_avahi_v1_service_file (const gchar          *avahi_service_direc
                                                                                         bloom_filter_bits),
                                                               get_summary_timestamp_variant (summary_timestamp_unix),
                                                               get_repository_index_variant (repository_index),
+                                                              has_load_hint ? get_load_hint_variant (&load_hint) : NULL,
                                                               options_dict,
                                                               cancellable,
                                                               error);
@@ -832,13 +1143,23 @@ static gboolean
 check_v1_options (GVariantDict  *options_dict,
                   GError       **error)
 {
+  guint8 bloom_hash_func_id;
+
   if (!get_and_check_bloom_size (options_dict, NULL, error))
     return FALSE;
 
   if (!get_and_check_bloom_k (options_dict, NULL, error))
     return FALSE;
 
-  if (!get_and_check_bloom_hash_func_id (options_dict, NULL, error))
+  if (!get_and_check_bloom_hash_func_id (options_dict, &bloom_hash_func_id, error))
+    return FALSE;
+
+  if (bloom_hash_func_id == EOS_OSTREE_AVAHI_BLOOM_HASH_ID_OSTREE_COLLECTION_REF_BLOCKED &&
+      g_variant_dict_contains (options_dict, EOS_OSTREE_AVAHI_OPTION_BLOOM_SIZE_U) &&
+      !get_and_check_blocked_bloom_size (options_dict, NULL, error))
+    return FALSE;
+
+  if (!get_and_check_bloom_target_fpr (options_dict, NULL, error))
     return FALSE;
 
   if (!get_and_check_avahi_service_port (options_dict, NULL, error))
@@ -847,6 +1168,175 @@ check_v1_options (GVariantDict  *options_dict,
   if (!get_and_check_txt_records_size_level (options_dict, NULL, error))
     return FALSE;
 
+  if (!get_and_check_load_hint (options_dict, NULL, NULL, error))
+    return FALSE;
+
+  return TRUE;
+}
+
+/**
+ * eos_ostree_avahi_load_hint_to_bytes:
+ * @hint: a load hint
+ *
+ * Serialise @hint in the format used for the value of the load hint TXT
+ * record. The same format is used for the file at
+ * eos_avahi_load_hint_file_get_path().
+ *
+ * Returns: (transfer full): serialised @hint
+ */
+GBytes *
+eos_ostree_avahi_load_hint_to_bytes (const EosOstreeAvahiLoadHint *hint)
+{
+  g_autoptr(GVariant) variant = NULL;
+
+  g_return_val_if_fail (hint != NULL, NULL);
+  g_return_val_if_fail (is_valid_load_capacity (hint->capacity), NULL);
+
+  variant = g_variant_ref_sink (get_load_hint_variant (hint));
+  return g_variant_get_data_as_bytes (variant);
+}
+
+/**
+ * eos_ostree_avahi_load_hint_from_bytes:
+ * @bytes: serialised load hint
+ * @out_hint: (out caller-allocates): return location for the load hint
+ * @error: return location for a #GError
+ *
+ * Parse a load hint serialised by eos_ostree_avahi_load_hint_to_bytes(), or
+ * received as the value of a load hint TXT record from another machine. As
+ * such, @bytes is untrusted, and an error is returned if it is not valid.
+ *
+ * Returns: %TRUE on success, %FALSE otherwise
+ */
+gboolean
+eos_ostree_avahi_load_hint_from_bytes (GBytes                  *bytes,
+                                       EosOstreeAvahiLoadHint  *out_hint,
+                                       GError                 **error)
+{
+  g_autoptr(GVariant) variant = NULL;
+  guint16 active_streams;
+  guint8 capacity;
+  gboolean saturated;
+
+  g_return_val_if_fail (bytes != NULL, FALSE);
+  g_return_val_if_fail (out_hint != NULL, FALSE);
+  g_return_val_if_fail (error == NULL || *error == NULL, FALSE);
+
+  /* GVariant would silently substitute zeros for a fixed-size value of the
+   * wrong size, so check it explicitly. */
+  if (g_bytes_get_size (bytes) != EOS_OSTREE_AVAHI_V1_LOAD_HINT_SIZE)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                   "load hint has size %" G_GSIZE_FORMAT " bytes, expected %u",
+                   g_bytes_get_size (bytes), (guint) EOS_OSTREE_AVAHI_V1_LOAD_HINT_SIZE);
+      return FALSE;
+    }
+
+  variant = g_variant_ref_sink (g_variant_new_from_bytes (EOS_OSTREE_AVAHI_V1_LOAD_HINT_VARIANT_TYPE,
+                                                          bytes, FALSE));
+
+  if (!g_variant_is_normal_form (variant))
+    {
+      g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                           "corrupt load hint");
+      return FALSE;
+    }
+
+  g_variant_get (variant, "(qyb)", &active_streams, &capacity, &saturated);
+
+  if (!is_valid_load_capacity (capacity))
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                   "unknown load hint capacity %u", capacity);
+      return FALSE;
+    }
+
+  out_hint->active_streams = GUINT16_FROM_BE (active_streams);
+  out_hint->capacity = capacity;
+  out_hint->saturated = saturated;
+  return TRUE;
+}
+
+/**
+ * eos_ostree_avahi_refs_bloom_maybe_contains:
+ * @bytes: value of a refs bloom filter TXT record
+ * @collection_ref: collection–ref to look up
+ * @out_maybe_contains: (out caller-allocates): return location for whether
+ *    @collection_ref is possibly advertised
+ * @error: return location for a #GError
+ *
+ * Parse the value of a refs bloom filter TXT record, as generated by
+ * eos_ostree_avahi_service_file_generate(), and check whether @collection_ref
+ * is possibly in it. @bytes is untrusted, so an error is returned if it is not
+ * valid, or if it uses an unknown hash ID.
+ *
+ * Returns: %TRUE on success, %FALSE otherwise
+ */
+gboolean
+eos_ostree_avahi_refs_bloom_maybe_contains (GBytes                     *bytes,
+                                            const OstreeCollectionRef  *collection_ref,
+                                            gboolean                   *out_maybe_contains,
+                                            GError                    **error)
+{
+  g_autoptr(GVariant) variant = NULL;
+  g_autoptr(GVariant) bits_variant = NULL;
+  g_autoptr(GBytes) bits = NULL;
+  g_autoptr(OstreeBloom) bloom = NULL;
+  guint8 k, hash_id;
+  gsize n_bytes;
+
+  g_return_val_if_fail (bytes != NULL, FALSE);
+  g_return_val_if_fail (collection_ref != NULL, FALSE);
+  g_return_val_if_fail (out_maybe_contains != NULL, FALSE);
+  g_return_val_if_fail (error == NULL || *error == NULL, FALSE);
+
+  variant = g_variant_ref_sink (g_variant_new_from_bytes (EOS_OSTREE_AVAHI_V1_REFS_BLOOM_FILTER_VARIANT_TYPE,
+                                                          bytes, FALSE));
+
+  if (!g_variant_is_normal_form (variant))
+    {
+      g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                           "corrupt refs bloom filter");
+      return FALSE;
+    }
+
+  g_variant_get (variant, "(yy@ay)", &k, &hash_id, &bits_variant);
+  bits = g_variant_get_data_as_bytes (bits_variant);
+  n_bytes = g_bytes_get_size (bits);
+
+  if (k == 0 || n_bytes == 0)
+    {
+      g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                           "empty refs bloom filter");
+      return FALSE;
+    }
+
+  switch (hash_id)
+    {
+    case EOS_OSTREE_AVAHI_BLOOM_HASH_ID_OSTREE_COLLECTION_REF:
+      bloom = ostree_bloom_new_from_bytes (bits, k, ostree_collection_ref_bloom_hash);
+      break;
+
+    case EOS_OSTREE_AVAHI_BLOOM_HASH_ID_OSTREE_COLLECTION_REF_BLOCKED:
+      if (n_bytes % OSTREE_BLOOM_BLOCK_SIZE != 0)
+        {
+          g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                       "blocked refs bloom filter has size %" G_GSIZE_FORMAT
+                       " bytes, which is not a whole number of blocks",
+                       n_bytes);
+          return FALSE;
+        }
+
+      bloom = ostree_bloom_new_from_bytes_blocked (bits, k, ostree_collection_ref_bloom_hash);
+      break;
+
+    default:
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+                   "unknown refs bloom filter hash ID %u", hash_id);
+      return FALSE;
+    }
+
+  *out_maybe_contains = ostree_bloom_maybe_contains (bloom, collection_ref);
   return TRUE;
 }
 
@@ -1008,8 +1498,24 @@ eos_ostree_avahi_service_file_delete (const gchar   *avahi_service_directory,
   return TRUE;
 }
 
+static gboolean
+index_in_array (guint16        index,
+                const guint16 *indices,
+                gsize          n_indices)
+{
+  gsize i;
+
+  for (i = 0; i < n_indices; i++)
+    if (indices[i] == index)
+      return TRUE;
+
+  return FALSE;
+}
+
 static gboolean
 iterate_and_remove_ostree_service_files (GFileEnumerator  *enumerator,
+                                         const guint16    *keep_indices,
+                                         gsize             n_keep_indices,
                                          GCancellable     *cancellable,
                                          GError          **error)
 {
@@ -1027,6 +1533,7 @@ iterate_and_remove_ostree_service_files (GFileEnumerator  *enumerator,
       g_autoptr(GMatchInfo) match_info = NULL;
       g_autofree gchar *matched_repository_index = NULL;
       const gchar *filename;
+      guint64 repository_index;
 
       if (!g_file_enumerator_iterate (enumerator,
                                       &file_info,
@@ -1043,7 +1550,9 @@ iterate_and_remove_ostree_service_files (GFileEnumerator  *enumerator,
         continue;
 
       matched_repository_index = g_match_info_fetch (match_info, 1);
-      if (!g_ascii_string_to_unsigned (matched_repository_index, 10, 0, G_MAXUINT16, NULL, NULL))
+      if (!g_ascii_string_to_unsigned (matched_repository_index, 10, 0, G_MAXUINT16, &repository_index, NULL))
+        continue;
+      if (index_in_array ((guint16) repository_index, keep_indices, n_keep_indices))
         continue;
       if (!delete_file_if_exists (file, cancellable, error))
         return FALSE;
@@ -1069,11 +1578,41 @@ gboolean
 eos_ostree_avahi_service_file_cleanup_directory (const gchar   *avahi_service_directory,
                                                  GCancellable  *cancellable,
                                                  GError       **error)
+{
+  return eos_ostree_avahi_service_file_cleanup_directory_except (avahi_service_directory,
+                                                                 NULL, 0,
+                                                                 cancellable,
+                                                                 error);
+}
+
+/**
+ * eos_ostree_avahi_service_file_cleanup_directory_except:
+ * @avahi_service_directory: path to the directory containing `.service` files
+ * @keep_indices: (array length=n_keep_indices) (nullable): repository indices
+ *    whose `.service` files should be kept
+ * @n_keep_indices: number of elements in @keep_indices
+ * @cancellable: (nullable): a #GCancellable
+ * @error: return location for a #GError
+ *
+ * Like eos_ostree_avahi_service_file_cleanup_directory(), but leave the
+ * `.service` files for the repository indices in @keep_indices in place. This
+ * is useful for removing the files for repositories which are no longer
+ * advertised.
+ *
+ * Returns: %TRUE on success, %FALSE otherwise
+ */
+gboolean
+eos_ostree_avahi_service_file_cleanup_directory_except (const gchar    *avahi_service_directory,
+                                                        const guint16  *keep_indices,
+                                                        gsize           n_keep_indices,
+                                                        GCancellable   *cancellable,
+                                                        GError        **error)
 {
   g_autoptr(GFile) dir = NULL;
   g_autoptr(GFileEnumerator) enumerator = NULL;
 
   g_return_val_if_fail (avahi_service_directory != NULL, FALSE);
+  g_return_val_if_fail (keep_indices != NULL || n_keep_indices == 0, FALSE);
   g_return_val_if_fail (cancellable == NULL || G_IS_CANCELLABLE (cancellable),
                         FALSE);
   g_return_val_if_fail (error == NULL || *error == NULL, FALSE);
@@ -1088,6 +1627,8 @@ eos_ostree_avahi_service_file_cleanup_directory (const gchar   *avahi_service_di
     return FALSE;
 
   return iterate_and_remove_ostree_service_files (enumerator,
+                                                  keep_indices,
+                                                  n_keep_indices,
                                                   cancellable,
                                                   error);
 }
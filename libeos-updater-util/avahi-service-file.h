@@ -34,6 +34,7 @@
 G_BEGIN_DECLS
 
 const gchar *eos_avahi_service_file_get_directory (void);
+const gchar *eos_avahi_load_hint_file_get_path (void);
 
 /* new DNS-SD records format for ostree */
 /* TXT records' values are basically serialized GVariants. Below all
@@ -70,7 +71,25 @@ const gchar *eos_avahi_service_file_get_directory (void);
  *               ideally telling when the original summary was
  *               created, otherwise it could also be the modification
  *               time of the summary file on host
+ *
+ * - load hint, optional, a snapshot of how busy the host is serving
+ *   updates, so clients can prefer less loaded hosts
+ *   - key: "ld"
+ *   - type: "(qyb)" (tuple containing a big-endian uint16, a byte
+ *           and a boolean)
+ *   - contents: the number of requests currently being served, the
+ *               #EosOstreeAvahiLoadCapacity of the host, and whether
+ *               the host is saturated and should only be used if
+ *               there are no other hosts
+ */
+
+/**
+ * EOS_OSTREE_AVAHI_LOAD_HINT_TXT_KEY:
+ *
+ * Key of the load hint TXT record; see eos_ostree_avahi_load_hint_from_bytes()
+ * for parsing its value.
  */
+#define EOS_OSTREE_AVAHI_LOAD_HINT_TXT_KEY "ld"
 
 /**
  * EOS_OSTREE_AVAHI_OPTION_FORCE_VERSION_Y:
@@ -86,10 +105,14 @@ const gchar *eos_avahi_service_file_get_directory (void);
  * - %EOS_OSTREE_AVAHI_OPTION_BLOOM_HASH_ID_Y
  * - %EOS_OSTREE_AVAHI_OPTION_BLOOM_K_Y
  * - %EOS_OSTREE_AVAHI_OPTION_BLOOM_SIZE_U
+ * - %EOS_OSTREE_AVAHI_OPTION_BLOOM_TARGET_FPR_D
  * - %EOS_OSTREE_AVAHI_OPTION_REPO_INDEX_Q
  * - %EOS_OSTREE_AVAHI_OPTION_PORT_Q
  * - %EOS_OSTREE_AVAHI_OPTION_TXT_RECORDS_SIZE_LEVEL_Y
  * - %EOS_OSTREE_AVAHI_OPTION_TXT_RECORDS_CUSTOM_SIZE_T
+ * - %EOS_OSTREE_AVAHI_OPTION_LOAD_ACTIVE_STREAMS_Q
+ * - %EOS_OSTREE_AVAHI_OPTION_LOAD_CAPACITY_Y
+ * - %EOS_OSTREE_AVAHI_OPTION_LOAD_SATURATED_B
  *
  * Default value of this option (if not overridden) is 1.
  */
@@ -111,7 +134,9 @@ const gchar *eos_avahi_service_file_get_directory (void);
  * how many times an element will be hashed before using it to set a
  * bit in the bloom filter.
  *
- * Default value of this option (if not overridden) is 1.
+ * If neither this nor %EOS_OSTREE_AVAHI_OPTION_BLOOM_SIZE_U is set, k is
+ * chosen automatically; see %EOS_OSTREE_AVAHI_OPTION_BLOOM_TARGET_FPR_D.
+ * Otherwise, the default value of this option (if not overridden) is 1.
  */
 #define EOS_OSTREE_AVAHI_OPTION_BLOOM_K_Y "bloom-k"
 /**
@@ -128,9 +153,33 @@ const gchar *eos_avahi_service_file_get_directory (void);
  * sign. 1 byte goes for the bloom k parameter and 1 byte goes for the
  * bloom hashing function ID. That gives us 250 bytes max.
  *
- * Default value of this option (if not overridden) is 250.
+ * If neither this nor %EOS_OSTREE_AVAHI_OPTION_BLOOM_K_Y is set, the size is
+ * chosen automatically, and this is its upper bound; see
+ * %EOS_OSTREE_AVAHI_OPTION_BLOOM_TARGET_FPR_D. Otherwise, the default value of
+ * this option (if not overridden) is 250.
+ *
+ * For %EOS_OSTREE_AVAHI_BLOOM_HASH_ID_OSTREE_COLLECTION_REF_BLOCKED, an
+ * explicit size is rounded down to a whole number of blocks, so it must be at
+ * least 64.
  */
 #define EOS_OSTREE_AVAHI_OPTION_BLOOM_SIZE_U "bloom-size"
+/**
+ * EOS_OSTREE_AVAHI_OPTION_BLOOM_TARGET_FPR_D:
+ *
+ * Specifies the false positive rate to aim for when choosing the bloom filter
+ * size and k automatically, as a fraction strictly between 0 and 1. The
+ * smallest filter which achieves this rate for the number of refs being
+ * advertised is used, with the optimal k for that size. If that filter does
+ * not fit in the TXT records size limit (see
+ * %EOS_OSTREE_AVAHI_OPTION_TXT_RECORDS_SIZE_LEVEL_Y), the largest filter which
+ * fits is used instead, with a correspondingly higher false positive rate.
+ *
+ * This is only used if neither %EOS_OSTREE_AVAHI_OPTION_BLOOM_SIZE_U nor
+ * %EOS_OSTREE_AVAHI_OPTION_BLOOM_K_Y is set.
+ *
+ * Default value of this option (if not overridden) is 0.01.
+ */
+#define EOS_OSTREE_AVAHI_OPTION_BLOOM_TARGET_FPR_D "bloom-target-false-positive-rate"
 /**
  * EOS_OSTREE_AVAHI_OPTION_REPO_INDEX_Q:
  *
@@ -170,19 +219,56 @@ const gchar *eos_avahi_service_file_get_directory (void);
  * It has no default value - must be specified explicitly.
  */
 #define EOS_OSTREE_AVAHI_OPTION_TXT_RECORDS_CUSTOM_SIZE_T "txt-records-custom-size"
+/**
+ * EOS_OSTREE_AVAHI_OPTION_LOAD_ACTIVE_STREAMS_Q:
+ *
+ * Specifies the number of requests the server is currently serving, for the
+ * load hint TXT record. The load hint record is only generated if this option
+ * is set.
+ *
+ * It has no default value.
+ */
+#define EOS_OSTREE_AVAHI_OPTION_LOAD_ACTIVE_STREAMS_Q "load-active-streams"
+/**
+ * EOS_OSTREE_AVAHI_OPTION_LOAD_CAPACITY_Y:
+ *
+ * Specifies how much spare capacity the server has, for the load hint TXT
+ * record. See #EosOstreeAvahiLoadCapacity for possible values. Only used if
+ * %EOS_OSTREE_AVAHI_OPTION_LOAD_ACTIVE_STREAMS_Q is set.
+ *
+ * Default value of this option (if not overridden) is
+ * %EOS_OSTREE_AVAHI_LOAD_CAPACITY_HIGH.
+ */
+#define EOS_OSTREE_AVAHI_OPTION_LOAD_CAPACITY_Y "load-capacity"
+/**
+ * EOS_OSTREE_AVAHI_OPTION_LOAD_SATURATED_B:
+ *
+ * Specifies whether the server is saturated, for the load hint TXT record.
+ * Only used if %EOS_OSTREE_AVAHI_OPTION_LOAD_ACTIVE_STREAMS_Q is set.
+ *
+ * Default value of this option (if not overridden) is %FALSE.
+ */
+#define EOS_OSTREE_AVAHI_OPTION_LOAD_SATURATED_B "load-saturated"
 
 /**
  * EosOstreeAvahiBloomHashId:
  * @EOS_OSTREE_AVAHI_BLOOM_HASH_ID_OSTREE_COLLECTION_REF: Use
  * ostree_collection_ref_bloom_hash() for hashing; it takes
  * #OstreeCollectionRef instance as an input.
+ * @EOS_OSTREE_AVAHI_BLOOM_HASH_ID_OSTREE_COLLECTION_REF_BLOCKED: Use
+ * ostree_collection_ref_bloom_hash() with a cache-line-blocked filter and
+ * double hashing (see ostree_bloom_new_blocked()). This is much cheaper to
+ * build and query for large k, but older clients (including libostree’s
+ * #OstreeRepoFinderAvahi at the time of writing) don’t understand it and will
+ * ignore the advertisement, so it must be explicitly enabled.
  *
  * Possible values for the
  * %EOS_OSTREE_AVAHI_OPTION_BLOOM_HASH_ID_Y option.
  */
 typedef enum
   {
-    EOS_OSTREE_AVAHI_BLOOM_HASH_ID_OSTREE_COLLECTION_REF = 1
+    EOS_OSTREE_AVAHI_BLOOM_HASH_ID_OSTREE_COLLECTION_REF = 1,
+    EOS_OSTREE_AVAHI_BLOOM_HASH_ID_OSTREE_COLLECTION_REF_BLOCKED = 2,
   } EosOstreeAvahiBloomHashId;
 
 /**
@@ -212,6 +298,57 @@ typedef enum
     EOS_OSTREE_AVAHI_SIZE_LEVEL_ABSOLUTELY_LAX
   } EosOstreeAvahiSizeLevel;
 
+/**
+ * EosOstreeAvahiLoadCapacity:
+ * @EOS_OSTREE_AVAHI_LOAD_CAPACITY_NONE: The server has no spare capacity
+ * @EOS_OSTREE_AVAHI_LOAD_CAPACITY_LOW: The server has less than a third of its
+ *    capacity spare
+ * @EOS_OSTREE_AVAHI_LOAD_CAPACITY_MEDIUM: The server has between a third and
+ *    two thirds of its capacity spare
+ * @EOS_OSTREE_AVAHI_LOAD_CAPACITY_HIGH: The server has more than two thirds of
+ *    its capacity spare
+ *
+ * Coarse classes of spare upload capacity, as advertised in the load hint TXT
+ * record. These are deliberately coarse so that the TXT records (and hence the
+ * mDNS announcements) don’t change for every request.
+ *
+ * Possible values for the %EOS_OSTREE_AVAHI_OPTION_LOAD_CAPACITY_Y option.
+ */
+typedef enum
+  {
+    EOS_OSTREE_AVAHI_LOAD_CAPACITY_NONE = 0,
+    EOS_OSTREE_AVAHI_LOAD_CAPACITY_LOW = 1,
+    EOS_OSTREE_AVAHI_LOAD_CAPACITY_MEDIUM = 2,
+    EOS_OSTREE_AVAHI_LOAD_CAPACITY_HIGH = 3,
+  } EosOstreeAvahiLoadCapacity;
+
+/**
+ * EosOstreeAvahiLoadHint:
+ * @active_streams: number of requests the server is currently serving
+ * @capacity: spare capacity class of the server
+ * @saturated: whether the server is saturated
+ *
+ * Load hint advertised by a server in its TXT records, and passed from
+ * eos-update-server to eos-updater-avahi in the file at
+ * eos_avahi_load_hint_file_get_path().
+ */
+typedef struct
+{
+  guint16 active_streams;
+  EosOstreeAvahiLoadCapacity capacity;
+  gboolean saturated;
+} EosOstreeAvahiLoadHint;
+
+GBytes *eos_ostree_avahi_load_hint_to_bytes (const EosOstreeAvahiLoadHint *hint);
+gboolean eos_ostree_avahi_load_hint_from_bytes (GBytes                  *bytes,
+                                                EosOstreeAvahiLoadHint  *out_hint,
+                                                GError                 **error);
+
+gboolean eos_ostree_avahi_refs_bloom_maybe_contains (GBytes                     *bytes,
+                                                     const OstreeCollectionRef  *collection_ref,
+                                                     gboolean                   *out_maybe_contains,
+                                                     GError                    **error);
+
 gboolean eos_ostree_avahi_service_file_check_options (GVariant  *options,
                                                       GError   **error);
 gboolean eos_ostree_avahi_service_file_generate (const gchar          *avahi_service_directory,
@@ -227,5 +364,10 @@ gboolean eos_ostree_avahi_service_file_delete (const gchar   *avahi_service_dire
 gboolean eos_ostree_avahi_service_file_cleanup_directory (const gchar   *avahi_service_directory,
                                                           GCancellable  *cancellable,
                                                           GError       **error);
+gboolean eos_ostree_avahi_service_file_cleanup_directory_except (const gchar    *avahi_service_directory,
+                                                                 const guint16  *keep_indices,
+                                                                 gsize           n_keep_indices,
+                                                                 GCancellable   *cancellable,
+                                                                 GError        **error);
 
 G_END_DECLS
@@ -628,3 +628,151 @@ euu_config_file_get_groups (EuuConfigFile  *self,
 
   return g_steal_pointer (&groups_array);
 }
+
+static gboolean
+parse_time_of_day (const gchar  *str,
+                   guint        *out_minute)
+{
+  g_auto(GStrv) parts = g_strsplit (str, ":", -1);
+  guint64 hours, minutes;
+
+  if (g_strv_length (parts) != 2 ||
+      !g_ascii_string_to_unsigned (parts[0], 10, 0, 24, &hours, NULL) ||
+      !g_ascii_string_to_unsigned (parts[1], 10, 0, 59, &minutes, NULL) ||
+      (hours == 24 && minutes != 0))
+    return FALSE;
+
+  *out_minute = (guint) (hours * 60 + minutes);
+  return TRUE;
+}
+
+/**
+ * euu_time_windows_parse:
+ * @windows: (array zero-terminated=1): time windows to parse, each in the
+ *    form `HH:MM-HH:MM`
+ * @error: return location for a #GError, or %NULL
+ *
+ * Parse a list of daily time windows from a configuration file. Each window
+ * runs from its start time (inclusive) to its end time (exclusive), in local
+ * time. If the end time is earlier than the start time, the window wraps
+ * around midnight (for example, `22:00-06:00`). If they are equal, the window
+ * covers the whole day.
+ *
+ * Returns: (transfer full) (element-type EuuTimeWindow): the parsed windows,
+ *    which may be empty
+ */
+GArray *
+euu_time_windows_parse (const gchar * const  *windows,
+                        GError              **error)
+{
+  g_autoptr(GArray) array = g_array_new (FALSE, FALSE, sizeof (EuuTimeWindow));
+  gsize i;
+
+  g_return_val_if_fail (error == NULL || *error == NULL, NULL);
+
+  for (i = 0; windows != NULL && windows[i] != NULL; i++)
+    {
+      g_auto(GStrv) times = g_strsplit (windows[i], "-", -1);
+      EuuTimeWindow window;
+
+      if (g_strv_length (times) != 2 ||
+          !parse_time_of_day (g_strstrip (times[0]), &window.start_minute) ||
+          !parse_time_of_day (g_strstrip (times[1]), &window.end_minute))
+        {
+          g_set_error (error, G_KEY_FILE_ERROR, G_KEY_FILE_ERROR_INVALID_VALUE,
+                       "Invalid time window ‘%s’: must be of the form HH:MM-HH:MM",
+                       windows[i]);
+          return NULL;
+        }
+
+      g_array_append_val (array, window);
+    }
+
+  return g_steal_pointer (&array);
+}
+
+/**
+ * euu_time_windows_contain:
+ * @windows: (element-type EuuTimeWindow): windows from euu_time_windows_parse()
+ * @date_time: time to check, which is converted to local time
+ *
+ * Check whether @date_time falls into any of @windows. If @windows is empty,
+ * there are no restrictions, so this always returns %TRUE.
+ *
+ * Returns: %TRUE if @date_time is in one of @windows, %FALSE otherwise
+ */
+gboolean
+euu_time_windows_contain (GArray    *windows,
+                          GDateTime *date_time)
+{
+  g_autoptr(GDateTime) local_date_time = NULL;
+  guint minute;
+  gsize i;
+
+  g_return_val_if_fail (windows != NULL, TRUE);
+  g_return_val_if_fail (date_time != NULL, TRUE);
+
+  if (windows->len == 0)
+    return TRUE;
+
+  local_date_time = g_date_time_to_local (date_time);
+  minute = (guint) (g_date_time_get_hour (local_date_time) * 60 +
+                    g_date_time_get_minute (local_date_time));
+
+  for (i = 0; i < windows->len; i++)
+    {
+      const EuuTimeWindow *window = &g_array_index (windows, EuuTimeWindow, i);
+
+      if (window->start_minute == window->end_minute)
+        return TRUE;
+      else if (window->start_minute < window->end_minute &&
+               minute >= window->start_minute && minute < window->end_minute)
+        return TRUE;
+      else if (window->start_minute > window->end_minute &&
+               (minute >= window->start_minute || minute < window->end_minute))
+        return TRUE;
+    }
+
+  return FALSE;
+}
+
+/**
+ * euu_time_windows_get_minutes_until_open:
+ * @windows: (element-type EuuTimeWindow): windows from euu_time_windows_parse()
+ * @date_time: time to check from, which is converted to local time
+ *
+ * Work out how long it is from @date_time until the start of the next of
+ * @windows. If @date_time is already in one of @windows (or @windows is
+ * empty), this returns zero.
+ *
+ * Returns: number of minutes until one of @windows opens; at most one day
+ */
+guint
+euu_time_windows_get_minutes_until_open (GArray    *windows,
+                                         GDateTime *date_time)
+{
+  g_autoptr(GDateTime) local_date_time = NULL;
+  guint minute;
+  guint minutes_until_open = 24 * 60;
+  gsize i;
+
+  g_return_val_if_fail (windows != NULL, 0);
+  g_return_val_if_fail (date_time != NULL, 0);
+
+  if (euu_time_windows_contain (windows, date_time))
+    return 0;
+
+  local_date_time = g_date_time_to_local (date_time);
+  minute = (guint) (g_date_time_get_hour (local_date_time) * 60 +
+                    g_date_time_get_minute (local_date_time));
+
+  for (i = 0; i < windows->len; i++)
+    {
+      const EuuTimeWindow *window = &g_array_index (windows, EuuTimeWindow, i);
+      guint minutes = (window->start_minute + 24 * 60 - minute) % (24 * 60);
+
+      minutes_until_open = MIN (minutes_until_open, minutes);
+    }
+
+  return minutes_until_open;
+}
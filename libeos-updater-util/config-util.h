@@ -65,4 +65,25 @@ gchar **euu_config_file_get_groups (EuuConfigFile  *self,
                                     gsize          *n_groups_out,
                                     GError        **error);
 
+/**
+ * EuuTimeWindow:
+ * @start_minute: start of the window, in minutes since midnight (inclusive)
+ * @end_minute: end of the window, in minutes since midnight (exclusive); if
+ *    this is less than @start_minute, the window wraps around midnight
+ *
+ * A daily window of local time, as parsed by euu_time_windows_parse().
+ */
+typedef struct
+{
+  guint start_minute;
+  guint end_minute;
+} EuuTimeWindow;
+
+GArray *euu_time_windows_parse (const gchar * const  *windows,
+                                GError              **error);
+gboolean euu_time_windows_contain (GArray    *windows,
+                                   GDateTime *date_time);
+guint euu_time_windows_get_minutes_until_open (GArray    *windows,
+                                               GDateTime *date_time);
+
 G_END_DECLS
@@ -23,6 +23,8 @@
  *  - Philip Withnall <withnall@endlessm.com>
  */
 
+#include "config.h"
+
 #include <errno.h>
 #include <flatpak.h>
 #include <glib.h>
@@ -1169,6 +1171,344 @@ euu_flatpak_remote_ref_actions_file_free (EuuFlatpakRemoteRefActionsFile *file)
   g_slice_free (EuuFlatpakRemoteRefActionsFile, file);
 }
 
+/* Cache of the parsed autoinstall files from directories on the file system,
+ * so that unchanged files don’t have to be re-parsed, or have their filters
+ * re-evaluated, each time the flatpak installer runs or an update is fetched.
+ *
+ * Entries are keyed by the path of each file, and are only used if the file’s
+ * size, modification and change times, inode and device are all unchanged.
+ * As filters are applied while parsing, the whole cache is invalidated if the
+ * architecture or locales used to evaluate them change. It is also invalidated
+ * if eos-updater is upgraded, as the parser (and so the parsed actions) may
+ * have changed without the format changing.
+ *
+ * The cache is stored as a GVariant of type %AUTOINSTALL_CACHE_FORMAT, so it
+ * can be mapped in rather than parsed. */
+#define AUTOINSTALL_CACHE_VERSION 3
+#define AUTOINSTALL_CACHE_FINGERPRINT_FORMAT "(ttttt)"
+#define AUTOINSTALL_CACHE_ACTION_FORMAT "(uusmsmsmsmssiu)"
+#define AUTOINSTALL_CACHE_ENTRY_FORMAT "(" AUTOINSTALL_CACHE_FINGERPRINT_FORMAT "a" AUTOINSTALL_CACHE_ACTION_FORMAT "as)"
+#define AUTOINSTALL_CACHE_FORMAT "(ussasa{s" AUTOINSTALL_CACHE_ENTRY_FORMAT "})"
+
+/* File attributes needed by autoinstall_cache_fingerprint(). */
+#define AUTOINSTALL_CACHE_FILE_ATTRIBUTES \
+  G_FILE_ATTRIBUTE_STANDARD_SIZE "," \
+  G_FILE_ATTRIBUTE_TIME_MODIFIED "," \
+  G_FILE_ATTRIBUTE_TIME_MODIFIED_USEC "," \
+  G_FILE_ATTRIBUTE_TIME_CHANGED "," \
+  G_FILE_ATTRIBUTE_TIME_CHANGED_USEC "," \
+  G_FILE_ATTRIBUTE_UNIX_INODE "," \
+  G_FILE_ATTRIBUTE_UNIX_DEVICE
+
+typedef struct
+{
+  gchar *path;  /* (owned) */
+  GHashTable *entries;  /* (owned) (element-type filename GVariant) */
+  GHashTable *seen_paths;  /* (owned) (element-type filename filename) */
+  GHashTable *scanned_directories;  /* (owned) (element-type filename filename) */
+  gboolean dirty;
+} AutoinstallCache;
+
+static void
+autoinstall_cache_free (AutoinstallCache *cache)
+{
+  g_free (cache->path);
+  g_hash_table_unref (cache->entries);
+  g_hash_table_unref (cache->seen_paths);
+  g_hash_table_unref (cache->scanned_directories);
+  g_free (cache);
+}
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (AutoinstallCache, autoinstall_cache_free)
+
+/* Load the cache from disk. Any problems loading it are not fatal: an empty
+ * cache is returned instead. */
+static AutoinstallCache *
+autoinstall_cache_load (void)
+{
+  g_autoptr(AutoinstallCache) cache = g_new0 (AutoinstallCache, 1);
+  g_autoptr(GMappedFile) mapped_file = NULL;
+  g_autoptr(GBytes) bytes = NULL;
+  g_autoptr(GVariant) variant = NULL;
+  g_autoptr(GVariant) entries = NULL;
+  g_autoptr(GError) local_error = NULL;
+  g_auto(GStrv) locales = eos_updater_override_locales_list ();
+  g_autofree const gchar **cached_locales = NULL;
+  const gchar *cached_package_version;
+  const gchar *cached_architecture;
+  guint32 version;
+  GVariantIter iter;
+  gchar *path;
+  GVariant *entry;
+
+  cache->path = g_strdup (euu_flatpak_autoinstall_cache_path ());
+  cache->entries = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                          (GDestroyNotify) g_variant_unref);
+  cache->seen_paths = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  cache->scanned_directories = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+
+  mapped_file = g_mapped_file_new (cache->path, FALSE, &local_error);
+  if (mapped_file == NULL)
+    {
+      if (!g_error_matches (local_error, G_FILE_ERROR, G_FILE_ERROR_NOENT))
+        g_debug ("%s: Error loading autoinstall cache ‘%s’; ignoring: %s",
+                 G_STRFUNC, cache->path, local_error->message);
+      return g_steal_pointer (&cache);
+    }
+
+  bytes = g_mapped_file_get_bytes (mapped_file);
+  variant = g_variant_ref_sink (g_variant_new_from_bytes (G_VARIANT_TYPE (AUTOINSTALL_CACHE_FORMAT),
+                                                          bytes, FALSE));
+
+  if (!g_variant_is_normal_form (variant))
+    {
+      g_debug ("%s: Ignoring corrupt autoinstall cache ‘%s’", G_STRFUNC, cache->path);
+      cache->dirty = TRUE;
+      return g_steal_pointer (&cache);
+    }
+
+  g_variant_get (variant, "(u&s&s^a&s@a{s" AUTOINSTALL_CACHE_ENTRY_FORMAT "})",
+                 &version, &cached_package_version, &cached_architecture,
+                 &cached_locales, &entries);
+
+  if (version != AUTOINSTALL_CACHE_VERSION ||
+      g_strcmp0 (cached_package_version, VERSION) != 0 ||
+      g_strcmp0 (cached_architecture, euu_get_system_architecture_string ()) != 0 ||
+      !g_strv_equal ((const gchar * const *) cached_locales, (const gchar * const *) locales))
+    {
+      g_debug ("%s: Ignoring outdated autoinstall cache ‘%s’", G_STRFUNC, cache->path);
+      cache->dirty = TRUE;
+      return g_steal_pointer (&cache);
+    }
+
+  g_variant_iter_init (&iter, entries);
+  while (g_variant_iter_next (&iter, "{s@" AUTOINSTALL_CACHE_ENTRY_FORMAT "}", &path, &entry))
+    g_hash_table_replace (cache->entries, path, entry);
+
+  return g_steal_pointer (&cache);
+}
+
+/* Write the cache back to disk if it has changed. Entries for files which were
+ * not seen in any of the directories scanned since it was loaded are dropped,
+ * as those files no longer exist; entries from other directories are kept.
+ * Failure to save the cache is not fatal. */
+static void
+autoinstall_cache_save (AutoinstallCache *cache)
+{
+  g_auto(GStrv) locales = eos_updater_override_locales_list ();
+  g_auto(GVariantBuilder) entries_builder = G_VARIANT_BUILDER_INIT (G_VARIANT_TYPE ("a{s" AUTOINSTALL_CACHE_ENTRY_FORMAT "}"));
+  g_autoptr(GVariant) variant = NULL;
+  g_autofree gchar *cache_directory = NULL;
+  g_autoptr(GError) local_error = NULL;
+  GHashTableIter iter;
+  gpointer key, value;
+
+  g_hash_table_iter_init (&iter, cache->entries);
+  while (g_hash_table_iter_next (&iter, &key, &value))
+    {
+      const gchar *path = key;
+      g_autofree gchar *directory = g_path_get_dirname (path);
+
+      if (g_hash_table_contains (cache->scanned_directories, directory) &&
+          !g_hash_table_contains (cache->seen_paths, path))
+        {
+          g_hash_table_iter_remove (&iter);
+          cache->dirty = TRUE;
+          continue;
+        }
+
+      g_variant_builder_add (&entries_builder, "{s@" AUTOINSTALL_CACHE_ENTRY_FORMAT "}",
+                             path, value);
+    }
+
+  if (!cache->dirty)
+    return;
+
+  variant = g_variant_ref_sink (g_variant_new ("(uss^as@a{s" AUTOINSTALL_CACHE_ENTRY_FORMAT "})",
+                                               (guint32) AUTOINSTALL_CACHE_VERSION,
+                                               VERSION,
+                                               euu_get_system_architecture_string (),
+                                               locales,
+                                               g_variant_builder_end (&entries_builder)));
+
+  cache_directory = g_path_get_dirname (cache->path);
+  if (g_mkdir_with_parents (cache_directory, 0755) != 0)
+    {
+      int saved_errno = errno;
+      g_debug ("%s: Error creating directory ‘%s’ for autoinstall cache; ignoring: %s",
+               G_STRFUNC, cache_directory, g_strerror (saved_errno));
+      return;
+    }
+
+  if (!g_file_set_contents (cache->path, g_variant_get_data (variant),
+                            (gssize) g_variant_get_size (variant), &local_error))
+    {
+      g_debug ("%s: Error saving autoinstall cache; ignoring: %s",
+               G_STRFUNC, local_error->message);
+      return;
+    }
+
+  cache->dirty = FALSE;
+}
+
+static GVariant *
+autoinstall_cache_fingerprint (GFileInfo *info)
+{
+  guint64 modified = g_file_info_get_attribute_uint64 (info, G_FILE_ATTRIBUTE_TIME_MODIFIED) * G_USEC_PER_SEC +
+                     g_file_info_get_attribute_uint32 (info, G_FILE_ATTRIBUTE_TIME_MODIFIED_USEC);
+  guint64 changed = g_file_info_get_attribute_uint64 (info, G_FILE_ATTRIBUTE_TIME_CHANGED) * G_USEC_PER_SEC +
+                    g_file_info_get_attribute_uint32 (info, G_FILE_ATTRIBUTE_TIME_CHANGED_USEC);
+
+  return g_variant_new (AUTOINSTALL_CACHE_FINGERPRINT_FORMAT,
+                        (guint64) g_file_info_get_size (info),
+                        modified,
+                        changed,
+                        g_file_info_get_attribute_uint64 (info, G_FILE_ATTRIBUTE_UNIX_INODE),
+                        (guint64) g_file_info_get_attribute_uint32 (info, G_FILE_ATTRIBUTE_UNIX_DEVICE));
+}
+
+static GVariant *
+autoinstall_cache_serialize_action (EuuFlatpakRemoteRefAction *action)
+{
+  FlatpakRef *ref = action->ref->ref;
+
+  return g_variant_new (AUTOINSTALL_CACHE_ACTION_FORMAT,
+                        (guint32) action->type,
+                        (guint32) flatpak_ref_get_kind (ref),
+                        flatpak_ref_get_name (ref),
+                        flatpak_ref_get_arch (ref),
+                        flatpak_ref_get_branch (ref),
+                        action->ref->remote,
+                        action->ref->collection_id,
+                        action->source,
+                        action->serial,
+                        (guint32) action->flags);
+}
+
+/* Returns %NULL if @variant is not valid. */
+static EuuFlatpakRemoteRefAction *
+autoinstall_cache_deserialize_action (GVariant *variant)
+{
+  guint32 type, kind, flags;
+  const gchar *name, *arch, *branch, *remote, *collection_id, *source;
+  gint32 serial;
+  g_autoptr(FlatpakRef) ref = NULL;
+  g_autoptr(EuuFlatpakLocationRef) location_ref = NULL;
+
+  g_variant_get (variant, "(uu&sm&sm&sm&sm&s&siu)",
+                 &type, &kind, &name, &arch, &branch, &remote, &collection_id,
+                 &source, &serial, &flags);
+
+  if (type > EUU_FLATPAK_REMOTE_REF_ACTION_UPDATE ||
+      (kind != FLATPAK_REF_KIND_APP && kind != FLATPAK_REF_KIND_RUNTIME) ||
+      (flags & ~EUU_FLATPAK_REMOTE_REF_ACTION_FLAG_IS_DEPENDENCY) != 0 ||
+      /* Uninstall and update actions have no remote; see
+       * flatpak_remote_ref_from_action_entry(). */
+      (type == EUU_FLATPAK_REMOTE_REF_ACTION_INSTALL && remote == NULL) ||
+      (remote != NULL && !ostree_validate_remote_name (remote, NULL)) ||
+      (collection_id != NULL && !ostree_validate_collection_id (collection_id, NULL)))
+    return NULL;
+
+  ref = g_object_new (FLATPAK_TYPE_REF,
+                      "kind", (FlatpakRefKind) kind,
+                      "name", name,
+                      "arch", arch,
+                      "branch", branch,
+                      NULL);
+  location_ref = euu_flatpak_location_ref_new (ref, remote, collection_id);
+
+  return euu_flatpak_remote_ref_action_new ((EuuFlatpakRemoteRefActionType) type,
+                                            location_ref,
+                                            source,
+                                            serial,
+                                            (EuuFlatpakRemoteRefActionFlags) flags);
+}
+
+/* Look up the actions for the file at @path, returning %NULL if they aren’t
+ * cached or the file has changed since they were. */
+static GPtrArray *  /* (element-type EuuFlatpakRemoteRefAction) */
+autoinstall_cache_lookup (AutoinstallCache  *cache,
+                          const gchar       *path,
+                          GVariant          *fingerprint,
+                          GPtrArray        **out_skipped_actions  /* (element-type utf8) */)
+{
+  GVariant *entry = g_hash_table_lookup (cache->entries, path);
+  g_autoptr(GVariant) cached_fingerprint = NULL;
+  g_autoptr(GVariant) cached_actions = NULL;
+  g_autoptr(GVariant) cached_skipped_actions = NULL;
+  g_autoptr(GPtrArray) actions = NULL;
+  g_autoptr(GPtrArray) skipped_actions = NULL;
+  gsize i, n_actions, n_skipped_actions;
+
+  if (entry == NULL)
+    return NULL;
+
+  g_variant_get (entry, "(@" AUTOINSTALL_CACHE_FINGERPRINT_FORMAT "@a" AUTOINSTALL_CACHE_ACTION_FORMAT "@as)",
+                 &cached_fingerprint, &cached_actions, &cached_skipped_actions);
+
+  if (!g_variant_equal (cached_fingerprint, fingerprint))
+    return NULL;
+
+  n_actions = g_variant_n_children (cached_actions);
+  actions = g_ptr_array_new_full (n_actions, (GDestroyNotify) euu_flatpak_remote_ref_action_unref);
+
+  for (i = 0; i < n_actions; i++)
+    {
+      g_autoptr(GVariant) child = g_variant_get_child_value (cached_actions, i);
+      EuuFlatpakRemoteRefAction *action = autoinstall_cache_deserialize_action (child);
+
+      if (action == NULL)
+        return NULL;
+
+      g_ptr_array_add (actions, action);
+    }
+
+  n_skipped_actions = g_variant_n_children (cached_skipped_actions);
+  skipped_actions = g_ptr_array_new_full (n_skipped_actions, g_free);
+
+  for (i = 0; i < n_skipped_actions; i++)
+    {
+      const gchar *skipped_action;
+
+      g_variant_get_child (cached_skipped_actions, i, "&s", &skipped_action);
+      g_ptr_array_add (skipped_actions, g_strdup (skipped_action));
+    }
+
+  g_hash_table_add (cache->seen_paths, g_strdup (path));
+
+  *out_skipped_actions = g_steal_pointer (&skipped_actions);
+  return g_steal_pointer (&actions);
+}
+
+static void
+autoinstall_cache_insert (AutoinstallCache *cache,
+                          const gchar      *path,
+                          GVariant         *fingerprint,
+                          GPtrArray        *actions  /* (element-type EuuFlatpakRemoteRefAction) */,
+                          GPtrArray        *skipped_actions  /* (element-type utf8) (nullable) */)
+{
+  g_auto(GVariantBuilder) actions_builder = G_VARIANT_BUILDER_INIT (G_VARIANT_TYPE ("a" AUTOINSTALL_CACHE_ACTION_FORMAT));
+  g_auto(GVariantBuilder) skipped_actions_builder = G_VARIANT_BUILDER_INIT (G_VARIANT_TYPE_STRING_ARRAY);
+  gsize i;
+
+  for (i = 0; i < actions->len; i++)
+    g_variant_builder_add_value (&actions_builder,
+                                 autoinstall_cache_serialize_action (g_ptr_array_index (actions, i)));
+
+  for (i = 0; skipped_actions != NULL && i < skipped_actions->len; i++)
+    g_variant_builder_add (&skipped_actions_builder, "s",
+                           (const gchar *) g_ptr_array_index (skipped_actions, i));
+
+  g_hash_table_replace (cache->entries,
+                        g_strdup (path),
+                        g_variant_ref_sink (g_variant_new ("(@" AUTOINSTALL_CACHE_FINGERPRINT_FORMAT "@a" AUTOINSTALL_CACHE_ACTION_FORMAT "@as)",
+                                                           fingerprint,
+                                                           g_variant_builder_end (&actions_builder),
+                                                           g_variant_builder_end (&skipped_actions_builder))));
+  g_hash_table_add (cache->seen_paths, g_strdup (path));
+  cache->dirty = TRUE;
+}
+
 /* Update @ref_actions_for_files to add all the action lists from files in
  * @directory to it, at the given @priority. Lower numeric @priority values are
  * more important. If a filename from @directory is already listed in
@@ -1183,21 +1523,34 @@ euu_flatpak_remote_ref_actions_file_free (EuuFlatpakRemoteRefActionsFile *file)
  *
  * If @directory does not exist, a %G_IO_ERROR_NOT_FOUND error will be returned
  * unless @allow_noent is %TRUE, in which case, %TRUE will be returned and
- * @ref_actions_for_files will not be modified. */
-gboolean
-euu_flatpak_ref_actions_append_from_directory (GFile         *directory,
-                                               GHashTable    *ref_actions_for_files,
-                                               gint           priority,
-                                               gboolean       allow_noent,
-                                               GCancellable  *cancellable,
-                                               GError       **error)
+ * @ref_actions_for_files will not be modified.
+ *
+ * If @cache is non-%NULL and @directory is on the local file system, files
+ * which are unchanged since they were last parsed are loaded from @cache rather
+ * than being parsed again, and @cache is updated with any newly parsed files. */
+static gboolean
+append_from_directory_cached (GFile             *directory,
+                              GHashTable        *ref_actions_for_files,
+                              gint               priority,
+                              gboolean           allow_noent,
+                              AutoinstallCache  *cache,
+                              GCancellable      *cancellable,
+                              GError           **error)
 {
   g_autoptr(GFileEnumerator) autoinstall_d_enumerator = NULL;
   g_autoptr(GError) local_error = NULL;
+  g_autofree gchar *directory_path = NULL;
+
+  /* Files in commits are cached in memory by OstreeRepo already, and don’t
+   * have stable fingerprints, so only cache files on the local file system. */
+  if (cache != NULL && g_file_is_native (directory))
+    directory_path = g_file_get_path (directory);
 
   /* Repository checked out, read all files in order and build up a list
    * of flatpaks to auto-install */
   autoinstall_d_enumerator = g_file_enumerate_children (directory,
+                                                        (directory_path != NULL) ?
+                                                        G_FILE_ATTRIBUTE_STANDARD_NAME "," AUTOINSTALL_CACHE_FILE_ATTRIBUTES :
                                                         G_FILE_ATTRIBUTE_STANDARD_NAME,
                                                         G_FILE_QUERY_INFO_NONE,
                                                         cancellable,
@@ -1207,7 +1560,11 @@ euu_flatpak_ref_actions_append_from_directory (GFile         *directory,
     {
       if (allow_noent &&
           g_error_matches (local_error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND))
-        return TRUE;
+        {
+          if (directory_path != NULL)
+            g_hash_table_add (cache->scanned_directories, g_steal_pointer (&directory_path));
+          return TRUE;
+        }
 
       g_propagate_error (error, g_steal_pointer (&local_error));
       return FALSE;
@@ -1248,10 +1605,30 @@ euu_flatpak_ref_actions_append_from_directory (GFile         *directory,
           existing_actions_file->priority < priority)
         continue;
 
-      action_refs = euu_flatpak_ref_actions_from_file (file, &skipped_action_refs, cancellable, error);
+      if (directory_path != NULL)
+        {
+          g_autofree gchar *path = g_build_filename (directory_path, filename, NULL);
+          g_autoptr(GVariant) fingerprint = g_variant_ref_sink (autoinstall_cache_fingerprint (info));
 
-      if (action_refs == NULL)
-        return FALSE;
+          action_refs = autoinstall_cache_lookup (cache, path, fingerprint, &skipped_action_refs);
+
+          if (action_refs == NULL)
+            {
+              action_refs = euu_flatpak_ref_actions_from_file (file, &skipped_action_refs, cancellable, error);
+
+              if (action_refs == NULL)
+                return FALSE;
+
+              autoinstall_cache_insert (cache, path, fingerprint, action_refs, skipped_action_refs);
+            }
+        }
+      else
+        {
+          action_refs = euu_flatpak_ref_actions_from_file (file, &skipped_action_refs, cancellable, error);
+
+          if (action_refs == NULL)
+            return FALSE;
+        }
 
       if (skipped_action_refs != NULL && skipped_action_refs->len > 0)
         {
@@ -1269,9 +1646,26 @@ euu_flatpak_ref_actions_append_from_directory (GFile         *directory,
                                                                      priority));
     }
 
+  if (directory_path != NULL)
+    g_hash_table_add (cache->scanned_directories, g_steal_pointer (&directory_path));
+
   return TRUE;
 }
 
+/* As append_from_directory_cached(), without a cache. */
+gboolean
+euu_flatpak_ref_actions_append_from_directory (GFile         *directory,
+                                               GHashTable    *ref_actions_for_files,
+                                               gint           priority,
+                                               gboolean       allow_noent,
+                                               GCancellable  *cancellable,
+                                               GError       **error)
+{
+  return append_from_directory_cached (directory, ref_actions_for_files,
+                                       priority, allow_noent, NULL,
+                                       cancellable, error);
+}
+
 /**
  * euu_flatpak_ref_actions_from_directory:
  * @directory:
@@ -1332,14 +1726,65 @@ euu_flatpak_ref_equal (gconstpointer a,
           g_strcmp0 (flatpak_ref_get_branch (a_ref), flatpak_ref_get_branch (b_ref)) == 0);
 }
 
-/* A GEqualFunc which only looks at the ref, not the action type etc. */
+/**
+ * euu_flatpak_installation_list_installed_refs_set:
+ * @installation: a #FlatpakInstallation
+ * @cancellable: (nullable): a #GCancellable
+ * @error: return location for a #GError
+ *
+ * List all the refs installed in @installation in one go, as a set which can
+ * be queried with a #FlatpakRef in constant time. This is a lot cheaper than
+ * calling flatpak_installation_get_installed_ref() for each of several refs,
+ * which reads the deploy directory each time.
+ *
+ * The set is a snapshot, and is not updated if @installation changes.
+ *
+ * Returns: (transfer container) (element-type FlatpakInstalledRef FlatpakInstalledRef):
+ *    set of installed refs, hashed using euu_flatpak_ref_hash()
+ */
+GHashTable *
+euu_flatpak_installation_list_installed_refs_set (FlatpakInstallation  *installation,
+                                                  GCancellable         *cancellable,
+                                                  GError              **error)
+{
+  g_autoptr(GPtrArray) installed_refs = NULL;
+  g_autoptr(GHashTable) installed_refs_set = NULL;
+  gsize i;
+
+  g_return_val_if_fail (FLATPAK_IS_INSTALLATION (installation), NULL);
+  g_return_val_if_fail (cancellable == NULL || G_IS_CANCELLABLE (cancellable), NULL);
+  g_return_val_if_fail (error == NULL || *error == NULL, NULL);
+
+  installed_refs = flatpak_installation_list_installed_refs (installation, cancellable, error);
+  if (installed_refs == NULL)
+    return NULL;
+
+  installed_refs_set = g_hash_table_new_full (euu_flatpak_ref_hash,
+                                              euu_flatpak_ref_equal,
+                                              g_object_unref,
+                                              NULL);
+
+  for (i = 0; i < installed_refs->len; i++)
+    g_hash_table_add (installed_refs_set, g_object_ref (g_ptr_array_index (installed_refs, i)));
+
+  return g_steal_pointer (&installed_refs_set);
+}
+
+/* Whether @ref_actions is already in the order sort_flatpak_remote_ref_actions()
+ * would put it in. */
 static gboolean
-euu_flatpak_remote_ref_action_equal_ref_only (gconstpointer a,
-                                              gconstpointer b)
+ref_actions_are_sorted (GPtrArray *ref_actions  /* (element-type EuuFlatpakRemoteRefAction) */)
 {
-  EuuFlatpakRemoteRefAction *a_action = (EuuFlatpakRemoteRefAction *)a;
-  EuuFlatpakRemoteRefAction *b_action = (EuuFlatpakRemoteRefAction *)b;
-  return euu_flatpak_ref_equal (a_action->ref->ref, b_action->ref->ref);
+  gsize i;
+
+  for (i = 1; i < ref_actions->len; ++i)
+    {
+      if (sort_flatpak_remote_ref_actions (&ref_actions->pdata[i - 1],
+                                           &ref_actions->pdata[i]) > 0)
+        return FALSE;
+    }
+
+  return TRUE;
 }
 
 /* Squash actions on the same ref into the last action on that ref, returning
@@ -1394,32 +1839,29 @@ squash_ref_actions_ptr_array (GPtrArray *ref_actions  /* (element-type EuuFlatpa
   for (i = 0; i < ref_actions->len; ++i)
     {
       EuuFlatpakRemoteRefAction *action = g_ptr_array_index (ref_actions, i);
-      EuuFlatpakRemoteRefAction *squashed_action_for_ref = NULL;
-
-      squashed_action_for_ref = g_hash_table_lookup (hash_table, action->ref->ref);
-      g_assert (squashed_action_for_ref != NULL);
+      gpointer squashed_ref, squashed_action_for_ref;
 
       /* Check that the action matches so that e.g.
        * [ install A, install B, uninstall A ] gets squashed into
        * [ install B, uninstall A ] not [ uninstall A, install B ]
+       *
+       * The action is removed from the hash table once it’s added, so that
+       * it’s not added again in case it appears multiple times in the input
+       * array.
        */
-      if (squashed_action_for_ref != action)
-        continue;
-
-      /* Ensure we're not adding a duplicate in case the input array has
-       * multiple actions of the same type on the same ref
-       */
-      if (g_ptr_array_find_with_equal_func (squashed_ref_actions,
-                                            action,
-                                            euu_flatpak_remote_ref_action_equal_ref_only,
-                                            NULL))
+      if (g_hash_table_lookup (hash_table, action->ref->ref) != action)
         continue;
 
-      g_ptr_array_add (squashed_ref_actions,
-                       euu_flatpak_remote_ref_action_ref (squashed_action_for_ref));
+      g_hash_table_steal_extended (hash_table, action->ref->ref,
+                                   &squashed_ref, &squashed_action_for_ref);
+      g_object_unref (squashed_ref);
+      g_ptr_array_add (squashed_ref_actions, squashed_action_for_ref);
     }
 
-  g_ptr_array_sort (squashed_ref_actions, sort_flatpak_remote_ref_actions);
+  /* The input is typically already sorted, unless it’s been concatenated from
+   * several files, so avoid the sort if possible. */
+  if (!ref_actions_are_sorted (squashed_ref_actions))
+    g_ptr_array_sort (squashed_ref_actions, sort_flatpak_remote_ref_actions);
 
   return g_steal_pointer (&squashed_ref_actions);
 }
@@ -1659,6 +2101,80 @@ euu_filter_for_existing_flatpak_ref_actions (GHashTable *ref_actions  /* (elemen
                                            progresses);
 }
 
+/* Create a dependency ref action for the related @op found while resolving
+ * @origin_action. */
+static EuuFlatpakRemoteRefAction *
+dependency_ref_action_new_for_op (FlatpakTransactionOperation *op,
+                                  GPtrArray                   *remotes,
+                                  EuuFlatpakRemoteRefAction   *origin_action)
+{
+  FlatpakTransactionOperationType op_type = flatpak_transaction_operation_get_operation_type (op);
+  const char *op_ref = flatpak_transaction_operation_get_ref (op);
+  const char *op_remote = flatpak_transaction_operation_get_remote (op);
+  g_autoptr(EuuFlatpakLocationRef) location_ref = NULL;
+  g_autoptr(FlatpakRef) related_ref_as_ref = NULL;
+  FlatpakRemote *remote = NULL;
+  EuuFlatpakRemoteRefActionType action_type;
+
+  related_ref_as_ref = flatpak_ref_parse (op_ref, NULL);
+  g_assert (related_ref_as_ref != NULL);
+
+  for (gsize i = 0; i < remotes->len; ++i)
+    {
+      FlatpakRemote *candidate_remote = g_ptr_array_index (remotes, i);
+      /* We don't skip noenumerate remotes here, because while Flatpak
+       * doesn't use such remotes for runtime dependencies it does use them
+       * for related ref dependencies, in case the origin remote of the
+       * main ref is noenumerate.
+       */
+      if (flatpak_remote_get_disabled (candidate_remote) ||
+          flatpak_remote_get_nodeps (candidate_remote))
+        continue;
+
+      if (g_strcmp0 (op_remote, flatpak_remote_get_name (candidate_remote)) == 0)
+        {
+          remote = candidate_remote;
+          break;
+        }
+    }
+  g_assert (remote != NULL);
+
+  location_ref =
+    euu_flatpak_location_ref_new (related_ref_as_ref,
+                                  flatpak_remote_get_name (remote),
+                                  flatpak_remote_get_collection_id (remote));
+
+  switch (op_type)
+    {
+      case FLATPAK_TRANSACTION_OPERATION_INSTALL:
+        action_type = EUU_FLATPAK_REMOTE_REF_ACTION_INSTALL;
+        break;
+      case FLATPAK_TRANSACTION_OPERATION_UNINSTALL:
+        action_type = EUU_FLATPAK_REMOTE_REF_ACTION_UNINSTALL;
+        break;
+      case FLATPAK_TRANSACTION_OPERATION_UPDATE:
+        action_type = EUU_FLATPAK_REMOTE_REF_ACTION_UPDATE;
+        break;
+      case FLATPAK_TRANSACTION_OPERATION_INSTALL_BUNDLE:
+      case FLATPAK_TRANSACTION_OPERATION_LAST_TYPE:
+      default:
+        /* We don't expect to see FLATPAK_TRANSACTION_OPERATION_INSTALL_BUNDLE */
+        g_assert_not_reached ();
+    }
+
+  /* Dependencies inherit the serial number and the
+   * source and have the EUU_FLATPAK_REMOTE_REF_ACTION_FLAG_IS_DEPENDENCY flag set.
+   * At the point at which dependencies are added, action ordering
+   * and prioritization has already occurred, so the serial doesn't have
+   * much meaning. The source is inherited because then we can at least
+   * show where the dependency came from in the debug output. */
+  return euu_flatpak_remote_ref_action_new (action_type,
+                                            location_ref,
+                                            origin_action->source,
+                                            origin_action->serial,
+                                            EUU_FLATPAK_REMOTE_REF_ACTION_FLAG_IS_DEPENDENCY);
+}
+
 typedef struct {
   EuuFlatpakRemoteRefAction *ref_action;
   const char                *ref_action_ref;
@@ -1675,87 +2191,94 @@ transaction_ready (FlatpakTransaction  *transaction,
   for (GList *l = ops; l != NULL; l = l->next)
     {
       FlatpakTransactionOperation *op = l->data;
-      FlatpakTransactionOperationType op_type = flatpak_transaction_operation_get_operation_type (op);
       const char *op_ref = flatpak_transaction_operation_get_ref (op);
-      const char *op_remote = flatpak_transaction_operation_get_remote (op);
-      EuuFlatpakLocationRef *location_ref = NULL;
-      g_autoptr(FlatpakRef) related_ref_as_ref = NULL;
-      FlatpakRemote *remote = NULL;
-      EuuFlatpakRemoteRefActionType action_type;
 
       /* We are only interested in related refs */
       if (g_strcmp0 (euu_transaction_data->ref_action_ref, op_ref) == 0)
         continue;
 
       g_debug ("Found dependency %s in remote %s for %s",
-               op_ref, op_remote, euu_transaction_data->ref_action_ref);
-
-      related_ref_as_ref = flatpak_ref_parse (op_ref, NULL);
-      g_assert (related_ref_as_ref != NULL);
+               op_ref, flatpak_transaction_operation_get_remote (op),
+               euu_transaction_data->ref_action_ref);
 
-      for (gsize i = 0; i < euu_transaction_data->remotes->len; ++i)
-        {
-          FlatpakRemote *candidate_remote = g_ptr_array_index (euu_transaction_data->remotes, i);
-          /* We don't skip noenumerate remotes here, because while Flatpak
-           * doesn't use such remotes for runtime dependencies it does use them
-           * for related ref dependencies, in case the origin remote of the
-           * main ref is noenumerate.
-           */
-          if (flatpak_remote_get_disabled (candidate_remote) ||
-              flatpak_remote_get_nodeps (candidate_remote))
-            continue;
+      g_ptr_array_add (euu_transaction_data->related_ref_actions,
+                       dependency_ref_action_new_for_op (op,
+                                                         euu_transaction_data->remotes,
+                                                         euu_transaction_data->ref_action));
+    }
 
-          if (g_strcmp0 (op_remote, flatpak_remote_get_name (candidate_remote)) == 0)
-            {
-              remote = candidate_remote;
-              break;
-            }
-        }
-      g_assert (remote != NULL);
+  /* Abort the transaction; we only wanted to know what it would do */
+  return FALSE;
+}
 
-      location_ref =
-        euu_flatpak_location_ref_new (related_ref_as_ref,
-                                      flatpak_remote_get_name (remote),
-                                      flatpak_remote_get_collection_id (remote));
+/* Enforce the conditions for each action type:
+ * - install means "update if installed, install otherwise"
+ * - update means "update if installed, do nothing otherwise"
+ * - uninstall means "uninstall if installed, do nothing otherwise"
+ *
+ * @out_needed is set to %FALSE if @ref_action should do nothing. @installed_refs
+ * is the set of installed refs, from
+ * euu_flatpak_installation_list_installed_refs_set(). */
+static void
+resolve_ref_action_type (GHashTable                     *installed_refs,
+                         EuuFlatpakRemoteRefAction      *ref_action,
+                         gboolean                       *out_needed,
+                         EuuFlatpakRemoteRefActionType  *out_resolved_action_type)
+{
+  gboolean is_installed = g_hash_table_contains (installed_refs, ref_action->ref->ref);
 
-      switch (op_type)
-        {
-          case FLATPAK_TRANSACTION_OPERATION_INSTALL:
-            action_type = EUU_FLATPAK_REMOTE_REF_ACTION_INSTALL;
-            break;
-          case FLATPAK_TRANSACTION_OPERATION_UNINSTALL:
-            action_type = EUU_FLATPAK_REMOTE_REF_ACTION_UNINSTALL;
-            break;
-          case FLATPAK_TRANSACTION_OPERATION_UPDATE:
-            action_type = EUU_FLATPAK_REMOTE_REF_ACTION_UPDATE;
-            break;
-          case FLATPAK_TRANSACTION_OPERATION_INSTALL_BUNDLE:
-          case FLATPAK_TRANSACTION_OPERATION_LAST_TYPE:
-          default:
-            /* We don't expect to see FLATPAK_TRANSACTION_OPERATION_INSTALL_BUNDLE */
-            g_assert_not_reached ();
-        }
+  *out_needed = TRUE;
+  *out_resolved_action_type = ref_action->type;
 
-      /* Dependencies inherit the serial number and the
-       * source and have the EUU_FLATPAK_REMOTE_REF_ACTION_FLAG_IS_DEPENDENCY flag set.
-       * At the point at which dependencies are added, action ordering
-       * and prioritization has already occurred, so the serial doesn't have
-       * much meaning. The source is inherited because then we can at least
-       * show where the dependency came from in the debug output. */
-      g_ptr_array_add (euu_transaction_data->related_ref_actions,
-                       euu_flatpak_remote_ref_action_new (action_type,
-                                                          location_ref,
-                                                          euu_transaction_data->ref_action->source,
-                                                          euu_transaction_data->ref_action->serial,
-                                                          EUU_FLATPAK_REMOTE_REF_ACTION_FLAG_IS_DEPENDENCY));
+  switch (ref_action->type)
+    {
+      case EUU_FLATPAK_REMOTE_REF_ACTION_INSTALL:
+        if (!is_installed)
+          *out_resolved_action_type = EUU_FLATPAK_REMOTE_REF_ACTION_INSTALL;
+        else
+          *out_resolved_action_type = EUU_FLATPAK_REMOTE_REF_ACTION_UPDATE;
+        break;
+      case EUU_FLATPAK_REMOTE_REF_ACTION_UNINSTALL:
+        if (!is_installed)
+          *out_needed = FALSE;
+        else
+          *out_resolved_action_type = EUU_FLATPAK_REMOTE_REF_ACTION_UNINSTALL;
+        break;
+      case EUU_FLATPAK_REMOTE_REF_ACTION_UPDATE:
+        if (!is_installed)
+          *out_needed = FALSE;
+        else
+          *out_resolved_action_type = EUU_FLATPAK_REMOTE_REF_ACTION_UPDATE;
+        break;
+      default:
+          g_assert_not_reached ();
     }
+}
 
-  /* Abort the transaction; we only wanted to know what it would do */
-  return FALSE;
+static gboolean
+transaction_add_ref_action (FlatpakTransaction             *transaction,
+                            EuuFlatpakRemoteRefAction      *ref_action,
+                            const char                     *ref_action_ref,
+                            EuuFlatpakRemoteRefActionType   resolved_action_type,
+                            GError                        **error)
+{
+  switch (resolved_action_type)
+    {
+      case EUU_FLATPAK_REMOTE_REF_ACTION_INSTALL:
+        return flatpak_transaction_add_install (transaction, ref_action->ref->remote, ref_action_ref, NULL, error);
+      case EUU_FLATPAK_REMOTE_REF_ACTION_UNINSTALL:
+        return flatpak_transaction_add_uninstall (transaction, ref_action_ref, error);
+      case EUU_FLATPAK_REMOTE_REF_ACTION_UPDATE:
+        return flatpak_transaction_add_update (transaction, ref_action_ref, NULL, NULL, error);
+      default:
+          g_assert_not_reached ();
+          return FALSE;
+    }
 }
 
 static gboolean
 find_related_refs_for_action (FlatpakInstallation       *installation,
+                              GHashTable                *installed_refs,
                               EuuFlatpakRemoteRefAction *ref_action,
                               GPtrArray                 *remotes,
                               GPtrArray                 *related_ref_actions,
@@ -1767,54 +2290,11 @@ find_related_refs_for_action (FlatpakInstallation       *installation,
   EuuTransactionData euu_transaction_data = { NULL };
   g_autofree char *ref_action_ref = flatpak_ref_format_ref (ref_action->ref->ref);
   EuuFlatpakRemoteRefActionType resolved_action_type;
+  gboolean needed;
 
-  /* Enforce the conditions for each action type:
-   * - install means "update if installed, install otherwise"
-   * - update means "update if installed, do nothing otherwise"
-   * - uninstall means "uninstall if installed, do nothing otherwise"
-   */
-    {
-      g_autoptr(FlatpakInstalledRef) installed_ref =
-        flatpak_installation_get_installed_ref (installation,
-                                                flatpak_ref_get_kind (ref_action->ref->ref),
-                                                flatpak_ref_get_name (ref_action->ref->ref),
-                                                flatpak_ref_get_arch (ref_action->ref->ref),
-                                                flatpak_ref_get_branch (ref_action->ref->ref),
-                                                cancellable,
-                                                &local_error);
-      if (installed_ref == NULL &&
-          !g_error_matches (local_error, FLATPAK_ERROR, FLATPAK_ERROR_NOT_INSTALLED))
-        {
-          g_propagate_error (error, g_steal_pointer (&local_error));
-          return FALSE;
-        }
-
-      switch (ref_action->type)
-        {
-          case EUU_FLATPAK_REMOTE_REF_ACTION_INSTALL:
-            if (installed_ref == NULL)
-              resolved_action_type = EUU_FLATPAK_REMOTE_REF_ACTION_INSTALL;
-            else
-              resolved_action_type = EUU_FLATPAK_REMOTE_REF_ACTION_UPDATE;
-            break;
-          case EUU_FLATPAK_REMOTE_REF_ACTION_UNINSTALL:
-            if (installed_ref == NULL)
-              return TRUE; /* early return */
-            else
-              resolved_action_type = EUU_FLATPAK_REMOTE_REF_ACTION_UNINSTALL;
-            break;
-          case EUU_FLATPAK_REMOTE_REF_ACTION_UPDATE:
-            if (installed_ref == NULL)
-              return TRUE; /* early return */
-            else
-              resolved_action_type = EUU_FLATPAK_REMOTE_REF_ACTION_UPDATE;
-            break;
-          default:
-              g_assert_not_reached ();
-        }
-
-      g_clear_error (&local_error);
-    }
+  resolve_ref_action_type (installed_refs, ref_action, &needed, &resolved_action_type);
+  if (!needed)
+    return TRUE;
 
   /* Here we use a FlatpakTransaction to determine the dependencies of
    * @action_ref, and abort the transaction before it executes the operations.
@@ -1832,23 +2312,9 @@ find_related_refs_for_action (FlatpakInstallation       *installation,
 
   flatpak_transaction_set_no_interaction (transaction, TRUE);
 
-  switch (resolved_action_type)
-    {
-      case EUU_FLATPAK_REMOTE_REF_ACTION_INSTALL:
-        if (!flatpak_transaction_add_install (transaction, ref_action->ref->remote, ref_action_ref, NULL, error))
-          return FALSE;
-        break;
-      case EUU_FLATPAK_REMOTE_REF_ACTION_UNINSTALL:
-        if (!flatpak_transaction_add_uninstall (transaction, ref_action_ref, error))
-          return FALSE;
-        break;
-      case EUU_FLATPAK_REMOTE_REF_ACTION_UPDATE:
-        if (!flatpak_transaction_add_update (transaction, ref_action_ref, NULL, NULL, error))
-          return FALSE;
-        break;
-      default:
-          g_assert_not_reached ();
-    }
+  if (!transaction_add_ref_action (transaction, ref_action, ref_action_ref,
+                                   resolved_action_type, error))
+    return FALSE;
 
   euu_transaction_data.ref_action = ref_action;
   euu_transaction_data.ref_action_ref = ref_action_ref;
@@ -1870,6 +2336,208 @@ find_related_refs_for_action (FlatpakInstallation       *installation,
   return TRUE;
 }
 
+#ifdef HAVE_FLATPAK_TRANSACTION_OPERATION_GET_RELATED_TO_OPS
+typedef struct {
+  GHashTable *ref_actions_by_ref;  /* (element-type utf8 EuuFlatpakRemoteRefAction) (unowned values) */
+  GHashTable *related_ref_actions;  /* (element-type EuuFlatpakRemoteRefAction GPtrArray<EuuFlatpakRemoteRefAction>) */
+  GPtrArray  *remotes;  /* (element-type FlatpakRemote) */
+  GError     *error;  /* (owned) (nullable) */
+} EuuBatchedTransactionData;
+
+/* Find the ref actions in the batched transaction which @op was added for,
+ * by following its related-to ops until they reach ops for ref actions.
+ * Runtimes and extensions of dependencies are therefore attributed to the
+ * ref action which pulled in the dependency. */
+static void
+collect_originating_ref_actions (EuuBatchedTransactionData   *data,
+                                 FlatpakTransactionOperation *op,
+                                 GHashTable                  *visited_ops,
+                                 GPtrArray                   *originating_ref_actions)
+{
+  GPtrArray *related_to_ops = flatpak_transaction_operation_get_related_to_ops (op);
+
+  if (!g_hash_table_add (visited_ops, op) || related_to_ops == NULL)
+    return;
+
+  for (gsize i = 0; i < related_to_ops->len; ++i)
+    {
+      FlatpakTransactionOperation *related_to_op = g_ptr_array_index (related_to_ops, i);
+      EuuFlatpakRemoteRefAction *ref_action =
+        g_hash_table_lookup (data->ref_actions_by_ref,
+                             flatpak_transaction_operation_get_ref (related_to_op));
+
+      if (ref_action == NULL)
+        collect_originating_ref_actions (data, related_to_op, visited_ops,
+                                         originating_ref_actions);
+      else if (!g_ptr_array_find (originating_ref_actions, ref_action, NULL))
+        g_ptr_array_add (originating_ref_actions, ref_action);
+    }
+}
+
+static gboolean
+batched_transaction_ready (FlatpakTransaction        *transaction,
+                           EuuBatchedTransactionData *data)
+{
+  g_autolist(GObject) ops = flatpak_transaction_get_operations (transaction);
+
+  for (GList *l = ops; l != NULL; l = l->next)
+    {
+      FlatpakTransactionOperation *op = l->data;
+      const char *op_ref = flatpak_transaction_operation_get_ref (op);
+      EuuFlatpakRemoteRefAction *op_ref_action = g_hash_table_lookup (data->ref_actions_by_ref, op_ref);
+      g_autoptr(GHashTable) visited_ops = g_hash_table_new (NULL, NULL);
+      g_autoptr(GPtrArray) originating_ref_actions = g_ptr_array_new ();
+
+      collect_originating_ref_actions (data, op, visited_ops, originating_ref_actions);
+
+      /* If a dependency can’t be traced back to a ref action, the results
+       * wouldn’t match what resolving each ref action separately gives. */
+      if (op_ref_action == NULL && originating_ref_actions->len == 0)
+        {
+          g_set_error (&data->error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+                       "Could not find which ref action dependency %s is for",
+                       op_ref);
+          return FALSE;
+        }
+
+      /* A ref action may itself be a dependency of another ref action; in that
+       * case, it’s treated as a dependency of that one too, as it would be if
+       * the ref actions were resolved separately. */
+      for (gsize i = 0; i < originating_ref_actions->len; ++i)
+        {
+          EuuFlatpakRemoteRefAction *origin_action = g_ptr_array_index (originating_ref_actions, i);
+          g_autofree char *origin_action_ref = NULL;
+          GPtrArray *related_ref_actions;
+
+          if (origin_action == op_ref_action)
+            continue;
+
+          origin_action_ref = flatpak_ref_format_ref (origin_action->ref->ref);
+          g_debug ("Found dependency %s in remote %s for %s",
+                   op_ref, flatpak_transaction_operation_get_remote (op),
+                   origin_action_ref);
+
+          related_ref_actions = g_hash_table_lookup (data->related_ref_actions, origin_action);
+          if (related_ref_actions == NULL)
+            {
+              related_ref_actions = g_ptr_array_new_with_free_func ((GDestroyNotify) euu_flatpak_remote_ref_action_unref);
+              g_hash_table_insert (data->related_ref_actions, origin_action, related_ref_actions);
+            }
+
+          g_ptr_array_add (related_ref_actions,
+                           dependency_ref_action_new_for_op (op, data->remotes, origin_action));
+        }
+    }
+
+  /* Abort the transaction; we only wanted to know what it would do */
+  return FALSE;
+}
+
+/* Resolve the dependencies of all of @ref_actions at once, in a single aborted
+ * transaction, so that the remote metadata is only loaded once rather than
+ * once per ref action. On success, @out_related_ref_actions is set to a map
+ * from each ref action to its related ref actions (or no entry if it has none),
+ * the same as find_related_refs_for_action() would give for each.
+ *
+ * This fails if the ref actions can’t be combined into a single transaction,
+ * for example because they conflict; in that case the caller should fall back
+ * to find_related_refs_for_action(). */
+static gboolean
+find_related_refs_for_actions_batched (FlatpakInstallation  *installation,
+                                       GHashTable           *installed_refs,
+                                       GPtrArray            *ref_actions,
+                                       GPtrArray            *remotes,
+                                       GHashTable          **out_related_ref_actions,
+                                       GCancellable         *cancellable,
+                                       GError              **error)
+{
+  g_autoptr(FlatpakTransaction) transaction = NULL;
+  g_autoptr(GError) local_error = NULL;
+  g_autoptr(GHashTable) ref_actions_by_ref = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  g_autoptr(GHashTable) related_ref_actions = g_hash_table_new_full (NULL, NULL, NULL, (GDestroyNotify) g_ptr_array_unref);
+  EuuBatchedTransactionData data = { NULL };
+
+  transaction = flatpak_transaction_new_for_installation (installation, cancellable, error);
+  if (transaction == NULL)
+    return FALSE;
+
+  flatpak_transaction_set_no_interaction (transaction, TRUE);
+
+  for (gsize i = 0; i < ref_actions->len; ++i)
+    {
+      EuuFlatpakRemoteRefAction *ref_action = g_ptr_array_index (ref_actions, i);
+      g_autofree char *ref_action_ref = flatpak_ref_format_ref (ref_action->ref->ref);
+      EuuFlatpakRemoteRefActionType resolved_action_type;
+      gboolean needed;
+
+      resolve_ref_action_type (installed_refs, ref_action, &needed, &resolved_action_type);
+      if (!needed)
+        continue;
+
+      if (g_hash_table_contains (ref_actions_by_ref, ref_action_ref))
+        {
+          g_set_error (error, G_IO_ERROR, G_IO_ERROR_EXISTS,
+                       "Multiple ref actions for %s", ref_action_ref);
+          return FALSE;
+        }
+
+      if (!transaction_add_ref_action (transaction, ref_action, ref_action_ref,
+                                       resolved_action_type, error))
+        return FALSE;
+
+      g_hash_table_insert (ref_actions_by_ref, g_steal_pointer (&ref_action_ref), ref_action);
+    }
+
+  if (g_hash_table_size (ref_actions_by_ref) == 0)
+    {
+      *out_related_ref_actions = g_steal_pointer (&related_ref_actions);
+      return TRUE;
+    }
+
+  data.ref_actions_by_ref = ref_actions_by_ref;
+  data.related_ref_actions = related_ref_actions;
+  data.remotes = remotes;
+
+  g_signal_connect (transaction, "ready", G_CALLBACK (batched_transaction_ready), &data);
+  /* no need to connect to operation-error since we abort the transaction */
+
+  flatpak_transaction_run (transaction, cancellable, &local_error);
+  g_assert (local_error != NULL);
+
+  if (data.error != NULL)
+    {
+      g_propagate_error (error, g_steal_pointer (&data.error));
+      return FALSE;
+    }
+  else if (!g_error_matches (local_error, FLATPAK_ERROR, FLATPAK_ERROR_ABORTED))
+    {
+      g_propagate_error (error, g_steal_pointer (&local_error));
+      return FALSE;
+    }
+
+  *out_related_ref_actions = g_steal_pointer (&related_ref_actions);
+  return TRUE;
+}
+
+/* Batching can be disabled so that tests can check it gives the same results as
+ * resolving each ref action separately. */
+static gboolean
+batched_dependencies_enabled (void)
+{
+  return g_strcmp0 (g_getenv ("EOS_UPDATER_TEST_UPDATER_FLATPAK_DISABLE_BATCHED_DEPENDENCIES"), "1") != 0;
+}
+#endif  /* HAVE_FLATPAK_TRANSACTION_OPERATION_GET_RELATED_TO_OPS */
+
+static void
+add_dependency_ref_action (GPtrArray                 *dependency_ref_actions,
+                           GHashTable                *dependency_refs,
+                           EuuFlatpakRemoteRefAction *ref_action)
+{
+  g_ptr_array_add (dependency_ref_actions,
+                   euu_flatpak_remote_ref_action_ref (ref_action));
+  g_hash_table_add (dependency_refs, ref_action->ref->ref);
+}
+
 /**
  * euu_add_dependency_ref_actions_for_installation:
  * @installation: A #FlatpakInstallation
@@ -1903,7 +2571,12 @@ euu_add_dependency_ref_actions_for_installation (FlatpakInstallation  *installat
 {
   g_autoptr(GPtrArray) dependency_ref_actions =
     g_ptr_array_new_with_free_func ((GDestroyNotify) euu_flatpak_remote_ref_action_unref);
+  /* Index of the refs in @dependency_ref_actions, owned by the actions there */
+  g_autoptr(GHashTable) dependency_refs = g_hash_table_new (euu_flatpak_ref_hash,
+                                                            euu_flatpak_ref_equal);
   g_autoptr(GPtrArray) remotes = NULL; /* (element-type FlatpakRemote) */
+  g_autoptr(GHashTable) installed_refs = NULL; /* (element-type FlatpakInstalledRef FlatpakInstalledRef) */
+  g_autoptr(GHashTable) batched_related_ref_actions = NULL; /* (element-type EuuFlatpakRemoteRefAction GPtrArray<EuuFlatpakRemoteRefAction>) */
 
   g_return_val_if_fail (FLATPAK_IS_INSTALLATION (installation), NULL);
   g_return_val_if_fail (cancellable == NULL || G_IS_CANCELLABLE (cancellable), NULL);
@@ -1914,25 +2587,66 @@ euu_add_dependency_ref_actions_for_installation (FlatpakInstallation  *installat
   if (remotes == NULL)
     return NULL;
 
+  /* Work out which refs are installed once, rather than once per ref action. */
+  installed_refs = euu_flatpak_installation_list_installed_refs_set (installation, cancellable, error);
+
+  if (installed_refs == NULL)
+    return NULL;
+
+#ifdef HAVE_FLATPAK_TRANSACTION_OPERATION_GET_RELATED_TO_OPS
+  /* Try resolving all the dependencies in one go first, as each transaction
+   * reloads the remote metadata. This needs
+   * flatpak_transaction_operation_get_related_to_ops(), so with older versions
+   * of flatpak, each ref action is always resolved separately below. */
+  if (batched_dependencies_enabled ())
+    {
+      g_autoptr(GError) local_error = NULL;
+
+      if (!find_related_refs_for_actions_batched (installation,
+                                                  installed_refs,
+                                                  ref_actions,
+                                                  remotes,
+                                                  &batched_related_ref_actions,
+                                                  cancellable,
+                                                  &local_error))
+        {
+          if (g_cancellable_set_error_if_cancelled (cancellable, error))
+            return NULL;
+
+          g_debug ("Error resolving dependencies for all ref actions at once; "
+                   "resolving them separately instead: %s",
+                   local_error->message);
+        }
+    }
+#endif  /* HAVE_FLATPAK_TRANSACTION_OPERATION_GET_RELATED_TO_OPS */
+
   for (gsize i = 0; i < ref_actions->len; ++i)
     {
       EuuFlatpakRemoteRefAction *ref_action = g_ptr_array_index (ref_actions, i);
       g_autoptr(GPtrArray) related_ref_actions =
         g_ptr_array_new_with_free_func ((GDestroyNotify) euu_flatpak_remote_ref_action_unref);
 
-      if (!find_related_refs_for_action (installation,
-                                         ref_action,
-                                         remotes,
-                                         related_ref_actions,
-                                         cancellable,
-                                         error))
+      if (batched_related_ref_actions != NULL)
+        {
+          GPtrArray *batched = g_hash_table_lookup (batched_related_ref_actions, ref_action);
+
+          for (gsize j = 0; batched != NULL && j < batched->len; ++j)
+            g_ptr_array_add (related_ref_actions,
+                             euu_flatpak_remote_ref_action_ref (g_ptr_array_index (batched, j)));
+        }
+      else if (!find_related_refs_for_action (installation,
+                                              installed_refs,
+                                              ref_action,
+                                              remotes,
+                                              related_ref_actions,
+                                              cancellable,
+                                              error))
         return FALSE;
 
       /* If the source ref action is to uninstall then its
        * dependencies should go after it. */
       if (ref_action->type == EUU_FLATPAK_REMOTE_REF_ACTION_UNINSTALL)
-        g_ptr_array_add (dependency_ref_actions,
-                         euu_flatpak_remote_ref_action_ref (ref_action));
+        add_dependency_ref_action (dependency_ref_actions, dependency_refs, ref_action);
 
       /* Go through each of the related refs and add it to the dependency ref
        * actions. Note that we may be adding duplicates here for uninstall
@@ -1952,14 +2666,11 @@ euu_add_dependency_ref_actions_for_installation (FlatpakInstallation  *installat
            */
           if ((related_ref_action->type == EUU_FLATPAK_REMOTE_REF_ACTION_INSTALL ||
                related_ref_action->type == EUU_FLATPAK_REMOTE_REF_ACTION_UPDATE) &&
-              g_ptr_array_find_with_equal_func (dependency_ref_actions,
-                                                related_ref_action,
-                                                euu_flatpak_remote_ref_action_equal_ref_only,
-                                                NULL))
+              g_hash_table_contains (dependency_refs, related_ref_action->ref->ref))
             continue;
 
-          g_ptr_array_add (dependency_ref_actions,
-                           euu_flatpak_remote_ref_action_ref (related_ref_action));
+          add_dependency_ref_action (dependency_ref_actions, dependency_refs,
+                                     related_ref_action);
         }
 
       /* If the source ref action is to install or update then its dependencies
@@ -1970,8 +2681,7 @@ euu_add_dependency_ref_actions_for_installation (FlatpakInstallation  *installat
        * are also installed. */
       if (ref_action->type == EUU_FLATPAK_REMOTE_REF_ACTION_INSTALL ||
           ref_action->type == EUU_FLATPAK_REMOTE_REF_ACTION_UPDATE)
-        g_ptr_array_add (dependency_ref_actions,
-                         euu_flatpak_remote_ref_action_ref (ref_action));
+        add_dependency_ref_action (dependency_ref_actions, dependency_refs, ref_action);
     }
 
   /* Squash the list now that we've assembled it. */
@@ -1993,6 +2703,14 @@ euu_flatpak_autoinstall_override_paths (void)
                                     LOCALSTATEDIR "/lib/eos-application-tools/flatpak-autoinstall.d");
 }
 
+/* The cache can be deleted at any time, and will be recreated as needed. */
+const gchar *
+euu_flatpak_autoinstall_cache_path (void)
+{
+  return eos_updater_get_envvar_or ("EOS_UPDATER_TEST_UPDATER_FLATPAK_AUTOINSTALL_CACHE_PATH",
+                                    LOCALSTATEDIR "/cache/eos-updater/flatpak-autoinstall.cache");
+}
+
 /**
  * euu_flatpak_ref_action_application_progress_in_state_path:
  * @cancellable:
@@ -2320,6 +3038,7 @@ euu_flatpak_ref_actions_from_paths (GStrv    directories_to_search,
                                     GError **error)
 {
   g_auto(GStrv) default_directories_to_search = NULL;
+  g_autoptr(AutoinstallCache) cache = NULL;
   GStrv iter = NULL;
   gint priority_counter = 0;
   g_autoptr(GHashTable) ref_actions = g_hash_table_new_full (g_str_hash,
@@ -2333,18 +3052,23 @@ euu_flatpak_ref_actions_from_paths (GStrv    directories_to_search,
       directories_to_search = default_directories_to_search;
     }
 
+  cache = autoinstall_cache_load ();
+
   for (iter = directories_to_search; *iter != NULL; ++iter, ++priority_counter)
     {
       g_autoptr(GFile) directory = g_file_new_for_path (*iter);
-      if (!euu_flatpak_ref_actions_append_from_directory (directory,
-                                                          ref_actions,
-                                                          priority_counter,
-                                                          TRUE,  /* ignore ENOENT */
-                                                          NULL,
-                                                          error))
+      if (!append_from_directory_cached (directory,
+                                         ref_actions,
+                                         priority_counter,
+                                         TRUE,  /* ignore ENOENT */
+                                         cache,
+                                         NULL,
+                                         error))
         return NULL;
     }
 
+  autoinstall_cache_save (cache);
+
   return euu_hoist_flatpak_remote_ref_actions (ref_actions);
 }
 
@@ -2374,24 +3098,75 @@ euu_flattened_flatpak_ref_actions_from_paths (GStrv    directories_to_search,
   return euu_flatten_flatpak_ref_actions_table (ref_actions);
 }
 
-static gboolean
-inspect_directory_in_ostree_repo (OstreeRepo    *repo,
-                                  const gchar   *checksum,
-                                  const gchar   *subpath,
-                                  const gchar   *checkout_path,
-                                  GCancellable  *cancellable,
-                                  GError       **error)
-{
-  OstreeRepoCheckoutAtOptions options = { 0, };
-  options.subpath = subpath;
+/* Cache of the autoinstall files parsed from the most recently inspected
+ * commit. Commits are immutable, so the parsed files for a given checksum never
+ * change; only the override directories (which live on the real file system)
+ * need to be re-read on each call. A single entry is enough, since the updater
+ * only ever looks at the commit it is about to deploy. */
+G_LOCK_DEFINE_STATIC (commit_ref_actions_cache);
+static gchar *commit_ref_actions_cache_checksum = NULL;  /* (owned) (nullable) (locked-by commit_ref_actions_cache) */
+static GHashTable *commit_ref_actions_cache_table = NULL;  /* (owned) (nullable) (element-type filename EuuFlatpakRemoteRefActionsFile) (locked-by commit_ref_actions_cache) */
+
+/* Parse the autoinstall files under @subpath in @checksum straight out of
+ * @repo, without checking anything out. If @subpath does not exist in the
+ * commit, an empty table is returned. */
+static GHashTable *
+ref_actions_files_from_ostree_commit (OstreeRepo    *repo,
+                                      const gchar   *checksum,
+                                      const gchar   *subpath,
+                                      gint           priority,
+                                      GCancellable  *cancellable,
+                                      GError       **error)
+{
+  g_autoptr(GFile) root = NULL;
+  g_autoptr(GFile) directory = NULL;
+  g_autoptr(GHashTable) ref_actions_for_files = NULL;
+  g_autoptr(GError) local_error = NULL;
 
-  return ostree_repo_checkout_at (repo,
-                                  &options,
-                                  -1,
-                                  checkout_path,
-                                  checksum,
-                                  cancellable,
-                                  error);
+  G_LOCK (commit_ref_actions_cache);
+  if (commit_ref_actions_cache_table != NULL &&
+      g_strcmp0 (commit_ref_actions_cache_checksum, checksum) == 0)
+    {
+      ref_actions_for_files = g_hash_table_ref (commit_ref_actions_cache_table);
+      G_UNLOCK (commit_ref_actions_cache);
+      return g_steal_pointer (&ref_actions_for_files);
+    }
+  G_UNLOCK (commit_ref_actions_cache);
+
+  ref_actions_for_files = g_hash_table_new_full (g_str_hash,
+                                                 g_str_equal,
+                                                 g_free,
+                                                 (GDestroyNotify) euu_flatpak_remote_ref_actions_file_free);
+
+  /* If the commit isn’t available, there’s nothing to read. */
+  if (!ostree_repo_read_commit (repo, checksum, &root, NULL, cancellable, &local_error))
+    {
+      if (!g_error_matches (local_error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND))
+        {
+          g_propagate_error (error, g_steal_pointer (&local_error));
+          return NULL;
+        }
+
+      return g_steal_pointer (&ref_actions_for_files);
+    }
+
+  directory = g_file_resolve_relative_path (root, subpath);
+  if (!euu_flatpak_ref_actions_append_from_directory (directory,
+                                                      ref_actions_for_files,
+                                                      priority,
+                                                      TRUE,  /* ignore ENOENT */
+                                                      cancellable,
+                                                      error))
+    return NULL;
+
+  G_LOCK (commit_ref_actions_cache);
+  g_free (commit_ref_actions_cache_checksum);
+  commit_ref_actions_cache_checksum = g_strdup (checksum);
+  g_clear_pointer (&commit_ref_actions_cache_table, g_hash_table_unref);
+  commit_ref_actions_cache_table = g_hash_table_ref (ref_actions_for_files);
+  G_UNLOCK (commit_ref_actions_cache);
+
+  return g_steal_pointer (&ref_actions_for_files);
 }
 
 /**
@@ -2401,6 +3176,11 @@ inspect_directory_in_ostree_repo (OstreeRepo    *repo,
  * @cancellable:
  * @error:
  *
+ * Load the autoinstall files from the override directories and from the
+ * flatpak-autoinstall.d directory in commit @checksum in @repo. The commit
+ * is read directly from the repository, rather than being checked out.
+ * Files in the commit have the lowest priority.
+ *
  * Returns: (transfer container) (element-type filename GPtrArray<EuuFlatpakRemoteRefAction>):
  */
 GHashTable *
@@ -2409,67 +3189,54 @@ euu_flatpak_ref_actions_from_ostree_commit (OstreeRepo    *repo,
                                             GCancellable  *cancellable,
                                             GError       **error)
 {
-  g_autofree gchar *temp_dir_path = NULL;
-  g_autofree gchar *checkout_path = NULL;
   const gchar *path_relative_to_deployment = "usr/share/eos-application-tools/flatpak-autoinstall.d";
-  g_autoptr(GHashTable) flatpak_ref_actions_table = NULL;
-  const gchar *override_paths = euu_flatpak_autoinstall_override_paths ();
-  const gchar *paths_to_search_string = NULL;
-  g_autofree gchar *allocated_paths_to_search_string = NULL;
-  g_auto(GStrv) paths_to_search = NULL;
-  g_autoptr(GError) local_error = NULL;
-  GHashTable *ret_actions_table = NULL;
-
-  temp_dir_path = g_dir_make_tmp ("ostree-checkout-XXXXXX", error);
-  if (temp_dir_path == NULL)
-    goto out;
-
-  /* Now that we have a temporary directory, checkout the OSTree in it
-   * at the /usr/share/eos-application-tools path. If it fails, there’s nothing to
-   * read, otherwise we can read in the list of flatpaks to be auto-installed
-   * for this commit. */
-  checkout_path = g_build_filename (temp_dir_path, "checkout", NULL);
-  if (inspect_directory_in_ostree_repo (repo,
-                                        checksum,
-                                        path_relative_to_deployment,
-                                        checkout_path,
-                                        cancellable,
-                                        &local_error))
-    {
-      /* Checkout directory has the lowest priority, if it is specified */
-      allocated_paths_to_search_string = g_strjoin (";", override_paths, checkout_path, NULL);
-      paths_to_search_string = allocated_paths_to_search_string;
-    }
-  else
-    {
-      if (!g_error_matches (local_error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND))
-        {
-          g_propagate_error (error, g_steal_pointer (&local_error));
-          goto out;
-        }
+  g_auto(GStrv) override_paths = g_strsplit (euu_flatpak_autoinstall_override_paths (), ";", -1);
+  g_autoptr(GHashTable) ref_actions = g_hash_table_new_full (g_str_hash,
+                                                             g_str_equal,
+                                                             g_free,
+                                                             (GDestroyNotify) euu_flatpak_remote_ref_actions_file_free);
+  g_autoptr(GHashTable) commit_ref_actions = NULL;
+  g_autoptr(AutoinstallCache) cache = autoinstall_cache_load ();
+  GStrv iter = NULL;
+  gint priority_counter = 0;
+  GHashTableIter commit_iter;
+  gpointer key, value;
 
-      paths_to_search_string = override_paths;
+  for (iter = override_paths; *iter != NULL; ++iter, ++priority_counter)
+    {
+      g_autoptr(GFile) directory = g_file_new_for_path (*iter);
+      if (!append_from_directory_cached (directory,
+                                         ref_actions,
+                                         priority_counter,
+                                         TRUE,  /* ignore ENOENT */
+                                         cache,
+                                         cancellable,
+                                         error))
+        return NULL;
     }
 
-  paths_to_search = g_strsplit (paths_to_search_string, ";", -1);
-  flatpak_ref_actions_table = euu_flatpak_ref_actions_from_paths (paths_to_search,
-                                                                  error);
+  autoinstall_cache_save (cache);
 
-  ret_actions_table = g_steal_pointer (&flatpak_ref_actions_table);
+  commit_ref_actions = ref_actions_files_from_ostree_commit (repo,
+                                                             checksum,
+                                                             path_relative_to_deployment,
+                                                             priority_counter,
+                                                             cancellable,
+                                                             error);
+  if (commit_ref_actions == NULL)
+    return NULL;
 
- out:
-  /* Regardless of whether there was an error, we always want to remove
-   * the temporary directory at this point and garbage-collect on the
-   * OstreeRepo. Note that these operations may fail, but we don’t
-   * really care. */
-  if (temp_dir_path != NULL)
+  /* Files from the commit only fill in the gaps left by the overrides. */
+  g_hash_table_iter_init (&commit_iter, commit_ref_actions);
+  while (g_hash_table_iter_next (&commit_iter, &key, &value))
     {
-      g_autoptr(GFile) temp_dir = g_file_new_for_path (temp_dir_path);
-      eos_updater_remove_recursive (temp_dir, NULL, NULL);
+      if (!g_hash_table_contains (ref_actions, key))
+        g_hash_table_insert (ref_actions,
+                             g_strdup (key),
+                             euu_flatpak_remote_ref_actions_file_copy (value));
     }
-  ostree_repo_checkout_gc (repo, cancellable, NULL);
 
-  return ret_actions_table;
+  return euu_hoist_flatpak_remote_ref_actions (ref_actions);
 }
 
 /**
@@ -2549,18 +3316,32 @@ transaction_operation_error (FlatpakTransaction             *object,
   return FALSE;
 }
 
-/* Run a transaction which contains a single op, and report the most specific
- * error possible on failure. */
-static gboolean
-transaction_run_single_op (FlatpakTransaction  *transaction,
-                           GCancellable        *cancellable,
-                           GError             **error)
+/**
+ * euu_flatpak_transaction_run:
+ * @transaction: a #FlatpakTransaction
+ * @cancellable: (nullable): a #GCancellable
+ * @error: return location for a #GError
+ *
+ * Run @transaction, aborting it on the first fatal operation error, and report
+ * the most specific error possible on failure: the error from the failed
+ * operation, rather than %FLATPAK_ERROR_ABORTED from the transaction.
+ *
+ * Returns: %TRUE on success, %FALSE otherwise
+ */
+gboolean
+euu_flatpak_transaction_run (FlatpakTransaction  *transaction,
+                             GCancellable        *cancellable,
+                             GError             **error)
 {
   g_autoptr(GError) operation_error = NULL;
   g_autoptr(GError) transaction_error = NULL;
   gboolean success;
   gulong id;
 
+  g_return_val_if_fail (FLATPAK_IS_TRANSACTION (transaction), FALSE);
+  g_return_val_if_fail (cancellable == NULL || G_IS_CANCELLABLE (cancellable), FALSE);
+  g_return_val_if_fail (error == NULL || *error == NULL, FALSE);
+
   id = g_signal_connect (transaction, "operation-error",
                          G_CALLBACK (transaction_operation_error), &operation_error);
   success = flatpak_transaction_run (transaction, cancellable, &transaction_error);
@@ -2608,7 +3389,7 @@ euu_flatpak_transaction_install (FlatpakInstallation *installation,
                                         error))
     return FALSE;
 
-  return transaction_run_single_op (transaction, cancellable, error);
+  return euu_flatpak_transaction_run (transaction, cancellable, error);
 }
 
 gboolean
@@ -2644,7 +3425,7 @@ euu_flatpak_transaction_update (FlatpakInstallation *installation,
                                        error))
     return FALSE;
 
-  return transaction_run_single_op (transaction, cancellable, error);
+  return euu_flatpak_transaction_run (transaction, cancellable, error);
 }
 
 gboolean
@@ -2671,5 +3452,5 @@ euu_flatpak_transaction_uninstall (FlatpakInstallation *installation,
   if (!flatpak_transaction_add_uninstall (transaction, formatted_ref, error))
     return FALSE;
 
-  return transaction_run_single_op (transaction, cancellable, error);
+  return euu_flatpak_transaction_run (transaction, cancellable, error);
 }
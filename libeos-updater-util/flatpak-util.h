@@ -161,6 +161,7 @@ gchar *euu_lookup_flatpak_remote_for_collection_id (FlatpakInstallation  *instal
 
 const gchar *euu_pending_flatpak_deployments_state_path (void);
 const gchar *euu_flatpak_autoinstall_override_paths (void);
+const gchar *euu_flatpak_autoinstall_cache_path (void);
 const gchar *euu_get_system_architecture_string (void);
 
 GHashTable *euu_flatpak_ref_actions_from_paths (GStrv    directories_to_search,
@@ -178,6 +179,14 @@ FlatpakInstallation *eos_updater_get_flatpak_installation (GCancellable  *cancel
 guint euu_flatpak_ref_hash (gconstpointer ref);
 gboolean euu_flatpak_ref_equal (gconstpointer a, gconstpointer b);
 
+GHashTable *euu_flatpak_installation_list_installed_refs_set (FlatpakInstallation  *installation,
+                                                              GCancellable         *cancellable,
+                                                              GError              **error);
+
+gboolean euu_flatpak_transaction_run (FlatpakTransaction  *transaction,
+                                      GCancellable        *cancellable,
+                                      GError             **error);
+
 gboolean euu_flatpak_transaction_install (FlatpakInstallation *installation,
                                           const gchar         *remote,
                                           const gchar         *formatted_ref,
@@ -59,6 +59,14 @@ typedef struct _OstreeBloom OstreeBloom;
 typedef guint64 (*OstreeBloomHashFunc) (gconstpointer element,
                                         guint8        k);
 
+/**
+ * OSTREE_BLOOM_BLOCK_SIZE:
+ *
+ * Size of each block in a blocked #OstreeBloom, in bytes. This is a typical
+ * cache line size, and is part of the serialised format, so must not change.
+ */
+#define OSTREE_BLOOM_BLOCK_SIZE 64
+
 #define OSTREE_TYPE_BLOOM (ostree_bloom_get_type ())
 
 G_GNUC_INTERNAL
@@ -74,6 +82,15 @@ OstreeBloom *ostree_bloom_new_from_bytes (GBytes              *bytes,
                                           guint8               k,
                                           OstreeBloomHashFunc  hash_func);
 
+G_GNUC_INTERNAL
+OstreeBloom *ostree_bloom_new_blocked (gsize               n_bytes,
+                                       guint8              k,
+                                       OstreeBloomHashFunc hash_func);
+G_GNUC_INTERNAL
+OstreeBloom *ostree_bloom_new_from_bytes_blocked (GBytes              *bytes,
+                                                  guint8               k,
+                                                  OstreeBloomHashFunc  hash_func);
+
 G_GNUC_INTERNAL
 OstreeBloom *ostree_bloom_ref (OstreeBloom *bloom);
 G_GNUC_INTERNAL
@@ -98,6 +115,8 @@ G_GNUC_INTERNAL
 guint8 ostree_bloom_get_k (OstreeBloom *bloom);
 G_GNUC_INTERNAL
 OstreeBloomHashFunc ostree_bloom_get_hash_func (OstreeBloom *bloom);
+G_GNUC_INTERNAL
+gboolean ostree_bloom_is_blocked (OstreeBloom *bloom);
 
 G_GNUC_INTERNAL
 guint64 ostree_str_bloom_hash (gconstpointer element,
@@ -24,6 +24,7 @@
 
 #include <glib.h>
 #include <libeos-updater-util/ostree-util.h>
+#include <libeos-updater-util/types.h>
 #include <libeos-updater-util/util.h>
 #include <ostree.h>
 #include <string.h>
@@ -307,3 +308,113 @@ eos_updater_get_ostree_path (OstreeRepo *repo,
   *ostree_path = g_steal_pointer (&path);
   return TRUE;
 }
+
+/* libostree reports HTTP 500 errors from the server as %G_IO_ERROR_BUSY, but
+ * other errors which indicate overload (429 Too Many Requests and 503 Service
+ * Unavailable) are only distinguishable by their message, which differs between
+ * its HTTP backends. */
+static gboolean
+is_server_overloaded_error (const GError *error)
+{
+  const gchar * const overloaded_statuses[] =
+    {
+      "HTTP 429", "HTTP 503", "status 429", "status 503",
+    };
+  gsize i;
+
+  if (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_BUSY))
+    return TRUE;
+
+  for (i = 0; i < G_N_ELEMENTS (overloaded_statuses); i++)
+    {
+      if (strstr (error->message, overloaded_statuses[i]) != NULL)
+        return TRUE;
+    }
+
+  return FALSE;
+}
+
+/* Compare two repository URLs, ignoring any trailing slashes. */
+static gboolean
+repo_urls_equal (const gchar *url1,
+                 const gchar *url2)
+{
+  gsize len1 = strlen (url1), len2 = strlen (url2);
+
+  while (len1 > 0 && url1[len1 - 1] == '/')
+    len1--;
+  while (len2 > 0 && url2[len2 - 1] == '/')
+    len2--;
+
+  return (len1 == len2 && strncmp (url1, url2, len1) == 0);
+}
+
+/**
+ * eos_updater_get_refspec_remote_url:
+ * @repo: an #OstreeRepo
+ * @refspec: (nullable): refspec to look up the remote from
+ *
+ * Get the URL configured in @repo for the remote in @refspec. This is the
+ * origin server for the OS, as opposed to any peers on the local network
+ * which may also provide the ref.
+ *
+ * Returns: (transfer full) (nullable): the remote URL, or %NULL if @refspec
+ *    doesn’t contain a remote or it is not configured
+ */
+gchar *
+eos_updater_get_refspec_remote_url (OstreeRepo  *repo,
+                                    const gchar *refspec)
+{
+  g_autofree gchar *remote = NULL;
+  g_autofree gchar *url = NULL;
+
+  g_return_val_if_fail (OSTREE_IS_REPO (repo), NULL);
+
+  if (refspec == NULL ||
+      !ostree_parse_refspec (refspec, &remote, NULL, NULL) ||
+      remote == NULL ||
+      !ostree_repo_remote_get_url (repo, remote, &url, NULL))
+    return NULL;
+
+  return g_steal_pointer (&url);
+}
+
+/**
+ * eos_updater_map_pull_error:
+ * @origin_url: (nullable): URL of the origin server for the OS (or the URL
+ *    configured to override it), or %NULL if it’s not known
+ * @url: (nullable): URL of the repository which was pulled from, or %NULL if
+ *    it’s not known
+ * @error: (inout) (optional) (nullable): the error from the pull
+ *
+ * If @error shows that the origin HTTP server is overloaded, replace it with
+ * %EOS_UPDATER_ERROR_SERVER_OVERLOADED, so that it’s reported consistently and
+ * eos-autoupdater can back off.
+ *
+ * This must only be called on errors from pulling from a remote: other
+ * operations, and pulls from repositories which aren’t served over HTTP (such
+ * as on a USB drive), can fail with %G_IO_ERROR_BUSY for unrelated reasons.
+ * Errors for such @urls, or a %NULL @url, are left alone. Errors from any
+ * @url other than @origin_url are left alone too: a busy peer on the local
+ * network is no reason to stop polling the origin server.
+ */
+void
+eos_updater_map_pull_error (const gchar  *origin_url,
+                            const gchar  *url,
+                            GError      **error)
+{
+  g_autoptr(GError) pull_error = NULL;
+
+  if (error == NULL || *error == NULL || (*error)->domain == EOS_UPDATER_ERROR)
+    return;
+
+  if (url == NULL || origin_url == NULL ||
+      !(g_str_has_prefix (url, "http://") || g_str_has_prefix (url, "https://")) ||
+      !repo_urls_equal (url, origin_url) ||
+      !is_server_overloaded_error (*error))
+    return;
+
+  pull_error = g_steal_pointer (error);
+  g_set_error (error, EOS_UPDATER_ERROR, EOS_UPDATER_ERROR_SERVER_OVERLOADED,
+               "Server is overloaded: %s", pull_error->message);
+}
@@ -49,4 +49,11 @@ gboolean eos_updater_get_ostree_path (OstreeRepo *repo,
                                       gchar **ostree_path,
                                       GError **error);
 
+gchar *eos_updater_get_refspec_remote_url (OstreeRepo  *repo,
+                                           const gchar *refspec);
+
+void eos_updater_map_pull_error (const gchar  *origin_url,
+                                 const gchar  *url,
+                                 GError      **error);
+
 G_END_DECLS
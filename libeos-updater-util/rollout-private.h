@@ -0,0 +1,63 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * Copyright 2024 Endless OS Foundation LLC <maintainers@endlessos.org>
+ *
+ * SPDX-License-Identifier: LGPL-2.1-or-later
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/**
+ * EUU_BACKOFF_INITIAL_SECS:
+ *
+ * How long to wait after the update server first reports being overloaded.
+ * The wait doubles each consecutive time, up to %EUU_BACKOFF_MAX_SECS.
+ */
+#define EUU_BACKOFF_INITIAL_SECS (G_GUINT64_CONSTANT (3600))
+
+/**
+ * EUU_BACKOFF_MAX_SECS:
+ *
+ * The longest wait after the update server reports being overloaded.
+ */
+#define EUU_BACKOFF_MAX_SECS (G_GUINT64_CONSTANT (7 * 24 * 3600))
+
+gboolean euu_backoff_load (const gchar  *path,
+                           guint        *out_attempts,
+                           guint64      *out_next_attempt_secs,
+                           GError      **error);
+gboolean euu_backoff_record_overload (const gchar  *path,
+                                      guint64       now_secs,
+                                      GRand        *rand,
+                                      guint64      *out_delay_secs,
+                                      GError      **error);
+gboolean euu_backoff_is_active (const gchar  *path,
+                                guint64       now_secs,
+                                GError      **error);
+gboolean euu_backoff_clear (const gchar  *path,
+                            GError      **error);
+
+guint euu_rollout_get_bucket (const gchar *machine_id,
+                              const gchar *update_id);
+gboolean euu_rollout_includes_machine (guint        percentage,
+                                       const gchar *machine_id,
+                                       const gchar *update_id);
+
+G_END_DECLS
@@ -0,0 +1,300 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * Copyright 2024 Endless OS Foundation LLC <maintainers@endlessos.org>
+ *
+ * SPDX-License-Identifier: LGPL-2.1-or-later
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include <errno.h>
+#include <gio/gio.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <libeos-updater-util/rollout-private.h>
+
+/* Helpers for eos-autoupdater to spread the load on the update server: backing
+ * off when the server reports being overloaded, and only fetching an update
+ * which is being rolled out gradually once the rollout reaches this machine.
+ *
+ * The backoff state is stored in a file encoded in #GVariant dictionary
+ * format, with `Attempts` (`u`) and `NextAttemptSecs` (`t`) entries. */
+
+/**
+ * euu_backoff_load:
+ * @path: path to the backoff state file
+ * @out_attempts: (out) (optional): return location for the number of
+ *    consecutive times the server has reported being overloaded
+ * @out_next_attempt_secs: (out) (optional): return location for the UNIX
+ *    timestamp before which the server should not be contacted again
+ * @error: return location for a #GError, or %NULL
+ *
+ * Load the backoff state written by euu_backoff_record_overload(). If the file
+ * doesn’t exist, %G_IO_ERROR_NOT_FOUND is returned; if it’s corrupt,
+ * %G_IO_ERROR_INVALID_DATA is returned.
+ *
+ * Returns: %TRUE on success, %FALSE otherwise
+ */
+gboolean
+euu_backoff_load (const gchar  *path,
+                  guint        *out_attempts,
+                  guint64      *out_next_attempt_secs,
+                  GError      **error)
+{
+  g_autoptr(GFile) file = NULL;
+  g_autoptr(GBytes) contents = NULL;
+  g_autoptr(GVariant) variant = NULL;
+  guint attempts;
+  guint64 next_attempt_secs;
+
+  g_return_val_if_fail (path != NULL, FALSE);
+  g_return_val_if_fail (error == NULL || *error == NULL, FALSE);
+
+  file = g_file_new_for_path (path);
+  contents = g_file_load_bytes (file, NULL, NULL, error);
+  if (contents == NULL)
+    return FALSE;
+
+  variant = g_variant_ref_sink (g_variant_new_from_bytes (G_VARIANT_TYPE ("a{sv}"),
+                                                          contents,
+                                                          FALSE));
+  if (!g_variant_lookup (variant, "Attempts", "u", &attempts) ||
+      !g_variant_lookup (variant, "NextAttemptSecs", "t", &next_attempt_secs))
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                   "Backoff file ‘%s’ is corrupt", path);
+      return FALSE;
+    }
+
+  if (out_attempts != NULL)
+    *out_attempts = attempts;
+  if (out_next_attempt_secs != NULL)
+    *out_next_attempt_secs = next_attempt_secs;
+
+  return TRUE;
+}
+
+/**
+ * euu_backoff_record_overload:
+ * @path: path to the backoff state file
+ * @now_secs: the current UNIX time
+ * @rand: (nullable): random number generator to use, or %NULL to use the
+ *    global one
+ * @out_delay_secs: (out) (optional): return location for how long to wait
+ *    before contacting the server again, in seconds
+ * @error: return location for a #GError, or %NULL
+ *
+ * Record that the update server has reported being overloaded, and work out
+ * when to contact it again. The wait starts at %EUU_BACKOFF_INITIAL_SECS and
+ * doubles each consecutive time this is called, up to %EUU_BACKOFF_MAX_SECS.
+ * The second half of each wait is random, so that all the machines which were
+ * turned away at the same time don’t come back at the same time.
+ *
+ * A missing or corrupt state file is treated as there having been no previous
+ * attempts. The parent directory of @path must exist.
+ *
+ * Returns: %TRUE on success, %FALSE otherwise
+ */
+gboolean
+euu_backoff_record_overload (const gchar  *path,
+                             guint64       now_secs,
+                             GRand        *rand,
+                             guint64      *out_delay_secs,
+                             GError      **error)
+{
+  g_auto(GVariantBuilder) builder = G_VARIANT_BUILDER_INIT (G_VARIANT_TYPE ("a{sv}"));
+  g_autoptr(GVariant) variant = NULL;
+  g_autoptr(GBytes) contents = NULL;
+  g_autoptr(GFile) file = NULL;
+  g_autoptr(GError) local_error = NULL;
+  guint attempts = 0;
+  guint64 delay_secs, jitter_secs;
+
+  g_return_val_if_fail (path != NULL, FALSE);
+  g_return_val_if_fail (error == NULL || *error == NULL, FALSE);
+
+  if (!euu_backoff_load (path, &attempts, NULL, &local_error))
+    {
+      if (!g_error_matches (local_error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND))
+        g_debug ("Ignoring previous backoff state: %s", local_error->message);
+      attempts = 0;
+    }
+
+  attempts = MIN (attempts + 1, 32);
+  delay_secs = MIN (EUU_BACKOFF_INITIAL_SECS << MIN (attempts - 1, 16),
+                    EUU_BACKOFF_MAX_SECS);
+
+  jitter_secs = (rand != NULL) ?
+                (guint64) g_rand_int_range (rand, 0, (gint32) (delay_secs / 2) + 1) :
+                (guint64) g_random_int_range (0, (gint32) (delay_secs / 2) + 1);
+  delay_secs = delay_secs / 2 + jitter_secs;
+
+  g_variant_builder_add (&builder, "{sv}", "Attempts",
+                         g_variant_new_uint32 (attempts));
+  g_variant_builder_add (&builder, "{sv}", "NextAttemptSecs",
+                         g_variant_new_uint64 (now_secs + delay_secs));
+
+  variant = g_variant_ref_sink (g_variant_builder_end (&builder));
+  contents = g_variant_get_data_as_bytes (variant);
+  file = g_file_new_for_path (path);
+  if (!g_file_replace_contents (file,
+                                g_bytes_get_data (contents, NULL),
+                                g_bytes_get_size (contents),
+                                NULL,
+                                FALSE,
+                                G_FILE_CREATE_NONE,
+                                NULL,
+                                NULL,
+                                error))
+    return FALSE;
+
+  if (out_delay_secs != NULL)
+    *out_delay_secs = delay_secs;
+
+  return TRUE;
+}
+
+/**
+ * euu_backoff_is_active:
+ * @path: path to the backoff state file
+ * @now_secs: the current UNIX time
+ * @error: return location for a #GError, or %NULL
+ *
+ * Check whether the update server should be left alone at @now_secs, because
+ * the wait worked out by euu_backoff_record_overload() hasn’t finished yet.
+ *
+ * A missing state file is not an error. If the state file can’t be loaded,
+ * %FALSE is returned and @error is set, so that a corrupt file can’t stop
+ * updates indefinitely.
+ *
+ * Returns: %TRUE if backing off, %FALSE otherwise
+ */
+gboolean
+euu_backoff_is_active (const gchar  *path,
+                       guint64       now_secs,
+                       GError      **error)
+{
+  g_autoptr(GError) local_error = NULL;
+  guint attempts;
+  guint64 next_attempt_secs;
+
+  g_return_val_if_fail (path != NULL, FALSE);
+  g_return_val_if_fail (error == NULL || *error == NULL, FALSE);
+
+  if (!euu_backoff_load (path, &attempts, &next_attempt_secs, &local_error))
+    {
+      if (!g_error_matches (local_error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND))
+        g_propagate_error (error, g_steal_pointer (&local_error));
+      return FALSE;
+    }
+
+  g_debug ("Server was overloaded %u times; next attempt at %" G_GUINT64_FORMAT,
+           attempts, next_attempt_secs);
+
+  return (now_secs < next_attempt_secs);
+}
+
+/**
+ * euu_backoff_clear:
+ * @path: path to the backoff state file
+ * @error: return location for a #GError, or %NULL
+ *
+ * Reset the backoff after the update server has been contacted successfully.
+ * It is not an error if there is no backoff state.
+ *
+ * Returns: %TRUE on success, %FALSE otherwise
+ */
+gboolean
+euu_backoff_clear (const gchar  *path,
+                   GError      **error)
+{
+  g_return_val_if_fail (path != NULL, FALSE);
+  g_return_val_if_fail (error == NULL || *error == NULL, FALSE);
+
+  if (g_unlink (path) != 0 && errno != ENOENT)
+    {
+      int saved_errno = errno;
+      g_set_error (error, G_IO_ERROR, g_io_error_from_errno (saved_errno),
+                   "Failed to remove backoff file ‘%s’: %s",
+                   path, g_strerror (saved_errno));
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+/**
+ * euu_rollout_get_bucket:
+ * @machine_id: the machine ID, as in `/etc/machine-id`
+ * @update_id: checksum of the update commit
+ *
+ * Work out which percentile (0–99) the machine falls into for the rollout of
+ * @update_id. This is derived from @machine_id, so it’s stable between runs,
+ * but it’s also salted with @update_id so that the same machines aren’t always
+ * the first to get each update.
+ *
+ * Returns: the machine’s rollout bucket, between 0 and 99 inclusive
+ */
+guint
+euu_rollout_get_bucket (const gchar *machine_id,
+                        const gchar *update_id)
+{
+  g_autoptr(GChecksum) checksum = NULL;
+  guint8 digest[32];
+  gsize digest_len = sizeof (digest);
+  guint32 value;
+
+  g_return_val_if_fail (machine_id != NULL, 0);
+  g_return_val_if_fail (update_id != NULL, 0);
+
+  checksum = g_checksum_new (G_CHECKSUM_SHA256);
+  g_checksum_update (checksum, (const guchar *) machine_id, -1);
+  g_checksum_update (checksum, (const guchar *) ":", 1);
+  g_checksum_update (checksum, (const guchar *) update_id, -1);
+  g_checksum_get_digest (checksum, digest, &digest_len);
+
+  value = ((guint32) digest[0] << 24 | (guint32) digest[1] << 16 |
+           (guint32) digest[2] << 8 | (guint32) digest[3]);
+
+  return value % 100;
+}
+
+/**
+ * euu_rollout_includes_machine:
+ * @percentage: percentage of machines the update is being rolled out to,
+ *    between 0 and 100 inclusive
+ * @machine_id: the machine ID, as in `/etc/machine-id`
+ * @update_id: checksum of the update commit
+ *
+ * Check whether the rollout of @update_id has reached the machine, using
+ * euu_rollout_get_bucket(). As @percentage increases, machines are only ever
+ * added to the rollout, never removed.
+ *
+ * Returns: %TRUE if the update should be fetched, %FALSE otherwise
+ */
+gboolean
+euu_rollout_includes_machine (guint        percentage,
+                              const gchar *machine_id,
+                              const gchar *update_id)
+{
+  g_return_val_if_fail (machine_id != NULL, TRUE);
+  g_return_val_if_fail (update_id != NULL, TRUE);
+
+  if (percentage >= 100)
+    return TRUE;
+
+  return (euu_rollout_get_bucket (machine_id, update_id) < percentage);
+}
@@ -65,13 +65,34 @@ teardown (Fixture       *fixture,
   ostree_collection_ref_freev (fixture->refs);
 }
 
+typedef enum
+  {
+    BLOOM_BITS_AUTO,
+    BLOOM_BITS_SMALL,
+    BLOOM_BITS_DEFAULT_SIZE,
+  } BloomBits;
+
 static const gchar *
-get_encoded_bloom_bits (gboolean short_bloom_size)
+get_encoded_bloom_bits (BloomBits bloom_bits)
 {
-  /* - AQEAA... - guint8 1, guint8 1, guint8[] of bloom filter bits encoding "ref" */
-  if (short_bloom_size)
-    return "AQFAAAAAAAAAAAAAAAA=";
-  return "AQEAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAABAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAA";
+  switch (bloom_bits)
+    {
+    case BLOOM_BITS_AUTO:
+      /* - CwHHkg== - guint8 11, guint8 1, 2 bytes of bloom filter bits encoding
+       *   "ref"; this is the automatic size for one ref at the default target
+       *   false positive rate of 1% */
+      return "CwHHkg==";
+    case BLOOM_BITS_SMALL:
+      /* - AQFAA... - guint8 1, guint8 1, 12 bytes of bloom filter bits
+       *   encoding "ref" */
+      return "AQFAAAAAAAAAAAAAAAA=";
+    case BLOOM_BITS_DEFAULT_SIZE:
+      /* - AQEAA... - guint8 1, guint8 1, 250 bytes of bloom filter bits
+       *   encoding "ref" */
+      return "AQEAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAABAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAA";
+    default:
+      g_assert_not_reached ();
+    }
 }
 
 static const gchar *
@@ -85,23 +106,30 @@ get_encoded_repository_index (gboolean default_repository_index)
   return "AAY=";
 }
 
-/* Check the contents of a generated .service file. */
+/* Check the contents of a generated .service file. @encoded_load_hint is the
+ * expected base64 value of the load hint record, or %NULL if there should be
+ * none. */
 static void
 assert_ostree_service_file_contents_valid (const gchar *service_file,
-                                           gboolean     short_bloom_size,
-                                           gboolean     default_repository_index)
+                                           BloomBits    bloom_bits,
+                                           gboolean     default_repository_index,
+                                           const gchar *encoded_load_hint)
 {
   g_autoptr(GError) error = NULL;
   g_autofree gchar *contents = NULL;
   gsize length;
   const gchar *encoded_bloom_bits;
   const gchar *encoded_repository_index;
+  g_autofree gchar *expected_load_hint_record = NULL;
   g_autofree gchar *expected_contents = NULL;
 
   g_file_get_contents (service_file, &contents, &length, &error);
   g_assert_no_error (error);
-  encoded_bloom_bits = get_encoded_bloom_bits (short_bloom_size);
+  encoded_bloom_bits = get_encoded_bloom_bits (bloom_bits);
   encoded_repository_index = get_encoded_repository_index (default_repository_index);
+  if (encoded_load_hint != NULL)
+    expected_load_hint_record = g_strdup_printf ("    <txt-record value-format=\"binary-base64\">ld=%s</txt-record>\n",
+                                                 encoded_load_hint);
   /* base64 values below are (note that these are raw numbers, not characters):
    * - AQ== - guint8 1
    * - AAAAAFhoRoA= - big-endian guint64 1483228800 (2017-01-01 00:00:00 UTC)
@@ -115,10 +143,12 @@ assert_ostree_service_file_contents_valid (const gchar *service_file,
                                        "    <txt-record value-format=\"binary-base64\">rb=%s</txt-record>\n"
                                        "    <txt-record value-format=\"binary-base64\">st=AAAAAFhoRoA=</txt-record>\n"
                                        "    <txt-record value-format=\"binary-base64\">ri=%s</txt-record>\n"
+                                       "%s"
                                        "  </service>\n"
                                        "</service-group>\n",
                                        encoded_bloom_bits,
-                                       encoded_repository_index);
+                                       encoded_repository_index,
+                                       (expected_load_hint_record != NULL) ? expected_load_hint_record : "");
 
   g_assert_cmpstr (contents, ==, expected_contents);
   g_assert_cmpuint (length, ==, strlen (contents));
@@ -135,6 +165,8 @@ typedef enum
     SET_PORT                    = 1 << 5,
     SET_TXT_RECORDS_SIZE_LEVEL  = 1 << 6,
     SET_TXT_RECORDS_CUSTOM_SIZE = 1 << 7,
+    SET_BLOOM_TARGET_FPR        = 1 << 8,
+    SET_LOAD_HINT               = 1 << 9,
   } TestSetFlags;
 
 typedef struct
@@ -148,6 +180,10 @@ typedef struct
   guint16 port;
   guint8 txt_records_size_level;
   guint64 txt_records_custom_size;
+  gdouble bloom_target_fpr;
+  guint16 load_active_streams;
+  guint8 load_capacity;
+  gboolean load_saturated;
 } AvahiOstreeTestOptions;
 
 #define CHECK_FLAG(flags, flag) (((flags) & (flag)) == (flag))
@@ -205,6 +241,28 @@ avahi_ostree_test_options_to_variant (const AvahiOstreeTestOptions *test_options
                            "t",
                            test_options->txt_records_custom_size);
 
+  if (CHECK_FLAG (test_options->set_flags, SET_BLOOM_TARGET_FPR))
+    g_variant_dict_insert (&options_dict,
+                           EOS_OSTREE_AVAHI_OPTION_BLOOM_TARGET_FPR_D,
+                           "d",
+                           test_options->bloom_target_fpr);
+
+  if (CHECK_FLAG (test_options->set_flags, SET_LOAD_HINT))
+    {
+      g_variant_dict_insert (&options_dict,
+                             EOS_OSTREE_AVAHI_OPTION_LOAD_ACTIVE_STREAMS_Q,
+                             "q",
+                             test_options->load_active_streams);
+      g_variant_dict_insert (&options_dict,
+                             EOS_OSTREE_AVAHI_OPTION_LOAD_CAPACITY_Y,
+                             "y",
+                             test_options->load_capacity);
+      g_variant_dict_insert (&options_dict,
+                             EOS_OSTREE_AVAHI_OPTION_LOAD_SATURATED_B,
+                             "b",
+                             test_options->load_saturated);
+    }
+
   return g_variant_dict_end (&options_dict);
 }
 
@@ -241,7 +299,19 @@ const TestOptions test_options[] =
       TRUE,
     },
     {
-      {SET_BLOOM_HASH_ID, .bloom_hash_id = 2},
+      {SET_BLOOM_HASH_ID, .bloom_hash_id = EOS_OSTREE_AVAHI_BLOOM_HASH_ID_OSTREE_COLLECTION_REF_BLOCKED},
+      TRUE,
+    },
+    {
+      {SET_BLOOM_HASH_ID | SET_BLOOM_SIZE, .bloom_hash_id = EOS_OSTREE_AVAHI_BLOOM_HASH_ID_OSTREE_COLLECTION_REF_BLOCKED, .bloom_size = 63},
+      FALSE,
+    },
+    {
+      {SET_BLOOM_HASH_ID | SET_BLOOM_SIZE, .bloom_hash_id = EOS_OSTREE_AVAHI_BLOOM_HASH_ID_OSTREE_COLLECTION_REF_BLOCKED, .bloom_size = 250},
+      TRUE,
+    },
+    {
+      {SET_BLOOM_HASH_ID, .bloom_hash_id = 3},
       FALSE,
     },
     {
@@ -268,6 +338,18 @@ const TestOptions test_options[] =
       {SET_BLOOM_SIZE, .bloom_size = 255 - 3 /* rb= */ - 2 /* bloom hash id + bloom k */ + 1},
       FALSE,
     },
+    {
+      {SET_BLOOM_TARGET_FPR, .bloom_target_fpr = 0.0},
+      FALSE,
+    },
+    {
+      {SET_BLOOM_TARGET_FPR, .bloom_target_fpr = 0.05},
+      TRUE,
+    },
+    {
+      {SET_BLOOM_TARGET_FPR, .bloom_target_fpr = 1.0},
+      FALSE,
+    },
     {
       {SET_PORT, .port = 0},
       FALSE,
@@ -312,6 +394,18 @@ const TestOptions test_options[] =
       {SET_TXT_RECORDS_SIZE_LEVEL, .txt_records_size_level = 7},
       FALSE,
     },
+    {
+      {SET_LOAD_HINT, .load_active_streams = 3, .load_capacity = EOS_OSTREE_AVAHI_LOAD_CAPACITY_MEDIUM},
+      TRUE,
+    },
+    {
+      {SET_LOAD_HINT, .load_active_streams = 16, .load_capacity = EOS_OSTREE_AVAHI_LOAD_CAPACITY_NONE, .load_saturated = TRUE},
+      TRUE,
+    },
+    {
+      {SET_LOAD_HINT, .load_capacity = 4},
+      FALSE,
+    },
   };
 
 static void
@@ -417,10 +511,21 @@ const AvahiOstreeGenerateTest avahi_ostree_generate_tests[] =
       FALSE,
     },
     {
-      {SET_TXT_RECORDS_SIZE_LEVEL, .txt_records_size_level = EOS_OSTREE_AVAHI_SIZE_LEVEL_SUPPORT_FAULTY_HARDWARE},
+      {SET_TXT_RECORDS_SIZE_LEVEL | SET_BLOOM_K, .txt_records_size_level = EOS_OSTREE_AVAHI_SIZE_LEVEL_SUPPORT_FAULTY_HARDWARE, .bloom_k = 1},
       GOOD_YEAR,
       FALSE,
     },
+    {
+      /* The automatically sized filter fits within the limit. */
+      {SET_TXT_RECORDS_SIZE_LEVEL, .txt_records_size_level = EOS_OSTREE_AVAHI_SIZE_LEVEL_SUPPORT_FAULTY_HARDWARE},
+      GOOD_YEAR,
+      TRUE,
+    },
+    {
+      {SET_BLOOM_K, .bloom_k = 1},
+      GOOD_YEAR,
+      TRUE,
+    },
     {
       {SET_BLOOM_SIZE | SET_TXT_RECORDS_SIZE_LEVEL, .bloom_size = SMALL_BLOOM_SIZE, .txt_records_size_level = EOS_OSTREE_AVAHI_SIZE_LEVEL_SUPPORT_FAULTY_HARDWARE},
       GOOD_YEAR,
@@ -431,6 +536,16 @@ const AvahiOstreeGenerateTest avahi_ostree_generate_tests[] =
       GOOD_YEAR,
       TRUE,
     },
+    {
+      {SET_LOAD_HINT, .load_active_streams = 3, .load_capacity = EOS_OSTREE_AVAHI_LOAD_CAPACITY_MEDIUM},
+      GOOD_YEAR,
+      TRUE,
+    },
+    {
+      {SET_LOAD_HINT, .load_capacity = 4},
+      GOOD_YEAR,
+      FALSE,
+    },
   };
 
 static void
@@ -473,17 +588,24 @@ test_avahi_ostree_service_file_generate (Fixture       *fixture,
 
       if (test_data->success)
         {
-          gboolean small_bloom_size;
+          BloomBits bloom_bits;
           gboolean default_repository_index;
 
           g_assert_no_error (error);
           g_assert_true (result);
 
-          small_bloom_size = CHECK_FLAG (test_data->options.set_flags, SET_BLOOM_SIZE) && test_data->options.bloom_size == SMALL_BLOOM_SIZE;
+          if (CHECK_FLAG (test_data->options.set_flags, SET_BLOOM_SIZE) && test_data->options.bloom_size == SMALL_BLOOM_SIZE)
+            bloom_bits = BLOOM_BITS_SMALL;
+          else if (CHECK_FLAG (test_data->options.set_flags, SET_BLOOM_K))
+            bloom_bits = BLOOM_BITS_DEFAULT_SIZE;
+          else
+            bloom_bits = BLOOM_BITS_AUTO;
           default_repository_index = !CHECK_FLAG (test_data->options.set_flags, SET_REPOSITORY_INDEX) || test_data->options.repository_index == 0;
+          /* - AAMCAA== - big-endian guint16 3, guint8 2, FALSE */
           assert_ostree_service_file_contents_valid (service_file,
-                                                     small_bloom_size,
-                                                     default_repository_index);
+                                                     bloom_bits,
+                                                     default_repository_index,
+                                                     CHECK_FLAG (test_data->options.set_flags, SET_LOAD_HINT) ? "AAMCAA==" : NULL);
 
           g_assert_cmpint (g_unlink (service_file), ==, 0);
         }
@@ -496,6 +618,243 @@ test_avahi_ostree_service_file_generate (Fixture       *fixture,
     }
 }
 
+/* Get the decoded value of the TXT record with @key from @service_file. */
+static GBytes *
+get_service_file_txt_record (const gchar *service_file,
+                             const gchar *key)
+{
+  g_autofree gchar *contents = NULL;
+  g_autofree gchar *prefix = g_strdup_printf (">%s=", key);
+  g_autofree gchar *encoded = NULL;
+  g_autoptr(GError) error = NULL;
+  const gchar *start, *end;
+  guchar *decoded;
+  gsize decoded_len;
+
+  g_file_get_contents (service_file, &contents, NULL, &error);
+  g_assert_no_error (error);
+
+  start = strstr (contents, prefix);
+  g_assert_nonnull (start);
+  start += strlen (prefix);
+  end = strstr (start, "</txt-record>");
+  g_assert_nonnull (end);
+
+  encoded = g_strndup (start, (gsize) (end - start));
+  decoded = g_base64_decode (encoded, &decoded_len);
+
+  return g_bytes_new_take (decoded, decoded_len);
+}
+
+/* Test that refs advertised in a bloom filter TXT record can be found when it
+ * is read back, for both bloom filter layouts, and that explicit sizes for
+ * blocked filters are rounded down to stay within the TXT record. */
+static void
+test_avahi_ostree_refs_bloom_round_trip (Fixture       *fixture,
+                                         gconstpointer  user_data G_GNUC_UNUSED)
+{
+  const struct
+    {
+      guint8 hash_id;
+      guint32 bloom_size;  /* 0 for automatic */
+      gsize expected_bloom_size;  /* 0 to not check */
+    }
+  vectors[] =
+    {
+      { EOS_OSTREE_AVAHI_BLOOM_HASH_ID_OSTREE_COLLECTION_REF, 0, 0 },
+      { EOS_OSTREE_AVAHI_BLOOM_HASH_ID_OSTREE_COLLECTION_REF, 250, 250 },
+      { EOS_OSTREE_AVAHI_BLOOM_HASH_ID_OSTREE_COLLECTION_REF_BLOCKED, 0, 0 },
+      { EOS_OSTREE_AVAHI_BLOOM_HASH_ID_OSTREE_COLLECTION_REF_BLOCKED, 250, 192 },
+    };
+  const gsize n_refs = 20;
+  const gsize n_absent_refs = 100;
+  g_autoptr(GPtrArray) refs = g_ptr_array_new_with_free_func ((GDestroyNotify) ostree_collection_ref_free);
+  g_autofree gchar *service_file = g_build_filename (fixture->tmp_dir,
+                                                     "eos-ostree-updater-0.service",
+                                                     NULL);
+  gsize i, j;
+
+  for (i = 0; i < n_refs; i++)
+    {
+      g_autofree gchar *ref_name = g_strdup_printf ("app/com.example.App%" G_GSIZE_FORMAT "/x86_64/stable", i);
+      g_ptr_array_add (refs, ostree_collection_ref_new ("com.example", ref_name));
+    }
+  g_ptr_array_add (refs, NULL);
+
+  for (i = 0; i < G_N_ELEMENTS (vectors); i++)
+    {
+      g_auto(GVariantDict) options_dict = G_VARIANT_DICT_INIT (NULL);
+      g_autoptr(GBytes) bytes = NULL;
+      g_autoptr(GError) error = NULL;
+      gboolean result, maybe_contains;
+      gsize n_false_positives = 0;
+
+      g_test_message ("Vector %" G_GSIZE_FORMAT, i);
+
+      g_variant_dict_insert (&options_dict, EOS_OSTREE_AVAHI_OPTION_BLOOM_HASH_ID_Y,
+                             "y", vectors[i].hash_id);
+      if (vectors[i].bloom_size != 0)
+        {
+          g_variant_dict_insert (&options_dict, EOS_OSTREE_AVAHI_OPTION_BLOOM_SIZE_U,
+                                 "u", vectors[i].bloom_size);
+          g_variant_dict_insert (&options_dict, EOS_OSTREE_AVAHI_OPTION_BLOOM_K_Y,
+                                 "y", 4);
+        }
+
+      result = eos_ostree_avahi_service_file_generate (fixture->tmp_dir,
+                                                       (OstreeCollectionRef **) refs->pdata,
+                                                       fixture->example_timestamp,
+                                                       g_variant_dict_end (&options_dict),
+                                                       NULL,
+                                                       &error);
+      g_assert_no_error (error);
+      g_assert_true (result);
+
+      bytes = get_service_file_txt_record (service_file, "rb");
+      g_assert_cmpuint (g_bytes_get_size (bytes), >, 2);
+      g_assert_cmpuint (g_bytes_get_size (bytes), <=, 255 - strlen ("rb="));
+      if (vectors[i].expected_bloom_size != 0)
+        g_assert_cmpuint (g_bytes_get_size (bytes) - 2 /* k, hash ID */, ==,
+                          vectors[i].expected_bloom_size);
+
+      /* Every advertised ref must be found. */
+      for (j = 0; j < n_refs; j++)
+        {
+          result = eos_ostree_avahi_refs_bloom_maybe_contains (bytes, refs->pdata[j],
+                                                               &maybe_contains, &error);
+          g_assert_no_error (error);
+          g_assert_true (result);
+          g_assert_true (maybe_contains);
+        }
+
+      /* Most refs which aren’t advertised must not be. */
+      for (j = 0; j < n_absent_refs; j++)
+        {
+          g_autofree gchar *ref_name = g_strdup_printf ("app/org.example.Absent%" G_GSIZE_FORMAT "/x86_64/stable", j);
+          g_autoptr(OstreeCollectionRef) absent_ref = ostree_collection_ref_new ("com.example", ref_name);
+
+          result = eos_ostree_avahi_refs_bloom_maybe_contains (bytes, absent_ref,
+                                                               &maybe_contains, &error);
+          g_assert_no_error (error);
+          g_assert_true (result);
+          if (maybe_contains)
+            n_false_positives++;
+        }
+
+      g_test_message ("%" G_GSIZE_FORMAT " false positives out of %" G_GSIZE_FORMAT,
+                      n_false_positives, n_absent_refs);
+      g_assert_cmpuint (n_false_positives, <, n_absent_refs / 10);
+
+      g_assert_cmpint (g_unlink (service_file), ==, 0);
+    }
+}
+
+/* Test that invalid bloom filter TXT records are rejected. */
+static void
+test_avahi_ostree_refs_bloom_invalid (void)
+{
+  g_autoptr(OstreeCollectionRef) ref = ostree_collection_ref_new ("com.example", "ref");
+  guint8 blocked_data[2 + 64] = { 1, EOS_OSTREE_AVAHI_BLOOM_HASH_ID_OSTREE_COLLECTION_REF_BLOCKED, 0, };
+  const struct
+    {
+      const guint8 *data;
+      gsize length;
+      GIOErrorEnum expected_code;
+    }
+  vectors[] =
+    {
+      { (const guint8 *) "\x01\x01", 2, G_IO_ERROR_INVALID_DATA },  /* no bits */
+      { (const guint8 *) "\x00\x01\xff", 3, G_IO_ERROR_INVALID_DATA },  /* k = 0 */
+      { (const guint8 *) "\x01\x03\xff", 3, G_IO_ERROR_NOT_SUPPORTED },  /* unknown hash ID */
+      { blocked_data, sizeof (blocked_data) - 1, G_IO_ERROR_INVALID_DATA },  /* partial block */
+    };
+  gsize i;
+
+  for (i = 0; i < G_N_ELEMENTS (vectors); i++)
+    {
+      g_autoptr(GBytes) bytes = g_bytes_new (vectors[i].data, vectors[i].length);
+      g_autoptr(GError) error = NULL;
+      gboolean maybe_contains = FALSE;
+      gboolean result;
+
+      g_test_message ("Vector %" G_GSIZE_FORMAT, i);
+
+      result = eos_ostree_avahi_refs_bloom_maybe_contains (bytes, ref, &maybe_contains, &error);
+      g_assert_error (error, G_IO_ERROR, (gint) vectors[i].expected_code);
+      g_assert_false (result);
+    }
+
+  /* A whole block is fine, and an empty filter contains nothing. */
+  {
+    g_autoptr(GBytes) bytes = g_bytes_new (blocked_data, sizeof (blocked_data));
+    g_autoptr(GError) error = NULL;
+    gboolean maybe_contains = TRUE;
+    gboolean result;
+
+    result = eos_ostree_avahi_refs_bloom_maybe_contains (bytes, ref, &maybe_contains, &error);
+    g_assert_no_error (error);
+    g_assert_true (result);
+    g_assert_false (maybe_contains);
+  }
+}
+
+/* Test that load hints survive a round trip through their serialised form, and
+ * that invalid serialised hints are rejected. */
+static void
+test_avahi_ostree_load_hint_bytes (void)
+{
+  const EosOstreeAvahiLoadHint hint =
+    {
+      .active_streams = 3,
+      .capacity = EOS_OSTREE_AVAHI_LOAD_CAPACITY_MEDIUM,
+      .saturated = TRUE,
+    };
+  const guint8 expected_data[] = { 0x00, 0x03, 0x02, 0x01 };
+  const struct
+    {
+      const guint8 data[5];
+      gsize length;
+    }
+  invalid_hints[] =
+    {
+      { { 0x00 }, 0 },
+      { { 0x00, 0x03, 0x02 }, 3 },
+      { { 0x00, 0x03, 0x02, 0x01, 0x00 }, 5 },
+      { { 0x00, 0x03, 0x04, 0x01 }, 4 },  /* unknown capacity */
+      { { 0x00, 0x03, 0x02, 0x02 }, 4 },  /* invalid boolean */
+    };
+  g_autoptr(GBytes) bytes = NULL;
+  EosOstreeAvahiLoadHint parsed_hint = { 0, };
+  g_autoptr(GError) error = NULL;
+  gboolean result;
+  gsize i;
+
+  bytes = eos_ostree_avahi_load_hint_to_bytes (&hint);
+  g_assert_nonnull (bytes);
+  g_assert_cmpmem (g_bytes_get_data (bytes, NULL), g_bytes_get_size (bytes),
+                   expected_data, sizeof (expected_data));
+
+  result = eos_ostree_avahi_load_hint_from_bytes (bytes, &parsed_hint, &error);
+  g_assert_no_error (error);
+  g_assert_true (result);
+  g_assert_cmpuint (parsed_hint.active_streams, ==, hint.active_streams);
+  g_assert_cmpint (parsed_hint.capacity, ==, hint.capacity);
+  g_assert_cmpint (parsed_hint.saturated, ==, hint.saturated);
+
+  for (i = 0; i < G_N_ELEMENTS (invalid_hints); i++)
+    {
+      g_autoptr(GBytes) invalid_bytes = g_bytes_new (invalid_hints[i].data,
+                                                     invalid_hints[i].length);
+
+      g_test_message ("Invalid hint %" G_GSIZE_FORMAT, i);
+
+      result = eos_ostree_avahi_load_hint_from_bytes (invalid_bytes, &parsed_hint, &error);
+      g_assert_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA);
+      g_assert_false (result);
+      g_clear_error (&error);
+    }
+}
+
 static void
 create_file (const gchar *path)
 {
@@ -576,6 +935,57 @@ test_avahi_ostree_cleanup_directory (Fixture       *fixture,
     }
 }
 
+/* Test that eos_ostree_avahi_service_file_cleanup_directory_except() leaves
+ * the service files for the given repository indices in place. */
+static void
+test_avahi_ostree_cleanup_directory_except (Fixture       *fixture,
+                                            gconstpointer  user_data G_GNUC_UNUSED)
+{
+  const guint16 keep_indices[] = { 1, 4 };
+  guint16 idx;
+  guint16 max = 6;
+  gboolean result;
+  g_autoptr(GError) error = NULL;
+
+  for (idx = 0; idx < max; ++idx)
+    {
+      g_autofree gchar *repo_index = g_strdup_printf ("%" G_GUINT16_FORMAT, idx);
+      g_autofree gchar *filename = ostree_service_file (repo_index);
+      g_autofree gchar *service_file = g_build_filename (fixture->tmp_dir,
+                                                         filename,
+                                                         NULL);
+
+      create_file (service_file);
+    }
+
+  result = eos_ostree_avahi_service_file_cleanup_directory_except (fixture->tmp_dir,
+                                                                   keep_indices,
+                                                                   G_N_ELEMENTS (keep_indices),
+                                                                   NULL,
+                                                                   &error);
+  g_assert_no_error (error);
+  g_assert_true (result);
+
+  for (idx = 0; idx < max; ++idx)
+    {
+      g_autofree gchar *repo_index = g_strdup_printf ("%" G_GUINT16_FORMAT, idx);
+      g_autofree gchar *filename = ostree_service_file (repo_index);
+      g_autofree gchar *service_file = g_build_filename (fixture->tmp_dir,
+                                                         filename,
+                                                         NULL);
+
+      if (idx == 1 || idx == 4)
+        {
+          g_assert_true (g_file_test (service_file, G_FILE_TEST_EXISTS));
+          g_assert_cmpint (g_unlink (service_file), ==, 0);
+        }
+      else
+        {
+          g_assert_false (g_file_test (service_file, G_FILE_TEST_EXISTS));
+        }
+    }
+}
+
 static void
 test_avahi_ostree_delete (Fixture       *fixture,
                           gconstpointer  user_data G_GNUC_UNUSED)
@@ -621,8 +1031,16 @@ main (int   argc,
                    test_avahi_ostree_options_check);
   g_test_add ("/avahi-service-file/ostree/generate", Fixture, NULL, setup,
               test_avahi_ostree_service_file_generate, teardown);
+  g_test_add_func ("/avahi-service-file/ostree/load-hint-bytes",
+                   test_avahi_ostree_load_hint_bytes);
+  g_test_add ("/avahi-service-file/ostree/refs-bloom/round-trip", Fixture, NULL, setup,
+              test_avahi_ostree_refs_bloom_round_trip, teardown);
+  g_test_add_func ("/avahi-service-file/ostree/refs-bloom/invalid",
+                   test_avahi_ostree_refs_bloom_invalid);
   g_test_add ("/avahi-service-file/ostree/cleanup-directory", Fixture, NULL, setup,
               test_avahi_ostree_cleanup_directory, teardown);
+  g_test_add ("/avahi-service-file/ostree/cleanup-directory-except", Fixture, NULL, setup,
+              test_avahi_ostree_cleanup_directory_except, teardown);
   g_test_add ("/avahi-service-file/ostree/delete", Fixture, NULL, setup,
               test_avahi_ostree_delete, teardown);
 
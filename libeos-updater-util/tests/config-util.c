@@ -354,6 +354,133 @@ test_config_file_groups (Fixture       *fixture,
   g_assert_null (groups[4]);
 }
 
+/* Test parsing valid and invalid time windows. */
+static void
+test_time_windows_parse (void)
+{
+  const struct
+    {
+      const gchar *windows[3];
+      gboolean expected_valid;
+    }
+  vectors[] =
+    {
+      { { NULL, }, TRUE },
+      { { "00:00-24:00", NULL }, TRUE },
+      { { "22:00-06:30", "12:15-13:00", NULL }, TRUE },
+      { { " 9:00 - 17:00 ", NULL }, TRUE },
+      { { "", NULL }, FALSE },
+      { { "9:00", NULL }, FALSE },
+      { { "9-17", NULL }, FALSE },
+      { { "09:00-17:60", NULL }, FALSE },
+      { { "09:00-24:01", NULL }, FALSE },
+      { { "09:00-17:00-18:00", NULL }, FALSE },
+      { { "12:00-13:00", "nonsense", NULL }, FALSE },
+    };
+  gsize i;
+
+  for (i = 0; i < G_N_ELEMENTS (vectors); i++)
+    {
+      g_autoptr(GArray) windows = NULL;
+      g_autoptr(GError) error = NULL;
+
+      windows = euu_time_windows_parse (vectors[i].windows, &error);
+
+      if (vectors[i].expected_valid)
+        {
+          g_assert_no_error (error);
+          g_assert_nonnull (windows);
+        }
+      else
+        {
+          g_assert_error (error, G_KEY_FILE_ERROR, G_KEY_FILE_ERROR_INVALID_VALUE);
+          g_assert_null (windows);
+        }
+    }
+}
+
+/* Test checking whether times fall within time windows, including windows
+ * which wrap around midnight. */
+static void
+test_time_windows_contain (void)
+{
+  const struct
+    {
+      const gchar *windows[3];
+      gint hour;
+      gint minute;
+      gboolean expected_contained;
+    }
+  vectors[] =
+    {
+      { { NULL, }, 12, 0, TRUE },
+      { { "09:00-17:00", NULL }, 8, 59, FALSE },
+      { { "09:00-17:00", NULL }, 9, 0, TRUE },
+      { { "09:00-17:00", NULL }, 16, 59, TRUE },
+      { { "09:00-17:00", NULL }, 17, 0, FALSE },
+      { { "22:00-06:00", NULL }, 23, 30, TRUE },
+      { { "22:00-06:00", NULL }, 3, 0, TRUE },
+      { { "22:00-06:00", NULL }, 12, 0, FALSE },
+      { { "22:00-06:00", "12:00-13:00", NULL }, 12, 30, TRUE },
+      { { "00:00-00:00", NULL }, 15, 45, TRUE },
+    };
+  gsize i;
+
+  for (i = 0; i < G_N_ELEMENTS (vectors); i++)
+    {
+      g_autoptr(GArray) windows = NULL;
+      g_autoptr(GError) error = NULL;
+      g_autoptr(GDateTime) date_time = NULL;
+
+      windows = euu_time_windows_parse (vectors[i].windows, &error);
+      g_assert_no_error (error);
+
+      date_time = g_date_time_new_local (2024, 6, 1, vectors[i].hour, vectors[i].minute, 0);
+      g_assert_cmpint (euu_time_windows_contain (windows, date_time), ==,
+                       vectors[i].expected_contained);
+    }
+}
+
+/* Test working out when the next time window opens, including windows which
+ * wrap around midnight. */
+static void
+test_time_windows_minutes_until_open (void)
+{
+  const struct
+    {
+      const gchar *windows[3];
+      gint hour;
+      gint minute;
+      guint expected_minutes;
+    }
+  vectors[] =
+    {
+      { { NULL, }, 12, 0, 0 },
+      { { "09:00-17:00", NULL }, 8, 59, 1 },
+      { { "09:00-17:00", NULL }, 12, 0, 0 },
+      { { "09:00-17:00", NULL }, 17, 0, 16 * 60 },
+      { { "22:00-06:00", NULL }, 12, 0, 10 * 60 },
+      { { "22:00-06:00", NULL }, 3, 0, 0 },
+      { { "22:00-06:00", "12:00-13:00", NULL }, 11, 30, 30 },
+      { { "22:00-06:00", "12:00-13:00", NULL }, 13, 0, 9 * 60 },
+    };
+  gsize i;
+
+  for (i = 0; i < G_N_ELEMENTS (vectors); i++)
+    {
+      g_autoptr(GArray) windows = NULL;
+      g_autoptr(GError) error = NULL;
+      g_autoptr(GDateTime) date_time = NULL;
+
+      windows = euu_time_windows_parse (vectors[i].windows, &error);
+      g_assert_no_error (error);
+
+      date_time = g_date_time_new_local (2024, 6, 1, vectors[i].hour, vectors[i].minute, 0);
+      g_assert_cmpuint (euu_time_windows_get_minutes_until_open (windows, date_time), ==,
+                        vectors[i].expected_minutes);
+    }
+}
+
 int
 main (int   argc,
       char *argv[])
@@ -380,6 +507,10 @@ main (int   argc,
               test_config_file_fallback_per_key, teardown);
   g_test_add ("/config/groups", Fixture, NULL, setup,
               test_config_file_groups, teardown);
+  g_test_add_func ("/config/time-windows/parse", test_time_windows_parse);
+  g_test_add_func ("/config/time-windows/contain", test_time_windows_contain);
+  g_test_add_func ("/config/time-windows/minutes-until-open",
+                   test_time_windows_minutes_until_open);
 
   return g_test_run ();
 }
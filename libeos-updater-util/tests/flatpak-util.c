@@ -28,6 +28,7 @@
 #include <libeos-updater-util/flatpak-util.h>
 #include <libeos-updater-util/types.h>
 #include <locale.h>
+#include <string.h>
 
 static guint n_warnings = 0;
 
@@ -445,6 +446,82 @@ test_compression_preserves_order (void)
                    EUU_FLATPAK_REMOTE_REF_ACTION_UNINSTALL);
 }
 
+/* Test that squashing a large number of actions, spread across several
+ * files, gives the right result. Run with `-m perf` to use a much larger input
+ * and report how long squashing took; it should scale linearly. */
+static void
+test_compress_large (void)
+{
+  const guint n_refs = g_test_perf () ? 100000 : 1000;
+  const EuuFlatpakRemoteRefActionType file_types[] =
+    {
+      EUU_FLATPAK_REMOTE_REF_ACTION_INSTALL,
+      EUU_FLATPAK_REMOTE_REF_ACTION_UPDATE,
+      EUU_FLATPAK_REMOTE_REF_ACTION_UNINSTALL,
+    };
+  g_autoptr(GHashTable) uncompressed_ref_actions_table = NULL;
+  g_autoptr(GHashTable) squashed_ref_actions_table = NULL;
+  g_autoptr(GPtrArray) flattened_actions_list = NULL;
+  guint n_uninstalls = 0;
+  gdouble elapsed;
+  gsize i, j;
+
+  uncompressed_ref_actions_table = g_hash_table_new_full (g_str_hash,
+                                                          g_str_equal,
+                                                          g_free,
+                                                          (GDestroyNotify) g_ptr_array_unref);
+
+  /* Every ref is installed by the first file, then updated by the second, and
+   * every other one is uninstalled by the third. */
+  for (i = 0; i < G_N_ELEMENTS (file_types); i++)
+    {
+      g_autofree gchar *name = g_strdup_printf ("autoinstall%" G_GSIZE_FORMAT, i);
+      g_autoptr(GPtrArray) actions = g_ptr_array_new_with_free_func ((GDestroyNotify) euu_flatpak_remote_ref_action_unref);
+
+      for (j = 0; j < n_refs; j++)
+        {
+          g_autofree gchar *app_id = g_strdup_printf ("org.test.Test%" G_GSIZE_FORMAT, j);
+          FlatpakToInstallEntry entry = { file_types[i], FLATPAK_REF_KIND_APP, app_id, "stable", (gint32) j, 0 };
+
+          if (file_types[i] == EUU_FLATPAK_REMOTE_REF_ACTION_UNINSTALL && (j % 2) == 0)
+            continue;
+
+          g_ptr_array_add (actions, flatpak_to_install_entry_to_remote_ref_action (name, &entry));
+        }
+
+      g_hash_table_insert (uncompressed_ref_actions_table,
+                           g_steal_pointer (&name), g_steal_pointer (&actions));
+    }
+
+  g_test_timer_start ();
+
+  squashed_ref_actions_table = euu_squash_remote_ref_actions (uncompressed_ref_actions_table);
+  flattened_actions_list = euu_flatten_flatpak_ref_actions_table (squashed_ref_actions_table);
+
+  elapsed = g_test_timer_elapsed ();
+  g_test_minimized_result (elapsed, "Squashed %u actions on %u refs in %.3f s",
+                           n_refs * 3 - n_refs / 2, n_refs, elapsed);
+
+  g_assert_cmpuint (g_hash_table_size (squashed_ref_actions_table), ==, G_N_ELEMENTS (file_types));
+  g_assert_cmpuint (flattened_actions_list->len, ==, n_refs);
+
+  for (i = 0; i < flattened_actions_list->len; i++)
+    {
+      EuuFlatpakRemoteRefAction *action = g_ptr_array_index (flattened_actions_list, i);
+
+      g_assert_true (action->type == EUU_FLATPAK_REMOTE_REF_ACTION_INSTALL ||
+                     action->type == EUU_FLATPAK_REMOTE_REF_ACTION_UNINSTALL);
+      if (action->type == EUU_FLATPAK_REMOTE_REF_ACTION_UNINSTALL)
+        n_uninstalls++;
+
+      if (i > 0)
+        g_assert_cmpint (((EuuFlatpakRemoteRefAction *) g_ptr_array_index (flattened_actions_list, i - 1))->serial, <=,
+                         action->serial);
+    }
+
+  g_assert_cmpuint (n_uninstalls, ==, n_refs / 2);
+}
+
 /* Test the autoinstall file parser handles various different constructs (valid
  * and erroneous) in the format, returning success or an error when appropriate. */
 static void
@@ -840,6 +917,262 @@ test_autoinstall_file_filters (void)
     g_unsetenv ("EOS_UPDATER_TEST_UPDATER_OVERRIDE_LOCALES");
 }
 
+/* Assert that @ref_actions, as returned by euu_flatpak_ref_actions_from_paths(),
+ * contains a single file with a single install action with the given
+ * @expected_serial. */
+static void
+assert_single_autoinstall_action (GHashTable *ref_actions,
+                                  gint32      expected_serial)
+{
+  GPtrArray *actions;
+  const EuuFlatpakRemoteRefAction *action;
+  g_autofree gchar *action_ref = NULL;
+
+  g_assert_cmpuint (g_hash_table_size (ref_actions), ==, 1);
+  actions = g_hash_table_lookup (ref_actions, "10-test.json");
+  g_assert_nonnull (actions);
+  g_assert_cmpuint (actions->len, ==, 1);
+
+  action = g_ptr_array_index (actions, 0);
+  action_ref = flatpak_ref_format_ref (action->ref->ref);
+
+  g_assert_cmpint (action->type, ==, EUU_FLATPAK_REMOTE_REF_ACTION_INSTALL);
+  g_assert_cmpstr (action_ref, ==, "app/org.example.MyApp/arch/stable");
+  g_assert_cmpstr (action->ref->remote, ==, "eos-apps");
+  g_assert_cmpstr (action->ref->collection_id, ==, "com.endlessm.Apps");
+  g_assert_cmpstr (action->source, ==, "10-test.json");
+  g_assert_cmpint (action->serial, ==, expected_serial);
+  g_assert_cmpint (action->flags, ==, EUU_FLATPAK_REMOTE_REF_ACTION_FLAG_NONE);
+}
+
+/* Assert that @ref_actions, loaded from a directory with the architecture
+ * overridden to `otherarch`, contains a single file with an install, an
+ * uninstall and an update action, in that order, with the given serials. */
+static void
+assert_mixed_autoinstall_actions (GHashTable *ref_actions,
+                                  gint32      install_serial,
+                                  gint32      uninstall_serial,
+                                  gint32      update_serial)
+{
+  const struct
+    {
+      EuuFlatpakRemoteRefActionType type;
+      const gchar *ref;
+      const gchar *remote;
+      const gchar *collection_id;
+      gint32 serial;
+    }
+  expected[] =
+    {
+      { EUU_FLATPAK_REMOTE_REF_ACTION_INSTALL, "app/org.example.Install/otherarch/stable",
+        "eos-apps", "com.endlessm.Apps", install_serial },
+      { EUU_FLATPAK_REMOTE_REF_ACTION_UNINSTALL, "app/org.example.Uninstall/otherarch/stable",
+        NULL, NULL, uninstall_serial },
+      { EUU_FLATPAK_REMOTE_REF_ACTION_UPDATE, "runtime/org.example.Update/otherarch/stable",
+        NULL, NULL, update_serial },
+    };
+  GPtrArray *actions;
+  gsize i;
+
+  g_assert_cmpuint (g_hash_table_size (ref_actions), ==, 1);
+  actions = g_hash_table_lookup (ref_actions, "10-test.json");
+  g_assert_nonnull (actions);
+  g_assert_cmpuint (actions->len, ==, G_N_ELEMENTS (expected));
+
+  for (i = 0; i < actions->len; i++)
+    {
+      const EuuFlatpakRemoteRefAction *action = g_ptr_array_index (actions, i);
+      g_autofree gchar *action_ref = flatpak_ref_format_ref (action->ref->ref);
+
+      g_test_message ("Action %" G_GSIZE_FORMAT, i);
+      g_assert_cmpint (action->type, ==, expected[i].type);
+      g_assert_cmpstr (action_ref, ==, expected[i].ref);
+      g_assert_cmpstr (action->ref->remote, ==, expected[i].remote);
+      g_assert_cmpstr (action->ref->collection_id, ==, expected[i].collection_id);
+      g_assert_cmpstr (action->source, ==, "10-test.json");
+      g_assert_cmpint (action->serial, ==, expected[i].serial);
+    }
+}
+
+/* Replace the serialised @old_serial in the autoinstall cache at @cache_path
+ * with @new_serial, leaving everything else (including the fingerprint of the
+ * file it came from) unchanged. This is done on the raw bytes so that it
+ * doesn’t depend on the format of the cache. */
+static void
+patch_autoinstall_cache_serial (const gchar *cache_path,
+                                gint32       old_serial,
+                                gint32       new_serial)
+{
+  g_autofree gchar *contents = NULL;
+  gsize length, i;
+  gsize n_matches = 0;
+  g_autoptr(GError) error = NULL;
+
+  g_file_get_contents (cache_path, &contents, &length, &error);
+  g_assert_no_error (error);
+
+  for (i = 0; i + sizeof (old_serial) <= length; i++)
+    {
+      if (memcmp (contents + i, &old_serial, sizeof (old_serial)) == 0)
+        {
+          memcpy (contents + i, &new_serial, sizeof (new_serial));
+          n_matches++;
+        }
+    }
+
+  g_assert_cmpuint (n_matches, ==, 1);
+
+  g_file_set_contents (cache_path, contents, (gssize) length, &error);
+  g_assert_no_error (error);
+}
+
+/* Test that parsed autoinstall files are cached on disk, that the cached
+ * results match the parsed ones, and that changes to the files or a corrupt
+ * cache are handled. */
+static void
+test_autoinstall_file_cache (void)
+{
+  const gchar *data_template =
+    "["
+      "{ 'action': 'install', 'serial': %d, 'ref-kind': 'app', "
+      "   'name': 'org.example.MyApp', 'collection-id': 'com.endlessm.Apps', "
+      "   'remote': 'eos-apps', 'branch': 'stable' }"
+    "]";
+
+  g_autofree gchar *old_env_arch = g_strdup (g_getenv ("EOS_UPDATER_TEST_OVERRIDE_ARCHITECTURE"));
+  g_autofree gchar *old_env_cache = g_strdup (g_getenv ("EOS_UPDATER_TEST_UPDATER_FLATPAK_AUTOINSTALL_CACHE_PATH"));
+  g_autofree gchar *directory = g_build_filename (g_get_user_data_dir (), "flatpak-autoinstall.d", NULL);
+  g_autofree gchar *file_path = g_build_filename (directory, "10-test.json", NULL);
+  g_autofree gchar *cache_path = g_build_filename (g_get_user_cache_dir (), "eos-updater", "flatpak-autoinstall.cache", NULL);
+  const gchar *directories[] = { directory, NULL };
+  g_autofree gchar *data = NULL;
+  g_autoptr(GHashTable) ref_actions = NULL;
+  GPtrArray *actions;
+  const EuuFlatpakRemoteRefAction *action;
+  g_autofree gchar *action_ref = NULL;
+  g_autoptr(GError) error = NULL;
+
+  g_setenv ("EOS_UPDATER_TEST_OVERRIDE_ARCHITECTURE", "arch", TRUE);
+  g_setenv ("EOS_UPDATER_TEST_UPDATER_FLATPAK_AUTOINSTALL_CACHE_PATH", cache_path, TRUE);
+
+  g_assert_cmpint (g_mkdir_with_parents (directory, 0755), ==, 0);
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpragmas"
+#pragma GCC diagnostic ignored "-Wsuggest-attribute=format"
+#pragma GCC diagnostic ignored "-Wformat-nonliteral"
+  data = g_strdup_printf (data_template, 2017100100);
+#pragma GCC diagnostic pop
+
+  g_file_set_contents (file_path, data, -1, &error);
+  g_assert_no_error (error);
+
+  /* The first load parses the file and creates the cache. */
+  g_assert_false (g_file_test (cache_path, G_FILE_TEST_EXISTS));
+
+  ref_actions = euu_flatpak_ref_actions_from_paths ((GStrv) directories, &error);
+  g_assert_no_error (error);
+  assert_single_autoinstall_action (ref_actions, 2017100100);
+  g_clear_pointer (&ref_actions, g_hash_table_unref);
+
+  g_assert_true (g_file_test (cache_path, G_FILE_TEST_IS_REGULAR));
+
+  /* The second load should come from the cache, and give the same results. */
+  ref_actions = euu_flatpak_ref_actions_from_paths ((GStrv) directories, &error);
+  g_assert_no_error (error);
+  assert_single_autoinstall_action (ref_actions, 2017100100);
+  g_clear_pointer (&ref_actions, g_hash_table_unref);
+
+  /* Check that it really did come from the cache by changing the serial in the
+   * cache but not in the file. */
+  patch_autoinstall_cache_serial (cache_path, 2017100100, 2017100199);
+
+  ref_actions = euu_flatpak_ref_actions_from_paths ((GStrv) directories, &error);
+  g_assert_no_error (error);
+  assert_single_autoinstall_action (ref_actions, 2017100199);
+  g_clear_pointer (&ref_actions, g_hash_table_unref);
+
+  /* Changing the file should invalidate its cache entry. */
+  g_clear_pointer (&data, g_free);
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpragmas"
+#pragma GCC diagnostic ignored "-Wsuggest-attribute=format"
+#pragma GCC diagnostic ignored "-Wformat-nonliteral"
+  data = g_strdup_printf (data_template, 2017110100);
+#pragma GCC diagnostic pop
+
+  g_file_set_contents (file_path, data, -1, &error);
+  g_assert_no_error (error);
+
+  ref_actions = euu_flatpak_ref_actions_from_paths ((GStrv) directories, &error);
+  g_assert_no_error (error);
+  assert_single_autoinstall_action (ref_actions, 2017110100);
+  g_clear_pointer (&ref_actions, g_hash_table_unref);
+
+  /* A corrupt cache should be ignored and then replaced. */
+  g_file_set_contents (cache_path, "corrupt", -1, &error);
+  g_assert_no_error (error);
+
+  ref_actions = euu_flatpak_ref_actions_from_paths ((GStrv) directories, &error);
+  g_assert_no_error (error);
+  assert_single_autoinstall_action (ref_actions, 2017110100);
+  g_clear_pointer (&ref_actions, g_hash_table_unref);
+
+  /* Changing the architecture used to filter the files should invalidate the
+   * whole cache. */
+  g_setenv ("EOS_UPDATER_TEST_OVERRIDE_ARCHITECTURE", "otherarch", TRUE);
+
+  ref_actions = euu_flatpak_ref_actions_from_paths ((GStrv) directories, &error);
+  g_assert_no_error (error);
+  g_assert_cmpuint (g_hash_table_size (ref_actions), ==, 1);
+  actions = g_hash_table_lookup (ref_actions, "10-test.json");
+  g_assert_nonnull (actions);
+  g_assert_cmpuint (actions->len, ==, 1);
+  action = g_ptr_array_index (actions, 0);
+  action_ref = flatpak_ref_format_ref (action->ref->ref);
+  g_assert_cmpstr (action_ref, ==, "app/org.example.MyApp/otherarch/stable");
+  g_clear_pointer (&ref_actions, g_hash_table_unref);
+
+  /* All the action types should round-trip through the cache, including
+   * uninstall and update actions, which have no remote. As above, patch the
+   * serials in the cache to check the second load really came from it. */
+  g_file_set_contents (file_path,
+                       "["
+                         "{ 'action': 'install', 'serial': 2018010100, 'ref-kind': 'app', "
+                         "   'name': 'org.example.Install', 'collection-id': 'com.endlessm.Apps', "
+                         "   'remote': 'eos-apps', 'branch': 'stable' },"
+                         "{ 'action': 'uninstall', 'serial': 2018010101, 'ref-kind': 'app', "
+                         "   'name': 'org.example.Uninstall', 'branch': 'stable' },"
+                         "{ 'action': 'update', 'serial': 2018010102, 'ref-kind': 'runtime', "
+                         "   'name': 'org.example.Update', 'branch': 'stable' }"
+                       "]", -1, &error);
+  g_assert_no_error (error);
+
+  ref_actions = euu_flatpak_ref_actions_from_paths ((GStrv) directories, &error);
+  g_assert_no_error (error);
+  assert_mixed_autoinstall_actions (ref_actions, 2018010100, 2018010101, 2018010102);
+  g_clear_pointer (&ref_actions, g_hash_table_unref);
+
+  patch_autoinstall_cache_serial (cache_path, 2018010100, 2018010150);
+  patch_autoinstall_cache_serial (cache_path, 2018010101, 2018010151);
+  patch_autoinstall_cache_serial (cache_path, 2018010102, 2018010152);
+
+  ref_actions = euu_flatpak_ref_actions_from_paths ((GStrv) directories, &error);
+  g_assert_no_error (error);
+  assert_mixed_autoinstall_actions (ref_actions, 2018010150, 2018010151, 2018010152);
+  g_clear_pointer (&ref_actions, g_hash_table_unref);
+
+  if (old_env_arch != NULL)
+    g_setenv ("EOS_UPDATER_TEST_OVERRIDE_ARCHITECTURE", old_env_arch, TRUE);
+  else
+    g_unsetenv ("EOS_UPDATER_TEST_OVERRIDE_ARCHITECTURE");
+  if (old_env_cache != NULL)
+    g_setenv ("EOS_UPDATER_TEST_UPDATER_FLATPAK_AUTOINSTALL_CACHE_PATH", old_env_cache, TRUE);
+  else
+    g_unsetenv ("EOS_UPDATER_TEST_UPDATER_FLATPAK_AUTOINSTALL_CACHE_PATH");
+}
+
 int
 main (int   argc,
       char *argv[])
@@ -877,12 +1210,16 @@ main (int   argc,
               test_uninstall_dependency_action_ordered_before_source);
   g_test_add_func ("/flatpak/compress/preserves-order",
               test_compression_preserves_order);
+  g_test_add_func ("/flatpak/compress/large",
+                   test_compress_large);
   g_test_add_func ("/flatpak/parse-autoinstall-file",
                    test_parse_autoinstall_file);
   g_test_add_func ("/flatpak/parse-autoinstall-file/unsorted",
                    test_parse_autoinstall_file_unsorted);
   g_test_add_func ("/flatpak/autoinstall-file-filters",
                    test_autoinstall_file_filters);
+  g_test_add_func ("/flatpak/autoinstall-file-cache",
+                   test_autoinstall_file_cache);
 
   gint status = g_test_run ();
 
@@ -0,0 +1,212 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * Copyright 2024 Endless OS Foundation LLC
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library; if not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: LGPL-2.1-or-later
+ */
+
+#include <glib.h>
+#include <libeos-updater-util/ostree-bloom-private.h>
+#include <locale.h>
+
+static OstreeBloom *
+new_bloom (gboolean is_blocked,
+           gsize    n_bytes,
+           guint8   k)
+{
+  if (is_blocked)
+    return ostree_bloom_new_blocked (n_bytes, k, ostree_str_bloom_hash);
+  else
+    return ostree_bloom_new (n_bytes, k, ostree_str_bloom_hash);
+}
+
+/* Test that every element added to a filter is always reported as possibly
+ * being in it, before and after sealing and after reloading, for both layouts
+ * and a range of sizes (including ones which aren’t a multiple of the block
+ * size). */
+static void
+test_bloom_no_false_negatives (void)
+{
+  const gsize sizes[] = { 1, 63, 64, 65, 100, 250, 4096 };
+  const guint8 ks[] = { 1, 4, 8, 16 };
+  const gsize n_elements = 500;
+  gsize i, j, l;
+  gint is_blocked;
+
+  for (is_blocked = 0; is_blocked <= 1; is_blocked++)
+    for (i = 0; i < G_N_ELEMENTS (sizes); i++)
+      for (j = 0; j < G_N_ELEMENTS (ks); j++)
+        {
+          g_autoptr(OstreeBloom) bloom = NULL;
+          g_autoptr(GBytes) bytes = NULL;
+          g_autoptr(OstreeBloom) loaded = NULL;
+          g_autoptr(GPtrArray) elements = g_ptr_array_new_with_free_func (g_free);
+
+          /* Blocked filters are at least one block. */
+          if (is_blocked && sizes[i] < OSTREE_BLOOM_BLOCK_SIZE)
+            continue;
+
+          g_test_message ("Blocked: %d, size: %" G_GSIZE_FORMAT ", k: %u",
+                          is_blocked, sizes[i], (guint) ks[j]);
+
+          bloom = new_bloom (is_blocked, sizes[i], ks[j]);
+          g_assert_nonnull (bloom);
+          g_assert_cmpint (ostree_bloom_is_blocked (bloom), ==, is_blocked);
+
+          for (l = 0; l < n_elements; l++)
+            {
+              gchar *element = g_strdup_printf ("com.example.App%" G_GSIZE_FORMAT, l);
+
+              ostree_bloom_add_element (bloom, element);
+              g_ptr_array_add (elements, element);
+            }
+
+          for (l = 0; l < elements->len; l++)
+            g_assert_true (ostree_bloom_maybe_contains (bloom, elements->pdata[l]));
+
+          bytes = ostree_bloom_seal (bloom);
+          g_assert_cmpuint (g_bytes_get_size (bytes), ==, ostree_bloom_get_size (bloom));
+
+          for (l = 0; l < elements->len; l++)
+            g_assert_true (ostree_bloom_maybe_contains (bloom, elements->pdata[l]));
+
+          /* The filter can be reloaded from its serialised form. */
+          if (is_blocked)
+            loaded = ostree_bloom_new_from_bytes_blocked (bytes, ks[j], ostree_str_bloom_hash);
+          else
+            loaded = ostree_bloom_new_from_bytes (bytes, ks[j], ostree_str_bloom_hash);
+
+          g_assert_nonnull (loaded);
+          g_assert_cmpint (ostree_bloom_is_blocked (loaded), ==, is_blocked);
+          g_assert_cmpuint (ostree_bloom_get_size (loaded), ==, ostree_bloom_get_size (bloom));
+
+          for (l = 0; l < elements->len; l++)
+            g_assert_true (ostree_bloom_maybe_contains (loaded, elements->pdata[l]));
+        }
+}
+
+/* Test that blocked filters are rounded down to a whole number of blocks, so
+ * they are never bigger than requested. */
+static void
+test_bloom_blocked_size (void)
+{
+  const struct
+    {
+      gsize n_bytes;
+      gsize expected_size;
+    }
+  vectors[] =
+    {
+      { OSTREE_BLOOM_BLOCK_SIZE, OSTREE_BLOOM_BLOCK_SIZE },
+      { OSTREE_BLOOM_BLOCK_SIZE + 1, OSTREE_BLOOM_BLOCK_SIZE },
+      { 2 * OSTREE_BLOOM_BLOCK_SIZE - 1, OSTREE_BLOOM_BLOCK_SIZE },
+      { 2 * OSTREE_BLOOM_BLOCK_SIZE, 2 * OSTREE_BLOOM_BLOCK_SIZE },
+      { 250, 3 * OSTREE_BLOOM_BLOCK_SIZE },
+      { 256, 4 * OSTREE_BLOOM_BLOCK_SIZE },
+    };
+  gsize i;
+
+  for (i = 0; i < G_N_ELEMENTS (vectors); i++)
+    {
+      g_autoptr(OstreeBloom) bloom = ostree_bloom_new_blocked (vectors[i].n_bytes, 3, ostree_str_bloom_hash);
+
+      g_test_message ("Vector %" G_GSIZE_FORMAT, i);
+      g_assert_cmpuint (ostree_bloom_get_size (bloom), ==, vectors[i].expected_size);
+    }
+}
+
+/* Test that adding one element to a blocked filter sets exactly k distinct
+ * bits, all in the same block. */
+static void
+test_bloom_blocked_probes (void)
+{
+  const gsize n_blocks = 4;
+  guint8 k;
+
+  for (k = 1; k <= 32; k++)
+    {
+      g_autoptr(OstreeBloom) bloom = ostree_bloom_new_blocked (n_blocks * OSTREE_BLOOM_BLOCK_SIZE, k, ostree_str_bloom_hash);
+      g_autoptr(GBytes) bytes = NULL;
+      const guint8 *data;
+      gsize size, i, block, n_set_bits = 0, n_used_blocks = 0;
+
+      ostree_bloom_add_element (bloom, "com.example.App");
+      bytes = ostree_bloom_seal (bloom);
+      data = g_bytes_get_data (bytes, &size);
+      g_assert_cmpuint (size, ==, n_blocks * OSTREE_BLOOM_BLOCK_SIZE);
+
+      for (block = 0; block < n_blocks; block++)
+        {
+          gsize n_block_bits = 0;
+
+          for (i = block * OSTREE_BLOOM_BLOCK_SIZE * 8; i < (block + 1) * OSTREE_BLOOM_BLOCK_SIZE * 8; i++)
+            if (data[i / 8] & (1 << (i % 8)))
+              n_block_bits++;
+
+          if (n_block_bits > 0)
+            n_used_blocks++;
+          n_set_bits += n_block_bits;
+        }
+
+      g_test_message ("k: %u", (guint) k);
+      g_assert_cmpuint (n_used_blocks, ==, 1);
+      g_assert_cmpuint (n_set_bits, ==, k);
+    }
+}
+
+/* Test that the false positive rate of a blocked filter is in the right
+ * ballpark: about 30 bits per element with k = 7 should give well under 1%. */
+static void
+test_bloom_blocked_false_positive_rate (void)
+{
+  g_autoptr(OstreeBloom) bloom = ostree_bloom_new_blocked (4096, 7, ostree_str_bloom_hash);
+  const gsize n_elements = 1000;
+  const gsize n_queries = 10000;
+  gsize i, n_false_positives = 0;
+
+  for (i = 0; i < n_elements; i++)
+    {
+      g_autofree gchar *element = g_strdup_printf ("present-%" G_GSIZE_FORMAT, i);
+      ostree_bloom_add_element (bloom, element);
+    }
+
+  for (i = 0; i < n_queries; i++)
+    {
+      g_autofree gchar *element = g_strdup_printf ("absent-%" G_GSIZE_FORMAT, i);
+      if (ostree_bloom_maybe_contains (bloom, element))
+        n_false_positives++;
+    }
+
+  g_test_message ("%" G_GSIZE_FORMAT " false positives out of %" G_GSIZE_FORMAT,
+                  n_false_positives, n_queries);
+  g_assert_cmpuint (n_false_positives, <, n_queries / 100);
+}
+
+int
+main (int   argc,
+      char *argv[])
+{
+  setlocale (LC_ALL, "");
+
+  g_test_init (&argc, &argv, G_TEST_OPTION_ISOLATE_DIRS, NULL);
+
+  g_test_add_func ("/ostree-bloom/no-false-negatives", test_bloom_no_false_negatives);
+  g_test_add_func ("/ostree-bloom/blocked/size", test_bloom_blocked_size);
+  g_test_add_func ("/ostree-bloom/blocked/probes", test_bloom_blocked_probes);
+  g_test_add_func ("/ostree-bloom/blocked/false-positive-rate", test_bloom_blocked_false_positive_rate);
+
+  return g_test_run ();
+}
@@ -25,6 +25,7 @@
 #include <gio/gio.h>
 #include <glib.h>
 #include <libeos-updater-util/ostree-util.h>
+#include <libeos-updater-util/types.h>
 #include <locale.h>
 #include <ostree.h>
 
@@ -139,6 +140,66 @@ test_ostree_no_deployments (Fixture       *fixture,
   g_assert_cmpuint (commit_timestamp, ==, 0);
 }
 
+/* Test that only overload errors from the origin server are mapped to
+ * %EOS_UPDATER_ERROR_SERVER_OVERLOADED, and not errors from peers on the local
+ * network, from other URLs, or unrelated errors. */
+static void
+test_ostree_map_pull_error (void)
+{
+  const struct
+    {
+      const gchar *origin_url;  /* (nullable) */
+      const gchar *url;  /* (nullable) */
+      GIOErrorEnum code;
+      const gchar *message;
+      gboolean expected_mapped;
+    }
+  vectors[] =
+    {
+      { "https://origin.example.com/ostree", "https://origin.example.com/ostree",
+        G_IO_ERROR_FAILED, "Server returned HTTP 503", TRUE },
+      { "https://origin.example.com/ostree", "https://origin.example.com/ostree/",
+        G_IO_ERROR_FAILED, "Server returned status 429: Too Many Requests", TRUE },
+      { "https://origin.example.com/ostree", "https://origin.example.com/ostree",
+        G_IO_ERROR_BUSY, "Server returned HTTP 500", TRUE },
+      { "https://origin.example.com/ostree", "https://origin.example.com/ostree",
+        G_IO_ERROR_FAILED, "Server returned HTTP 404", FALSE },
+      /* A peer on the local network, as found by Avahi. */
+      { "https://origin.example.com/ostree", "http://192.168.1.5:43381/",
+        G_IO_ERROR_FAILED, "Server returned HTTP 503", FALSE },
+      { "https://origin.example.com/ostree", "https://mirror.example.com/ostree",
+        G_IO_ERROR_BUSY, "Server returned HTTP 500", FALSE },
+      { "https://origin.example.com/ostree", NULL,
+        G_IO_ERROR_FAILED, "Server returned HTTP 503", FALSE },
+      { NULL, "https://origin.example.com/ostree",
+        G_IO_ERROR_FAILED, "Server returned HTTP 503", FALSE },
+      /* A USB drive. */
+      { "file:///media/usb/.ostree/repo", "file:///media/usb/.ostree/repo",
+        G_IO_ERROR_BUSY, "Device or resource busy", FALSE },
+    };
+  gsize i;
+
+  for (i = 0; i < G_N_ELEMENTS (vectors); i++)
+    {
+      g_autoptr(GError) error = NULL;
+
+      g_test_message ("Vector %" G_GSIZE_FORMAT, i);
+
+      g_set_error_literal (&error, G_IO_ERROR, (gint) vectors[i].code,
+                           vectors[i].message);
+      eos_updater_map_pull_error (vectors[i].origin_url, vectors[i].url, &error);
+
+      if (vectors[i].expected_mapped)
+        g_assert_error (error, EOS_UPDATER_ERROR, EOS_UPDATER_ERROR_SERVER_OVERLOADED);
+      else
+        g_assert_error (error, G_IO_ERROR, (gint) vectors[i].code);
+    }
+
+  /* %NULL errors are left alone. */
+  eos_updater_map_pull_error ("https://origin.example.com/ostree",
+                              "https://origin.example.com/ostree", NULL);
+}
+
 int
 main (int   argc,
       char *argv[])
@@ -149,6 +210,7 @@ main (int   argc,
 
   g_test_add ("/ostree/no-deployments", Fixture, NULL, setup,
               test_ostree_no_deployments, teardown);
+  g_test_add_func ("/ostree/map-pull-error", test_ostree_map_pull_error);
   /* TODO: More */
 
   return g_test_run ();
@@ -0,0 +1,264 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * Copyright 2024 Endless OS Foundation LLC
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library; if not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: LGPL-2.1-or-later
+ */
+
+#include <errno.h>
+#include <gio/gio.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <libeos-updater-util/rollout-private.h>
+#include <locale.h>
+
+#define UPDATE_ID "0b1c2d3e4f5a6b7c8d9e0f1a2b3c4d5e6f7a8b9c0d1e2f3a4b5c6d7e8f9a0b1c"
+
+typedef struct
+{
+  gchar *tmp_dir;  /* (owned) */
+  gchar *path;  /* (owned) */
+} Fixture;
+
+static void
+setup (Fixture       *fixture,
+       gconstpointer  test_data)
+{
+  g_autoptr(GError) error = NULL;
+
+  fixture->tmp_dir = g_dir_make_tmp ("eos-updater-test-rollout-XXXXXX", &error);
+  g_assert_no_error (error);
+  fixture->path = g_build_filename (fixture->tmp_dir, "autoupdater-backoff", NULL);
+}
+
+static void
+teardown (Fixture       *fixture,
+          gconstpointer  test_data)
+{
+  if (g_remove (fixture->path) != 0)
+    {
+      int saved_errno = errno;
+      g_assert_cmpint (saved_errno, ==, ENOENT);
+    }
+
+  g_assert_cmpint (g_rmdir (fixture->tmp_dir), ==, 0);
+
+  g_free (fixture->path);
+  g_free (fixture->tmp_dir);
+}
+
+/* Test that each consecutive overload doubles the wait, with the second half
+ * of it random, up to the maximum; and that the backoff is only active until
+ * the end of the wait. */
+static void
+test_backoff_record (Fixture       *fixture,
+                     gconstpointer  test_data)
+{
+  g_autoptr(GRand) rand = g_rand_new_with_seed (42);
+  const guint64 now_secs = 1700000000;
+  guint64 expected_max_secs = EUU_BACKOFF_INITIAL_SECS;
+  guint i;
+
+  for (i = 1; i <= 12; i++)
+    {
+      guint attempts;
+      guint64 delay_secs, next_attempt_secs;
+      g_autoptr(GError) error = NULL;
+
+      g_test_message ("Attempt %u", i);
+
+      euu_backoff_record_overload (fixture->path, now_secs, rand, &delay_secs, &error);
+      g_assert_no_error (error);
+
+      g_assert_cmpuint (delay_secs, >=, expected_max_secs / 2);
+      g_assert_cmpuint (delay_secs, <=, expected_max_secs);
+
+      euu_backoff_load (fixture->path, &attempts, &next_attempt_secs, &error);
+      g_assert_no_error (error);
+      g_assert_cmpuint (attempts, ==, i);
+      g_assert_cmpuint (next_attempt_secs, ==, now_secs + delay_secs);
+
+      g_assert_true (euu_backoff_is_active (fixture->path, now_secs, &error));
+      g_assert_no_error (error);
+      g_assert_true (euu_backoff_is_active (fixture->path, next_attempt_secs - 1, &error));
+      g_assert_no_error (error);
+      g_assert_false (euu_backoff_is_active (fixture->path, next_attempt_secs, &error));
+      g_assert_no_error (error);
+
+      expected_max_secs = MIN (expected_max_secs * 2, EUU_BACKOFF_MAX_SECS);
+    }
+
+  /* It should have reached the maximum by now. */
+  g_assert_cmpuint (expected_max_secs, ==, EUU_BACKOFF_MAX_SECS);
+}
+
+/* Test that clearing the backoff starts it again from the initial wait, and
+ * that there’s no backoff if there’s no state. */
+static void
+test_backoff_clear (Fixture       *fixture,
+                    gconstpointer  test_data)
+{
+  const guint64 now_secs = 1700000000;
+  guint64 delay_secs;
+  guint attempts;
+  g_autoptr(GError) error = NULL;
+
+  g_assert_false (euu_backoff_is_active (fixture->path, now_secs, &error));
+  g_assert_no_error (error);
+
+  g_assert_false (euu_backoff_load (fixture->path, &attempts, NULL, &error));
+  g_assert_error (error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND);
+  g_clear_error (&error);
+
+  /* Clearing when there’s no state is fine. */
+  euu_backoff_clear (fixture->path, &error);
+  g_assert_no_error (error);
+
+  euu_backoff_record_overload (fixture->path, now_secs, NULL, NULL, &error);
+  g_assert_no_error (error);
+  euu_backoff_record_overload (fixture->path, now_secs, NULL, NULL, &error);
+  g_assert_no_error (error);
+  g_assert_true (euu_backoff_is_active (fixture->path, now_secs, &error));
+  g_assert_no_error (error);
+
+  euu_backoff_clear (fixture->path, &error);
+  g_assert_no_error (error);
+  g_assert_false (g_file_test (fixture->path, G_FILE_TEST_EXISTS));
+  g_assert_false (euu_backoff_is_active (fixture->path, now_secs, &error));
+  g_assert_no_error (error);
+
+  euu_backoff_record_overload (fixture->path, now_secs, NULL, &delay_secs, &error);
+  g_assert_no_error (error);
+  g_assert_cmpuint (delay_secs, <=, EUU_BACKOFF_INITIAL_SECS);
+
+  euu_backoff_load (fixture->path, &attempts, NULL, &error);
+  g_assert_no_error (error);
+  g_assert_cmpuint (attempts, ==, 1);
+}
+
+/* Test that a corrupt state file doesn’t stop updates, and is replaced by the
+ * next overload. */
+static void
+test_backoff_corrupt (Fixture       *fixture,
+                      gconstpointer  test_data)
+{
+  const guint64 now_secs = 1700000000;
+  guint attempts;
+  g_autoptr(GError) error = NULL;
+
+  g_file_set_contents (fixture->path, "not a variant", -1, &error);
+  g_assert_no_error (error);
+
+  g_assert_false (euu_backoff_is_active (fixture->path, now_secs, &error));
+  g_assert_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA);
+  g_clear_error (&error);
+
+  euu_backoff_record_overload (fixture->path, now_secs, NULL, NULL, &error);
+  g_assert_no_error (error);
+
+  euu_backoff_load (fixture->path, &attempts, NULL, &error);
+  g_assert_no_error (error);
+  g_assert_cmpuint (attempts, ==, 1);
+}
+
+/* Test that rollout buckets are stable, in range, and spread evenly enough
+ * that a rollout percentage selects about that percentage of machines. */
+static void
+test_rollout_bucket (void)
+{
+  const gsize n_machines = 10000;
+  guint n_in_bucket[100] = { 0, };
+  gsize n_changed_bucket = 0;
+  gsize i, j;
+
+  for (i = 0; i < n_machines; i++)
+    {
+      g_autofree gchar *machine_id = g_compute_checksum_for_data (G_CHECKSUM_MD5,
+                                                                  (const guchar *) &i,
+                                                                  sizeof (i));
+      guint bucket = euu_rollout_get_bucket (machine_id, UPDATE_ID);
+
+      g_assert_cmpuint (bucket, <, 100);
+      g_assert_cmpuint (euu_rollout_get_bucket (machine_id, UPDATE_ID), ==, bucket);
+      n_in_bucket[bucket]++;
+
+      /* Buckets depend on the update too. */
+      if (euu_rollout_get_bucket (machine_id, "other-update") != bucket)
+        n_changed_bucket++;
+    }
+
+  /* Each bucket should have about 1% of the machines. This is deterministic,
+   * so the bounds can be generous without the test being flaky. */
+  for (j = 0; j < G_N_ELEMENTS (n_in_bucket); j++)
+    {
+      g_assert_cmpuint (n_in_bucket[j], >, n_machines / 100 / 2);
+      g_assert_cmpuint (n_in_bucket[j], <, n_machines / 100 * 2);
+    }
+
+  g_assert_cmpuint (n_changed_bucket, >, n_machines * 9 / 10);
+}
+
+/* Test that the rollout includes no machines at 0%, all of them at 100%, and
+ * that machines are only ever added as the percentage increases. */
+static void
+test_rollout_includes_machine (void)
+{
+  gsize i;
+
+  for (i = 0; i < 1000; i++)
+    {
+      g_autofree gchar *machine_id = g_compute_checksum_for_data (G_CHECKSUM_MD5,
+                                                                  (const guchar *) &i,
+                                                                  sizeof (i));
+      gboolean was_included = FALSE;
+      guint percentage;
+
+      for (percentage = 0; percentage <= 100; percentage++)
+        {
+          gboolean included = euu_rollout_includes_machine (percentage, machine_id, UPDATE_ID);
+
+          if (percentage == 0)
+            g_assert_false (included);
+          else if (percentage == 100)
+            g_assert_true (included);
+
+          g_assert_true (included || !was_included);
+          g_assert_cmpint (included, ==,
+                           euu_rollout_get_bucket (machine_id, UPDATE_ID) < percentage);
+
+          was_included = included;
+        }
+
+      g_assert_true (euu_rollout_includes_machine (150, machine_id, UPDATE_ID));
+    }
+}
+
+int
+main (int   argc,
+      char *argv[])
+{
+  setlocale (LC_ALL, "");
+
+  g_test_init (&argc, &argv, G_TEST_OPTION_ISOLATE_DIRS, NULL);
+
+  g_test_add ("/backoff/record", Fixture, NULL, setup, test_backoff_record, teardown);
+  g_test_add ("/backoff/clear", Fixture, NULL, setup, test_backoff_clear, teardown);
+  g_test_add ("/backoff/corrupt", Fixture, NULL, setup, test_backoff_corrupt, teardown);
+  g_test_add_func ("/rollout/bucket", test_rollout_bucket);
+  g_test_add_func ("/rollout/includes-machine", test_rollout_includes_machine);
+
+  return g_test_run ();
+}
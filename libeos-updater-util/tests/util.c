@@ -0,0 +1,126 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * Copyright 2024 Endless OS Foundation LLC
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library; if not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: LGPL-2.1-or-later
+ */
+
+#include <gio/gio.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <libeos-updater-util/util.h>
+#include <locale.h>
+#include <unistd.h>
+
+/* Create a file at @path, failing the test on error. */
+static void
+create_file (const gchar *path)
+{
+  g_autoptr(GError) error = NULL;
+
+  g_file_set_contents (path, "contents", -1, &error);
+  g_assert_no_error (error);
+}
+
+/* Test that removing a directory tree removes everything in it, including
+ * several nested subdirectories, but doesn’t follow symlinks out of it. */
+static void
+test_remove_recursive_tree (void)
+{
+  g_autoptr(GError) error = NULL;
+  g_autofree gchar *root_path = g_dir_make_tmp ("eos-updater-test-remove-recursive-XXXXXX", &error);
+  g_autofree gchar *tree_path = g_build_filename (root_path, "tree", NULL);
+  g_autofree gchar *top_file_path = g_build_filename (tree_path, "file", NULL);
+  g_autofree gchar *outside_path = g_build_filename (root_path, "outside", NULL);
+  g_autofree gchar *outside_file_path = g_build_filename (outside_path, "file", NULL);
+  g_autoptr(GFile) root = g_file_new_for_path (root_path);
+  g_autoptr(GFile) tree = g_file_new_for_path (tree_path);
+  gsize i, j;
+
+  g_assert_no_error (error);
+  g_assert_cmpint (g_mkdir_with_parents (outside_path, 0755), ==, 0);
+  create_file (outside_file_path);
+
+  for (i = 0; i < 8; i++)
+    {
+      g_autofree gchar *dir_name = g_strdup_printf ("dir%" G_GSIZE_FORMAT, i);
+      g_autofree gchar *nested_path = g_build_filename (tree_path, dir_name, "nested", NULL);
+      g_autofree gchar *link_path = g_build_filename (tree_path, dir_name, "link", NULL);
+
+      g_assert_cmpint (g_mkdir_with_parents (nested_path, 0755), ==, 0);
+
+      for (j = 0; j < 16; j++)
+        {
+          g_autofree gchar *file_name = g_strdup_printf ("file%" G_GSIZE_FORMAT, j);
+          g_autofree gchar *file_path = g_build_filename (nested_path, file_name, NULL);
+
+          create_file (file_path);
+        }
+
+      g_assert_cmpint (symlink (outside_path, link_path), ==, 0);
+    }
+
+  create_file (top_file_path);
+
+  eos_updater_remove_recursive (tree, NULL, &error);
+  g_assert_no_error (error);
+
+  g_assert_false (g_file_test (tree_path, G_FILE_TEST_EXISTS));
+  g_assert_true (g_file_test (outside_file_path, G_FILE_TEST_IS_REGULAR));
+
+  eos_updater_remove_recursive (tree, NULL, &error);
+  g_assert_no_error (error);
+
+  eos_updater_remove_recursive (root, NULL, &error);
+  g_assert_no_error (error);
+}
+
+/* Test that removing a single file, or something which doesn’t exist,
+ * works. */
+static void
+test_remove_recursive_file (void)
+{
+  g_autoptr(GError) error = NULL;
+  g_autofree gchar *root_path = g_dir_make_tmp ("eos-updater-test-remove-recursive-XXXXXX", &error);
+  g_autofree gchar *file_path = g_build_filename (root_path, "file", NULL);
+  g_autoptr(GFile) file = g_file_new_for_path (file_path);
+
+  g_assert_no_error (error);
+  create_file (file_path);
+
+  eos_updater_remove_recursive (file, NULL, &error);
+  g_assert_no_error (error);
+  g_assert_false (g_file_test (file_path, G_FILE_TEST_EXISTS));
+
+  eos_updater_remove_recursive (file, NULL, &error);
+  g_assert_no_error (error);
+
+  g_assert_cmpint (g_rmdir (root_path), ==, 0);
+}
+
+int
+main (int   argc,
+      char *argv[])
+{
+  setlocale (LC_ALL, "");
+
+  g_test_init (&argc, &argv, G_TEST_OPTION_ISOLATE_DIRS, NULL);
+
+  g_test_add_func ("/util/remove-recursive/tree", test_remove_recursive_tree);
+  g_test_add_func ("/util/remove-recursive/file", test_remove_recursive_file);
+
+  return g_test_run ();
+}
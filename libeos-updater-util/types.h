@@ -38,7 +38,9 @@ typedef enum {
   EOS_UPDATER_ERROR_UNKNOWN_ENTRY_IN_AUTOINSTALL_SPEC,
   EOS_UPDATER_ERROR_FLATPAK_REMOTE_CONFLICT,
   EOS_UPDATER_ERROR_METERED_CONNECTION,
-  EOS_UPDATER_ERROR_LAST = EOS_UPDATER_ERROR_METERED_CONNECTION, /*< skip >*/
+  EOS_UPDATER_ERROR_SERVER_OVERLOADED,
+  EOS_UPDATER_ERROR_OUTSIDE_FETCH_WINDOW,
+  EOS_UPDATER_ERROR_LAST = EOS_UPDATER_ERROR_OUTSIDE_FETCH_WINDOW, /*< skip >*/
 } EosUpdaterError;
 
 #define EOS_UPDATER_ERROR (eos_updater_error_quark ())
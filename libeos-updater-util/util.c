@@ -26,8 +26,27 @@
 
 #include <libeos-updater-util/util.h>
 
+#include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
 #include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+/* From linux/ioprio.h, which is not always installed. */
+#define IOPRIO_CLASS_SHIFT 13
+#define IOPRIO_CLASS_BE 2
+#define IOPRIO_CLASS_IDLE 3
+#define IOPRIO_PRIO_VALUE(class, data) (((class) << IOPRIO_CLASS_SHIFT) | (data))
+#define IOPRIO_WHO_PROCESS 1
+
+/* From sched.h, where it’s only defined with _GNU_SOURCE. */
+#ifndef SCHED_IDLE
+#define SCHED_IDLE 5
+#endif
 
 const gchar *
 eos_updater_get_envvar_or (const gchar *envvar,
@@ -332,6 +351,186 @@ rm_rf_internal (GFile                     *topdir,
   return TRUE;
 }
 
+static gboolean
+set_rm_rf_error (GError      **error,
+                 int           saved_errno,
+                 const gchar  *dir_path,
+                 const gchar  *name)
+{
+  g_autofree gchar *path = (name != NULL) ? g_build_filename (dir_path, name, NULL) : g_strdup (dir_path);
+
+  g_set_error (error, G_IO_ERROR, g_io_error_from_errno (saved_errno),
+               "Error removing ‘%s’: %s", path, g_strerror (saved_errno));
+  return FALSE;
+}
+
+static gboolean rm_rf_children_at (int           dfd,
+                                   const gchar  *path,
+                                   GError      **error);
+
+/* Remove @name from the directory open as @dfd, whose path is @dir_path (only
+ * used for error messages). If @is_dir, everything beneath @name is removed
+ * first. It is not an error if @name doesn’t exist. */
+static gboolean
+rm_rf_entry_at (int           dfd,
+                const gchar  *name,
+                gboolean      is_dir,
+                const gchar  *dir_path,
+                GError      **error)
+{
+  g_autofree gchar *path = NULL;
+  int child_dfd;
+  gboolean success;
+
+  if (!is_dir)
+    {
+      if (unlinkat (dfd, name, 0) != 0 && errno != ENOENT)
+        return set_rm_rf_error (error, errno, dir_path, name);
+      return TRUE;
+    }
+
+  child_dfd = openat (dfd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+  if (child_dfd < 0)
+    {
+      if (errno == ENOENT)
+        return TRUE;
+      return set_rm_rf_error (error, errno, dir_path, name);
+    }
+
+  path = g_build_filename (dir_path, name, NULL);
+  success = rm_rf_children_at (child_dfd, path, error);
+  close (child_dfd);
+
+  if (!success)
+    return FALSE;
+
+  if (unlinkat (dfd, name, AT_REMOVEDIR) != 0 && errno != ENOENT)
+    return set_rm_rf_error (error, errno, dir_path, name);
+
+  return TRUE;
+}
+
+/* Remove everything in the directory open as @dfd, whose path is @path (only
+ * used for error messages). @dfd is not closed. */
+static gboolean
+rm_rf_children_at (int           dfd,
+                   const gchar  *path,
+                   GError      **error)
+{
+  DIR *dir;
+  int iter_dfd;
+
+  /* fdopendir() takes ownership of the FD it’s given, and @dfd is still needed
+   * by the caller. */
+  iter_dfd = fcntl (dfd, F_DUPFD_CLOEXEC, 3);
+  if (iter_dfd < 0)
+    return set_rm_rf_error (error, errno, path, NULL);
+
+  dir = fdopendir (iter_dfd);
+  if (dir == NULL)
+    {
+      int saved_errno = errno;
+      close (iter_dfd);
+      return set_rm_rf_error (error, saved_errno, path, NULL);
+    }
+
+  while (TRUE)
+    {
+      struct dirent *dent;
+      gboolean is_dir;
+
+      errno = 0;
+      dent = readdir (dir);
+      if (dent == NULL)
+        {
+          int saved_errno = errno;
+
+          closedir (dir);
+
+          if (saved_errno != 0)
+            return set_rm_rf_error (error, saved_errno, path, NULL);
+          return TRUE;
+        }
+
+      if (strcmp (dent->d_name, ".") == 0 || strcmp (dent->d_name, "..") == 0)
+        continue;
+
+      if (dent->d_type == DT_UNKNOWN)
+        {
+          struct stat stbuf;
+
+          if (fstatat (dfd, dent->d_name, &stbuf, AT_SYMLINK_NOFOLLOW) != 0)
+            {
+              int saved_errno = errno;
+
+              if (saved_errno == ENOENT)
+                continue;
+
+              set_rm_rf_error (error, saved_errno, path, dent->d_name);
+              closedir (dir);
+              return FALSE;
+            }
+
+          is_dir = S_ISDIR (stbuf.st_mode);
+        }
+      else
+        {
+          is_dir = (dent->d_type == DT_DIR);
+        }
+
+      if (!rm_rf_entry_at (dfd, dent->d_name, is_dir, path, error))
+        {
+          closedir (dir);
+          return FALSE;
+        }
+    }
+}
+
+/* Remove @path and everything beneath it, without following symlinks, using
+ * system calls relative to directory FDs rather than a #GFile and #GFileInfo
+ * per entry. It is not an error if @path doesn’t exist. */
+static gboolean
+rm_rf_path (const gchar  *path,
+            GError      **error)
+{
+  struct stat stbuf;
+  int dfd;
+  gboolean success;
+
+  if (lstat (path, &stbuf) != 0)
+    {
+      if (errno == ENOENT)
+        return TRUE;
+      return set_rm_rf_error (error, errno, path, NULL);
+    }
+
+  if (!S_ISDIR (stbuf.st_mode))
+    {
+      if (unlink (path) != 0 && errno != ENOENT)
+        return set_rm_rf_error (error, errno, path, NULL);
+      return TRUE;
+    }
+
+  dfd = open (path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+  if (dfd < 0)
+    {
+      if (errno == ENOENT)
+        return TRUE;
+      return set_rm_rf_error (error, errno, path, NULL);
+    }
+
+  success = rm_rf_children_at (dfd, path, error);
+  close (dfd);
+
+  if (!success)
+    return FALSE;
+
+  if (rmdir (path) != 0 && errno != ENOENT)
+    return set_rm_rf_error (error, errno, path, NULL);
+
+  return TRUE;
+}
+
 /**
  * eos_updater_remove_recursive:
  * @topdir:
@@ -345,16 +544,176 @@ eos_updater_remove_recursive (GFile                     *topdir,
                               EosUpdaterFileFilterFunc   filter_func,
                               GError                   **error)
 {
-  if (!rm_rf_internal (topdir, filter_func, error))
+  g_autofree gchar *path = g_file_get_path (topdir);
+  gboolean success;
+
+  /* The filter needs a #GFile and #GFileInfo for each entry, so only use the
+   * faster FD-based implementation if there isn’t one. */
+  if (filter_func == NULL && g_file_is_native (topdir) && path != NULL)
+    success = rm_rf_path (path, error);
+  else
+    success = rm_rf_internal (topdir, filter_func, error);
+
+  if (!success)
     {
-      g_autofree gchar *raw_path = g_file_get_path (topdir);
       g_prefix_error (error,
                       "Failed to remove the file or directory in %s, this should not happen: ",
-                      raw_path);
+                      path);
+
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+
+/**
+ * eos_updater_thread_priority_from_string:
+ * @str: a priority name: `normal`, `low` or `idle`
+ * @out_priority: (out caller-allocates): return location for the priority
+ * @error: return location for a #GError, or %NULL
+ *
+ * Parse a thread priority name, as used in configuration files.
+ *
+ * Returns: %TRUE on success, %FALSE otherwise
+ */
+gboolean
+eos_updater_thread_priority_from_string (const gchar               *str,
+                                         EosUpdaterThreadPriority  *out_priority,
+                                         GError                   **error)
+{
+  g_return_val_if_fail (str != NULL, FALSE);
+  g_return_val_if_fail (out_priority != NULL, FALSE);
+  g_return_val_if_fail (error == NULL || *error == NULL, FALSE);
+
+  if (g_str_equal (str, "normal"))
+    *out_priority = EOS_UPDATER_THREAD_PRIORITY_NORMAL;
+  else if (g_str_equal (str, "low"))
+    *out_priority = EOS_UPDATER_THREAD_PRIORITY_LOW;
+  else if (g_str_equal (str, "idle"))
+    *out_priority = EOS_UPDATER_THREAD_PRIORITY_IDLE;
+  else
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT,
+                   "Invalid thread priority ‘%s’", str);
+      return FALSE;
+    }
 
+  return TRUE;
+}
+
+static gboolean
+set_thread_priority_values (pid_t      tid,
+                            int        policy,
+                            int        nice_value,
+                            int        ioprio,
+                            GError   **error)
+{
+  const struct sched_param param = { .sched_priority = 0 };
+
+  /* On Linux, these apply to a single thread when given its thread ID. The
+   * scheduling policy has to be changed before the niceness, since leaving
+   * SCHED_IDLE may be subject to the niceness limits. */
+  if (sched_setscheduler (tid, policy, &param) != 0 ||
+      setpriority (PRIO_PROCESS, (id_t) tid, nice_value) != 0 ||
+      syscall (SYS_ioprio_set, IOPRIO_WHO_PROCESS, tid, ioprio) != 0)
+    {
+      int saved_errno = errno;
+      g_set_error (error, G_IO_ERROR, g_io_error_from_errno (saved_errno),
+                   "Error changing thread priority: %s",
+                   g_strerror (saved_errno));
       return FALSE;
     }
 
   return TRUE;
 }
 
+/**
+ * eos_updater_set_thread_priority:
+ * @priority: the priority to run the calling thread at
+ * @out_old_state: (out caller-allocates) (optional): return location for the
+ *    thread’s previous priority, or %NULL
+ * @error: return location for a #GError, or %NULL
+ *
+ * Change the CPU and I/O scheduling priority of the calling thread, so that
+ * work done in it doesn’t affect the responsiveness of the rest of the system
+ * (or, for %EOS_UPDATER_THREAD_PRIORITY_NORMAL, so that it isn’t held back by
+ * a low priority inherited from the process).
+ *
+ * Only the calling thread is affected. As worker threads are reused for other
+ * tasks, the previous priority should be restored once the work is done,
+ * using eos_updater_thread_priority_state_restore() on @out_old_state; it is
+ * always filled in, even on error. Typically it is declared with `g_auto()` at
+ * the top of a #GTaskThreadFunc.
+ *
+ * Returns: %TRUE on success, %FALSE otherwise
+ */
+gboolean
+eos_updater_set_thread_priority (EosUpdaterThreadPriority        priority,
+                                 EosUpdaterThreadPriorityState  *out_old_state,
+                                 GError                        **error)
+{
+  pid_t tid = (pid_t) syscall (SYS_gettid);
+  int old_policy, old_nice_value, old_ioprio;
+
+  g_return_val_if_fail (error == NULL || *error == NULL, FALSE);
+
+  if (out_old_state != NULL)
+    {
+      /* getpriority() can legitimately return -1. */
+      errno = 0;
+      old_policy = sched_getscheduler (tid);
+      old_nice_value = getpriority (PRIO_PROCESS, (id_t) tid);
+      if (old_nice_value == -1 && errno != 0)
+        old_policy = -1;
+      old_ioprio = (int) syscall (SYS_ioprio_get, IOPRIO_WHO_PROCESS, tid);
+
+      out_old_state->saved = (old_policy >= 0 && old_ioprio >= 0);
+      out_old_state->policy = old_policy;
+      out_old_state->nice_value = old_nice_value;
+      out_old_state->ioprio = old_ioprio;
+    }
+
+  switch (priority)
+    {
+    case EOS_UPDATER_THREAD_PRIORITY_NORMAL:
+      return set_thread_priority_values (tid, SCHED_OTHER, 0,
+                                         IOPRIO_PRIO_VALUE (IOPRIO_CLASS_BE, 4),
+                                         error);
+    case EOS_UPDATER_THREAD_PRIORITY_LOW:
+      return set_thread_priority_values (tid, SCHED_OTHER, 10,
+                                         IOPRIO_PRIO_VALUE (IOPRIO_CLASS_BE, 7),
+                                         error);
+    case EOS_UPDATER_THREAD_PRIORITY_IDLE:
+      return set_thread_priority_values (tid, SCHED_IDLE, 19,
+                                         IOPRIO_PRIO_VALUE (IOPRIO_CLASS_IDLE, 0),
+                                         error);
+    default:
+      g_assert_not_reached ();
+    }
+}
+
+/**
+ * eos_updater_thread_priority_state_restore:
+ * @state: state returned by eos_updater_set_thread_priority()
+ *
+ * Restore the calling thread’s priority to what it was before
+ * eos_updater_set_thread_priority() was called, and clear @state. This must be
+ * called from the same thread. If @state is cleared, or the old priority
+ * could not be saved, this does nothing.
+ */
+void
+eos_updater_thread_priority_state_restore (EosUpdaterThreadPriorityState *state)
+{
+  g_autoptr(GError) local_error = NULL;
+
+  if (!state->saved)
+    return;
+
+  if (!set_thread_priority_values ((pid_t) syscall (SYS_gettid),
+                                   state->policy, state->nice_value,
+                                   state->ioprio, &local_error))
+    g_message ("Error restoring thread priority: %s", local_error->message);
+
+  state->saved = FALSE;
+}
@@ -81,4 +81,54 @@ gboolean eos_updater_remove_recursive (GFile                     *topdir,
                                        EosUpdaterFileFilterFunc   filter_func,
                                        GError                   **error);
 
+/**
+ * EosUpdaterThreadPriority:
+ * @EOS_UPDATER_THREAD_PRIORITY_NORMAL: normal CPU scheduling at niceness 0,
+ *    and the default best-effort I/O priority
+ * @EOS_UPDATER_THREAD_PRIORITY_LOW: normal CPU scheduling at niceness 10, and
+ *    the lowest best-effort I/O priority
+ * @EOS_UPDATER_THREAD_PRIORITY_IDLE: `SCHED_IDLE` CPU scheduling at niceness
+ *    19, and the idle I/O class; the thread only runs and does I/O when
+ *    nothing else wants to
+ *
+ * Scheduling priorities which can be set on a worker thread using
+ * eos_updater_set_thread_priority().
+ */
+typedef enum
+{
+  EOS_UPDATER_THREAD_PRIORITY_NORMAL = 0,
+  EOS_UPDATER_THREAD_PRIORITY_LOW,
+  EOS_UPDATER_THREAD_PRIORITY_IDLE,
+} EosUpdaterThreadPriority;
+
+gboolean eos_updater_thread_priority_from_string (const gchar               *str,
+                                                  EosUpdaterThreadPriority  *out_priority,
+                                                  GError                   **error);
+
+/**
+ * EosUpdaterThreadPriorityState:
+ *
+ * The scheduling priority of a thread before eos_updater_set_thread_priority()
+ * changed it, so that it can be restored using
+ * eos_updater_thread_priority_state_restore(). Initialise it to
+ * %EOS_UPDATER_THREAD_PRIORITY_STATE_CLEARED.
+ */
+typedef struct
+{
+  /*< private >*/
+  gboolean saved;
+  int policy;
+  int nice_value;
+  int ioprio;
+} EosUpdaterThreadPriorityState;
+
+#define EOS_UPDATER_THREAD_PRIORITY_STATE_CLEARED { FALSE, 0, 0, 0 }
+
+gboolean eos_updater_set_thread_priority (EosUpdaterThreadPriority        priority,
+                                          EosUpdaterThreadPriorityState  *out_old_state,
+                                          GError                        **error);
+void eos_updater_thread_priority_state_restore (EosUpdaterThreadPriorityState *state);
+
+G_DEFINE_AUTO_CLEANUP_CLEAR_FUNC (EosUpdaterThreadPriorityState, eos_updater_thread_priority_state_restore)
+
 G_END_DECLS
@@ -1474,6 +1474,12 @@ updater_config_file (GFile *updater_dir)
   return g_file_get_child (updater_dir, "config");
 }
 
+static GFile *
+updater_broken_deltas_file (GFile *updater_dir)
+{
+  return g_file_get_child (updater_dir, "broken-static-deltas");
+}
+
 GFile *
 get_flatpak_upgrade_state_dir_for_updater_dir (GFile *updater_dir)
 {
@@ -1492,6 +1498,12 @@ get_flatpak_autoinstall_override_dir (GFile *client_root)
   return g_file_get_child (client_root, "flatpak-autoinstall-override");
 }
 
+GFile *
+get_flatpak_autoinstall_cache_for_updater_dir (GFile *updater_dir)
+{
+  return g_file_get_child (updater_dir, "flatpak-autoinstall.cache");
+}
+
 static gboolean
 prepare_updater_dir (GFile *updater_dir,
                      GKeyFile *config_file,
@@ -1626,9 +1638,11 @@ spawn_updater (GFile *sysroot,
                GFile *repo,
                GFile *config_file,
                GFile *quit_file,
+               GFile *broken_deltas_file,
                GFile *flatpak_upgrade_state_dir,
                GFile *flatpak_installation_dir,
                GFile *flatpak_autoinstall_override_dir,
+               GFile *flatpak_autoinstall_cache_file,
                const gchar *osname,
                gboolean fatal_warnings,
                const gchar *force_follow_checkpoint,
@@ -1645,11 +1659,13 @@ spawn_updater (GFile *sysroot,
       { "EOS_UPDATER_TEST_UPDATER_CONFIG_FILE_PATH", NULL, config_file },
       { "EOS_UPDATER_TEST_UPDATER_DEPLOYMENT_FALLBACK", "yes", NULL },
       { "EOS_UPDATER_TEST_UPDATER_QUIT_FILE", NULL, quit_file },
+      { "EOS_UPDATER_TEST_UPDATER_BROKEN_DELTAS_PATH", NULL, broken_deltas_file },
       { "EOS_UPDATER_TEST_UPDATER_USE_SESSION_BUS", "yes", NULL },
       { "EOS_UPDATER_TEST_UPDATER_OSTREE_OSNAME", osname, NULL },
       { "EOS_UPDATER_TEST_UPDATER_FLATPAK_UPGRADE_STATE_DIR", NULL, flatpak_upgrade_state_dir },
       { "EOS_UPDATER_TEST_FLATPAK_INSTALLATION_DIR", NULL, flatpak_installation_dir },
       { "EOS_UPDATER_TEST_UPDATER_FLATPAK_AUTOINSTALL_OVERRIDE_DIRS", NULL, flatpak_autoinstall_override_dir },
+      { "EOS_UPDATER_TEST_UPDATER_FLATPAK_AUTOINSTALL_CACHE_PATH", NULL, flatpak_autoinstall_cache_file },
       { "EOS_UPDATER_TEST_OVERRIDE_ARCHITECTURE", arch_override_name, NULL },
       { "EOS_UPDATER_TEST_UPDATER_OVERRIDE_LOCALES", "locale", NULL },
       { "EOS_UPDATER_FORCE_FOLLOW_CHECKPOINT", force_follow_checkpoint ?: "", NULL },
@@ -1715,17 +1731,21 @@ spawn_updater_simple (GFile *sysroot,
 {
   g_autoptr(GFile) config_file_path = updater_config_file (updater_dir);
   g_autoptr(GFile) quit_file_path = updater_quit_file (updater_dir);
+  g_autoptr(GFile) broken_deltas_file_path = updater_broken_deltas_file (updater_dir);
   g_autoptr(GFile) flatpak_upgrade_state_dir_path = get_flatpak_upgrade_state_dir_for_updater_dir (updater_dir);
   g_autoptr(GFile) flatpak_installation_dir_path = get_flatpak_user_dir_for_updater_dir (updater_dir);
   g_autoptr(GFile) flatpak_autoinstall_override_dir = get_flatpak_autoinstall_override_dir (updater_dir);
+  g_autoptr(GFile) flatpak_autoinstall_cache_file = get_flatpak_autoinstall_cache_for_updater_dir (updater_dir);
 
   return spawn_updater (sysroot,
                         repo,
                         config_file_path,
                         quit_file_path,
+                        broken_deltas_file_path,
                         flatpak_upgrade_state_dir_path,
                         flatpak_installation_dir_path,
                         flatpak_autoinstall_override_dir,
+                        flatpak_autoinstall_cache_file,
                         osname,
                         fatal_warnings,
                         force_follow_checkpoint,
@@ -2002,11 +2022,14 @@ run_update_server (GFile *repo,
                                                                       NULL);
   g_autofree gchar *raw_port_file_path = g_file_get_path (port_file);
   g_autofree gchar *raw_config_file_path = g_file_get_path (config_file);
+  g_autoptr(GFile) port_file_dir = g_file_get_parent (port_file);
+  g_autoptr(GFile) load_hint_file = g_file_get_child (port_file_dir, "update-server-load");
   CmdEnvVar envv[] =
     {
       { "OSTREE_REPO", NULL, repo },
       { "OSTREE_SYSROOT_DEBUG", "mutable-deployments", NULL },
       { "EOS_UPDATER_TEST_UPDATE_SERVER_QUIT_FILE", NULL, quit_file },
+      { "EOS_UPDATER_TEST_UPDATE_SERVER_LOAD_HINT_PATH", NULL, load_hint_file },
       { "FLATPAK_SYSTEM_HELPER_ON_SESSION", "1", NULL },
       { "G_DEBUG", "gc-friendly,fatal-warnings", NULL },
       { NULL, NULL, NULL }
@@ -2196,6 +2219,7 @@ eos_test_run_flatpak_installer (GFile        *client_root,
   g_autoptr(GFile) flatpak_installation_dir = get_flatpak_user_dir_for_updater_dir (updater_dir);
   g_autoptr(GFile) flatpak_upgrade_state_dir = get_flatpak_upgrade_state_dir_for_updater_dir (updater_dir);
   g_autoptr(GFile) flatpak_autoinstall_override_dir = get_flatpak_autoinstall_override_dir (updater_dir);
+  g_autoptr(GFile) flatpak_autoinstall_cache_file = get_flatpak_autoinstall_cache_for_updater_dir (updater_dir);
   g_autoptr(GFile) sysroot = get_sysroot_for_client (client_root);
   g_autofree gchar *sysroot_path = g_file_get_path (sysroot);
   g_autofree gchar *deployment_id = g_strdup_printf ("%s.0", deployment_csum);
@@ -2220,6 +2244,7 @@ eos_test_run_flatpak_installer (GFile        *client_root,
       { "EOS_UPDATER_TEST_FLATPAK_INSTALLATION_DIR", NULL, flatpak_installation_dir },
       { "EOS_UPDATER_TEST_UPDATER_FLATPAK_UPGRADE_STATE_DIR", NULL, flatpak_upgrade_state_dir },
       { "EOS_UPDATER_TEST_UPDATER_FLATPAK_AUTOINSTALL_OVERRIDE_DIRS", NULL, flatpak_autoinstall_override_dir },
+      { "EOS_UPDATER_TEST_UPDATER_FLATPAK_AUTOINSTALL_CACHE_PATH", NULL, flatpak_autoinstall_cache_file },
       { "EOS_UPDATER_TEST_OSTREE_DATADIR", NULL, datadir },
       { "EOS_UPDATER_TEST_OVERRIDE_ARCHITECTURE", arch_override_name, NULL },
       { "FLATPAK_SYSTEM_HELPER_ON_SESSION", "1", NULL },
@@ -3151,6 +3176,12 @@ autoupdater_config_file (GFile *autoupdater_dir)
   return g_file_get_child (autoupdater_dir, "config");
 }
 
+static GFile *
+autoupdater_machine_id_file (GFile *autoupdater_dir)
+{
+  return g_file_get_child (autoupdater_dir, "machine-id");
+}
+
 static gboolean
 prepare_autoupdater_dir (GFile *autoupdater_dir,
                          GKeyFile *config,
@@ -3158,6 +3189,8 @@ prepare_autoupdater_dir (GFile *autoupdater_dir,
 {
   g_autoptr(GFile) state_dir_path = autoupdater_state_dir (autoupdater_dir);
   g_autoptr(GFile) config_file_path = NULL;
+  g_autoptr(GFile) machine_id_path = NULL;
+  g_autoptr(GBytes) machine_id = NULL;
 
   if (!create_directory (state_dir_path, error))
     return FALSE;
@@ -3166,6 +3199,12 @@ prepare_autoupdater_dir (GFile *autoupdater_dir,
   if (!save_key_file (config_file_path, config, error))
     return FALSE;
 
+  /* An arbitrary, fixed machine ID, so that staged rollouts are reproducible. */
+  machine_id_path = autoupdater_machine_id_file (autoupdater_dir);
+  machine_id = g_bytes_new_static ("0123456789abcdef0123456789abcdef\n", 33);
+  if (!create_file (machine_id_path, machine_id, error))
+    return FALSE;
+
   return TRUE;
 }
 
@@ -3214,6 +3253,7 @@ get_dbus_timeout_value_for_autoupdater (void)
 static gboolean
 spawn_autoupdater (GFile *state_dir,
                    GFile *config_file,
+                   GFile *machine_id_file,
                    gboolean force_update,
                    CmdResult *cmd,
                    GError **error)
@@ -3237,6 +3277,7 @@ spawn_autoupdater (GFile *state_dir,
     {
       { "EOS_UPDATER_TEST_AUTOUPDATER_STATE_DIR", NULL, state_dir },
       { "EOS_UPDATER_TEST_AUTOUPDATER_CONFIG_FILE_PATH", NULL, config_file },
+      { "EOS_UPDATER_TEST_AUTOUPDATER_MACHINE_ID_PATH", NULL, machine_id_file },
       { "EOS_UPDATER_TEST_AUTOUPDATER_USE_SESSION_BUS", "yes", NULL },
       { "EOS_UPDATER_TEST_AUTOUPDATER_DBUS_TIMEOUT", dbus_timeout_value, NULL },
       { "OSTREE_SYSROOT_DEBUG", "mutable-deployments", NULL },
@@ -3258,9 +3299,11 @@ spawn_autoupdater_simple (GFile *autoupdater_dir,
 {
   g_autoptr(GFile) state_dir_path = autoupdater_state_dir (autoupdater_dir);
   g_autoptr(GFile) config_file_path = autoupdater_config_file (autoupdater_dir);
+  g_autoptr(GFile) machine_id_path = autoupdater_machine_id_file (autoupdater_dir);
 
   return spawn_autoupdater (state_dir_path,
                             config_file_path,
+                            machine_id_path,
                             force_update,
                             cmd,
                             error);
@@ -26,7 +26,7 @@ import subprocess
 import time
 import unittest
 
-from gi.repository import GLib
+from gi.repository import Gio, GLib
 import taptestrunner
 
 
@@ -166,9 +166,47 @@ class TestEosUpdaterAvahi(unittest.TestCase):
             )
         )
 
+    def _touch_deployment_refs(self):
+        """Rewrite all the deployment refs with the same contents, as happens
+        several times in quick succession while deploying an update."""
+        done = False
+        for boot_version in ['0/0', '0/1', '1/0', '1/1']:
+            for deployment_index in ['0', '1']:
+                path = ('/ostree/repo/refs/heads/ostree/' + boot_version +
+                        '/' + deployment_index)
+                try:
+                    with open(path, 'r') as f:
+                        contents = f.read()
+                    with open(path, 'w') as f:
+                        f.write(contents)
+                    done = True
+                except FileNotFoundError:
+                    pass
+
+        self.assertTrue(done, 'no suitable deployment ref found')
+
+    def _iterate_for(self, seconds):
+        """Run the main context for the given number of seconds."""
+        timed_out = False
+
+        def timeout_cb():
+            nonlocal timed_out
+            timed_out = True
+            self._main_context.wakeup()
+            return GLib.SOURCE_REMOVE
+
+        GLib.timeout_add_seconds(seconds, timeout_cb)
+        while not timed_out:
+            self._main_context.iteration(True)
+
     @unittest.skipIf(os.geteuid() != 0, "Must be run as root")
     def test_update_on_ostree_update(self):
-        """Test updating the OSTree deployment updates the .service file."""
+        """Test updating the OSTree deployment updates the .service file.
+
+        eos-updater-avahi.service keeps running and watches the deployment
+        refs, coalescing bursts of changes into one update, and only rewrites
+        the .service file if its contents change.
+        """
         def get_mtime_if_exists(path):
             try:
                 return os.stat(path).st_mtime
@@ -196,23 +234,39 @@ class TestEosUpdaterAvahi(unittest.TestCase):
         # advertisements.
         time.sleep(2)
 
-        # ‘Touch’ a deployment ref by rewriting it with the same contents
-        done = False
-        for boot_version in ['0/0', '0/1', '1/0', '1/1']:
-            try:
-                path = '/ostree/repo/refs/heads/ostree/' + boot_version + '/0'
-                with open(path, 'r') as f:
-                    contents = f.read()
-                with open(path, 'w') as f:
-                    f.write(contents)
-                done = True
-            except FileNotFoundError:
-                pass
+        # Touching the refs doesn’t change the advertisement, so the service
+        # file must not be rewritten (which would cause Avahi to re-announce
+        # it). Wait for longer than eos-updater-avahi’s debounce timeout.
+        self._touch_deployment_refs()
+        self._iterate_for(4)
+        self.assertEqual(get_mtime_if_exists(self.__new_service_file), before)
+
+        # Delete the service file so the next update has to regenerate it,
+        # and check that a burst of ref changes regenerates it exactly once.
+        service_file = Gio.File.new_for_path(self.__new_service_file)
+        monitor = service_file.get_parent().monitor_directory(
+            Gio.FileMonitorFlags.NONE, None)
+        n_created = 0
+
+        def changed_cb(monitor, file, other_file, event_type):
+            nonlocal n_created
+            if (file.equal(service_file) and
+                    event_type == Gio.FileMonitorEvent.CREATED):
+                n_created += 1
+
+        os.unlink(self.__new_service_file)
+        monitor.connect('changed', changed_cb)
+
+        self._touch_deployment_refs()
+        self._wait_for_condition(
+            lambda s: os.path.isfile(self.__new_service_file))
+        self._iterate_for(4)
 
-        self.assertTrue(done, 'no suitable deployment ref found')
+        monitor.cancel()
+        while self._main_context.iteration(False):
+            pass
 
-        self._wait_for_condition(
-            lambda s: get_mtime_if_exists(self.__new_service_file) > before)
+        self.assertEqual(n_created, 1)
 
     @unittest.skipIf(os.geteuid() != 0, "Must be run as root")
     def test_services_enabled_by_default(self):
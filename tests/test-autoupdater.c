@@ -321,6 +321,103 @@ test_user_visible_update_delay (EosUpdaterFixture *fixture,
   g_assert_true (cmd_result_ensure_ok_verbose (&reaped));
 }
 
+typedef struct {
+  const gchar *rollout_percentage;
+  gboolean     force_update;
+  gboolean     expected_has_commit;
+} RolloutTestData;
+
+/* Test that an update with rollout metadata is only fetched if the machine
+ * falls within the rollout percentage, or if the update is forced. */
+static void
+test_rollout (EosUpdaterFixture *fixture,
+              gconstpointer      user_data)
+{
+  const RolloutTestData *test_data = user_data;
+  g_autoptr(GError) error = NULL;
+  g_autoptr(EosTestServer) server = NULL;
+  g_autoptr(EosTestSubserver) subserver = NULL;
+  g_autoptr(EosTestClient) client = NULL;
+  g_autoptr(GHashTable) leaf_commit_nodes =
+    eos_test_subserver_ref_to_commit_new ();
+  DownloadSource main_source = DOWNLOAD_MAIN;
+  g_auto(CmdAsyncResult) updater_cmd = CMD_ASYNC_RESULT_CLEARED;
+  g_autoptr(GFile) autoupdater_root = g_file_get_child (fixture->tmpdir, "autoupdater");
+  g_autoptr(GFile) stamp_file = NULL;
+  g_autoptr(GFileInfo) stamp_file_info = NULL;
+  g_autoptr(EosTestAutoupdater) autoupdater = NULL;
+  g_auto(CmdResult) reaped = CMD_RESULT_CLEARED;
+  gboolean has_commit = FALSE;
+  guint64 start_time_secs, stamp_time_secs;
+
+  setup_basic_test_server_client (fixture, &server, &subserver, &client);
+
+  g_hash_table_insert (leaf_commit_nodes,
+                       ostree_collection_ref_dup (default_collection_ref),
+                       GUINT_TO_POINTER (1));
+  eos_test_add_metadata_for_commit (&subserver->additional_metadata_for_commit,
+                                    1, "eos-updater.rollout-percentage",
+                                    test_data->rollout_percentage);
+  eos_test_subserver_populate_commit_graph_from_leaf_nodes (subserver,
+                                                            leaf_commit_nodes);
+  eos_test_subserver_update (subserver, &error);
+  g_assert_no_error (error);
+
+  eos_test_client_run_updater (client,
+                               &main_source,
+                               1,
+                               NULL,
+                               &updater_cmd,
+                               &error);
+  g_assert_no_error (error);
+
+  start_time_secs = (guint64) g_get_real_time () / G_USEC_PER_SEC;
+  autoupdater = eos_test_autoupdater_new (autoupdater_root,
+                                          UPDATE_STEP_FETCH,
+                                          1,  /* interval (days) */
+                                          0, /* user visible delay (days) */
+                                          test_data->force_update,
+                                          &error);
+  g_assert_no_error (error);
+  g_assert_true (cmd_result_ensure_ok_verbose (autoupdater->cmd));
+
+  eos_test_client_has_commit (client,
+                              default_remote_name,
+                              1,
+                              &has_commit,
+                              &error);
+  g_assert_no_error (error);
+  g_assert_cmpint (has_commit, ==, test_data->expected_has_commit);
+
+  /* The stamp file should always be written, so the server isn’t polled on
+   * every run. If the update was held back, it should be backdated so the
+   * next check happens sooner than the full (one day) interval, but not
+   * immediately. */
+  stamp_file = g_file_get_child (autoupdater_root, "state/eos-updater-stamp");
+  stamp_file_info = g_file_query_info (stamp_file, G_FILE_ATTRIBUTE_TIME_MODIFIED,
+                                       G_FILE_QUERY_INFO_NONE, NULL, &error);
+  g_assert_no_error (error);
+  stamp_time_secs = g_file_info_get_attribute_uint64 (stamp_file_info,
+                                                      G_FILE_ATTRIBUTE_TIME_MODIFIED);
+
+  if (test_data->expected_has_commit)
+    {
+      g_assert_cmpuint (stamp_time_secs, >=, start_time_secs);
+    }
+  else
+    {
+      g_assert_cmpuint (stamp_time_secs, <, start_time_secs);
+      g_assert_cmpuint (stamp_time_secs + 24 * 60 * 60, >, start_time_secs);
+    }
+
+  eos_test_client_reap_updater (client,
+                                &updater_cmd,
+                                &reaped,
+                                &error);
+  g_assert_no_error (error);
+  g_assert_true (cmd_result_ensure_ok_verbose (&reaped));
+}
+
 int
 main (int    argc,
       char **argv)
@@ -351,6 +448,27 @@ main (int    argc,
                   .expected_has_commit = TRUE,
                 }),
                 test_user_visible_update_delay);
+  eos_test_add ("/autoupdater/rollout/excluded",
+                (&(RolloutTestData) {
+                  .rollout_percentage = "0",
+                  .force_update = FALSE,
+                  .expected_has_commit = FALSE,
+                }),
+                test_rollout);
+  eos_test_add ("/autoupdater/rollout/included",
+                (&(RolloutTestData) {
+                  .rollout_percentage = "100",
+                  .force_update = FALSE,
+                  .expected_has_commit = TRUE,
+                }),
+                test_rollout);
+  eos_test_add ("/autoupdater/rollout/force",
+                (&(RolloutTestData) {
+                  .rollout_percentage = "0",
+                  .force_update = TRUE,
+                  .expected_has_commit = TRUE,
+                }),
+                test_rollout);
 
   return g_test_run ();
 }
@@ -22,6 +22,7 @@
  *  - Sam Spilsbury <sam@endlessm.com>
  */
 
+#include <libeos-updater-util/flatpak-util.h>
 #include <libeos-updater-util/util.h>
 #include <test-common/flatpak-spawn.h>
 #include <test-common/gpg.h>
@@ -6469,6 +6470,138 @@ test_update_install_through_squashed_list (EosUpdaterFixture *fixture,
   g_assert_true (g_strv_contains ((const gchar * const *) deployed_flatpaks, flatpaks_to_install[2][2].app_id));
 }
 
+static GPtrArray *
+add_dependency_ref_actions (FlatpakInstallation *installation,
+                            GPtrArray           *ref_actions,
+                            gboolean             batched)
+{
+  g_autoptr(GPtrArray) dependency_ref_actions = NULL;
+  g_autoptr(GError) error = NULL;
+
+  if (!batched)
+    g_setenv ("EOS_UPDATER_TEST_UPDATER_FLATPAK_DISABLE_BATCHED_DEPENDENCIES", "1", TRUE);
+
+  dependency_ref_actions = euu_add_dependency_ref_actions_for_installation (installation,
+                                                                            ref_actions,
+                                                                            NULL,
+                                                                            &error);
+  g_unsetenv ("EOS_UPDATER_TEST_UPDATER_FLATPAK_DISABLE_BATCHED_DEPENDENCIES");
+
+  g_assert_no_error (error);
+  g_assert_nonnull (dependency_ref_actions);
+
+  return g_steal_pointer (&dependency_ref_actions);
+}
+
+/* Resolve the dependencies of several apps which share a runtime, and check
+ * that resolving them all in one transaction gives the same ref actions, in
+ * the same order, as resolving each app in its own transaction. Only the
+ * latter is possible with flatpak < 1.13.2, in which case both give the same
+ * results trivially. */
+static void
+test_update_install_flatpaks_batched_dependencies_match (EosUpdaterFixture *fixture,
+                                                         gconstpointer      user_data)
+{
+  const gchar *app_ids[] = { "org.test.Test", "org.test.Test2" };
+  g_autoptr(GPtrArray) flatpak_install_infos = g_ptr_array_new_with_free_func ((GDestroyNotify) flatpak_install_info_free);
+  g_autoptr(GHashTable) flatpak_repo_infos = g_hash_table_new_full (g_str_hash,
+                                                                    g_str_equal,
+                                                                    g_free,
+                                                                    (GDestroyNotify) flatpak_repo_info_free);
+  g_autoptr(GFile) updater_directory = g_file_get_child (fixture->tmpdir, "updater");
+  g_autoptr(GFile) flatpak_user_installation_dir = g_file_get_child (updater_directory, "flatpak-user");
+  g_autoptr(FlatpakInstallation) installation = NULL;
+  g_autoptr(GPtrArray) ref_actions = g_ptr_array_new_with_free_func ((GDestroyNotify) euu_flatpak_remote_ref_action_unref);
+  g_autoptr(GPtrArray) batched = NULL;
+  g_autoptr(GPtrArray) separate = NULL;
+  g_autofree gchar *keyid = get_keyid (fixture->gpg_home);
+  g_autoptr(GFile) gpg_key_file = get_gpg_key_file_for_keyid (fixture->gpg_home, keyid);
+  g_autoptr(GError) error = NULL;
+  gsize i;
+
+  /* Set up a runtime and two apps which use it, none of which are
+   * installed */
+  g_ptr_array_add (flatpak_install_infos,
+                   flatpak_install_info_new (FLATPAK_INSTALL_INFO_TYPE_RUNTIME,
+                                             "org.test.Runtime",
+                                             "stable",
+                                             NULL,
+                                             NULL,
+                                             "test-repo",
+                                             FALSE));
+  for (i = 0; i < G_N_ELEMENTS (app_ids); i++)
+    g_ptr_array_add (flatpak_install_infos,
+                     flatpak_install_info_new (FLATPAK_INSTALL_INFO_TYPE_APP,
+                                               app_ids[i],
+                                               "stable",
+                                               "org.test.Runtime",
+                                               "stable",
+                                               "test-repo",
+                                               FALSE));
+  g_hash_table_insert (flatpak_repo_infos,
+                       g_strdup ("test-repo"),
+                       flatpak_repo_info_new ("test-repo",
+                                              "com.endlessm.TestInstallFlatpaksCollection",
+                                              "com.endlessm.TestInstallFlatpaksCollection"));
+
+  eos_test_setup_flatpak_repo (updater_directory,
+                               flatpak_install_infos,
+                               flatpak_repo_infos,
+                               gpg_key_file,
+                               keyid,
+                               &error);
+  g_assert_no_error (error);
+
+  installation = flatpak_installation_new_for_path (flatpak_user_installation_dir,
+                                                    TRUE,
+                                                    NULL,
+                                                    &error);
+  g_assert_no_error (error);
+
+  for (i = 0; i < G_N_ELEMENTS (app_ids); i++)
+    {
+      g_autoptr(FlatpakRef) ref = g_object_new (FLATPAK_TYPE_REF,
+                                                "kind", FLATPAK_REF_KIND_APP,
+                                                "name", app_ids[i],
+                                                "arch", flatpak_get_default_arch (),
+                                                "branch", "stable",
+                                                NULL);
+      g_autoptr(EuuFlatpakLocationRef) location_ref = euu_flatpak_location_ref_new (ref, "test-repo", NULL);
+
+      g_ptr_array_add (ref_actions,
+                       euu_flatpak_remote_ref_action_new (EUU_FLATPAK_REMOTE_REF_ACTION_INSTALL,
+                                                          location_ref,
+                                                          "test",
+                                                          (gint32) i + 1,
+                                                          EUU_FLATPAK_REMOTE_REF_ACTION_FLAG_NONE));
+    }
+
+  batched = add_dependency_ref_actions (installation, ref_actions, TRUE);
+  separate = add_dependency_ref_actions (installation, ref_actions, FALSE);
+
+  /* The runtime, then the two apps. */
+  g_assert_cmpuint (separate->len, ==, 3);
+  g_assert_cmpuint (batched->len, ==, separate->len);
+
+  for (i = 0; i < separate->len; i++)
+    {
+      EuuFlatpakRemoteRefAction *batched_action = g_ptr_array_index (batched, i);
+      EuuFlatpakRemoteRefAction *separate_action = g_ptr_array_index (separate, i);
+      g_autofree gchar *batched_ref = flatpak_ref_format_ref (batched_action->ref->ref);
+      g_autofree gchar *separate_ref = flatpak_ref_format_ref (separate_action->ref->ref);
+
+      g_test_message ("Ref action %" G_GSIZE_FORMAT ": %s", i, separate_ref);
+
+      g_assert_cmpint (batched_action->type, ==, separate_action->type);
+      g_assert_cmpstr (batched_ref, ==, separate_ref);
+      g_assert_cmpstr (batched_action->ref->remote, ==, separate_action->ref->remote);
+      g_assert_cmpstr (batched_action->ref->collection_id, ==, separate_action->ref->collection_id);
+      g_assert_cmpstr (batched_action->source, ==, separate_action->source);
+      g_assert_cmpint (batched_action->serial, ==, separate_action->serial);
+      g_assert_cmpint (batched_action->flags, ==, separate_action->flags);
+    }
+}
+
 int
 main (int argc,
       char **argv)
@@ -6530,6 +6663,7 @@ main (int argc,
   eos_test_add ("/updater/update-deploy-fail-flatpaks-not-deployed", NULL, test_update_deploy_fail_flatpaks_not_deployed);
   eos_test_add ("/updater/update-flatpaks-pull-fail-system-not-deployed", NULL, test_update_flatpak_pull_fail_system_not_deployed);
   eos_test_add ("/updater/update-install-through-squashed-list", NULL, test_update_install_through_squashed_list);
+  eos_test_add ("/updater/install-flatpaks-batched-dependencies-match", NULL, test_update_install_flatpaks_batched_dependencies_match);
 
   return g_test_run ();
 }